@@ -139,6 +139,8 @@ void ftp_stor(Command *, State *);
 
 void ftp_dele(Command *, State *);
 
+void ftp_site(Command *, State *);
+
 void ftp_size(Command *, State *);
 
 void ftp_quit(State *);
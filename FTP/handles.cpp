@@ -7,17 +7,21 @@
  * @note 有大量改动以修正bug，调整排版和适配macOS 和 MoFS
 */
 #include <cerrno>
+#include <strings.h>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "../include/User.h"
 #include "../utils/Diagnose.h"
 #include "../include/Primitive.h"
 
-#define BUF_SIZE 8192
+/// 传输缓冲区，远大于块大小，每次读写的中间部分都是整块
+#define BUF_SIZE (256 * 1024)
 
 int send_file(int out_fd, int in_fd, size_t count) {
-    char buf[BUF_SIZE];
+    std::vector<char> buffer(BUF_SIZE);
+    char* buf = buffer.data();
     size_t toRead, numRead, numSent, totSent;
 
     mofs_lseek(in_fd, 0, SEEK_SET);
@@ -86,6 +90,9 @@ void response(Command *cmd, State *state) {
         case SIZE:
             ftp_size(cmd, state);
             break;
+        case SITE:
+            ftp_site(cmd, state);
+            break;
         case ABOR:
             ftp_abor(state);
             break;
@@ -409,7 +416,8 @@ void ftp_retr(Command *cmd, State *state) {
 
         /* Passive mode */
         if (state->mode == SERVER) {
-            fd = mofs_open(cmd->arg, MOFS_RDONLY, 0);
+            // 传输的数据只使用一次，整块部分不经过缓存
+            fd = mofs_open(cmd->arg, MOFS_RDONLY | MOFS_DIRECT, 0);
             if (fd >= 0) {
                 state->message = "150 Opening BINARY mode data connection.\r\n";
 
@@ -458,9 +466,8 @@ void ftp_retr(Command *cmd, State *state) {
 /** Handle STOR command. TODO: check permissions. */
 void ftp_stor(Command *cmd, State *state) {
     int connection, fd;
-    const int buff_size = 8192;
 
-    fd = mofs_open(cmd->arg, MOFS_WRONLY | MOFS_CREAT, 0777);
+    fd = mofs_open(cmd->arg, MOFS_WRONLY | MOFS_CREAT | MOFS_DIRECT, 0777);
     Diagnose::PrintLog("File " + string(cmd->arg) + " created.");
     if (fd == -1) {
         Diagnose::PrintErrno("Cannot open or create file " + string(cmd->arg));
@@ -486,19 +493,27 @@ void ftp_stor(Command *cmd, State *state) {
 //        while ((res = splice(connection, 0, pipefd[1], NULL, buff_size, SPLICE_F_MORE | SPLICE_F_MOVE))>0){
 //          splice(pipefd[0], NULL, fd, 0, buff_size, SPLICE_F_MORE | SPLICE_F_MOVE);
 //        }
-            char transfer_buffer[buff_size];
+            std::vector<char> transfer_buffer(BUF_SIZE);
             long write_byte_cnt = 1;
             int total_trans_byte = 0;
             errno = 0;
             while (true) {
-                long recv_byte_cnt = recv(connection, transfer_buffer, buff_size, 0);
+                // 攒满缓冲区再写入，避免按网络分包的大小零散地写
+                long recv_byte_cnt = 0;
+                while (recv_byte_cnt < BUF_SIZE) {
+                    long current_byte_cnt = recv(connection, transfer_buffer.data() + recv_byte_cnt, BUF_SIZE - recv_byte_cnt, 0);
+                    if (current_byte_cnt <= 0) {
+                        break;
+                    }
+                    recv_byte_cnt += current_byte_cnt;
+                }
                 Diagnose::PrintLog("Receive " + to_string(recv_byte_cnt) + " byte(s).");
                 if (recv_byte_cnt <= 0) {
                     // 读取完成
                     break;
                 }
 
-                write_byte_cnt = mofs_write(fd, transfer_buffer, recv_byte_cnt);
+                write_byte_cnt = mofs_write(fd, transfer_buffer.data(), recv_byte_cnt);
                 if (write_byte_cnt != recv_byte_cnt) {
                     // 没有全部写入，有问题
                     break;
@@ -611,6 +626,24 @@ void ftp_size(Command *cmd, State *state) {
     write_state(state);
 }
 
+/** Handle SITE STATS: cache and image I/O statistics */
+void ftp_site(Command *cmd, State *state) {
+    std::string reply;
+    if (!state->logged_in) {
+        reply = "530 Please login with USER and PASS.\r\n";
+    } else if (strcasecmp(cmd->arg, "STATS") == 0) {
+        MoFSStats stats{};
+        mofs_get_stats(&stats);
+        // 多行回复，中间的行不以回复码开头
+        reply = "211-MoFS statistics\r\n" + IOStats::Format(stats, "\r\n") + "211 End of statistics.\r\n";
+    } else {
+        reply = "504 Command not implemented for that parameter.\r\n";
+    }
+
+    state->message = &reply[0];
+    write_state(state);
+}
+
 char* rename_from_buffer;
 void ftp_rnfr(Command * cmd, State * state) {
     rename_from_buffer = new char[32];
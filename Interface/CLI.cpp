@@ -12,17 +12,21 @@
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <vector>
 
 #include "../include/CLI.h"
 #include "../include/User.h"
 #include "../utils/Diagnose.h"
 #include "../include/Primitive.h"
+#include "../include/device/DeviceManager.h"
+#include "../include/DedupStore.h"
+#include "../include/Journal.h"
 
 using namespace std;
 
 // []中参数为必须，{}中参数为可选，第二个:后为默认值
-#define MKFS_MAP_VALUE          0       ///< 格式化:                                     mkfs [大小(MB): int] [最大inode数: int]
-#define FFORMAT_MAP_VALUE       0       ///< 格式化:                                     fformat [大小(MB): int] [最大inode数: int]
+#define MKFS_MAP_VALUE          0       ///< 格式化:                                     mkfs [大小(MB): int] [最大inode数: int] {块大小: int: 4096}
+#define FFORMAT_MAP_VALUE       0       ///< 格式化:                                     fformat [大小(MB): int] [最大inode数: int] {块大小: int: 4096}
 #define LS_MAP_VALUE            1       ///< 展示目录下文件:                              ls [路径: str: 当前目录]
 #define MKDIR_MAP_VALUE         2       ///< 建立目录:                                   mkdir [路径目录名: str] [权限: oct_int]
 #define FCREAT_MAP_VALUE        3       ///< 创建文件(返回fd: int):                       fcreat [路径名: str] [权限: oct_int]
@@ -39,6 +43,10 @@ using namespace std;
 #define LINK_MAP_VALUE          14      ///< 创建硬链接:                                 link [源路径名: str] [目标路径名: str]
 #define EXIT_MAP_VALUE          15      ///< 退出程序                                    exit
 #define HELP_MAP_VALUE          16      ///< 帮助与提示:                                 help
+#define FSYNC_MAP_VALUE         17      ///< 将文件同步到设备:                            fsync [fd: int]
+#define SYNC_MAP_VALUE          18      ///< 将整个文件系统同步到设备:                     sync
+#define STATS_MAP_VALUE         19      ///< 缓存与I/O统计:                              stats {reset}
+#define COMPRESS_MAP_VALUE      20      ///< 打开或关闭压缩:                              compress [路径名: str] [on / off]
 
 /**
  * @brief 处理一条指令
@@ -77,7 +85,11 @@ void infinite_loop(istream &input_stream, int loop_time) {
             {"link", LINK_MAP_VALUE},
             {"unlink", FDELETE_MAP_VALUE},
             {"exit", EXIT_MAP_VALUE},
-            {"help", HELP_MAP_VALUE}
+            {"help", HELP_MAP_VALUE},
+            {"fsync", FSYNC_MAP_VALUE},
+            {"sync", SYNC_MAP_VALUE},
+            {"stats", STATS_MAP_VALUE},
+            {"compress", COMPRESS_MAP_VALUE}
     };
 
     string command;
@@ -116,7 +128,8 @@ void infinite_loop(istream &input_stream, int loop_time) {
 
 void print_list(const char* pathname);
 
-#define TRANS_BUFFER_SIZE 2048
+/// mvin/mvout的传输缓冲区，远大于块大小，每次读写的中间部分都是整块
+#define TRANS_BUFFER_SIZE (256 * 1024)
 
 int process_command(const string &command, stringstream &input_stream,
                     const unordered_map<string, int> &command_enum_mapping) {
@@ -134,7 +147,23 @@ int process_command(const string &command, stringstream &input_stream,
                 Diagnose::PrintError("Need more args.");
                 return 0;
             }
+            if (total_bytes <= 0 || max_inode_num <= 0) {
+                Diagnose::PrintError("Invalid size or inode number.");
+                return 0;
+            }
+
+            // 块大小可以省略
+            int block_size = DEFAULT_BLOCK_SIZE;
+            if (!(input_stream >> block_size)) {
+                block_size = DEFAULT_BLOCK_SIZE;
+            }
+            if (!DeviceManager::IsValidBlockSize(block_size)) {
+                Diagnose::PrintError("Invalid block size.");
+                return 0;
+            }
 
+            // 关闭用户打开的文件时还会写回inode，期间不提交
+            Journal::OpScope scope;
             for (User* & userPtr : User::userTable) {
                 if (userPtr != nullptr) {
                     delete userPtr;
@@ -143,7 +172,10 @@ int process_command(const string &command, stringstream &input_stream,
 
             memset(User::userTable, 0, sizeof(int*) * MAX_USER_NUM);
 
-            if (-1 == SuperBlock::MakeFS(total_bytes * 1024 * 1024, max_inode_num)) {
+            // 重新格式化沿用当前映象是否带校验和、是否去重、是否带日志、是否使用位图
+            if (-1 == SuperBlock::MakeFS((long long) total_bytes * 1024 * 1024, max_inode_num, block_size,
+                                         SuperBlock::superBlock.s_checksum != 0, SuperBlock::superBlock.s_dedupBlockCnt != 0,
+                                         SuperBlock::superBlock.s_journalBlockCnt != 0, SuperBlock::superBlock.s_bitmapBlockCnt != 0)) {
                 Diagnose::PrintErrno("Cannot make file system");
                 return -1;
             }
@@ -375,22 +407,23 @@ int process_command(const string &command, stringstream &input_stream,
             }
 
             // 从外部文件读，写入内部文件
-            int fd = mofs_open(in_path.c_str(), MOFS_WRONLY | MOFS_CREAT, 0777);
+            // 导入的数据只使用一次，整块部分不经过缓存
+            int fd = mofs_open(in_path.c_str(), MOFS_WRONLY | MOFS_CREAT | MOFS_DIRECT, 0777);
             if (fd < 0) {
                 Diagnose::PrintErrno("Cannot open / create in file " + in_path);
                 return 0;
             }
 
-            char trans_buffer[TRANS_BUFFER_SIZE];
+            std::vector<char> trans_buffer(TRANS_BUFFER_SIZE);
             while (!feof(out_file)) {
-                int read_byte_cnt = fread(trans_buffer, 1, TRANS_BUFFER_SIZE, out_file);
+                int read_byte_cnt = fread(trans_buffer.data(), 1, TRANS_BUFFER_SIZE, out_file);
 
                 if (read_byte_cnt < 0) {
                     Diagnose::PrintErrno("Out file read error");
                     return 0;
                 }
 
-                int write_byte_cnt = mofs_write(fd, trans_buffer, read_byte_cnt);
+                int write_byte_cnt = mofs_write(fd, trans_buffer.data(), read_byte_cnt);
                 if (read_byte_cnt != write_byte_cnt) {
                     Diagnose::PrintErrno("Transfer failed.");
                     return 0;
@@ -415,7 +448,7 @@ int process_command(const string &command, stringstream &input_stream,
             }
 
 
-            int fd = mofs_open(in_path.c_str(), MOFS_RDONLY, 0);
+            int fd = mofs_open(in_path.c_str(), MOFS_RDONLY | MOFS_DIRECT, 0);
             if (fd < 0) {
                 Diagnose::PrintErrno("Cannot open in file " + in_path);
                 return 0;
@@ -427,9 +460,9 @@ int process_command(const string &command, stringstream &input_stream,
                 return 0;
             }
 
-            char trans_buffer[TRANS_BUFFER_SIZE];
+            std::vector<char> trans_buffer(TRANS_BUFFER_SIZE);
             while (true) {
-                int read_byte_cnt = mofs_read(fd, trans_buffer, TRANS_BUFFER_SIZE);
+                int read_byte_cnt = mofs_read(fd, trans_buffer.data(), TRANS_BUFFER_SIZE);
 
                 if (read_byte_cnt < 0) {
                     Diagnose::PrintErrno("In file read error");
@@ -440,7 +473,7 @@ int process_command(const string &command, stringstream &input_stream,
                     break;
                 }
 
-                int write_byte_cnt = fwrite(trans_buffer, 1, read_byte_cnt, out_file);
+                int write_byte_cnt = fwrite(trans_buffer.data(), 1, read_byte_cnt, out_file);
                 if (read_byte_cnt != write_byte_cnt) {
                     Diagnose::PrintErrno("Transfer failed.");
                     return 0;
@@ -484,6 +517,7 @@ int process_command(const string &command, stringstream &input_stream,
                 return 0;
             }
 
+            Journal::OpScope scope;
             if (-1 == User::userPtr->ChangeDir(pathname.c_str())) {
                 Diagnose::PrintErrno("Cannot change dir");
                 return 0;
@@ -525,13 +559,70 @@ int process_command(const string &command, stringstream &input_stream,
         }
         break;
 
+        case FSYNC_MAP_VALUE: {
+            int fd = -1;
+            input_stream >> fd;
+            if (fd == -1) {
+                Diagnose::PrintError("Need more args.");
+                return 0;
+            }
+
+            if (mofs_fsync(fd) == -1) {
+                Diagnose::PrintErrno("Cannot sync file");
+                return 0;
+            }
+        }
+        break;
+
+        case SYNC_MAP_VALUE: {
+            if (mofs_sync() == -1) {
+                Diagnose::PrintErrno("Cannot sync file system");
+                return 0;
+            }
+        }
+        break;
+
+        case STATS_MAP_VALUE: {
+            string option;
+            input_stream >> option;
+
+            MoFSStats stats{};
+            if (mofs_get_stats(&stats) == -1) {
+                Diagnose::PrintErrno("Cannot get stats");
+                return 0;
+            }
+            cout << IOStats::Format(stats, "\n");
+
+            if (option == "reset") {
+                DeviceManager::deviceManager.ResetStats();
+                DedupStore::dedupStore.ResetStats();
+                Journal::journal.ResetStats();
+            }
+        }
+        break;
+
+        case COMPRESS_MAP_VALUE: {
+            string path, option;
+            input_stream >> path >> option;
+            if (path.length() == 0 || (option != "on" && option != "off")) {
+                Diagnose::PrintError("Need more args.");
+                return 0;
+            }
+
+            if (-1 == mofs_compress(path.c_str(), option == "on")) {
+                Diagnose::PrintErrno("Cannot change compression");
+                return 0;
+            }
+        }
+        break;
+
         case EXIT_MAP_VALUE: {
             return -1;
         }
 
         case HELP_MAP_VALUE: {
-            cout << "格式化:                                     mkfs [大小(MB): int] [最大inode数: int]\n"
-                    "格式化:                                     fformat [大小(MB): int] [最大inode数: int]\n"
+            cout << "格式化:                                     mkfs [大小(MB): int] [最大inode数: int] {块大小: int: 4096}\n"
+                    "格式化:                                     fformat [大小(MB): int] [最大inode数: int] {块大小: int: 4096}\n"
                     "展示目录下文件:                              ls [路径: str: 当前目录]\n"
                     "建立目录:                                   mkdir [路径目录名: str] [权限: oct_int]\n"
                     "创建文件(返回fd: int):                       fcreat [路径名: str] [权限: oct_int]\n"
@@ -546,6 +637,10 @@ int process_command(const string &command, stringstream &input_stream,
                     "切换用户:                                   chgusr [uid: int] [gid: int]\n"
                     "切换工作目录:                                cd [路径名: str]\n"
                     "创建硬链接:                                 link [源路径名: str] [目标路径名: str]\n"
+                    "将文件同步到设备:                            fsync [fd: int]\n"
+                    "将整个文件系统同步到设备:                     sync\n"
+                    "缓存与I/O统计:                              stats {reset}\n"
+                    "打开或关闭压缩:                              compress [路径名: str] [on / off]\n"
                     "退出程序                                    exit\n"
                     "帮助与提示:                                 help" << endl;
 
@@ -612,7 +707,7 @@ void print_list(const char* pathname) {
         }
 
         // 打印信息
-        char authority_str[10] = "---------";
+        char authority_str[11] = "---------";
         for (int i = 0; i < 3; ++i) {
             if (((fileStat.st_mode >> (3 * i + 2)) & 1) == 1) {
                 authority_str[8 - (3 * i + 2)] = 'r';
@@ -626,6 +721,9 @@ void print_list(const char* pathname) {
                 authority_str[8 - (3 * i + 0)] = 'x';
             }
         }
+        if (fileStat.st_mode & MemInode::ICOMPR) {
+            authority_str[9] = 'c';
+        }
 
         // 转换时间
         time_t acc_tt = fileStat.st_atime;
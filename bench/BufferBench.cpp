@@ -0,0 +1,76 @@
+/**
+ * @file BufferBench.cpp
+ * @brief 缓存查找的微基准测试，观察缓存块数量增长时单次查找的开销
+ * @author 韩孟霖
+ * @date 2022/6/2
+ * @license GPL v3
+ */
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../include/device/Buffer.h"
+
+/// 每种缓存大小下执行的查找次数
+#define LOOKUP_TIMES 2000000
+
+/**
+ * @brief 测量一组查找的平均耗时
+ * @param bufferList 被测缓存链表
+ * @param keys 待查找的块号
+ * @param hitCnt 命中次数
+ * @return 每次查找的平均纳秒数
+ */
+double MeasureLookup(BufferLinkList& bufferList, const std::vector<int>& keys, int& hitCnt) {
+    hitCnt = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int key : keys) {
+        if (bufferList.GetBufferedIndex(key) >= 0) {
+            ++hitCnt;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() / keys.size();
+}
+
+int main() {
+    const int bufferNums[] = {128, 1024, 8192, 32768, 131072};
+
+    std::mt19937 rng(2022);
+
+    printf("%10s %14s %14s\n", "buffers", "hit (ns/op)", "miss (ns/op)");
+    for (int bufferNum : bufferNums) {
+        BufferLinkList bufferList(bufferNum);
+
+        // 用分散的块号填满缓存
+        std::vector<int> cachedBlocks(bufferNum);
+        for (int i = 0; i < bufferNum; ++i) {
+            int oldBlockIdx;
+            cachedBlocks[i] = i * 7 + 3;
+            bufferList.AllocNewBuffer(cachedBlocks[i], oldBlockIdx);
+        }
+
+        std::vector<int> hitKeys(LOOKUP_TIMES);
+        std::vector<int> missKeys(LOOKUP_TIMES);
+        std::uniform_int_distribution<int> pick(0, bufferNum - 1);
+        for (int i = 0; i < LOOKUP_TIMES; ++i) {
+            hitKeys[i] = cachedBlocks[pick(rng)];
+            missKeys[i] = cachedBlocks[pick(rng)] + 1;
+        }
+
+        int hitCnt, missHitCnt;
+        double hitCost = MeasureLookup(bufferList, hitKeys, hitCnt);
+        double missCost = MeasureLookup(bufferList, missKeys, missHitCnt);
+
+        if (hitCnt != LOOKUP_TIMES || missHitCnt != 0) {
+            printf("lookup result mismatch at %d buffers\n", bufferNum);
+            return -1;
+        }
+
+        printf("%10d %14.1f %14.1f\n", bufferNum, hitCost, missCost);
+    }
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+/**
+ * @file CacheScaleBench.cpp
+ * @brief 块缓存的多线程基准测试，观察线程数增长时随机读写吞吐量的变化
+ * @author 韩孟霖
+ * @date 2022/6/12
+ * @license GPL v3
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../include/device/DeviceManager.h"
+
+/// 每个线程执行的操作次数
+#define OPS_PER_THREAD 200000
+
+/// 块缓存大小
+#define BENCH_CACHE_BYTE (16LL * 1024 * 1024)
+
+/// 写操作所占的百分比
+#define WRITE_PERCENT 10
+
+/// 检查换出写回时，每个常驻段的块数
+#define HOT_RUN_BLOCKS 8
+
+/// 检查换出写回时，顺序写入全部块的遍数
+#define STREAM_PASSES 4
+
+/**
+ * @brief 多个线程同时随机读写，测量总吞吐量
+ * @param threadNum 线程数
+ * @param blockNum 参与读写的块数
+ * @param errorCnt 读写失败或读到的内容不属于该块的次数
+ * @return 每秒操作数
+ */
+double MeasureThroughput(int threadNum, int blockNum, int& errorCnt) {
+    std::vector<std::thread> threads;
+    std::vector<int> errors(threadNum, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threadNum; ++t) {
+        threads.emplace_back([t, blockNum, &errors] {
+            DeviceManager& deviceManager = DeviceManager::deviceManager;
+            std::vector<char> buffer(deviceManager.BlockSize());
+            std::mt19937 rng(2022 + t);
+            std::uniform_int_distribution<int> pickBlock(0, blockNum - 1);
+            std::uniform_int_distribution<int> pickOp(0, 99);
+
+            for (int i = 0; i < OPS_PER_THREAD; ++i) {
+                int blockNo = pickBlock(rng);
+                if (pickOp(rng) < WRITE_PERCENT) {
+                    // 每块开头总是写入自己的块号，读出时据此检查是否串块
+                    memcpy(buffer.data(), &blockNo, sizeof(int));
+                    if (deviceManager.WriteBlock(blockNo, buffer.data()) != (unsigned int) buffer.size()) {
+                        ++errors[t];
+                    }
+                }
+                else {
+                    int storedNo;
+                    if (deviceManager.ReadBlock(blockNo, buffer.data()) != (unsigned int) buffer.size()) {
+                        ++errors[t];
+                        continue;
+                    }
+                    memcpy(&storedNo, buffer.data(), sizeof(int));
+                    if (storedNo != blockNo) {
+                        ++errors[t];
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    errorCnt = 0;
+    for (int error : errors) {
+        errorCnt += error;
+    }
+    return (double) threadNum * OPS_PER_THREAD / std::chrono::duration<double>(end - start).count();
+}
+
+/**
+ * @brief 一半线程不停地改写几段常驻缓存的块，另一半线程顺序写入全部块，迫使与这几段相邻的块被换出，
+ * 换出时顺带写回正在被改写的脏块。之后丢弃缓存模拟崩溃，逐块从映象读回，检查内容完整且与校验和一致
+ * @param threadNum 线程数，至少为2
+ * @param blockNum 参与写入的块数
+ * @return 读回失败(包括校验和不符)或内容被撕裂的块数
+ */
+int CheckNeighbourWriteBack(int threadNum, int blockNum) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    if (-1 == deviceManager.SetupChecksums(blockNum, 1, false)) {
+        printf("cannot set up checksums\n");
+        return 1;
+    }
+
+    // 每块第一个int是块号，其余都是同一个版本号，写入一半的块可以看出来
+    std::vector<int> block(deviceManager.BlockSize() / sizeof(int));
+    for (int blockNo = 0; blockNo < blockNum; ++blockNo) {
+        std::fill(block.begin(), block.end(), 0);
+        block[0] = blockNo;
+        deviceManager.WriteBlock(blockNo, block.data());
+    }
+    deviceManager.FlushDirtyBlocks();
+
+    int hotNum = threadNum / 2;
+    std::atomic<bool> streaming(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadNum; ++t) {
+        threads.emplace_back([t, threadNum, hotNum, blockNum, &streaming] {
+            DeviceManager& deviceManager = DeviceManager::deviceManager;
+            std::vector<int> buffer(deviceManager.BlockSize() / sizeof(int));
+            int version = 0;
+            auto writeBlock = [&](int blockNo) {
+                std::fill(buffer.begin(), buffer.end(), (t << 24) | (++version & 0xFFFFFF));
+                buffer[0] = blockNo;
+                deviceManager.WriteBlock(blockNo, buffer.data());
+            };
+
+            if (t < hotNum) {
+                // 常驻的一段，两侧的块被顺序写入的线程写脏后换出
+                int first = (int) ((long long) blockNum * (t + 1) / (hotNum + 1));
+                while (streaming.load()) {
+                    for (int blockNo = first; blockNo < first + HOT_RUN_BLOCKS; ++blockNo) {
+                        writeBlock(blockNo);
+                    }
+                }
+            }
+            else {
+                for (int pass = 0; pass < STREAM_PASSES; ++pass) {
+                    for (int i = 0; i < blockNum; ++i) {
+                        writeBlock((i + (t - hotNum) * blockNum / (threadNum - hotNum)) % blockNum);
+                    }
+                }
+            }
+        });
+    }
+    for (int t = hotNum; t < threadNum; ++t) {
+        threads[t].join();
+    }
+    streaming.store(false);
+    for (int t = 0; t < hotNum; ++t) {
+        threads[t].join();
+    }
+
+    // 不写回直接丢弃缓存，映象中只剩换出时写回的内容
+    deviceManager.ResetCache();
+    int errorCnt = 0;
+    for (int blockNo = 0; blockNo < blockNum; ++blockNo) {
+        if (deviceManager.ReadBlock(blockNo, block.data()) != (unsigned int) deviceManager.BlockSize()
+            || block[0] != blockNo || std::count(block.begin() + 1, block.end(), block[1]) != (long) block.size() - 1) {
+            ++errorCnt;
+        }
+    }
+
+    deviceManager.DropChecksums();
+    return errorCnt;
+}
+
+int main(int argc, char* argv[]) {
+    const char* imagePath = argc > 1 ? argv[1] : "CacheScaleBench.img";
+    const int threadNums[] = {1, 2, 4, 8, 16};
+
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    // 不启动后台写回线程，只测前台路径
+    deviceManager.SetDirtyThreshold(DEFAULT_DIRTY_RATIO, 0);
+    deviceManager.SetCacheSize(BENCH_CACHE_BYTE, DEFAULT_INODE_BUFFER_NUM);
+    deviceManager.OpenImage(imagePath);
+    if (deviceManager.blockBuffer == nullptr) {
+        printf("cannot open image %s\n", imagePath);
+        return 1;
+    }
+    deviceManager.SetLayout(DEFAULT_BLOCK_SIZE, 1);
+
+    // 缓存能容纳的工作集和远大于缓存的工作集，后者主要走未命中、换出和写回的路径
+    int cachedBlockNum = (int) (BENCH_CACHE_BYTE / DEFAULT_BLOCK_SIZE / 2);
+    int workingSets[] = {cachedBlockNum, cachedBlockNum * 8};
+    std::vector<char> block(DEFAULT_BLOCK_SIZE, 0);
+    for (int blockNo = 0; blockNo < workingSets[1]; ++blockNo) {
+        memcpy(block.data(), &blockNo, sizeof(int));
+        deviceManager.WriteBlock(blockNo, block.data());
+    }
+
+    printf("cache: %d blocks, hardware threads: %u\n", deviceManager.blockBufferNum, std::thread::hardware_concurrency());
+    printf("%10s %8s %14s %10s %8s %8s\n", "blocks", "threads", "ops/s", "speedup", "hit%", "errors");
+    for (int blockNum : workingSets) {
+        double baseline = 0;
+        for (int threadNum : threadNums) {
+            int errorCnt;
+            deviceManager.ResetStats();
+            double throughput = MeasureThroughput(threadNum, blockNum, errorCnt);
+            if (threadNum == 1) {
+                baseline = throughput;
+            }
+
+            MoFSStats stats{};
+            deviceManager.GetStats(stats);
+            unsigned long long accesses = stats.blockHits + stats.blockMisses;
+            printf("%10d %8d %14.0f %10.2f %8.2f %8d\n", blockNum, threadNum, throughput, throughput / baseline,
+                   accesses == 0 ? 0.0 : 100.0 * stats.blockHits / accesses, errorCnt);
+        }
+    }
+
+    int tornCnt = CheckNeighbourWriteBack(threadNums[sizeof(threadNums) / sizeof(int) - 1], workingSets[1]);
+    printf("\nneighbour write-back: %d bad blocks after crash\n", tornCnt);
+
+    if (!BlockDevice::IsMemoryImage(imagePath)) {
+        std::remove(imagePath);
+    }
+    return tornCnt == 0 ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file ChecksumBench.cpp
+ * @brief 校验和的基准测试：CRC32C两种实现的吞吐量，以及开启校验后顺序读的开销
+ * @author 韩孟霖
+ * @date 2022/6/16
+ * @license GPL v3
+ */
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../include/device/DeviceManager.h"
+#include "../utils/Crc32c.h"
+
+/// 块缓存大小
+#define BENCH_CACHE_BYTE (16LL * 1024 * 1024)
+
+/// 顺序读的总字节数，远大于缓存，全部未命中
+#define STREAM_BYTE (128LL * 1024 * 1024)
+
+/// 每次ReadBlocks读取的块数
+#define STREAM_CHUNK_BLOCKS 32
+
+/// 每种缓冲区大小计算的总字节数
+#define KERNEL_BYTE (1LL << 30)
+
+/**
+ * @brief 测量CRC32C实现的吞吐量
+ * @param extend Crc32c::Extend或Crc32c::ExtendSlicing8
+ * @param data 数据
+ * @param length 每次计算的字节数
+ * @param checksum 返回校验和之和，避免计算被优化掉
+ * @return MB/s
+ */
+double MeasureKernel(uint32_t (*extend)(uint32_t, const void*, size_t), const char* data, size_t length, uint32_t& checksum) {
+    long long rounds = KERNEL_BYTE / (long long) length;
+    checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < rounds; ++i) {
+        checksum += extend(0, data, length);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return (double) rounds * length / 1024 / 1024 / std::chrono::duration<double>(end - start).count();
+}
+
+/**
+ * @brief 按块号顺序读一段区域
+ * @param blockNum 块数
+ * @param errorCnt 读取失败或内容不对的次数
+ * @return MB/s
+ */
+double MeasureStream(int blockNum, int& errorCnt) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    std::vector<char> buffer((size_t) STREAM_CHUNK_BLOCKS * deviceManager.BlockSize());
+    int blockNos[STREAM_CHUNK_BLOCKS];
+
+    errorCnt = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int first = 0; first < blockNum; first += STREAM_CHUNK_BLOCKS) {
+        for (int i = 0; i < STREAM_CHUNK_BLOCKS; ++i) {
+            blockNos[i] = first + i;
+        }
+        if (-1 == deviceManager.ReadBlocks(blockNos, STREAM_CHUNK_BLOCKS, buffer.data())) {
+            ++errorCnt;
+            continue;
+        }
+        int storedNo;
+        memcpy(&storedNo, buffer.data(), sizeof(int));
+        if (storedNo != first) {
+            ++errorCnt;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return (double) blockNum * deviceManager.BlockSize() / 1024 / 1024 / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    const char* imagePath = argc > 1 ? argv[1] : "mem:256M";
+
+    // CRC32C本身的吞吐量
+    std::vector<char> data(1024 * 1024);
+    std::mt19937 rng(2022);
+    for (char& c : data) {
+        c = (char) rng();
+    }
+    const size_t lengths[] = {512, DEFAULT_BLOCK_SIZE, 1024 * 1024};
+    printf("crc32c implementation: %s\n", Crc32c::Implementation());
+    printf("%10s %16s %16s\n", "bytes", "selected MB/s", "slicing-8 MB/s");
+    for (size_t length : lengths) {
+        uint32_t selectedSum;
+        uint32_t tableSum;
+        double selected = MeasureKernel(Crc32c::Extend, data.data(), length, selectedSum);
+        double table = MeasureKernel(Crc32c::ExtendSlicing8, data.data(), length, tableSum);
+        printf("%10zu %16.0f %16.0f%s\n", length, selected, table, selectedSum == tableSum ? "" : "  MISMATCH");
+    }
+
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    // 不启动后台写回线程，只测前台路径
+    deviceManager.SetDirtyThreshold(DEFAULT_DIRTY_RATIO, 0);
+    deviceManager.SetCacheSize(BENCH_CACHE_BYTE, DEFAULT_INODE_BUFFER_NUM);
+    deviceManager.OpenImage(imagePath);
+    if (deviceManager.blockBuffer == nullptr) {
+        printf("cannot open image %s\n", imagePath);
+        return 1;
+    }
+    deviceManager.SetLayout(DEFAULT_BLOCK_SIZE, 1);
+
+    int blockNum = (int) (STREAM_BYTE / DEFAULT_BLOCK_SIZE);
+    int cachedBlockNum = (int) (BENCH_CACHE_BYTE / DEFAULT_BLOCK_SIZE / 2);
+    std::vector<char> block(DEFAULT_BLOCK_SIZE);
+
+    printf("\nstreaming ReadBlocks, %d-block chunks\n", STREAM_CHUNK_BLOCKS);
+    printf("%10s %10s %12s %12s %8s\n", "checksum", "blocks", "miss MB/s", "hit MB/s", "errors");
+    for (int enabled = 0; enabled <= 1; ++enabled) {
+        // 开启后重写一遍，每块都记下校验和
+        if (enabled && -1 == deviceManager.SetupChecksums(blockNum, 1, false)) {
+            printf("cannot set up checksums\n");
+            return 1;
+        }
+        for (int blockNo = 0; blockNo < blockNum; ++blockNo) {
+            for (size_t i = 0; i < block.size(); i += sizeof(int)) {
+                memcpy(block.data() + i, &blockNo, sizeof(int));
+            }
+            deviceManager.WriteBlock(blockNo, block.data());
+        }
+        deviceManager.FlushDirtyBlocks();
+
+        // 清空缓存后整段读一遍，全部从映象读入；再反复读缓存能容纳的一段，全部命中
+        int missErrors;
+        int hitErrors;
+        deviceManager.ResetCache();
+        deviceManager.ResetStats();
+        double missSpeed = MeasureStream(blockNum, missErrors);
+        MeasureStream(cachedBlockNum, hitErrors);
+        double hitSpeed = MeasureStream(cachedBlockNum, hitErrors);
+
+        MoFSStats stats{};
+        deviceManager.GetStats(stats);
+        printf("%10s %10d %12.0f %12.0f %8llu\n", enabled ? "crc32c" : "off", blockNum, missSpeed, hitSpeed,
+               missErrors + hitErrors + stats.checksumErrors);
+    }
+
+    deviceManager.DropChecksums();
+    if (!BlockDevice::IsMemoryImage(imagePath)) {
+        std::remove(imagePath);
+    }
+    return 0;
+}
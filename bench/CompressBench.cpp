@@ -0,0 +1,126 @@
+/**
+ * @file CompressBench.cpp
+ * @brief 压缩的基准测试：不同内容的数据按组压缩、解压的吞吐量和压缩率
+ * @author 韩孟霖
+ * @date 2022/6/17
+ * @license GPL v3
+ */
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../utils/Lz4.h"
+
+/// 块大小，与默认块大小相同
+#define BENCH_BLOCK_SIZE 4096
+
+/// 每组的块数，与COMPRESS_GROUP_BLOCKS相同
+#define BENCH_GROUP_BLOCKS 16
+
+/// 每种数据的总字节数
+#define DATA_BYTE (64 * 1024 * 1024)
+
+/// 每种数据重复测量的轮数
+#define ROUNDS 4
+
+/**
+ * @brief 生成测试数据
+ * @param kind text / mixed / random / zero
+ * @param data 返回数据
+ */
+void Generate(const std::string& kind, std::vector<char>& data) {
+    std::mt19937 rng(2022);
+    data.assign(DATA_BYTE, 0);
+    if (kind == "text") {
+        // 类似日志的文本：时间戳、少数几种消息和变化的数字
+        const char* messages[] = {"cache miss, reading block", "write back dirty block", "open file", "close file", "prefetch blocks"};
+        size_t offset = 0;
+        long long timestamp = 1655000000000LL;
+        char line[128];
+        while (offset < data.size()) {
+            timestamp += rng() % 1000;
+            int length = snprintf(line, sizeof(line), "%lld [INFO] %s %u\n", timestamp, messages[rng() % 5], (unsigned) (rng() % 100000));
+            size_t copyLength = std::min((size_t) length, data.size() - offset);
+            memcpy(data.data() + offset, line, copyLength);
+            offset += copyLength;
+        }
+    }
+    else if (kind == "mixed") {
+        // 一半的块是随机数据，一半是0
+        for (size_t i = 0; i < data.size(); i += 2 * BENCH_BLOCK_SIZE) {
+            for (size_t j = i; j < i + BENCH_BLOCK_SIZE; ++j) {
+                data[j] = (char) rng();
+            }
+        }
+    }
+    else if (kind == "random") {
+        for (char& c : data) {
+            c = (char) rng();
+        }
+    }
+}
+
+int main() {
+    const int groupByte = BENCH_GROUP_BLOCKS * BENCH_BLOCK_SIZE;
+    const int groupCnt = DATA_BYTE / groupByte;
+    const char* kinds[] = {"text", "mixed", "random", "zero"};
+
+    std::vector<char> data;
+    std::vector<char> compressed((size_t) groupCnt * groupByte);
+    std::vector<int> compressedByte(groupCnt);
+    std::vector<char> restored(groupByte);
+
+    printf("%d-block groups of %d B\n", BENCH_GROUP_BLOCKS, BENCH_BLOCK_SIZE);
+    printf("%8s %10s %14s %16s %16s %8s\n", "data", "ratio", "blocks/group", "compress MB/s", "decompress MB/s", "errors");
+    for (const char* kind : kinds) {
+        Generate(kind, data);
+
+        // 与文件系统相同，输出超过组大小减一块时放弃压缩
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int group = 0; group < groupCnt; ++group) {
+                compressedByte[group] = Lz4::Compress(data.data() + (size_t) group * groupByte, groupByte,
+                                                      compressed.data() + (size_t) group * groupByte, groupByte - BENCH_BLOCK_SIZE);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        double compressSpeed = (double) ROUNDS * DATA_BYTE / 1024 / 1024 / std::chrono::duration<double>(end - start).count();
+
+        long long storedBlocks = 0;
+        int compressedGroupCnt = 0;
+        for (int group = 0; group < groupCnt; ++group) {
+            if (compressedByte[group] > 0) {
+                storedBlocks += (compressedByte[group] + BENCH_BLOCK_SIZE - 1) / BENCH_BLOCK_SIZE;
+                ++compressedGroupCnt;
+            }
+            else {
+                storedBlocks += BENCH_GROUP_BLOCKS;
+            }
+        }
+
+        int errorCnt = 0;
+        start = std::chrono::steady_clock::now();
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int group = 0; group < groupCnt; ++group) {
+                if (compressedByte[group] <= 0) {
+                    continue;
+                }
+                int restoredByte = Lz4::Decompress(compressed.data() + (size_t) group * groupByte, compressedByte[group],
+                                                   restored.data(), groupByte);
+                if (round == 0 && (restoredByte != groupByte || memcmp(restored.data(), data.data() + (size_t) group * groupByte, groupByte) != 0)) {
+                    ++errorCnt;
+                }
+            }
+        }
+        end = std::chrono::steady_clock::now();
+        double decompressSpeed = compressedGroupCnt == 0 ? 0 :
+                (double) ROUNDS * compressedGroupCnt * groupByte / 1024 / 1024 / std::chrono::duration<double>(end - start).count();
+
+        printf("%8s %10.2f %14.2f %16.0f %16.0f %8d\n", kind, (double) groupCnt * BENCH_GROUP_BLOCKS / storedBlocks,
+               (double) storedBlocks / groupCnt, compressSpeed, decompressSpeed, errorCnt);
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file LayoutBench.cpp
+ * @brief 文件布局的基准测试：按不同方式扩展文件，统计数据块和索引块在映象中分成几段，并检查跨过索引边界的扩展一次分到连续的块
+ * @author 韩孟霖
+ * @date 2022/6/20
+ * @license GPL v3
+ */
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../include/device/DeviceManager.h"
+#include "../include/SuperBlock.h"
+#include "../include/MemInode.h"
+#include "../include/User.h"
+#include "../include/Primitive.h"
+
+/// 映象使用的块大小，块小时一级索引表也小，边界上的块数不多
+#define LAYOUT_BLOCK_SIZE 512
+
+/// 格式化时的inode数
+#define LAYOUT_INODE_NUM 64
+
+/**
+ * @brief 文件在映象中占用的块，包括数据块和一级索引表
+ * @param path 文件路径
+ * @return 物理块号，已排序
+ */
+std::vector<int> FileBlocks(const char* path) {
+    std::vector<int> blocks;
+    int fd = mofs_open(path, MOFS_RDONLY, 0);
+    if (fd == -1) {
+        return blocks;
+    }
+
+    MemInode* inode = User::userPtr->userOpenFileTable[fd].f_inode;
+    int blockNum = (inode->i_size + LAYOUT_BLOCK_SIZE - 1) / LAYOUT_BLOCK_SIZE;
+    for (int i = 0; i < blockNum; ++i) {
+        blocks.push_back(inode->BlockMap(i));
+    }
+    for (int i = 6; i < 8; ++i) {
+        if (inode->i_addr[i] > 0) {
+            blocks.push_back(inode->i_addr[i]);
+        }
+    }
+    mofs_close(fd);
+
+    std::sort(blocks.begin(), blocks.end());
+    return blocks;
+}
+
+/**
+ * @brief 统计一组已排序的块号分成几段连续的块
+ * @param blocks 物理块号，已排序
+ * @return 段数
+ */
+int CountExtents(const std::vector<int>& blocks) {
+    int extentCnt = blocks.empty() ? 0 : 1;
+    for (size_t i = 1; i < blocks.size(); ++i) {
+        if (blocks[i] != blocks[i - 1] + 1) {
+            ++extentCnt;
+        }
+    }
+    return extentCnt;
+}
+
+/**
+ * @brief 创建文件并按给定的步长写到指定的块数
+ * @param path 文件路径
+ * @param blockNum 总块数
+ * @param stepBlocks 每次写入的块数
+ * @return 0表示成功，-1表示出错
+ */
+int WriteFile(const char* path, int blockNum, int stepBlocks) {
+    int fd = mofs_open(path, MOFS_WRONLY | MOFS_CREAT, 0777);
+    if (fd == -1) {
+        return -1;
+    }
+
+    std::vector<char> buffer((size_t) stepBlocks * LAYOUT_BLOCK_SIZE, 'm');
+    for (int written = 0; written < blockNum; written += stepBlocks) {
+        int byteCnt = std::min(stepBlocks, blockNum - written) * LAYOUT_BLOCK_SIZE;
+        if (mofs_write(fd, buffer.data(), byteCnt) != byteCnt) {
+            mofs_close(fd);
+            return -1;
+        }
+    }
+    return mofs_close(fd);
+}
+
+/**
+ * @brief 文件先有6块，紧跟其后只留下比扩展到6 + n块所需的块少一块的空洞，再一次扩展到6 + n块。
+ * 扩展需要n块数据、第一张一级索引表和刚好用上的第二张一级索引表，应当整段分配在空洞之外
+ * @return 新分配的块分成的段数
+ */
+int GrowAcrossTableBoundary() {
+    int n = MemInode::IndexFanout();
+
+    // 填充文件有n块数据和一张索引表，删除后正好留下n + 1块的空洞
+    if (-1 == WriteFile("/edge", 6, 6) || -1 == WriteFile("/filler", n, n) || -1 == WriteFile("/fence", 1, 1)
+        || -1 == mofs_unlink("/filler")) {
+        return -1;
+    }
+
+    std::vector<int> before = FileBlocks("/edge");
+    int fd = mofs_open("/edge", MOFS_WRONLY, 0);
+    std::vector<char> buffer((size_t) n * LAYOUT_BLOCK_SIZE, 'm');
+    if (fd == -1 || mofs_lseek(fd, 6 * LAYOUT_BLOCK_SIZE, SEEK_SET) == -1 || mofs_write(fd, buffer.data(), (int) buffer.size()) != (int) buffer.size()) {
+        return -1;
+    }
+    mofs_close(fd);
+
+    std::vector<int> after = FileBlocks("/edge");
+    std::vector<int> added;
+    std::set_difference(after.begin(), after.end(), before.begin(), before.end(), std::back_inserter(added));
+    return added.size() == (size_t) n + 2 ? CountExtents(added) : -1;
+}
+
+int main(int argc, char* argv[]) {
+    const char* imagePath = argc > 1 ? argv[1] : "mem:64M";
+
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    // 不启动后台写回线程
+    deviceManager.SetDirtyThreshold(DEFAULT_DIRTY_RATIO, 0);
+    deviceManager.OpenImage(imagePath);
+    if (deviceManager.blockBuffer == nullptr) {
+        printf("cannot open image %s\n", imagePath);
+        return 1;
+    }
+    if (-1 == SuperBlock::MakeFS(deviceManager.ImageSize(), LAYOUT_INODE_NUM, LAYOUT_BLOCK_SIZE, false, false, false, true)) {
+        printf("cannot make file system on %s\n", imagePath);
+        return 1;
+    }
+    User::userPtr = new User{0, 0};
+    User::userTable[0] = User::userPtr;
+
+    // 逐块追加、按组追加和一次写入，文件跨过两张一级索引表
+    int n = MemInode::IndexFanout();
+    const int fileBlocks[] = {6 + n, 6 + n + 1, 6 + 2 * n};
+    const int steps[] = {1, 16, 6 + 2 * n};
+    printf("%10s %10s %10s\n", "blocks", "step", "extents");
+    for (int blockNum : fileBlocks) {
+        for (int step : steps) {
+            std::string path = "/f" + std::to_string(blockNum) + "_" + std::to_string(step);
+            if (-1 == WriteFile(path.c_str(), blockNum, step)) {
+                printf("cannot write %s\n", path.c_str());
+                return 1;
+            }
+            printf("%10d %10d %10d\n", blockNum, step, CountExtents(FileBlocks(path.c_str())));
+            mofs_unlink(path.c_str());
+        }
+    }
+
+    int edgeExtents = GrowAcrossTableBoundary();
+    printf("\ngrow 6 -> %d blocks next to a %d-block hole: %d extents\n", 6 + n, n + 1, edgeExtents);
+
+    delete User::userPtr;
+    return edgeExtents == 1 ? 0 : 1;
+}
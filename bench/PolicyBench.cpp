@@ -0,0 +1,145 @@
+/**
+ * @file PolicyBench.cpp
+ * @brief 比较不同置换策略在元数据访问、顺序流式读取及二者混合时的命中率
+ * @author 韩孟霖
+ * @date 2022/6/4
+ * @license GPL v3
+ */
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "../include/device/Buffer.h"
+
+/// 缓存块数量
+#define BENCH_BUFFER_NUM 1024
+
+/// 每种负载的访问次数
+#define BENCH_ACCESS_NUM 2000000
+
+/// 元数据块（目录、索引块）的数量，小于缓存，能全部放入
+#define METADATA_BLOCK_NUM 768
+
+/// 流式读取的块号从这里开始，避免和元数据块重合
+#define STREAM_BLOCK_BASE 1000000
+
+/**
+ * @brief 按Zipf分布生成元数据块号，少量目录和索引块被频繁访问
+ */
+class ZipfGenerator {
+public:
+    ZipfGenerator(int n, double skew, unsigned int seed) : rng(seed), uniform(0.0, 1.0) {
+        cdf.resize(n);
+        double sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += 1.0 / pow(i + 1, skew);
+            cdf[i] = sum;
+        }
+        for (double& value : cdf) {
+            value /= sum;
+        }
+    }
+
+    int Next() {
+        double u = uniform(rng);
+        int low = 0, high = (int) cdf.size() - 1;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (cdf[mid] < u) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+private:
+    std::vector<double> cdf;
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> uniform;
+};
+
+/**
+ * @brief 生成访问序列
+ * @param streamPercent 流式读取占全部访问的百分比
+ * @return 块号序列
+ */
+std::vector<int> MakeTrace(int streamPercent) {
+    std::vector<int> trace;
+    trace.reserve(BENCH_ACCESS_NUM);
+
+    ZipfGenerator metadata(METADATA_BLOCK_NUM, 0.9, 2022);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    int streamCursor = 0;
+    for (int i = 0; i < BENCH_ACCESS_NUM; ++i) {
+        if (percent(rng) < streamPercent) {
+            // 每次流式读取都读到新的块，相当于一次大文件的RETR / mvout
+            trace.push_back(STREAM_BLOCK_BASE + streamCursor);
+            ++streamCursor;
+        }
+        else {
+            trace.push_back(metadata.Next());
+        }
+    }
+    return trace;
+}
+
+/**
+ * @brief 用给定的策略回放访问序列
+ * @param policyName 策略名称
+ * @param trace 访问序列
+ * @param metadataHitRate 元数据访问的命中率
+ * @return 总命中率
+ */
+double Replay(const char* policyName, const std::vector<int>& trace, double& metadataHitRate) {
+    BufferPolicy* policy = BufferPolicy::PolicyFactory(policyName, BENCH_BUFFER_NUM);
+
+    long long hitCnt = 0, metadataCnt = 0, metadataHitCnt = 0;
+    for (int blockIdx : trace) {
+        bool isMetadata = blockIdx < STREAM_BLOCK_BASE;
+        if (policy->GetBufferedIndex(blockIdx) >= 0) {
+            ++hitCnt;
+            metadataHitCnt += isMetadata;
+        }
+        else {
+            int oldBlockIdx;
+            policy->AllocNewBuffer(blockIdx, oldBlockIdx);
+        }
+        metadataCnt += isMetadata;
+    }
+
+    delete policy;
+    metadataHitRate = metadataCnt == 0 ? 0 : (double) metadataHitCnt / metadataCnt;
+    return (double) hitCnt / trace.size();
+}
+
+int main() {
+    const char* policies[] = {"lru", "clock", "2q", "arc"};
+    const int streamPercents[] = {0, 20, 50, 80};
+
+    printf("buffers: %d, metadata blocks: %d\n", BENCH_BUFFER_NUM, METADATA_BLOCK_NUM);
+    printf("%8s", "stream%");
+    for (const char* policyName : policies) {
+        printf(" %18s", policyName);
+    }
+    printf("\n");
+
+    for (int streamPercent : streamPercents) {
+        std::vector<int> trace = MakeTrace(streamPercent);
+        printf("%8d", streamPercent);
+        for (const char* policyName : policies) {
+            double metadataHitRate;
+            double hitRate = Replay(policyName, trace, metadataHitRate);
+            // 总命中率 / 元数据命中率
+            printf("     %6.2f%% /%6.2f%%", hitRate * 100, metadataHitRate * 100);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
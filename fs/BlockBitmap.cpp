@@ -0,0 +1,308 @@
+﻿/**
+ * @file BlockBitmap.cpp
+ * @brief 空闲块位图实现
+ * @author 韩孟霖
+ * @date 2022/6/20
+ * @license GPL v3
+ */
+
+#include <cstring>
+#include <algorithm>
+
+#include "../include/BlockBitmap.h"
+#include "../include/MoFSErrno.h"
+#include "../include/Journal.h"
+#include "../include/device/DeviceManager.h"
+
+/// 加载位图时一次读入的块数
+#define BITMAP_LOAD_BATCH 64
+
+/// 全部占用的字
+#define FULL_WORD (~0ULL)
+
+BlockBitmap BlockBitmap::blockBitmap;
+
+/**
+ * @brief 把0号块和位图覆盖范围之外的位标记为占用
+ * @param bits 整块的位图
+ * @param blockNum 位图覆盖的块数
+ */
+static void MarkReserved(std::vector<uint64_t>& bits, int blockNum) {
+    bits[0] |= 1;
+    size_t wordIdx = (size_t) blockNum >> 6;
+    if (wordIdx < bits.size()) {
+        bits[wordIdx] |= FULL_WORD << (blockNum & 63);
+        std::fill(bits.begin() + (long) wordIdx + 1, bits.end(), FULL_WORD);
+    }
+}
+
+int BlockBitmap::BlockCnt(int blockSize, int blockNum) {
+    long long bitsPerBlock = (long long) blockSize * 8;
+    return (int) ((blockNum + bitsPerBlock) / (bitsPerBlock + 1));
+}
+
+int BlockBitmap::Setup(int bitmapBlock, int bitmapBlockCnt, bool load) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int blockSize = deviceManager.BlockSize();
+    int wordsPerBlock = blockSize / (int) sizeof(uint64_t);
+    this->Drop();
+    if (bitmapBlockCnt <= 0 || bitmapBlock <= 1 || (long long) bitmapBlockCnt * blockSize * 8 < bitmapBlock) {
+        MoFSErrno = 16;
+        return -1;
+    }
+
+    // 按整块读写，0号块和覆盖范围之外的位总是占用
+    std::vector<uint64_t> bits((size_t) bitmapBlockCnt * wordsPerBlock);
+    if (!load) {
+        MarkReserved(bits, bitmapBlock);
+    }
+    int blockNos[BITMAP_LOAD_BATCH];
+    for (int first = 0; first < bitmapBlockCnt; first += BITMAP_LOAD_BATCH) {
+        int count = bitmapBlockCnt - first < BITMAP_LOAD_BATCH ? bitmapBlockCnt - first : BITMAP_LOAD_BATCH;
+        for (int i = 0; i < count; ++i) {
+            blockNos[i] = bitmapBlock + first + i;
+        }
+        char* buffer = (char*) (bits.data() + (size_t) first * wordsPerBlock);
+        int result = load ? deviceManager.ReadBlocks(blockNos, count, buffer) : deviceManager.WriteBlocks(blockNos, count, buffer);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    if (load) {
+        MarkReserved(bits, bitmapBlock);
+    }
+
+    this->bitmapBlock = bitmapBlock;
+    this->blockNum = bitmapBlock;
+    this->words.swap(bits);
+    this->bitmapBlockUnsynced.assign(bitmapBlockCnt, load ? 0 : 1);
+    for (int i = 0; !load && i < bitmapBlockCnt; ++i) {
+        this->unsyncedBitmapBlocks.push_back(bitmapBlock + i);
+    }
+
+    // 逐层汇总，直到只剩一个字
+    size_t lowerBits = this->words.size();
+    do {
+        std::vector<uint64_t> level((lowerBits + 63) / 64);
+        for (size_t i = 0; i < lowerBits; ++i) {
+            bool hasFree = this->summary.empty() ? this->words[i] != FULL_WORD : this->summary.back()[i] != 0;
+            if (hasFree) {
+                level[i >> 6] |= 1ULL << (i & 63);
+            }
+        }
+        lowerBits = level.size();
+        this->summary.push_back(std::move(level));
+    } while (lowerBits > 1);
+
+    for (uint64_t word : this->words) {
+        this->freeCnt += __builtin_popcountll(~word);
+    }
+    return 0;
+}
+
+void BlockBitmap::Drop() {
+    this->bitmapBlock = 0;
+    this->blockNum = 0;
+    this->freeCnt = 0;
+    this->rotor = 1;
+    std::vector<uint64_t>().swap(this->words);
+    this->summary.clear();
+    this->unsyncedBitmapBlocks.clear();
+    this->bitmapBlockUnsynced.clear();
+}
+
+int BlockBitmap::Alloc(int count, int goal, int &allocated) {
+    if (this->freeCnt == 0) {
+        MoFSErrno = 11;
+        return -1;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+
+    // 从起点向后找，到末尾后回到开头，直到找到足够长的段或检查了足够多的段
+    long long start = goal > 0 && goal < this->blockNum ? goal : this->rotor;
+    long long bestFirst = -1, bestLen = 0;
+    long long pos = start;
+    bool wrapped = false;
+    for (int checked = 0; checked < BITMAP_RUN_SEARCH_LIMIT; ) {
+        long long first = this->NextFree(pos);
+        if (wrapped && (first < 0 || first >= start)) {
+            break;
+        }
+        if (first < 0) {
+            wrapped = true;
+            pos = 1;
+            continue;
+        }
+
+        long long end = this->NextUsed(first, std::min<long long>(first + count, this->blockNum));
+        if (end - first > bestLen) {
+            bestFirst = first;
+            bestLen = end - first;
+            if (bestLen == count) {
+                break;
+            }
+        }
+        ++checked;
+        pos = end;
+    }
+
+    if (bestFirst < 0) {
+        MoFSErrno = 11;
+        return -1;
+    }
+    if (-1 == this->Mark((int) bestFirst, (int) bestLen, true)) {
+        return -1;
+    }
+    this->rotor = bestFirst + bestLen < this->blockNum ? (int) (bestFirst + bestLen) : 1;
+    allocated = (int) bestLen;
+    return (int) bestFirst;
+}
+
+int BlockBitmap::Free(int blockNo) {
+    if (blockNo <= 0 || blockNo >= this->blockNum) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    if ((this->words[blockNo >> 6] & (1ULL << (blockNo & 63))) == 0) {
+        // 已经是空闲的
+        return 0;
+    }
+    return this->Mark(blockNo, 1, false);
+}
+
+int BlockBitmap::Flush() {
+    if (this->unsyncedBitmapBlocks.empty()) {
+        return 0;
+    }
+
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    if (-1 == deviceManager.FlushBlocks(this->unsyncedBitmapBlocks.data(), (int) this->unsyncedBitmapBlocks.size())
+        || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    for (int blockNo : this->unsyncedBitmapBlocks) {
+        this->bitmapBlockUnsynced[blockNo - this->bitmapBlock] = 0;
+    }
+    this->unsyncedBitmapBlocks.clear();
+    return 0;
+}
+
+long long BlockBitmap::NextFree(long long pos) const {
+    if (pos >= this->blockNum) {
+        return -1;
+    }
+
+    long long wordIdx = pos >> 6;
+    uint64_t freeBits = ~this->words[wordIdx] & (FULL_WORD << (pos & 63));
+    if (freeBits != 0) {
+        return wordIdx * 64 + __builtin_ctzll(freeBits);
+    }
+
+    // 覆盖范围之外的位都是占用的，找到的一定是数据块
+    long long next = this->NextSummaryBit(0, wordIdx + 1);
+    return next < 0 ? -1 : next * 64 + __builtin_ctzll(~this->words[next]);
+}
+
+long long BlockBitmap::NextUsed(long long pos, long long limit) const {
+    while (pos < limit) {
+        long long wordIdx = pos >> 6;
+        uint64_t usedBits = this->words[wordIdx] & (FULL_WORD << (pos & 63));
+        if (usedBits != 0) {
+            return std::min(wordIdx * 64 + __builtin_ctzll(usedBits), limit);
+        }
+        pos = (wordIdx + 1) * 64;
+    }
+    return limit;
+}
+
+long long BlockBitmap::NextSummaryBit(int level, long long bit) const {
+    const std::vector<uint64_t>& bits = this->summary[level];
+    long long wordIdx = bit >> 6;
+    if (wordIdx >= (long long) bits.size()) {
+        return -1;
+    }
+
+    uint64_t setBits = bits[wordIdx] & (FULL_WORD << (bit & 63));
+    if (setBits != 0) {
+        return wordIdx * 64 + __builtin_ctzll(setBits);
+    }
+    if (level + 1 == (int) this->summary.size()) {
+        // 最上层只有一个字
+        return -1;
+    }
+
+    long long next = this->NextSummaryBit(level + 1, wordIdx + 1);
+    return next < 0 ? -1 : next * 64 + __builtin_ctzll(bits[next]);
+}
+
+int BlockBitmap::Mark(int first, int count, bool used) {
+    long long firstWord = first >> 6;
+    long long lastWord = ((long long) first + count - 1) >> 6;
+    for (long long wordIdx = firstWord; wordIdx <= lastWord; ++wordIdx) {
+        int low = wordIdx == firstWord ? first & 63 : 0;
+        int high = wordIdx == lastWord ? (int) (((long long) first + count - 1) & 63) : 63;
+        uint64_t mask = (FULL_WORD << low) & (FULL_WORD >> (63 - high));
+        if (used) {
+            this->words[wordIdx] |= mask;
+        }
+        else {
+            this->words[wordIdx] &= ~mask;
+        }
+        this->UpdateSummary(wordIdx);
+    }
+    this->freeCnt += used ? -count : count;
+    return this->StoreWords(firstWord, lastWord);
+}
+
+void BlockBitmap::UpdateSummary(long long wordIdx) {
+    bool hasFree = this->words[wordIdx] != FULL_WORD;
+    long long bit = wordIdx;
+    for (std::vector<uint64_t>& bits : this->summary) {
+        uint64_t& word = bits[bit >> 6];
+        bool hadFree = word != 0;
+        if (hasFree) {
+            word |= 1ULL << (bit & 63);
+        }
+        else {
+            word &= ~(1ULL << (bit & 63));
+        }
+
+        // 这一字是否为0没有变化时，上层不受影响
+        if ((word != 0) == hadFree) {
+            return;
+        }
+        hasFree = word != 0;
+        bit >>= 6;
+    }
+}
+
+int BlockBitmap::StoreWords(long long firstWord, long long lastWord) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int wordsPerBlock = deviceManager.BlockSize() / (int) sizeof(uint64_t);
+    for (long long blockIdx = firstWord / wordsPerBlock; blockIdx <= lastWord / wordsPerBlock; ++blockIdx) {
+        int blockNo = this->bitmapBlock + (int) blockIdx;
+
+        // 位图块与索引表、inode在同一个事务中提交
+        if (-1 == Journal::journal.LogBlock(blockNo)) {
+            return -1;
+        }
+
+        long long begin = std::max(firstWord, blockIdx * wordsPerBlock);
+        long long end = std::min(lastWord + 1, (blockIdx + 1) * wordsPerBlock);
+        char* blockData;
+        int handle = deviceManager.GetBlock(blockNo, blockData);
+        if (handle == -1) {
+            return -1;
+        }
+        memcpy(blockData + (begin - blockIdx * wordsPerBlock) * sizeof(uint64_t), &this->words[begin], (end - begin) * sizeof(uint64_t));
+        deviceManager.PutBlock(handle, true);
+
+        if (!this->bitmapBlockUnsynced[blockIdx]) {
+            this->bitmapBlockUnsynced[blockIdx] = 1;
+            this->unsyncedBitmapBlocks.push_back(blockNo);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+﻿/**
+ * @file DedupStore.cpp
+ * @brief 块级去重实现
+ * @author 韩孟霖
+ * @date 2022/6/18
+ * @license GPL v3
+ */
+
+#include <cstring>
+
+#include "../include/DedupStore.h"
+#include "../include/MoFSErrno.h"
+#include "../include/Journal.h"
+#include "../include/device/DeviceManager.h"
+#include "../utils/Crc32c.h"
+
+/// 加载去重表时一次读入的块数
+#define DEDUP_LOAD_BATCH 64
+
+/// 后一半CRC32C的初值，与前一半区分
+#define DEDUP_SECOND_SEED 0x9E3779B9u
+
+static_assert(sizeof(DedupEntry) == 16, "DedupEntry must occupy exactly 16 bytes on disk");
+
+DedupStore DedupStore::dedupStore;
+
+uint64_t DedupStore::Fingerprint(const char *data, int length) {
+    int half = length / 2;
+    uint64_t fingerprint = ((uint64_t) Crc32c::Compute(data, half) << 32) | Crc32c::Extend(DEDUP_SECOND_SEED, data + half, length - half);
+    return fingerprint == 0 ? 1 : fingerprint;
+}
+
+int DedupStore::Setup(int tableBlock, int tableBlockCnt, bool load) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int blockSize = deviceManager.BlockSize();
+    int entriesPerBlock = blockSize / (int) sizeof(DedupEntry);
+    this->Drop();
+    if (tableBlockCnt <= 0 || (long long) tableBlockCnt * entriesPerBlock < tableBlock) {
+        MoFSErrno = 16;
+        return -1;
+    }
+
+    // 先按整块读写，最后截去多余的项
+    std::vector<DedupEntry> table((size_t) tableBlockCnt * entriesPerBlock);
+    int blockNos[DEDUP_LOAD_BATCH];
+    for (int first = 0; first < tableBlockCnt; first += DEDUP_LOAD_BATCH) {
+        int count = tableBlockCnt - first < DEDUP_LOAD_BATCH ? tableBlockCnt - first : DEDUP_LOAD_BATCH;
+        for (int i = 0; i < count; ++i) {
+            blockNos[i] = tableBlock + first + i;
+        }
+        char* buffer = (char*) (table.data() + (size_t) first * entriesPerBlock);
+        int result = load ? deviceManager.ReadBlocks(blockNos, count, buffer) : deviceManager.WriteBlocks(blockNos, count, buffer);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    table.resize(tableBlock);
+
+    this->tableBlock = tableBlock;
+    this->entries.swap(table);
+    this->tableBlockUnsynced.assign(tableBlockCnt, load ? 0 : 1);
+    for (int i = 0; !load && i < tableBlockCnt; ++i) {
+        this->unsyncedTableBlocks.push_back(tableBlock + i);
+    }
+    this->compareBuffer.resize(blockSize);
+    for (int blockNo = 0; blockNo < tableBlock; ++blockNo) {
+        const DedupEntry& entry = this->entries[blockNo];
+        if (entry.fingerprint != 0) {
+            this->index[entry.fingerprint] = blockNo;
+        }
+        this->sharedRefs += entry.sharedRefs;
+    }
+    return 0;
+}
+
+void DedupStore::Drop() {
+    this->tableBlock = 0;
+    std::vector<DedupEntry>().swap(this->entries);
+    std::unordered_map<uint64_t, int>().swap(this->index);
+    this->unsyncedTableBlocks.clear();
+    this->tableBlockUnsynced.clear();
+    this->sharedRefs = 0;
+}
+
+int DedupStore::Find(uint64_t fingerprint) const {
+    auto iter = this->index.find(fingerprint);
+    return iter == this->index.end() ? -1 : iter->second;
+}
+
+bool DedupStore::Matches(int blockNo, const char *data) {
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    if ((unsigned int) blockSize != DeviceManager::deviceManager.ReadBlock(blockNo, this->compareBuffer.data())
+        || memcmp(this->compareBuffer.data(), data, blockSize) != 0) {
+        return false;
+    }
+    ++this->hits;
+    return true;
+}
+
+int DedupStore::Register(int blockNo, uint64_t fingerprint) {
+    if (blockNo < 0 || blockNo >= (int) this->entries.size()) {
+        return 0;
+    }
+
+    DedupEntry& entry = this->entries[blockNo];
+    auto iter = this->index.find(entry.fingerprint);
+    if (iter != this->index.end() && iter->second == blockNo) {
+        this->index.erase(iter);
+    }
+    entry.fingerprint = fingerprint;
+    this->index[fingerprint] = blockNo;
+    return this->StoreEntry(blockNo);
+}
+
+int DedupStore::Forget(int blockNo) {
+    if (blockNo < 0 || blockNo >= (int) this->entries.size() || this->entries[blockNo].fingerprint == 0) {
+        return 0;
+    }
+
+    DedupEntry& entry = this->entries[blockNo];
+    auto iter = this->index.find(entry.fingerprint);
+    if (iter != this->index.end() && iter->second == blockNo) {
+        this->index.erase(iter);
+    }
+    entry.fingerprint = 0;
+    return this->StoreEntry(blockNo);
+}
+
+bool DedupStore::IsShared(int blockNo) const {
+    return blockNo >= 0 && blockNo < (int) this->entries.size() && this->entries[blockNo].sharedRefs > 0;
+}
+
+int DedupStore::AddRef(int blockNo) {
+    if (blockNo < 0 || blockNo >= (int) this->entries.size()) {
+        return -1;
+    }
+
+    ++this->entries[blockNo].sharedRefs;
+    ++this->sharedRefs;
+    return this->StoreEntry(blockNo);
+}
+
+int DedupStore::DropRef(int blockNo) {
+    if (blockNo < 0 || blockNo >= (int) this->entries.size()) {
+        return 0;
+    }
+
+    DedupEntry& entry = this->entries[blockNo];
+    if (entry.sharedRefs == 0) {
+        // 最后一处引用，块即将放回空闲表并被用作其它用途
+        return this->Forget(blockNo);
+    }
+
+    --entry.sharedRefs;
+    --this->sharedRefs;
+    return -1 == this->StoreEntry(blockNo) ? -1 : 1;
+}
+
+int DedupStore::Flush() {
+    if (this->unsyncedTableBlocks.empty()) {
+        return 0;
+    }
+
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    if (-1 == deviceManager.FlushBlocks(this->unsyncedTableBlocks.data(), (int) this->unsyncedTableBlocks.size())
+        || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    for (int blockNo : this->unsyncedTableBlocks) {
+        this->tableBlockUnsynced[blockNo - this->tableBlock] = 0;
+    }
+    this->unsyncedTableBlocks.clear();
+    return 0;
+}
+
+void DedupStore::GetStats(unsigned long long &hits, unsigned long long &sharedRefs) const {
+    hits = this->hits;
+    sharedRefs = this->sharedRefs;
+}
+
+void DedupStore::ResetStats() {
+    this->hits = 0;
+}
+
+int DedupStore::StoreEntry(int blockNo) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int entriesPerBlock = deviceManager.BlockSize() / (int) sizeof(DedupEntry);
+    int tableBlockIdx = blockNo / entriesPerBlock;
+
+    // 引用数与空闲表、索引表在同一个事务中提交
+    if (-1 == Journal::journal.LogBlock(this->tableBlock + tableBlockIdx)) {
+        return -1;
+    }
+
+    char* blockData;
+    int handle = deviceManager.GetBlock(this->tableBlock + tableBlockIdx, blockData);
+    if (handle == -1) {
+        return -1;
+    }
+    memcpy(blockData + (size_t) (blockNo % entriesPerBlock) * sizeof(DedupEntry), &this->entries[blockNo], sizeof(DedupEntry));
+    deviceManager.PutBlock(handle, true);
+
+    if (!this->tableBlockUnsynced[tableBlockIdx]) {
+        this->tableBlockUnsynced[tableBlockIdx] = 1;
+        this->unsyncedTableBlocks.push_back(this->tableBlock + tableBlockIdx);
+    }
+    return 0;
+}
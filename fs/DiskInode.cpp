@@ -7,10 +7,12 @@
  * @license GPL v3
  */
 #include <cstring>
+#include <vector>
 
 #include "../include/DiskInode.h"
 #include "../include/device/DeviceManager.h"
 #include "../include/SuperBlock.h"
+#include "../include/MemInode.h"
 
 /**
  * @brief DiskInode构造函数
@@ -37,7 +39,8 @@ int DiskInode::DiskInodeFactory(int diskInodeIdx, DiskInode &diskInode) {
 }
 
 int DiskInode::ReleaseBlocks() {
-    int blockNum = (this->d_size - 1) / BLOCK_SIZE + 1;
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int n = blockSize / (int) sizeof(int);
 
     for (int i = 0; i < 6; ++i) {
         if (this->d_addr[i] > 0) {
@@ -45,19 +48,19 @@ int DiskInode::ReleaseBlocks() {
         }
     }
 
-    int buffer[128];
+    std::vector<int> buffer(n);
     for (int i = 6; i < 8; ++i) {
         if (this->d_addr[i] > 0) {
             // 一级索引有效
-            if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(this->d_addr[i], buffer)) {
+            if (blockSize != DeviceManager::deviceManager.ReadBlock(this->d_addr[i], buffer.data())) {
                 return -1;
             }
 
-            for (int j = 0; j < 128; ++j) {
+            for (int j = 0; j < n; ++j) {
                 if (buffer[j] > 0) {
                     SuperBlock::superBlock.ReleaseBlock(buffer[j]);
                 }
-                else {
+                else if (buffer[j] != COMPRESSED_BLOCK) {
                     break;
                 }
             }
@@ -66,26 +69,26 @@ int DiskInode::ReleaseBlocks() {
         }
     }
 
-    int buffer2[128];
+    std::vector<int> buffer2(n);
     for (int i = 8; i < 10; ++i) {
         if (this->d_addr[i] > 0) {
             // 二级索引有效
-            if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(this->d_addr[i], buffer)) {
+            if (blockSize != DeviceManager::deviceManager.ReadBlock(this->d_addr[i], buffer.data())) {
                 return -1;
             }
 
-            for (int j = 0; j < 128; ++j) {
+            for (int j = 0; j < n; ++j) {
                 if (buffer[j] > 0) {
                     // 一级索引有效
-                    if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(buffer[j], buffer2)) {
+                    if (blockSize != DeviceManager::deviceManager.ReadBlock(buffer[j], buffer2.data())) {
                         return -1;
                     }
 
-                    for (int k = 0; k < 128; ++k) {
+                    for (int k = 0; k < n; ++k) {
                         if (buffer2[k] > 0) {
                             SuperBlock::superBlock.ReleaseBlock(buffer2[k]);
                         }
-                        else {
+                        else if (buffer2[k] != COMPRESSED_BLOCK) {
                             break;
                         }
                     }
@@ -0,0 +1,622 @@
+﻿/**
+ * @file Journal.cpp
+ * @brief 元数据日志实现
+ * @author 韩孟霖
+ * @date 2022/6/19
+ * @license GPL v3
+ */
+
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+
+#include "../include/Journal.h"
+#include "../include/SuperBlock.h"
+#include "../include/MoFSErrno.h"
+#include "../include/device/DeviceManager.h"
+#include "../utils/Crc32c.h"
+
+static_assert(sizeof(JournalBlockHeader) == 16, "JournalBlockHeader must occupy exactly 16 bytes on disk");
+static_assert(sizeof(JournalTag) == 8, "JournalTag must occupy exactly 8 bytes on disk");
+
+Journal Journal::journal;
+
+/**
+ * @brief 取得单调时钟的当前时间
+ * @return 毫秒数
+ */
+static long long NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Journal::~Journal() {
+    this->StopCommitter();
+}
+
+int Journal::DefaultBlockCnt(int blockSize, int blockNum) {
+    int blockCnt = std::min(JOURNAL_DEFAULT_BYTE / blockSize, blockNum / 8);
+    return std::max(blockCnt, JOURNAL_MIN_BLOCKS);
+}
+
+void Journal::SetCommitInterval(int commitMs) {
+    this->commitMs = commitMs;
+}
+
+int Journal::Setup(int journalBlock, int journalBlockCnt, bool load) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    this->Drop();
+    if (journalBlockCnt < JOURNAL_MIN_BLOCKS || journalBlock <= 0
+        || (long long) journalBlock + journalBlockCnt > SuperBlock::superBlock.s_fsize) {
+        MoFSErrno = 16;
+        return -1;
+    }
+
+    this->journalBlock = journalBlock;
+    this->ringCnt = journalBlockCnt - 1;
+
+    // 一个事务连同描述块、撤销块和提交块不超过环的一半，用过一半时写回，下一个事务总能放下
+    this->blockHoldLimit = std::max(1, std::min(this->ringCnt / 8, deviceManager.blockBufferNum / 4));
+    this->inodeHoldLimit = std::max(1, std::min(this->ringCnt / 16, deviceManager.inodeBufferNum / 2));
+    this->freeBatch = (size_t) 100 * std::max(1, std::min(this->ringCnt / 16, deviceManager.blockBufferNum / 8));
+
+    int replayedCnt = 0;
+    if (load) {
+        replayedCnt = this->Replay();
+        if (replayedCnt == -1) {
+            return -1;
+        }
+    }
+    else {
+        // 序号从随机值开始，环中残留的旧文件系统的事务不会被当作本文件系统的
+        this->sequence = (uint32_t) std::random_device{}() ^ (uint32_t) time(nullptr);
+        this->headPos = 0;
+        if (-1 == this->WriteBack()) {
+            return -1;
+        }
+    }
+
+    this->committedSuper.resize(sizeof(SuperBlock));
+    memcpy(this->committedSuper.data(), &SuperBlock::superBlock, sizeof(SuperBlock));
+
+    // mmap模式下修改直接落在映射中，无法在提交之前留住，只重放不记录
+    this->enabled = !deviceManager.MappedMode();
+    if (this->enabled && this->commitMs > 0) {
+        this->committerThread = std::thread(&Journal::CommitterLoop, this);
+    }
+    return replayedCnt;
+}
+
+void Journal::Drop() {
+    this->StopCommitter();
+    this->enabled = false;
+    this->journalBlock = 0;
+    this->ringCnt = 0;
+    this->headPos = 0;
+    this->tailPos = 0;
+    this->usedCnt = 0;
+
+    // 未提交的修改不再留在缓存中，照常写回
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    for (int blockNo : this->heldBlocks) {
+        deviceManager.ReleaseHeldBlock(blockNo);
+    }
+    for (int inodeBlockNo : this->heldInodeBlocks) {
+        deviceManager.ReleaseHeldInodeBlock(inodeBlockNo);
+    }
+    this->heldBlocks.clear();
+    this->heldInodeBlocks.clear();
+    this->pendingFrees.clear();
+    this->readyFrees.clear();
+    this->freedBlocks.clear();
+    this->loggedBlocks.clear();
+    this->committedSuper.clear();
+    this->runningSince = 0;
+    this->committing = false;
+}
+
+int Journal::LogBlock(int blockNo) {
+    if (!this->enabled) {
+        return 0;
+    }
+    if (this->committing) {
+        // 提交时放回空闲表的块又被写成链表块，本次提交仍要写入它的映像
+        this->freedBlocks.erase(blockNo);
+    }
+    else if ((int) this->heldBlocks.size() >= this->blockHoldLimit && -1 == this->Commit()) {
+        return -1;
+    }
+
+    int result = DeviceManager::deviceManager.HoldBlock(blockNo);
+    if (result == -1) {
+        return -1;
+    }
+    if (result == 1) {
+        this->heldBlocks.push_back(blockNo);
+    }
+    if (this->runningSince == 0) {
+        this->runningSince = NowMs();
+    }
+    return 0;
+}
+
+int Journal::LogBlocks(const int *blockNos, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (-1 == this->LogBlock(blockNos[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int Journal::LogInode(int inodeNo) {
+    if (!this->enabled) {
+        return 0;
+    }
+    if (!this->committing && (int) this->heldInodeBlocks.size() >= this->inodeHoldLimit && -1 == this->Commit()) {
+        return -1;
+    }
+
+    int inodeBlockNo;
+    int result = DeviceManager::deviceManager.HoldInode(inodeNo, inodeBlockNo);
+    if (result == -1) {
+        return -1;
+    }
+    if (result == 1) {
+        this->heldInodeBlocks.push_back(inodeBlockNo);
+    }
+    if (this->runningSince == 0) {
+        this->runningSince = NowMs();
+    }
+    return 0;
+}
+
+bool Journal::DeferFree(int blockNo) {
+    if (!this->enabled) {
+        return false;
+    }
+
+    // 操作结束之前，已提交的元数据可能仍引用这个块
+    (this->opDepth > 0 ? this->pendingFrees : this->readyFrees).push_back(blockNo);
+    if (this->runningSince == 0) {
+        this->runningSince = NowMs();
+    }
+    return true;
+}
+
+bool Journal::ReclaimFrees() {
+    if (!this->enabled || this->committing || this->readyFrees.empty()) {
+        return false;
+    }
+    return 0 == this->Commit();
+}
+
+int Journal::Commit() {
+    std::lock_guard<std::recursive_mutex> lock(this->opMutex);
+    if (!this->enabled || this->committing) {
+        return 0;
+    }
+
+    this->committing = true;
+    int result = this->CommitRunning();
+    this->committing = false;
+    return result;
+}
+
+int Journal::Checkpoint() {
+    std::lock_guard<std::recursive_mutex> lock(this->opMutex);
+    if (!this->enabled) {
+        return 0;
+    }
+
+    // 调用者处在两次修改之间，正在进行的操作释放的块也可以放回空闲表
+    this->readyFrees.insert(this->readyFrees.end(), this->pendingFrees.begin(), this->pendingFrees.end());
+    this->pendingFrees.clear();
+    do {
+        if (-1 == this->Commit()) {
+            return -1;
+        }
+    } while (!this->readyFrees.empty());
+    return this->usedCnt == 0 ? 0 : this->WriteBack();
+}
+
+void Journal::GetStats(unsigned long long &commits, unsigned long long &loggedBlocks,
+                       unsigned long long &checkpoints, unsigned long long &replayed) const {
+    commits = this->commits;
+    loggedBlocks = this->journalWrites;
+    checkpoints = this->checkpoints;
+    replayed = this->replayed;
+}
+
+void Journal::ResetStats() {
+    this->commits = 0;
+    this->journalWrites = 0;
+    this->checkpoints = 0;
+    this->replayed = 0;
+}
+
+void Journal::BeginOp() {
+    this->opMutex.lock();
+    ++this->opDepth;
+}
+
+void Journal::EndOp() {
+    if (--this->opDepth == 0 && this->enabled) {
+        // 操作已经完成，它释放的块不再被引用，可以随下次提交放回空闲表
+        this->readyFrees.insert(this->readyFrees.end(), this->pendingFrees.begin(), this->pendingFrees.end());
+        this->pendingFrees.clear();
+        if (this->CommitDue()) {
+            this->Commit();
+        }
+    }
+    this->opMutex.unlock();
+}
+
+bool Journal::CommitDue() const {
+    if (this->runningSince == 0) {
+        return false;
+    }
+    if (this->commitMs <= 0) {
+        return true;
+    }
+
+    // 事务达到上限的一半时提前提交，避免之后在操作中途提交
+    return NowMs() - this->runningSince >= this->commitMs
+           || (int) this->heldBlocks.size() * 2 >= this->blockHoldLimit
+           || (int) this->heldInodeBlocks.size() * 2 >= this->inodeHoldLimit
+           || this->readyFrees.size() >= this->freeBatch;
+}
+
+int Journal::CommitRunning() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    SuperBlock& superBlock = SuperBlock::superBlock;
+    int blockSize = deviceManager.BlockSize();
+
+    // 先把已完成的操作释放的块放回空闲表，写入的链表块、位图块和SuperBlock一起进入本事务。
+    // 分散的块各自修改一个位图块，留下的块达到上限时其余的块留到下次提交
+    this->freedBlocks.clear();
+    size_t freeLimit = std::min(this->readyFrees.size(), this->freeBatch);
+    size_t freeCnt = 0;
+    for (; freeCnt < freeLimit && (int) this->heldBlocks.size() < this->blockHoldLimit; ++freeCnt) {
+        this->freedBlocks.insert(this->readyFrees[freeCnt]);
+        if (-1 == superBlock.AddFreeBlock(this->readyFrees[freeCnt])) {
+            this->readyFrees.erase(this->readyFrees.begin(), this->readyFrees.begin() + (long) freeCnt);
+            return -1;
+        }
+    }
+    this->readyFrees.erase(this->readyFrees.begin(), this->readyFrees.begin() + (long) freeCnt);
+
+    std::vector<char> superImage(sizeof(SuperBlock));
+    memcpy(superImage.data(), &superBlock, sizeof(SuperBlock));
+    if (this->heldBlocks.empty() && this->heldInodeBlocks.empty() && this->freedBlocks.empty() && superImage == this->committedSuper) {
+        this->runningSince = this->readyFrees.empty() ? 0 : NowMs();
+        return 0;
+    }
+
+    // 被释放的块不再写入映像；它们之前写入日志的映像要撤销，重放时不能覆盖之后写入的数据
+    int superParts = ((int) sizeof(SuperBlock) + blockSize - 1) / blockSize;
+    std::vector<JournalTag> tags;
+    for (int blockNo : this->heldBlocks) {
+        if (this->freedBlocks.count(blockNo) == 0) {
+            tags.push_back({JOURNAL_AREA_BLOCK, blockNo});
+        }
+    }
+    for (int inodeBlockNo : this->heldInodeBlocks) {
+        tags.push_back({JOURNAL_AREA_INODE, inodeBlockNo});
+    }
+    for (int i = 0; i < superParts; ++i) {
+        tags.push_back({JOURNAL_AREA_SUPER, i});
+    }
+    std::vector<int32_t> revokes;
+    for (int blockNo : this->freedBlocks) {
+        if (this->loggedBlocks.count(blockNo) != 0) {
+            revokes.push_back(blockNo);
+        }
+    }
+    std::sort(revokes.begin(), revokes.end());
+
+    const int headerSize = (int) sizeof(JournalBlockHeader);
+    int tagsPerBlock = (blockSize - headerSize) / (int) sizeof(JournalTag);
+    int revokesPerBlock = (blockSize - headerSize) / (int) sizeof(int32_t);
+    int tagCnt = (int) tags.size();
+    int revokeCnt = (int) revokes.size();
+    int totalCnt = (tagCnt + tagsPerBlock - 1) / tagsPerBlock + tagCnt + (revokeCnt + revokesPerBlock - 1) / revokesPerBlock + 1;
+    if (totalCnt > this->ringCnt - this->usedCnt) {
+        MoFSErrno = 11;
+        return -1;
+    }
+
+    // 描述块之后紧跟它描述的映像，然后是撤销块，最后是提交块
+    std::vector<char> data((size_t) totalCnt * blockSize, 0);
+    int pos = 0;
+    for (int first = 0; first < tagCnt; first += tagsPerBlock) {
+        int count = std::min(tagsPerBlock, tagCnt - first);
+        char* descriptor = data.data() + (size_t) pos++ * blockSize;
+        JournalBlockHeader header = {JOURNAL_MAGIC, JOURNAL_BLOCK_DESCRIPTOR, this->sequence, (uint32_t) count};
+        memcpy(descriptor, &header, headerSize);
+        memcpy(descriptor + headerSize, &tags[first], count * sizeof(JournalTag));
+
+        for (int i = first; i < first + count; ++i) {
+            char* image = data.data() + (size_t) pos++ * blockSize;
+            int result = 0;
+            if (tags[i].area == JOURNAL_AREA_BLOCK) {
+                result = deviceManager.CopyHeldBlock(tags[i].blockNo, image);
+            }
+            else if (tags[i].area == JOURNAL_AREA_INODE) {
+                result = deviceManager.CopyHeldInodeBlock(tags[i].blockNo, image);
+            }
+            else {
+                int offset = tags[i].blockNo * blockSize;
+                memcpy(image, superImage.data() + offset, std::min(blockSize, (int) sizeof(SuperBlock) - offset));
+            }
+            if (result == -1) {
+                return -1;
+            }
+        }
+    }
+    for (int first = 0; first < revokeCnt; first += revokesPerBlock) {
+        int count = std::min(revokesPerBlock, revokeCnt - first);
+        char* revokeBlock = data.data() + (size_t) pos++ * blockSize;
+        JournalBlockHeader header = {JOURNAL_MAGIC, JOURNAL_BLOCK_REVOKE, this->sequence, (uint32_t) count};
+        memcpy(revokeBlock, &header, headerSize);
+        memcpy(revokeBlock + headerSize, &revokes[first], count * sizeof(int32_t));
+    }
+
+    // 提交块与其它块一起写入，只同步一次；写了一半的事务校验不通过，重放时被丢弃
+    uint32_t checksum = Crc32c::Compute(data.data(), (size_t) pos * blockSize);
+    char* commitBlock = data.data() + (size_t) pos * blockSize;
+    JournalBlockHeader header = {JOURNAL_MAGIC, JOURNAL_BLOCK_COMMIT, this->sequence, (uint32_t) pos};
+    memcpy(commitBlock, &header, headerSize);
+    memcpy(commitBlock + headerSize, &checksum, sizeof(uint32_t));
+
+    std::vector<int> blockNos(totalCnt);
+    for (int i = 0; i < totalCnt; ++i) {
+        blockNos[i] = this->RingBlock(this->headPos + i);
+    }
+    if (-1 == deviceManager.WriteBlocksDirect(blockNos.data(), totalCnt, data.data()) || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+
+    // 已经提交，事务中的块可以照常写回
+    for (int blockNo : this->heldBlocks) {
+        deviceManager.ReleaseHeldBlock(blockNo);
+        if (this->freedBlocks.count(blockNo) == 0) {
+            this->loggedBlocks.insert(blockNo);
+        }
+    }
+    for (int inodeBlockNo : this->heldInodeBlocks) {
+        deviceManager.ReleaseHeldInodeBlock(inodeBlockNo);
+    }
+    this->heldBlocks.clear();
+    this->heldInodeBlocks.clear();
+    this->freedBlocks.clear();
+    this->committedSuper.swap(superImage);
+    this->headPos = (this->headPos + totalCnt) % this->ringCnt;
+    this->usedCnt += totalCnt;
+    ++this->sequence;
+    ++this->commits;
+    this->journalWrites += totalCnt;
+    this->runningSince = this->readyFrees.empty() ? 0 : NowMs();
+
+    if (this->usedCnt > this->ringCnt / 2) {
+        return this->WriteBack();
+    }
+    return 0;
+}
+
+int Journal::WriteBack() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+
+    // 日志中的修改全部落到原位置之后，头块才能越过它们
+    if (-1 == deviceManager.FlushDirtyBlocks() || -1 == deviceManager.FlushDirtyInodes()
+        || -1 == SuperBlock::superBlock.Flush() || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+
+    this->tailPos = this->headPos;
+    this->usedCnt = 0;
+    this->loggedBlocks.clear();
+    this->committedSuper.resize(sizeof(SuperBlock));
+    memcpy(this->committedSuper.data(), &SuperBlock::superBlock, sizeof(SuperBlock));
+    ++this->checkpoints;
+    return this->StoreHeader();
+}
+
+int Journal::StoreHeader() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    std::vector<char> block(deviceManager.BlockSize(), 0);
+    JournalBlockHeader header = {JOURNAL_MAGIC, JOURNAL_BLOCK_HEADER, this->sequence, (uint32_t) this->tailPos};
+    memcpy(block.data(), &header, sizeof(header));
+    if (-1 == deviceManager.WriteBlocksDirect(&this->journalBlock, 1, block.data())) {
+        return -1;
+    }
+    return deviceManager.SyncDevice();
+}
+
+int Journal::Replay() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    SuperBlock& superBlock = SuperBlock::superBlock;
+    int blockSize = deviceManager.BlockSize();
+    std::vector<char> block(blockSize);
+    JournalBlockHeader header{};
+
+    if (-1 == deviceManager.ReadBlocksDirect(&this->journalBlock, 1, block.data())) {
+        return -1;
+    }
+    memcpy(&header, block.data(), sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.type != JOURNAL_BLOCK_HEADER || header.count >= (uint32_t) this->ringCnt) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    this->sequence = header.sequence;
+    this->tailPos = (int) header.count;
+    this->headPos = this->tailPos;
+
+    /**
+     * @brief 从环中读出的一个完整事务
+     */
+    struct Transaction {
+        std::vector<JournalTag> tags;
+        std::vector<char> images;
+        std::vector<int32_t> revokes;
+    };
+
+    // 从头块记录的位置起逐个读出序号连续、提交块校验通过的事务，遇到第一个不完整的事务为止
+    const int headerSize = (int) sizeof(JournalBlockHeader);
+    int tagsPerBlock = (blockSize - headerSize) / (int) sizeof(JournalTag);
+    int revokesPerBlock = (blockSize - headerSize) / (int) sizeof(int32_t);
+    std::vector<Transaction> transactions;
+    int scannedCnt = 0;
+    while (true) {
+        Transaction transaction;
+        uint32_t expectedSequence = this->sequence + (uint32_t) transactions.size();
+        uint32_t checksum = 0;
+        int blockCnt = 0;
+        int imagesLeft = 0;
+        bool complete = false;
+        while (scannedCnt + blockCnt < this->ringCnt) {
+            int blockNo = this->RingBlock(this->headPos + blockCnt);
+            if (-1 == deviceManager.ReadBlocksDirect(&blockNo, 1, block.data())) {
+                break;
+            }
+            if (imagesLeft > 0) {
+                checksum = Crc32c::Extend(checksum, block.data(), blockSize);
+                transaction.images.insert(transaction.images.end(), block.begin(), block.end());
+                --imagesLeft;
+                ++blockCnt;
+                continue;
+            }
+
+            memcpy(&header, block.data(), sizeof(header));
+            if (header.magic != JOURNAL_MAGIC || header.sequence != expectedSequence) {
+                break;
+            }
+            if (header.type == JOURNAL_BLOCK_COMMIT) {
+                uint32_t storedChecksum;
+                memcpy(&storedChecksum, block.data() + headerSize, sizeof(uint32_t));
+                complete = header.count == (uint32_t) blockCnt && storedChecksum == checksum;
+                ++blockCnt;
+                break;
+            }
+            if (header.type == JOURNAL_BLOCK_DESCRIPTOR && header.count <= (uint32_t) tagsPerBlock) {
+                const JournalTag* tags = (const JournalTag*) (block.data() + headerSize);
+                transaction.tags.insert(transaction.tags.end(), tags, tags + header.count);
+                imagesLeft = (int) header.count;
+            }
+            else if (header.type == JOURNAL_BLOCK_REVOKE && header.count <= (uint32_t) revokesPerBlock) {
+                const int32_t* revokes = (const int32_t*) (block.data() + headerSize);
+                transaction.revokes.insert(transaction.revokes.end(), revokes, revokes + header.count);
+            }
+            else {
+                break;
+            }
+            checksum = Crc32c::Extend(checksum, block.data(), blockSize);
+            ++blockCnt;
+        }
+        if (!complete) {
+            break;
+        }
+
+        transactions.push_back(std::move(transaction));
+        this->headPos = (this->headPos + blockCnt) % this->ringCnt;
+        scannedCnt += blockCnt;
+    }
+    if (transactions.empty()) {
+        return 0;
+    }
+
+    // 被撤销的块只重放撤销之后的映像
+    std::unordered_map<int, size_t> revokedIn;
+    for (size_t i = 0; i < transactions.size(); ++i) {
+        for (int32_t blockNo : transactions[i].revokes) {
+            revokedIn[blockNo] = i;
+        }
+    }
+
+    int superParts = ((int) sizeof(SuperBlock) + blockSize - 1) / blockSize;
+    std::vector<char> superImage((size_t) superParts * blockSize);
+    memcpy(superImage.data(), &superBlock, sizeof(SuperBlock));
+    bool superReplayed = false;
+    for (size_t i = 0; i < transactions.size(); ++i) {
+        const Transaction& transaction = transactions[i];
+        for (size_t j = 0; j < transaction.tags.size(); ++j) {
+            const JournalTag& tag = transaction.tags[j];
+            const char* image = transaction.images.data() + j * blockSize;
+            int result = 0;
+            if (tag.area == JOURNAL_AREA_BLOCK) {
+                if (tag.blockNo <= 0 || tag.blockNo >= superBlock.s_fsize
+                    || (tag.blockNo >= this->journalBlock && tag.blockNo <= this->journalBlock + this->ringCnt)) {
+                    MoFSErrno = 16;
+                    return -1;
+                }
+                auto iter = revokedIn.find(tag.blockNo);
+                if (iter == revokedIn.end() || iter->second <= i) {
+                    result = deviceManager.WriteBlocks(&tag.blockNo, 1, image);
+                }
+            }
+            else if (tag.area == JOURNAL_AREA_INODE && tag.blockNo >= 0 && tag.blockNo < superBlock.s_isize) {
+                result = deviceManager.WriteInodeBlock(tag.blockNo, image);
+            }
+            else if (tag.area == JOURNAL_AREA_SUPER && tag.blockNo >= 0 && tag.blockNo < superParts) {
+                memcpy(superImage.data() + (size_t) tag.blockNo * blockSize, image, blockSize);
+                superReplayed = true;
+            }
+            else {
+                MoFSErrno = 16;
+                return -1;
+            }
+            if (result == -1) {
+                return -1;
+            }
+        }
+    }
+    if (superReplayed && -1 == deviceManager.StoreSuperBlock(superImage.data())) {
+        return -1;
+    }
+
+    // 重放的内容落盘之后才能清空日志
+    if (-1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    this->sequence += (uint32_t) transactions.size();
+    this->tailPos = this->headPos;
+    if (-1 == this->StoreHeader()) {
+        return -1;
+    }
+    this->replayed += transactions.size();
+    return (int) transactions.size();
+}
+
+void Journal::CommitterLoop() {
+    std::unique_lock<std::mutex> lock(this->committerMutex);
+    while (!this->committerStopping) {
+        this->committerCond.wait_for(lock, std::chrono::milliseconds(this->commitMs));
+        if (this->committerStopping) {
+            break;
+        }
+        lock.unlock();
+        {
+            // 有操作正在进行时不等待，由它结束时检查
+            std::unique_lock<std::recursive_mutex> opLock(this->opMutex, std::try_to_lock);
+            if (opLock.owns_lock() && this->enabled && this->CommitDue()) {
+                this->Commit();
+            }
+        }
+        lock.lock();
+    }
+}
+
+void Journal::StopCommitter() {
+    if (!this->committerThread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->committerMutex);
+        this->committerStopping = true;
+    }
+    this->committerCond.notify_all();
+    this->committerThread.join();
+    this->committerStopping = false;
+}
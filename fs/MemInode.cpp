@@ -6,14 +6,78 @@
  * @license GPL v3
  */
 #include <cstring>
+#include <cstdint>
 #include <ctime>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 #include "../include/MoFSErrno.h"
 #include "../include/device/DeviceManager.h"
 #include "../include/MemInode.h"
 #include "../include/SuperBlock.h"
+#include "../include/DedupStore.h"
+#include "../include/Journal.h"
 #include "../utils/Diagnose.h"
+#include "../utils/Lz4.h"
+
+/// 压缩组头的魔数，"MoLZ"
+#define COMPRESSED_GROUP_MAGIC 0x5A4C6F4Du
+
+/**
+ * @brief 压缩组第一块开头的组头，之后紧跟LZ4压缩数据
+ */
+struct CompressedGroupHeader {
+    uint32_t magic;     ///< COMPRESSED_GROUP_MAGIC
+    uint32_t byteCnt;   ///< 压缩数据的字节数
+};
+
+/**
+ * @brief 按连续段分配块：向SuperBlock请求剩下需要的全部块，分到的段用完后从段尾继续请求。
+ * 没有用完的块在析构时释放
+ */
+class BlockRun {
+public:
+    /**
+     * @brief 构造函数
+     * @param wanted 预计需要的块数
+     * @param goal 希望从这一块开始，不大于0时不指定
+     */
+    BlockRun(int wanted, int goal) : wanted(wanted), goal(goal) {}
+
+    ~BlockRun() {
+        for (; this->left > 0; --this->left) {
+            SuperBlock::superBlock.ReleaseBlock(this->next++);
+        }
+    }
+
+    BlockRun(const BlockRun&) = delete;
+    BlockRun& operator=(const BlockRun&) = delete;
+
+    /**
+     * @brief 取出下一块
+     * @return 块号，-1表示出错
+     */
+    int Take() {
+        if (this->left == 0) {
+            this->next = SuperBlock::superBlock.AllocBlocks(std::max(1, this->wanted), this->goal, this->left);
+            if (this->next == -1) {
+                this->left = 0;
+                return -1;
+            }
+        }
+        --this->left;
+        --this->wanted;
+        this->goal = this->next + 1;
+        return this->next++;
+    }
+
+private:
+    int wanted;     ///< 还需要的块数
+    int goal;       ///< 下次请求的起点
+    int next{};     ///< 当前段中的下一块
+    int left{};     ///< 当前段中剩下的块数
+};
 
 MemInode MemInode::systemMemInodeTable[SYSTEM_MEM_INODE_NUM];
 
@@ -74,6 +138,9 @@ int MemInode::MemInodeFactory(int diskInodeIdx, MemInode*& memInodePtr) {
     memInode.i_lastAccessTime = diskInode.d_atime;
     memInode.i_lastModifyTime = diskInode.d_mtime;
 
+    memInode.i_groupNo = -1;
+    memInode.i_pendingGroups.clear();
+
     memInode.i_used = 1;
 
     memInodePtr = &(MemInode::systemMemInodeTable[searchResult]);
@@ -97,51 +164,122 @@ int MemInode::MemInodeNotInit(MemInode*& memInodePtr) {
     }
 
     MemInode::systemMemInodeTable[searchResult].i_used = 1;
+    MemInode::systemMemInodeTable[searchResult].i_groupNo = -1;
+    MemInode::systemMemInodeTable[searchResult].i_pendingGroups.clear();
     memInodePtr = &(MemInode::systemMemInodeTable[searchResult]);
 
     return 0;
 }
 
+/**
+ * @brief 在缓存中原地读取索引块的一项
+ * @param indexBlock 索引块号
+ * @param entryIdx 项的序号
+ * @return 项的内容，-1表示出错
+ */
+static int ReadIndexEntry(int indexBlock, int entryIdx) {
+    char* blockData;
+    int handle = DeviceManager::deviceManager.GetBlock(indexBlock, blockData);
+    if (handle == -1) {
+        return -1;
+    }
+
+    int entry = ((int*) blockData)[entryIdx];
+    DeviceManager::deviceManager.PutBlock(handle, false);
+    return entry;
+}
+
+/**
+ * @brief 在缓存中原地修改索引块的一项
+ * @param indexBlock 索引块号
+ * @param entryIdx 项的序号
+ * @param entry 新的内容
+ * @return 0表示成功，-1表示出错
+ */
+static int WriteIndexEntry(int indexBlock, int entryIdx, int entry) {
+    if (-1 == Journal::journal.LogBlock(indexBlock)) {
+        return -1;
+    }
+
+    char* blockData;
+    int handle = DeviceManager::deviceManager.GetBlock(indexBlock, blockData);
+    if (handle == -1) {
+        return -1;
+    }
+
+    ((int*) blockData)[entryIdx] = entry;
+    DeviceManager::deviceManager.PutBlock(handle, true);
+    return 0;
+}
+
 int MemInode::BlockMap(int logicBlockIndex) {
+    int n = IndexFanout();
     if (logicBlockIndex < 6) {
         // 小型文件
         return this->i_addr[logicBlockIndex];
     }
-    else if (logicBlockIndex < 6 + 2 * 128) {
+    else if (logicBlockIndex < 6 + 2 * n) {
         // 大型文件
-        if (logicBlockIndex < 6 + 1 * 128) {
-            int index = this->i_addr[6];
-            int indices[128];
-            DeviceManager::deviceManager.ReadBlock(index, indices);
-
+        if (logicBlockIndex < 6 + 1 * n) {
             logicBlockIndex -= 6;
-            return indices[logicBlockIndex];
+            return ReadIndexEntry(this->i_addr[6], logicBlockIndex);
         }
         else {
-            int index = this->i_addr[7];
-            int indices[128];
-            DeviceManager::deviceManager.ReadBlock(index, indices);
-
-            logicBlockIndex -= 6 + 1 * 128;
-            return indices[logicBlockIndex];
+            logicBlockIndex -= 6 + 1 * n;
+            return ReadIndexEntry(this->i_addr[7], logicBlockIndex);
         }
     }
     else {
         // 巨型文件
-        logicBlockIndex -= 6 + 2 * 128;
-        int level1index = logicBlockIndex / (128 * 128);
-        logicBlockIndex = logicBlockIndex % (128 * 128);
+        logicBlockIndex -= 6 + 2 * n;
+        int level1index = logicBlockIndex / (n * n);
+        logicBlockIndex = logicBlockIndex % (n * n);
 
-        int level2index = logicBlockIndex / 128;
-        int level3index = logicBlockIndex % 128;
+        int level2index = logicBlockIndex / n;
+        int level3index = logicBlockIndex % n;
 
-        int indices[128];
-        DeviceManager::deviceManager.ReadBlock(this->i_addr[8 + level1index], indices);
+        int level2Block = ReadIndexEntry(this->i_addr[8 + level1index], level2index);
+        return ReadIndexEntry(level2Block, level3index);
+    }
+}
 
-        DeviceManager::deviceManager.ReadBlock(indices[level2index], indices);
+int MemInode::SetBlockMap(int logicBlockIndex, int blockNo) {
+    int n = IndexFanout();
+    if (logicBlockIndex < 6) {
+        this->i_addr[logicBlockIndex] = blockNo;
+        return 0;
+    }
+    if (logicBlockIndex < 6 + 2 * n) {
+        logicBlockIndex -= 6;
+        return WriteIndexEntry(this->i_addr[6 + logicBlockIndex / n], logicBlockIndex % n, blockNo);
+    }
 
-        return indices[level3index];
+    logicBlockIndex -= 6 + 2 * n;
+    int level1index = logicBlockIndex / (n * n);
+    logicBlockIndex = logicBlockIndex % (n * n);
+    int level2Block = ReadIndexEntry(this->i_addr[8 + level1index], logicBlockIndex / n);
+    if (level2Block <= 0) {
+        return -1;
     }
+    return WriteIndexEntry(level2Block, logicBlockIndex % n, blockNo);
+}
+
+int MemInode::IndexFanout() {
+    return DeviceManager::deviceManager.BlockSize() / (int) sizeof(int);
+}
+
+int MemInode::LargeFileBlock() {
+    int n = IndexFanout();
+    return 6 + 2 * n;
+}
+
+int MemInode::HugeFileBlock() {
+    int n = IndexFanout();
+    return 6 + 2 * n + 2 * n * n;
+}
+
+long long MemInode::MaxFileByte() {
+    return (long long) HugeFileBlock() * DeviceManager::deviceManager.BlockSize();
 }
 
 int min(int a, int b) {
@@ -152,68 +290,161 @@ int max(int a, int b) {
     return a > b ? a : b;
 }
 
-int MemInode::Read(int offset, char *buffer, int size) {
-    if (this->i_size == 0 || offset >= this->i_size) {
-        // 对空文件进行特判
+int MemInode::MapBlocks(int firstLogicBlock, int blockCnt, int *blockNos) {
+    int n = IndexFanout();
+    int fileBlockCnt = (this->i_size + DeviceManager::deviceManager.BlockSize() - 1) / DeviceManager::deviceManager.BlockSize();
+    blockCnt = min(min(blockCnt, MAX_BLOCK_BATCH), fileBlockCnt - firstLogicBlock);
+    if (firstLogicBlock < 0 || blockCnt <= 0) {
         return 0;
     }
+    int lastLogicBlock = firstLogicBlock + blockCnt - 1;
+
+    // 一级索引块：i_addr[6]、i_addr[7]各管n块，i_addr[8]、i_addr[9]各管n * n块
+    const int indexRegionBegin[4] = {6, 6 + n, 6 + 2 * n, 6 + 2 * n + n * n};
+    const int indexRegionEnd[4] = {6 + n, 6 + 2 * n, 6 + 2 * n + n * n, HugeFileBlock()};
+    int indexBlockNos[4];
+    int indexCnt = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (firstLogicBlock < indexRegionEnd[i] && lastLogicBlock >= indexRegionBegin[i]) {
+            indexBlockNos[indexCnt] = this->i_addr[6 + i];
+            ++indexCnt;
+        }
+    }
+    DeviceManager::deviceManager.PrefetchBlocks(indexBlockNos, indexCnt);
+
+    // 巨型文件的二级索引块，范围不超过MAX_BLOCK_BATCH块，最多跨越3个
+    int level2BlockNos[MAX_BLOCK_BATCH / (MIN_BLOCK_SIZE / sizeof(int)) + 2];
+    int level2Cnt = 0;
+    int lastLevel2 = -1;
+    for (int logicBlock = max(firstLogicBlock, 6 + 2 * n); logicBlock <= lastLogicBlock; ++logicBlock) {
+        int level2 = (logicBlock - 6 - 2 * n) / n;
+        if (level2 != lastLevel2) {
+            level2BlockNos[level2Cnt] = ReadIndexEntry(this->i_addr[8 + level2 / n], level2 % n);
+            ++level2Cnt;
+            lastLevel2 = level2;
+        }
+    }
+    DeviceManager::deviceManager.PrefetchBlocks(level2BlockNos, level2Cnt);
 
-    int currentFileOffset = offset;
-    int currentBufferOffset = 0;
-    int actualReadDst = min(offset + size, this->i_size);
-
-    int startLogicBlock = offset / BLOCK_SIZE;
-    int endLogicBlock = (actualReadDst - 1) / BLOCK_SIZE;
-
-    char readBlockBuffer[BLOCK_SIZE];
-    // 读取第一个逻辑块的数据
-    unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->BlockMap(startLogicBlock), readBlockBuffer);
-    if (readByteCnt != BLOCK_SIZE) {
-        return -1;
+    for (int i = 0; i < blockCnt; ++i) {
+        blockNos[i] = this->BlockMap(firstLogicBlock + i);
     }
+    return blockCnt;
+}
 
-    int expectedByteCnt = min(actualReadDst - currentFileOffset, BLOCK_SIZE - offset % BLOCK_SIZE);
-    memcpy(buffer, readBlockBuffer + offset % BLOCK_SIZE, expectedByteCnt);
-    currentFileOffset += expectedByteCnt;
-    currentBufferOffset += expectedByteCnt;
+int MemInode::ReadAhead(int firstLogicBlock, int blockCnt) {
+    int blockNos[MAX_BLOCK_BATCH];
+    blockCnt = this->MapBlocks(firstLogicBlock, blockCnt, blockNos);
 
+    // 压缩组中没有物理块的项不需要读
+    int storedCnt = 0;
+    for (int i = 0; i < blockCnt; ++i) {
+        if (blockNos[i] != COMPRESSED_BLOCK) {
+            blockNos[storedCnt] = blockNos[i];
+            ++storedCnt;
+        }
+    }
+    return DeviceManager::deviceManager.PrefetchBlocks(blockNos, storedCnt);
+}
 
-    // 读取剩余的完整块，除了最后一块
-    for (int i = startLogicBlock + 1; i < endLogicBlock; ++i) {
-        readByteCnt = DeviceManager::deviceManager.ReadBlock(this->BlockMap(i), readBlockBuffer);
+int MemInode::Read(int offset, char *buffer, int size, bool direct) {
+    if (this->i_size == 0 || offset >= this->i_size) {
+        // 对空文件进行特判
+        return 0;
+    }
 
-        if (readByteCnt != BLOCK_SIZE) {
+    int actualReadDst = min(offset + size, this->i_size);
+    if (!this->IsCompressed()) {
+        if (-1 == this->ReadRange(offset, buffer, actualReadDst - offset, direct)) {
             return -1;
         }
+    }
+    else {
+        // 按组读取：压缩的组从解压后的内容中复制，其余的组照常读取
+        int groupByte = COMPRESS_GROUP_BLOCKS * DeviceManager::deviceManager.BlockSize();
+        int currentFileOffset = offset;
+        while (currentFileOffset < actualReadDst) {
+            int group = currentFileOffset / groupByte;
+            int pieceEnd = min(actualReadDst, (group + 1) * groupByte);
+            char* dst = buffer + (currentFileOffset - offset);
+            if (this->IsGroupCompressed(group)) {
+                if (-1 == this->LoadGroup(group)) {
+                    return -1;
+                }
+                memcpy(dst, this->i_groupData.data() + (currentFileOffset - group * groupByte), pieceEnd - currentFileOffset);
+            }
+            else if (-1 == this->ReadRange(currentFileOffset, dst, pieceEnd - currentFileOffset, direct)) {
+                return -1;
+            }
+            currentFileOffset = pieceEnd;
+        }
+    }
 
-        memcpy(buffer + currentBufferOffset, readBlockBuffer, BLOCK_SIZE);
+    this->i_lastAccessTime = time(nullptr);
 
-        currentFileOffset += BLOCK_SIZE;
-        currentBufferOffset += BLOCK_SIZE;
-    }
+    return actualReadDst - offset;
+}
+
+int MemInode::ReadRange(int offset, char *buffer, int size, bool direct) {
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int currentFileOffset = offset;
+    int currentBufferOffset = 0;
+    int actualReadDst = offset + size;
+
+    while (currentFileOffset < actualReadDst) {
+        int logicBlock = currentFileOffset / blockSize;
+        int blockOffset = currentFileOffset % blockSize;
+
+        int fullBlockCnt = blockOffset == 0 ? (actualReadDst - currentFileOffset) / blockSize : 0;
+        if (fullBlockCnt > 0) {
+            // 中间的整块一起读取：命中的直接复制，未命中的按块号连续的段合并读取
+            int blockNos[MAX_BLOCK_BATCH];
+            fullBlockCnt = this->MapBlocks(logicBlock, fullBlockCnt, blockNos);
+            if (fullBlockCnt == 0) {
+                return -1;
+            }
+            char* dst = buffer + currentBufferOffset;
+            int result = direct ? DeviceManager::deviceManager.ReadBlocksDirect(blockNos, fullBlockCnt, dst)
+                                : DeviceManager::deviceManager.ReadBlocks(blockNos, fullBlockCnt, dst);
+            if (result == -1) {
+                return -1;
+            }
+
+            currentFileOffset += fullBlockCnt * blockSize;
+            currentBufferOffset += fullBlockCnt * blockSize;
+            continue;
+        }
 
+        // 首尾不完整的块从缓存直接复制到调用者的缓冲区
+        int expectedByteCnt = min(actualReadDst - currentFileOffset, blockSize - blockOffset);
 
-    // 读取最后一块，也有可能是一块完整的
-    if (startLogicBlock < endLogicBlock) {
-        readByteCnt = DeviceManager::deviceManager.ReadBlock(this->BlockMap(endLogicBlock), readBlockBuffer);
-        if (readByteCnt != BLOCK_SIZE) {
+        char* blockData;
+        int handle = DeviceManager::deviceManager.GetBlock(this->BlockMap(logicBlock), blockData);
+        if (handle == -1) {
             return -1;
         }
-
-        expectedByteCnt = (actualReadDst - 1) % BLOCK_SIZE + 1;
-        memcpy(buffer + currentBufferOffset, readBlockBuffer, expectedByteCnt);
+        memcpy(buffer + currentBufferOffset, blockData + blockOffset, expectedByteCnt);
+        DeviceManager::deviceManager.PutBlock(handle, false);
 
         currentFileOffset += expectedByteCnt;
         currentBufferOffset += expectedByteCnt;
     }
-
-    this->i_lastAccessTime = time(nullptr);
-
-    return currentBufferOffset;
+    return 0;
 }
 
-int MemInode::Write(int offset, char *buffer, int size) {
+int MemInode::Write(int offset, char *buffer, int size, bool direct) {
     bool needExpand = offset + size > this->i_size;
+    int groupByte = COMPRESS_GROUP_BLOCKS * DeviceManager::deviceManager.BlockSize();
+
+    if (needExpand && this->IsCompressed() && this->i_size > 0) {
+        // 原来末尾的组不满时，扩展新分配的块会接在这一组后面，这一组不能是压缩的
+        int blockSize = DeviceManager::deviceManager.BlockSize();
+        int lastGroup = (this->i_size - 1) / groupByte;
+        bool groupGrows = this->GroupBlockCnt(lastGroup) < COMPRESS_GROUP_BLOCKS && (offset + size - 1) / blockSize > (this->i_size - 1) / blockSize;
+        if (groupGrows && this->IsGroupCompressed(lastGroup) && -1 == this->ExpandGroup(lastGroup)) {
+            return -1;
+        }
+    }
 
     if (needExpand) {
         // 写入之后的大小大于目前文件大小，需要扩展
@@ -222,112 +453,430 @@ int MemInode::Write(int offset, char *buffer, int size) {
         }
     }
 
+    int writeDst = offset + size;
+    if (!this->IsCompressed()) {
+        if (-1 == this->WriteRange(offset, buffer, size, direct)) {
+            return -1;
+        }
+    }
+    else {
+        std::vector<char> groupBuffer;
+        int currentFileOffset = offset;
+        while (currentFileOffset < writeDst) {
+            int group = currentFileOffset / groupByte;
+            int groupBegin = group * groupByte;
+            int groupEnd = min(groupBegin + groupByte, this->i_size);
+            int pieceEnd = min(writeDst, groupBegin + groupByte);
+            char* src = buffer + (currentFileOffset - offset);
+
+            if (currentFileOffset == groupBegin && pieceEnd >= groupEnd) {
+                // 整组被覆盖，直接压缩写入的数据，最后一块在文件末尾之外的部分补0
+                groupBuffer.assign((size_t) this->GroupBlockCnt(group) * DeviceManager::deviceManager.BlockSize(), 0);
+                memcpy(groupBuffer.data(), src, groupEnd - groupBegin);
+                if (-1 == this->StoreGroup(group, groupBuffer.data(), false)) {
+                    return -1;
+                }
+            }
+            else {
+                // 部分改写先展开成逐块存储，在缓存中修改，关闭或同步文件时再压缩
+                if (this->IsGroupCompressed(group) && -1 == this->ExpandGroup(group)) {
+                    return -1;
+                }
+                if (-1 == this->WriteRange(currentFileOffset, src, pieceEnd - currentFileOffset, direct)) {
+                    return -1;
+                }
+                if (this->i_groupNo == group) {
+                    this->i_groupNo = -1;
+                }
+                if (this->i_pendingGroups.empty() || this->i_pendingGroups.back() != group) {
+                    this->i_pendingGroups.push_back(group);
+                }
+            }
+            currentFileOffset = pieceEnd;
+        }
+    }
+
+    this->i_lastModifyTime = time(nullptr);
+
+    return size;
+}
+
+int MemInode::WriteRange(int offset, char *buffer, int size, bool direct) {
+    int blockSize = DeviceManager::deviceManager.BlockSize();
     int currentFileOffset = offset;
     int currentBufferOffset = 0;
+    int writeDst = offset + size;
+    // 目录项是元数据，目录块先加入日志事务再修改
+    bool journaled = (this->i_mode & IFMT) == IFDIR;
+
+    while (currentFileOffset < writeDst) {
+        int logicBlock = currentFileOffset / blockSize;
+        int blockOffset = currentFileOffset % blockSize;
+
+        int fullBlockCnt = blockOffset == 0 ? (writeDst - currentFileOffset) / blockSize : 0;
+        if (fullBlockCnt > 0) {
+            // 中间的整块覆盖，无需加载，按块号连续的段合并写入
+            int blockNos[MAX_BLOCK_BATCH];
+            fullBlockCnt = this->MapBlocks(logicBlock, fullBlockCnt, blockNos);
+            if (fullBlockCnt == 0) {
+                return -1;
+            }
+            char* src = buffer + currentBufferOffset;
+            if (journaled && -1 == Journal::journal.LogBlocks(blockNos, fullBlockCnt)) {
+                return -1;
+            }
+            int result;
+            if (this->UsesDedup()) {
+                result = this->WriteBlocksDedup(logicBlock, blockNos, fullBlockCnt, src, direct);
+            }
+            else {
+                result = direct ? DeviceManager::deviceManager.WriteBlocksDirect(blockNos, fullBlockCnt, src)
+                                : DeviceManager::deviceManager.WriteBlocks(blockNos, fullBlockCnt, src);
+            }
+            if (result == -1) {
+                return -1;
+            }
 
-    int startLogicBlock = offset / BLOCK_SIZE;
-    int endLogicBlock = (offset + size - 1) / BLOCK_SIZE;
-
-    char writeBlockBuffer[BLOCK_SIZE];
+            currentFileOffset += fullBlockCnt * blockSize;
+            currentBufferOffset += fullBlockCnt * blockSize;
+            continue;
+        }
 
-    // 写第一个block的内容
-    if (offset % BLOCK_SIZE == 0) {
-        int firstBlock = this->BlockMap(startLogicBlock);
-        if (size > BLOCK_SIZE) {
-            // 无需加载块，直接写入即可
-            memcpy(writeBlockBuffer, buffer, BLOCK_SIZE);
+        int expectedByteCnt = min(writeDst - currentFileOffset, blockSize - blockOffset);
+        int blockNo = this->BlockMap(logicBlock);
+        if (journaled && -1 == Journal::journal.LogBlock(blockNo)) {
+            return -1;
         }
-        else if (offset + size >= this->i_size) {
-            memset(writeBlockBuffer, 0, BLOCK_SIZE);
-            memcpy(writeBlockBuffer, buffer, size);
+
+        if (blockOffset == 0 && writeDst >= this->i_size) {
+            // 块中写入范围之后的部分已经在文件末尾之外，补0后整块写入
+            std::vector<char> writeBlockBuffer(blockSize);
+            memcpy(writeBlockBuffer.data(), buffer + currentBufferOffset, expectedByteCnt);
+            if (this->UsesDedup()) {
+                if (-1 == this->WriteBlocksDedup(logicBlock, &blockNo, 1, writeBlockBuffer.data(), false)) {
+                    return -1;
+                }
+            }
+            else if (blockSize != DeviceManager::deviceManager.WriteBlock(blockNo, writeBlockBuffer.data())) {
+                return -1;
+            }
         }
         else {
-            DeviceManager::deviceManager.ReadBlock(firstBlock, writeBlockBuffer);
-            memcpy(writeBlockBuffer, buffer, size);
+            // 块中还有未被修改的内容，在缓存中原地修改
+            if (-1 == this->UnshareBlock(logicBlock, blockNo)) {
+                return -1;
+            }
+            char* blockData;
+            int handle = DeviceManager::deviceManager.GetBlock(blockNo, blockData);
+            if (handle == -1) {
+                return -1;
+            }
+            memcpy(blockData + blockOffset, buffer + currentBufferOffset, expectedByteCnt);
+            DeviceManager::deviceManager.PutBlock(handle, true);
         }
-        unsigned int writeByteCnt = DeviceManager::deviceManager.WriteBlock(firstBlock, writeBlockBuffer);
 
-        if (writeByteCnt != BLOCK_SIZE) {
-            return -1;
-        }
-        int expectedByteCnt = min(size, BLOCK_SIZE);
-        currentBufferOffset += expectedByteCnt;
         currentFileOffset += expectedByteCnt;
+        currentBufferOffset += expectedByteCnt;
     }
-    else {
-        // 需要先加载，修改后再写入
-        unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->BlockMap(startLogicBlock), writeBlockBuffer);
+    return 0;
+}
 
-        if (readByteCnt != BLOCK_SIZE) {
-            return -1;
-        }
+bool MemInode::UsesDedup() const {
+    return DedupStore::dedupStore.Enabled() && (this->i_mode & IFMT) != IFDIR;
+}
 
-        int expectedByteCnt = min(size, BLOCK_SIZE - offset % BLOCK_SIZE);
-        memcpy(writeBlockBuffer + (offset % BLOCK_SIZE), buffer, expectedByteCnt);
+int MemInode::WriteBlocksDedup(int firstLogicBlock, int *blockNos, int blockCnt, const char *src, bool direct) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    DedupStore& dedupStore = DedupStore::dedupStore;
+    int blockSize = deviceManager.BlockSize();
 
-        currentBufferOffset += expectedByteCnt;
-        currentFileOffset += expectedByteCnt;
+    // 需要写入的块攒成一段，按块号连续的部分合并写入
+    int runStart = 0;
+    auto writeRun = [&](int runEnd) {
+        if (runEnd <= runStart) {
+            return 0;
+        }
+        const char* runSrc = src + (size_t) runStart * blockSize;
+        return direct ? deviceManager.WriteBlocksDirect(blockNos + runStart, runEnd - runStart, runSrc)
+                      : deviceManager.WriteBlocks(blockNos + runStart, runEnd - runStart, runSrc);
+    };
+
+    for (int i = 0; i < blockCnt; ++i) {
+        const char* data = src + (size_t) i * blockSize;
+        uint64_t fingerprint = DedupStore::Fingerprint(data, blockSize);
+        int sameBlock = dedupStore.Find(fingerprint);
+        if (sameBlock != -1) {
+            // 比较内容之前先写入攒下的块，同一次写入中重复的块也能找到
+            if (-1 == writeRun(i)) {
+                return -1;
+            }
+            runStart = i;
+            if (dedupStore.Matches(sameBlock, data)) {
+                if (sameBlock != blockNos[i]) {
+                    if (-1 == dedupStore.AddRef(sameBlock) || -1 == this->SetBlockMap(firstLogicBlock + i, sameBlock)) {
+                        return -1;
+                    }
+                    SuperBlock::superBlock.ReleaseBlock(blockNos[i]);
+                    blockNos[i] = sameBlock;
+                }
+                runStart = i + 1;
+                continue;
+            }
+        }
 
-        unsigned int writeByteCnt = DeviceManager::deviceManager.WriteBlock(this->BlockMap(startLogicBlock), writeBlockBuffer);
-        if (writeByteCnt != BLOCK_SIZE) {
+        if (dedupStore.IsShared(blockNos[i])) {
+            // 共享的块不能覆盖，整块写入无需复制原来的内容
+            int newBlock = SuperBlock::superBlock.AllocBlock();
+            if (newBlock == -1 || -1 == this->SetBlockMap(firstLogicBlock + i, newBlock)) {
+                return -1;
+            }
+            SuperBlock::superBlock.ReleaseBlock(blockNos[i]);
+            blockNos[i] = newBlock;
+        }
+        if (-1 == dedupStore.Register(blockNos[i], fingerprint)) {
             return -1;
         }
     }
+    return writeRun(blockCnt);
+}
 
-    // 写剩余完整块，除了最后一块
-    for (int i = startLogicBlock + 1; i < endLogicBlock; ++i) {
-        unsigned int writeByteCnt = DeviceManager::deviceManager.WriteBlock(this->BlockMap(i), buffer + currentBufferOffset);
+int MemInode::UnshareBlock(int logicBlock, int &blockNo) {
+    DedupStore& dedupStore = DedupStore::dedupStore;
+    if (!dedupStore.IsShared(blockNo)) {
+        return dedupStore.Forget(blockNo);
+    }
 
-        if (writeByteCnt != BLOCK_SIZE) {
-            return -1;
-        }
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    unsigned int blockSize = deviceManager.BlockSize();
+    std::vector<char> content(blockSize);
+    if (blockSize != deviceManager.ReadBlock(blockNo, content.data())) {
+        return -1;
+    }
+    int newBlock = SuperBlock::superBlock.AllocBlock();
+    if (newBlock == -1 || blockSize != deviceManager.WriteBlock(newBlock, content.data())
+        || -1 == this->SetBlockMap(logicBlock, newBlock)) {
+        return -1;
+    }
+    SuperBlock::superBlock.ReleaseBlock(blockNo);
+    blockNo = newBlock;
+    return 0;
+}
+
+int MemInode::GroupBlockCnt(int group) const {
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int fileBlockCnt = (this->i_size + blockSize - 1) / blockSize;
+    return max(0, min(COMPRESS_GROUP_BLOCKS, fileBlockCnt - group * COMPRESS_GROUP_BLOCKS));
+}
+
+bool MemInode::IsGroupCompressed(int group) {
+    int blockCnt = this->GroupBlockCnt(group);
+    return blockCnt > 0 && this->BlockMap(group * COMPRESS_GROUP_BLOCKS + blockCnt - 1) == COMPRESSED_BLOCK;
+}
+
+int MemInode::LoadGroup(int group) {
+    if (this->i_groupNo == group) {
+        return 0;
+    }
 
-        currentFileOffset += BLOCK_SIZE;
-        currentBufferOffset += BLOCK_SIZE;
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int blockSize = deviceManager.BlockSize();
+    int blockCnt = this->GroupBlockCnt(group);
+    int blockNos[COMPRESS_GROUP_BLOCKS];
+    if (this->MapBlocks(group * COMPRESS_GROUP_BLOCKS, blockCnt, blockNos) != blockCnt) {
+        return -1;
+    }
+
+    int storedCnt = 0;
+    while (storedCnt < blockCnt && blockNos[storedCnt] != COMPRESSED_BLOCK) {
+        ++storedCnt;
+    }
+    if (storedCnt == 0) {
+        // 组的第一块就标记为压缩，索引表损坏
+        MoFSErrno = 16;
+        return -1;
+    }
+    std::vector<char> stored((size_t) storedCnt * blockSize);
+    if (-1 == deviceManager.ReadBlocks(blockNos, storedCnt, stored.data())) {
+        return -1;
+    }
+
+    CompressedGroupHeader header{};
+    memcpy(&header, stored.data(), sizeof(header));
+    int rawByte = blockCnt * blockSize;
+    this->i_groupData.resize(rawByte);
+    this->i_groupNo = -1;
+    if (header.magic != COMPRESSED_GROUP_MAGIC || header.byteCnt > stored.size() - sizeof(header)
+        || Lz4::Decompress(stored.data() + sizeof(header), (int) header.byteCnt, this->i_groupData.data(), rawByte) != rawByte) {
+        // 压缩数据损坏
+        MoFSErrno = 16;
+        return -1;
+    }
+    this->i_groupNo = group;
+    return 0;
+}
+
+int MemInode::LayoutGroup(int group, int storedCnt, int *blockNos) {
+    int firstLogicBlock = group * COMPRESS_GROUP_BLOCKS;
+    int blockCnt = this->GroupBlockCnt(group);
+    int mapped[COMPRESS_GROUP_BLOCKS];
+    if (this->MapBlocks(firstLogicBlock, blockCnt, mapped) != blockCnt) {
+        return -1;
     }
 
-    // 写最后一块
-    if (startLogicBlock < endLogicBlock) {
-        if (offset + size < this->i_size && (offset + size) % BLOCK_SIZE != 0) {
-            // 待写入的尾部仍然有一些内容没有被修改，需要加载最后一块
-            unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->BlockMap(endLogicBlock), writeBlockBuffer);
-            if (readByteCnt != BLOCK_SIZE) {
+    for (int i = 0; i < blockCnt; ++i) {
+        if (i < storedCnt && (mapped[i] == COMPRESSED_BLOCK || DedupStore::dedupStore.IsShared(mapped[i]))) {
+            // 压缩时释放的块重新分配；去重共享的块整块重写，换成新块
+            int blockNo = SuperBlock::superBlock.AllocBlock();
+            if (blockNo == -1 || -1 == this->SetBlockMap(firstLogicBlock + i, blockNo)) {
+                return -1;
+            }
+            if (mapped[i] != COMPRESSED_BLOCK) {
+                SuperBlock::superBlock.ReleaseBlock(mapped[i]);
+            }
+            mapped[i] = blockNo;
+        }
+        else if (i < storedCnt && -1 == DedupStore::dedupStore.Forget(mapped[i])) {
+            return -1;
+        }
+        else if (i >= storedCnt && mapped[i] != COMPRESSED_BLOCK) {
+            if (-1 == this->SetBlockMap(firstLogicBlock + i, COMPRESSED_BLOCK)) {
                 return -1;
             }
+            SuperBlock::superBlock.ReleaseBlock(mapped[i]);
+        }
+    }
+    memcpy(blockNos, mapped, sizeof(int) * storedCnt);
+    return 0;
+}
+
+int MemInode::StoreGroup(int group, const char *data, bool rawOnDisk) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+    int blockSize = deviceManager.BlockSize();
+    int blockCnt = this->GroupBlockCnt(group);
+    int rawByte = blockCnt * blockSize;
+
+    // 组头加上压缩数据至少要比原样存储少一块
+    std::vector<char> stored;
+    int storedCnt = blockCnt;
+    if (blockCnt > 1) {
+        stored.assign(rawByte, 0);
+        int compressedByte = Lz4::Compress(data, rawByte, stored.data() + sizeof(CompressedGroupHeader),
+                                           (blockCnt - 1) * blockSize - (int) sizeof(CompressedGroupHeader));
+        if (compressedByte > 0) {
+            CompressedGroupHeader header{COMPRESSED_GROUP_MAGIC, (uint32_t) compressedByte};
+            memcpy(stored.data(), &header, sizeof(header));
+            storedCnt = ((int) sizeof(header) + compressedByte + blockSize - 1) / blockSize;
         }
+    }
+    if (storedCnt == blockCnt && rawOnDisk) {
+        return 0;
+    }
+
+    int blockNos[COMPRESS_GROUP_BLOCKS];
+    if (-1 == this->LayoutGroup(group, storedCnt, blockNos)) {
+        return -1;
+    }
+    if (this->i_groupNo == group) {
+        this->i_groupNo = -1;
+    }
+    return deviceManager.WriteBlocks(blockNos, storedCnt, storedCnt == blockCnt ? data : stored.data());
+}
+
+int MemInode::ExpandGroup(int group) {
+    if (-1 == this->LoadGroup(group)) {
+        return -1;
+    }
+
+    // 展开后内容不变，i_groupData仍然有效
+    int blockCnt = this->GroupBlockCnt(group);
+    int blockNos[COMPRESS_GROUP_BLOCKS];
+    if (-1 == this->LayoutGroup(group, blockCnt, blockNos)) {
+        return -1;
+    }
+    return DeviceManager::deviceManager.WriteBlocks(blockNos, blockCnt, this->i_groupData.data());
+}
+
+int MemInode::CompressPending() {
+    if (!this->IsCompressed()) {
+        this->i_pendingGroups.clear();
+        return 0;
+    }
+    if (this->i_pendingGroups.empty()) {
+        return 0;
+    }
 
-        int expectedByteCnt = (offset + size - 1) % BLOCK_SIZE + 1;
-        memcpy(writeBlockBuffer, buffer + currentBufferOffset, expectedByteCnt);
+    std::sort(this->i_pendingGroups.begin(), this->i_pendingGroups.end());
+    this->i_pendingGroups.erase(std::unique(this->i_pendingGroups.begin(), this->i_pendingGroups.end()), this->i_pendingGroups.end());
 
-        unsigned int writeByteCnt = DeviceManager::deviceManager.WriteBlock(this->BlockMap(endLogicBlock), writeBlockBuffer);
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int groupByte = COMPRESS_GROUP_BLOCKS * blockSize;
+    std::vector<char> groupBuffer;
+    for (int group : this->i_pendingGroups) {
+        int blockCnt = this->GroupBlockCnt(group);
+        if (blockCnt < 2 || this->IsGroupCompressed(group)) {
+            continue;
+        }
 
-        if (writeByteCnt != BLOCK_SIZE) {
+        int groupBegin = group * groupByte;
+        groupBuffer.assign((size_t) blockCnt * blockSize, 0);
+        if (-1 == this->ReadRange(groupBegin, groupBuffer.data(), min(this->i_size, groupBegin + groupByte) - groupBegin, false)
+            || -1 == this->StoreGroup(group, groupBuffer.data(), true)) {
             return -1;
         }
+    }
+    this->i_pendingGroups.clear();
+    return 0;
+}
 
-        currentFileOffset += expectedByteCnt;
-        currentBufferOffset += expectedByteCnt;
+int MemInode::SetCompress(bool enable) {
+    if ((this->i_mode & IFMT) == IFDIR) {
+        if (enable) {
+            this->i_mode |= ICOMPR;
+        }
+        else {
+            this->i_mode &= ~ICOMPR;
+        }
+        return 0;
     }
 
-    this->i_lastModifyTime = time(nullptr);
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int groupCnt = ((this->i_size + blockSize - 1) / blockSize + COMPRESS_GROUP_BLOCKS - 1) / COMPRESS_GROUP_BLOCKS;
+    if (enable) {
+        this->i_mode |= ICOMPR;
+        for (int group = 0; group < groupCnt; ++group) {
+            this->i_pendingGroups.push_back(group);
+        }
+        return this->CompressPending();
+    }
 
-    return currentBufferOffset;
+    // 关闭时先展开，之后按普通文件读写
+    for (int group = 0; group < groupCnt; ++group) {
+        if (this->IsGroupCompressed(group) && -1 == this->ExpandGroup(group)) {
+            return -1;
+        }
+    }
+    this->i_mode &= ~ICOMPR;
+    this->i_pendingGroups.clear();
+    this->i_groupNo = -1;
+    return 0;
 }
 
 int MemInode::Expand(int newSize) {
-    int oldBlockNum = (this->i_size - 1) / BLOCK_SIZE + 1;
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int n = IndexFanout();
+    int oldBlockNum = (this->i_size - 1) / blockSize + 1;
     if (this->i_size == 0) {
         // 如果是空文件，占用0块
         oldBlockNum = 0;
     }
 
-    int newBlockNum = (newSize - 1) / BLOCK_SIZE + 1;
+    int newBlockNum = (newSize - 1) / blockSize + 1;
 
-    if (newBlockNum > 6 + 2 * 128 + 2 * 128 * 128) {
+    if (newBlockNum > HugeFileBlock()) {
         return -1;
     }
 
-    int indexBlockBuffer[128];
+    std::vector<int> indexBlockBuffer(n);
 
     if (newBlockNum == oldBlockNum) {
         // 尽管有所扩张，但占用的块数不变
@@ -339,15 +888,23 @@ int MemInode::Expand(int newSize) {
     int oldStage0 = max(0, min(6, oldBlockNum));
     int newStage0 = max(0, min(6, newBlockNum));
 
-    int oldStage1 = max(0, min(2 * 128, oldBlockNum - 6));
-    int newStage1 = max(0, min(2 * 128, newBlockNum - 6));
+    int oldStage1 = max(0, min(2 * n, oldBlockNum - 6));
+    int newStage1 = max(0, min(2 * n, newBlockNum - 6));
 
-    int oldStage2 = max(0, min(2 * 128 * 128, oldBlockNum - 6 - 2 * 128));
-    int newStage2 = max(0, min(2 * 128 * 128, newBlockNum - 6 - 2 * 128));
+    int oldStage2 = max(0, min(2 * n * n, oldBlockNum - 6 - 2 * n));
+    int newStage2 = max(0, min(2 * n * n, newBlockNum - 6 - 2 * n));
+
+    // 新增的数据块和索引块一起按连续段分配，从原来最后一块之后开始。
+    // 第二张一级索引表在一级索引恰好用满第一张表时就分配，计数的条件与下面分配的条件一致
+    int indexBlockNum = (oldStage1 == 0 && newStage1 > 0) + (oldStage1 < n && newStage1 >= n)
+                        + (oldStage2 == 0 && newStage2 > 0) + (oldStage2 <= n * n && newStage2 > n * n)
+                        + (newStage2 + n - 1) / n - (oldStage2 + n - 1) / n;
+    int lastBlock = oldBlockNum > 0 ? this->BlockMap(oldBlockNum - 1) : -1;
+    BlockRun run(newBlockNum - oldBlockNum + indexBlockNum, lastBlock > 0 ? lastBlock + 1 : 0);
 
     if (oldStage0 < newStage0) {
         for (int i = oldStage0 + 1; i <= newStage0; ++i) {
-            int freeBlock = SuperBlock::superBlock.AllocBlock();
+            int freeBlock = run.Take();
             if (freeBlock == -1) {
                 return -1;
             }
@@ -360,60 +917,62 @@ int MemInode::Expand(int newSize) {
         // 第一张一级索引表
         if (this->i_addr[6] <= 0) {
             // 原来的文件没有一级索引
-            this->i_addr[6] = SuperBlock::superBlock.AllocBlock();
+            this->i_addr[6] = run.Take();
             if (this->i_addr[6] == -1) {
                 return -1;
             }
-            memset(indexBlockBuffer, -1, BLOCK_SIZE);
+            std::fill(indexBlockBuffer.begin(), indexBlockBuffer.end(), -1);
         }
         else {
             // 从磁盘加载索引
-            unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[6], indexBlockBuffer);
+            unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[6], indexBlockBuffer.data());
             if (readByteCnt == -1) {
                 return -1;
             }
         }
 
-        int stage1table1 = min(128, newStage1);
-        for (int i = min(128, oldStage1); i < stage1table1; ++i) {
-            indexBlockBuffer[i] = SuperBlock::superBlock.AllocBlock();
+        int stage1table1 = min(n, newStage1);
+        for (int i = min(n, oldStage1); i < stage1table1; ++i) {
+            indexBlockBuffer[i] = run.Take();
             if (indexBlockBuffer[i] == -1) {
                 return -1;
             }
         }
 
-        if (BLOCK_SIZE != DeviceManager::deviceManager.WriteBlock(this->i_addr[6], indexBlockBuffer)) {
+        if (-1 == Journal::journal.LogBlock(this->i_addr[6])
+            || blockSize != DeviceManager::deviceManager.WriteBlock(this->i_addr[6], indexBlockBuffer.data())) {
             return -1;
         }
 
 
         // 第二张一级索引表
-        if (newStage1 >= 128) {
-            int stage1table2 = min(newStage1 - 128, 128);
+        if (newStage1 >= n) {
+            int stage1table2 = min(newStage1 - n, n);
             if (this->i_addr[7] <= 0) {
                 // 原来的文件没有一级索引
-                this->i_addr[7] = SuperBlock::superBlock.AllocBlock();
+                this->i_addr[7] = run.Take();
                 if (this->i_addr[7] == -1) {
                     return -1;
                 }
-                memset(indexBlockBuffer, -1, BLOCK_SIZE);
+                std::fill(indexBlockBuffer.begin(), indexBlockBuffer.end(), -1);
             }
             else {
                 // 从磁盘加载索引
-                unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[7], indexBlockBuffer);
+                unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[7], indexBlockBuffer.data());
                 if (readByteCnt == -1) {
                     return -1;
                 }
             }
 
-            for (int i = min(max(0, oldStage1 - 128), 128); i < stage1table2; ++i) {
-                indexBlockBuffer[i] = SuperBlock::superBlock.AllocBlock();
+            for (int i = min(max(0, oldStage1 - n), n); i < stage1table2; ++i) {
+                indexBlockBuffer[i] = run.Take();
                 if (indexBlockBuffer[i] == -1) {
                     return -1;
                 }
             }
 
-            if (BLOCK_SIZE != DeviceManager::deviceManager.WriteBlock(this->i_addr[7], indexBlockBuffer)) {
+            if (-1 == Journal::journal.LogBlock(this->i_addr[7])
+                || blockSize != DeviceManager::deviceManager.WriteBlock(this->i_addr[7], indexBlockBuffer.data())) {
                 return -1;
             }
         }
@@ -421,53 +980,53 @@ int MemInode::Expand(int newSize) {
 
 
     if (oldStage2 < newStage2) {
-        int index2Buffer[128];
+        std::vector<int> index2Buffer(n);
         int temp = oldStage2;
-        int loopIdx2 = temp % 128;
-        temp /= 128;
-        int loopIdx1 = temp % 128;
-        int loopIdx0 = temp / 128;
+        int loopIdx2 = temp % n;
+        temp /= n;
+        int loopIdx1 = temp % n;
+        int loopIdx0 = temp / n;
 
         int idx = oldStage2;
 
         while (loopIdx0 < 2) {
             if (this->i_addr[loopIdx0 + 8] <= 0) {
                 // 原来的文件没有二级索引
-                this->i_addr[loopIdx0 + 8] = SuperBlock::superBlock.AllocBlock();
+                this->i_addr[loopIdx0 + 8] = run.Take();
                 if (this->i_addr[loopIdx0 + 8] == -1) {
                     return -1;
                 }
-                memset(indexBlockBuffer, -1, BLOCK_SIZE);
+                std::fill(indexBlockBuffer.begin(), indexBlockBuffer.end(), -1);
             }
             else {
                 // 从磁盘加载索引
-                unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[loopIdx0 + 8], indexBlockBuffer);
+                unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(this->i_addr[loopIdx0 + 8], indexBlockBuffer.data());
                 if (readByteCnt == -1) {
                     return -1;
                 }
             }
 
 
-            while (loopIdx1 < 128) {
+            while (loopIdx1 < n) {
                 if (indexBlockBuffer[loopIdx1] <= 0) {
                     // 原来的文件没有一级索引
-                    indexBlockBuffer[loopIdx1] = SuperBlock::superBlock.AllocBlock();
+                    indexBlockBuffer[loopIdx1] = run.Take();
                     if (indexBlockBuffer[loopIdx1] == -1) {
                         return -1;
                     }
-                    memset(index2Buffer, -1, BLOCK_SIZE);
+                    std::fill(index2Buffer.begin(), index2Buffer.end(), -1);
                 }
                 else {
                     // 从磁盘加载索引
-                    unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(indexBlockBuffer[loopIdx1], index2Buffer);
+                    unsigned int readByteCnt = DeviceManager::deviceManager.ReadBlock(indexBlockBuffer[loopIdx1], index2Buffer.data());
                     if (readByteCnt == -1) {
                         return -1;
                     }
                 }
 
 
-                while (loopIdx2 < 128) {
-                    index2Buffer[loopIdx2] = SuperBlock::superBlock.AllocBlock();
+                while (loopIdx2 < n) {
+                    index2Buffer[loopIdx2] = run.Take();
                     if (index2Buffer[loopIdx2] == -1) {
                         return -1;
                     }
@@ -481,7 +1040,8 @@ int MemInode::Expand(int newSize) {
                 }
 
                 // 存储刚刚填好的index2Buffer
-                if (BLOCK_SIZE != DeviceManager::deviceManager.WriteBlock(indexBlockBuffer[loopIdx1], index2Buffer)) {
+                if (-1 == Journal::journal.LogBlock(indexBlockBuffer[loopIdx1])
+                    || blockSize != DeviceManager::deviceManager.WriteBlock(indexBlockBuffer[loopIdx1], index2Buffer.data())) {
                     return -1;
                 }
 
@@ -494,7 +1054,8 @@ int MemInode::Expand(int newSize) {
             }
 
             // 存储刚刚填好的index2Buffer
-            if (BLOCK_SIZE != DeviceManager::deviceManager.WriteBlock(this->i_addr[8 + loopIdx0], indexBlockBuffer)) {
+            if (-1 == Journal::journal.LogBlock(this->i_addr[8 + loopIdx0])
+                || blockSize != DeviceManager::deviceManager.WriteBlock(this->i_addr[8 + loopIdx0], indexBlockBuffer.data())) {
                 return -1;
             }
 
@@ -512,66 +1073,76 @@ int MemInode::Expand(int newSize) {
 }
 
 int MemInode::ReleaseBlocks() {
-    int blockNum = (this->i_size - 1) / BLOCK_SIZE + 1;
-
+    int n = IndexFanout();
     for (int i = 0; i < 6; ++i) {
         if (this->i_addr[i] > 0) {
             SuperBlock::superBlock.ReleaseBlock(this->i_addr[i]);
         }
     }
 
-    int buffer[128];
+    // 索引块在缓存中原地遍历，释放索引块本身之前先解除固定
+    char* blockData;
     for (int i = 6; i < 8; ++i) {
         if (this->i_addr[i] > 0) {
             // 一级索引有效
-            if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(this->i_addr[i], buffer)) {
+            int handle = DeviceManager::deviceManager.GetBlock(this->i_addr[i], blockData);
+            if (handle == -1) {
                 return -1;
             }
 
-            for (int j = 0; j < 128; ++j) {
-                if (buffer[j] > 0) {
-                    SuperBlock::superBlock.ReleaseBlock(buffer[j]);
+            int* indices = (int*) blockData;
+            for (int j = 0; j < n; ++j) {
+                if (indices[j] > 0) {
+                    SuperBlock::superBlock.ReleaseBlock(indices[j]);
                 }
-                else {
+                else if (indices[j] != COMPRESSED_BLOCK) {
                     break;
                 }
             }
 
+            DeviceManager::deviceManager.PutBlock(handle, false);
             SuperBlock::superBlock.ReleaseBlock(this->i_addr[i]);
         }
     }
 
-    int buffer2[128];
     for (int i = 8; i < 10; ++i) {
         if (this->i_addr[i] > 0) {
             // 二级索引有效
-            if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(this->i_addr[i], buffer)) {
+            int handle = DeviceManager::deviceManager.GetBlock(this->i_addr[i], blockData);
+            if (handle == -1) {
                 return -1;
             }
 
-            for (int j = 0; j < 128; ++j) {
-                if (buffer[j] > 0) {
+            int* indices = (int*) blockData;
+            for (int j = 0; j < n; ++j) {
+                if (indices[j] > 0) {
                     // 一级索引有效
-                    if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(buffer[j], buffer2)) {
+                    char* level2Data;
+                    int level2Handle = DeviceManager::deviceManager.GetBlock(indices[j], level2Data);
+                    if (level2Handle == -1) {
+                        DeviceManager::deviceManager.PutBlock(handle, false);
                         return -1;
                     }
 
-                    for (int k = 0; k < 128; ++k) {
-                        if (buffer2[k] > 0) {
-                            SuperBlock::superBlock.ReleaseBlock(buffer2[k]);
+                    int* level2Indices = (int*) level2Data;
+                    for (int k = 0; k < n; ++k) {
+                        if (level2Indices[k] > 0) {
+                            SuperBlock::superBlock.ReleaseBlock(level2Indices[k]);
                         }
-                        else {
+                        else if (level2Indices[k] != COMPRESSED_BLOCK) {
                             break;
                         }
                     }
 
-                    SuperBlock::superBlock.ReleaseBlock(buffer[j]);
+                    DeviceManager::deviceManager.PutBlock(level2Handle, false);
+                    SuperBlock::superBlock.ReleaseBlock(indices[j]);
                 }
                 else {
                     break;
                 }
             }
 
+            DeviceManager::deviceManager.PutBlock(handle, false);
             SuperBlock::superBlock.ReleaseBlock(this->i_addr[i]);
         }
         else {
@@ -589,6 +1160,9 @@ int MemInode::Close(bool updateTime) {
             return -1;
         }
 
+        // 解压缓存随inode一起释放
+        std::vector<char>().swap(this->i_groupData);
+        this->i_groupNo = -1;
         this->i_used = 0;
     }
     return 0;
@@ -599,6 +1173,11 @@ int MemInode::StoreToDisk(int lastAccTime, int lastModTime) {
         // 当前待保存的MemInode已经没有连接，直接返回即可
         return 0;
     }
+
+    // 被部分改写的组先压缩，索引表确定之后再写inode
+    if (-1 == this->CompressPending()) {
+        return -1;
+    }
     DiskInode diskInode;
 
     if (lastAccTime < 0 || lastAccTime < 0) {
@@ -625,5 +1204,144 @@ int MemInode::StoreToDisk(int lastAccTime, int lastModTime) {
         diskInode.d_mtime = lastModTime;
     }
 
+    if (-1 == Journal::journal.LogInode(this->i_number)) {
+        return -1;
+    }
     return DeviceManager::deviceManager.WriteInode(this->i_number, &diskInode);
 }
+
+int MemInode::CollectBlocks(std::vector<int> &blockNos) {
+    int n = IndexFanout();
+    for (int i = 0; i < 6; ++i) {
+        if (this->i_addr[i] > 0) {
+            blockNos.push_back(this->i_addr[i]);
+        }
+    }
+
+    // 与ReleaseBlocks相同的顺序遍历索引块，索引块本身也要落盘
+    char* blockData;
+    for (int i = 6; i < 10; ++i) {
+        if (this->i_addr[i] <= 0) {
+            continue;
+        }
+        blockNos.push_back(this->i_addr[i]);
+
+        int handle = DeviceManager::deviceManager.GetBlock(this->i_addr[i], blockData);
+        if (handle == -1) {
+            return -1;
+        }
+        // 固定期间索引块不会被换出，先复制出来再释放，避免同时固定两级索引块
+        std::vector<int> indices((int*) blockData, (int*) blockData + n);
+        DeviceManager::deviceManager.PutBlock(handle, false);
+
+        for (int j = 0; j < n && indices[j] != 0; ++j) {
+            // 压缩组中没有物理块的项跳过
+            if (indices[j] == COMPRESSED_BLOCK) {
+                continue;
+            }
+            if (indices[j] < 0) {
+                break;
+            }
+            blockNos.push_back(indices[j]);
+            if (i < 8) {
+                continue;
+            }
+
+            // 二级索引，indices[j]是一级索引块
+            int level2Handle = DeviceManager::deviceManager.GetBlock(indices[j], blockData);
+            if (level2Handle == -1) {
+                return -1;
+            }
+            int* level2Indices = (int*) blockData;
+            for (int k = 0; k < n && level2Indices[k] != 0; ++k) {
+                if (level2Indices[k] == COMPRESSED_BLOCK) {
+                    continue;
+                }
+                if (level2Indices[k] < 0) {
+                    break;
+                }
+                blockNos.push_back(level2Indices[k]);
+            }
+            DeviceManager::deviceManager.PutBlock(level2Handle, false);
+        }
+    }
+    return 0;
+}
+
+int MemInode::Sync(bool dataOnly) {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+
+    // 压缩会改变数据块和索引表，在收集要落盘的块之前进行
+    if (-1 == this->CompressPending()) {
+        return -1;
+    }
+
+    // 数据块和索引块先落盘，inode指向它们时它们已经完整
+    std::vector<int> blockNos;
+    if (-1 == this->CollectBlocks(blockNos)) {
+        return -1;
+    }
+    if (-1 == deviceManager.FlushBlocks(blockNos.data(), (int) blockNos.size()) || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+
+    // 启用日志时索引块、空闲表和inode随事务一起提交，提交即已持久，不必写回原位置
+    bool journaled = Journal::journal.Enabled();
+    if (!journaled && -1 == SuperBlock::superBlock.Flush()) {
+        return -1;
+    }
+
+    bool storeNeeded = true;
+    if (dataOnly) {
+        // 只有访问、修改时间变化时不需要写inode
+        DiskInode diskInode;
+        if (-1 == DiskInode::DiskInodeFactory(this->i_number, diskInode)) {
+            return -1;
+        }
+        storeNeeded = diskInode.d_size != this->i_size || memcmp(diskInode.d_addr, this->i_addr, 10 * sizeof(int)) != 0;
+    }
+    if (storeNeeded && -1 == this->StoreToDisk(dataOnly ? -1 : this->i_lastAccessTime, dataOnly ? -1 : this->i_lastModifyTime)) {
+        return -1;
+    }
+    if (journaled) {
+        return Journal::journal.Commit();
+    }
+
+    // 缓存中的inode区块可能在此前就已经是脏的，不论这次是否修改都要写回
+    int flushResult = deviceManager.FlushInode(this->i_number);
+    if (flushResult == -1) {
+        return -1;
+    }
+    if (flushResult == 1 && -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    return 0;
+}
+
+int MemInode::SyncAll() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+
+    // 打开文件的大小和索引表只在关闭时写入inode，先把它们写进inode缓存
+    for (int i = 0; i < SYSTEM_MEM_INODE_NUM; ++i) {
+        MemInode& memInode = MemInode::systemMemInodeTable[i];
+        if (memInode.i_used == 1 && -1 == memInode.StoreToDisk(memInode.i_lastAccessTime, memInode.i_lastModifyTime)) {
+            return -1;
+        }
+    }
+
+    // 所有脏块中包括了空闲链表块，顺序与Sync相同
+    if (-1 == deviceManager.FlushDirtyBlocks() || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    if (Journal::journal.Enabled()) {
+        // 元数据提交之后全部写回原位置，日志随之清空
+        return Journal::journal.Checkpoint();
+    }
+    if (-1 == SuperBlock::superBlock.Flush()) {
+        return -1;
+    }
+    if (-1 == deviceManager.FlushDirtyInodes() || -1 == deviceManager.SyncDevice()) {
+        return -1;
+    }
+    return 0;
+}
@@ -8,7 +8,7 @@
 
 #include "../include/MoFSErrno.h"
 
-int MoFSErrno;
+thread_local int MoFSErrno;
 
 char ErrnoMsg[MAX_ERRNO][MAX_MSG_LENGTH] = {
         "Success",
@@ -6,13 +6,16 @@
  * @license GPL v3
  */
 #include <ctime>
+#include <algorithm>
 
 #include "../include/MoFSErrno.h"
 #include "../utils/Diagnose.h"
 #include "../include/OpenFile.h"
 #include "../include/DirEntry.h"
+#include "../include/device/DeviceManager.h"
 
-#define BLOCK_SIZE 512
+/// 遍历目录文件时每次读取的字节数
+#define DIR_READ_CHUNK 512
 
 int OpenFile::Read(char *buffer, int size) {
     // 权限检查
@@ -22,10 +25,31 @@ int OpenFile::Read(char *buffer, int size) {
         return 0;
     }
 
-    int returnValue = this->f_inode->Read(this->f_offset, buffer, size);
+    bool direct = (this->f_flag & FileFlags::MOFS_DIRECT_IO) == FileFlags::MOFS_DIRECT_IO;
+    if (!direct && size > 0 && this->f_offset < this->f_inode->i_size) {
+        // 直接读写的数据只使用一次，不预读进缓存
+        int lastLogicBlock = (std::min(this->f_offset + size, this->f_inode->i_size) - 1) / DeviceManager::deviceManager.BlockSize();
+        if (this->f_offset == this->f_raNextOffset) {
+            // 顺序读取。已经预读的部分被读掉一半时才发起下一次预读，让预读始终领先于读取
+            if (lastLogicBlock + this->f_raWindow / 2 >= this->f_raEnd) {
+                this->f_raWindow = this->f_raWindow == 0 ? READ_AHEAD_INIT_BLOCKS : std::min(this->f_raWindow * 2, READ_AHEAD_MAX_BLOCKS);
+                int firstAheadBlock = std::max(this->f_raEnd, lastLogicBlock + 1);
+                this->f_inode->ReadAhead(firstAheadBlock, lastLogicBlock + 1 + this->f_raWindow - firstAheadBlock);
+                this->f_raEnd = lastLogicBlock + 1 + this->f_raWindow;
+            }
+        }
+        else {
+            // 随机读取，不预读
+            this->f_raWindow = 0;
+            this->f_raEnd = 0;
+        }
+    }
+
+    int returnValue = this->f_inode->Read(this->f_offset, buffer, size, direct);
 
     if (returnValue >= 0) {
         this->f_offset += returnValue;
+        this->f_raNextOffset = this->f_offset;
     }
 
     return returnValue;
@@ -39,7 +63,8 @@ int OpenFile::Write(char *buffer, int size) {
         return 0;
     }
 
-    int returnValue = this->f_inode->Write(this->f_offset, buffer, size);
+    bool direct = (this->f_flag & FileFlags::MOFS_DIRECT_IO) == FileFlags::MOFS_DIRECT_IO;
+    int returnValue = this->f_inode->Write(this->f_offset, buffer, size, direct);
 
     if (returnValue > 0) {
         this->f_offset += returnValue;
@@ -73,6 +98,7 @@ int OpenFile::Open(int flag, MemInode *inode, int uid, int gid) {
 
     this->f_count = 1;
     this->f_offset = 0;
+    this->ResetReadAhead();
 
     return 0;
 }
@@ -131,7 +157,7 @@ int OpenFile::Seek(int offset, int fromWhere) {
                 return -1;
             }
 
-            if (offset > (6 + 128 * 2 + 128 * 128 * 2) * BLOCK_SIZE) {
+            if (offset > MemInode::MaxFileByte()) {
                 return -1;
             }
 
@@ -147,7 +173,7 @@ int OpenFile::Seek(int offset, int fromWhere) {
                 return -1;
             }
 
-            if (newOffset > (6 + 128 * 2 + 128 * 128 * 2) * BLOCK_SIZE) {
+            if (newOffset > MemInode::MaxFileByte()) {
                 return -1;
             }
 
@@ -163,7 +189,7 @@ int OpenFile::Seek(int offset, int fromWhere) {
                 return -1;
             }
 
-            if (newOffset > (6 + 128 * 2 + 128 * 128 * 2) * BLOCK_SIZE) {
+            if (newOffset > MemInode::MaxFileByte()) {
                 return -1;
             }
 
@@ -185,6 +211,12 @@ int OpenFile::OpenFileFactory(OpenFile &openFile, int diskInodeIdx, int uid, int
     return openFile.Open(flags, openFile.f_inode, uid, gid);
 }
 
+void OpenFile::ResetReadAhead() {
+    this->f_raNextOffset = 0;
+    this->f_raWindow = 0;
+    this->f_raEnd = 0;
+}
+
 bool OpenFile::IsDirFile() {
     return (this->f_inode->i_mode & MemInode::IFMT) == MemInode::IFDIR;
 }
@@ -194,13 +226,13 @@ bool OpenFile::HaveFilesInDir() {
         return false;
     }
 
-    // 逐块读取并查找
-    DirEntry entries[BLOCK_SIZE / sizeof(DirEntry)];
+    // 分段读取并查找
+    DirEntry entries[DIR_READ_CHUNK / sizeof(DirEntry)];
 
     int readByteCnt = 0;
     this->Seek(0, SEEK_SET);
     while (true) {
-        readByteCnt = this->Read((char* )entries, BLOCK_SIZE);
+        readByteCnt = this->Read((char* )entries, DIR_READ_CHUNK);
         if (readByteCnt <= 0) {
             break;
         }
@@ -10,8 +10,13 @@
 #include "../include/Primitive.h"
 #include "../include/User.h"
 #include "../include/MoFSErrno.h"
+#include "../include/device/DeviceManager.h"
+#include "../include/DedupStore.h"
+#include "../include/Journal.h"
+#include "../include/BlockBitmap.h"
 
 int mofs_creat(const char *pathname, int mode) {
+    Journal::OpScope scope;
     // 掩码处理传入的mode参数，只保留最低9bit
     mode &= 0777;
 
@@ -20,6 +25,7 @@ int mofs_creat(const char *pathname, int mode) {
 }
 
 int mofs_mkdir(const char *pathname, int mode) {
+    Journal::OpScope scope;
     // 掩码处理传入的mode参数，只保留最低9bit
     mode &= 0777;
 
@@ -33,6 +39,7 @@ int mofs_mkdir(const char *pathname, int mode) {
 }
 
 int mofs_open(const char *pathname, int oflags,int mode) {
+    Journal::OpScope scope;
     int open_fd = User::userPtr->Open(pathname, oflags & 0x3);
     if (open_fd < 0) {
         if (MoFSErrno == 2) {
@@ -56,6 +63,9 @@ int mofs_open(const char *pathname, int oflags,int mode) {
                 }
 
                 // 成功创建
+                if ((oflags & MOFS_DIRECT) == MOFS_DIRECT) {
+                    User::userPtr->userOpenFileTable[open_fd].f_flag |= FileFlags::MOFS_DIRECT_IO;
+                }
                 return open_fd;
             }
             else {
@@ -80,10 +90,15 @@ int mofs_open(const char *pathname, int oflags,int mode) {
         mofs_lseek(open_fd, 1, SEEK_END);
     }
 
+    if ((oflags & MOFS_DIRECT) == MOFS_DIRECT) {
+        User::userPtr->userOpenFileTable[open_fd].f_flag |= FileFlags::MOFS_DIRECT_IO;
+    }
+
     return open_fd;
 }
 
 int mofs_read(int fd, void *buffer, int count) {
+    Journal::OpScope scope;
     if (count < 0) {
         return -1;
     }
@@ -92,6 +107,7 @@ int mofs_read(int fd, void *buffer, int count) {
 }
 
 int mofs_write(int fd, void *buffer, int count) {
+    Journal::OpScope scope;
     if (count < 0) {
         return -1;
     }
@@ -100,25 +116,67 @@ int mofs_write(int fd, void *buffer, int count) {
 }
 
 int mofs_lseek(int fd, int offset, int whence) {
+    Journal::OpScope scope;
     return User::userPtr->Seek(fd, offset, whence);
 }
 
 int mofs_close(int fd) {
+    Journal::OpScope scope;
     return User::userPtr->Close(fd);
 }
 
 int mofs_link(const char *srcpath, const char *dstpath) {
+    Journal::OpScope scope;
     return User::userPtr->Link(srcpath, dstpath);
 }
 
 int mofs_unlink(const char *pathname) {
+    Journal::OpScope scope;
     return User::userPtr->Unlink(pathname);
 }
 
 int mofs_stat(const char *pathname, struct FileStat *statbuf) {
+    Journal::OpScope scope;
     return User::userPtr->GetStat(pathname, statbuf);
 }
 
 int mofs_inode_stat(int inodeIndex, struct FileStat *statbuf) {
+    Journal::OpScope scope;
     return User::GetInodeStat(inodeIndex, statbuf);
 }
+
+int mofs_fsync(int fd) {
+    Journal::OpScope scope;
+    return User::userPtr->Sync(fd, false);
+}
+
+int mofs_fdatasync(int fd) {
+    Journal::OpScope scope;
+    return User::userPtr->Sync(fd, true);
+}
+
+int mofs_sync() {
+    Journal::OpScope scope;
+    return MemInode::SyncAll();
+}
+
+int mofs_compress(const char *pathname, int enable) {
+    Journal::OpScope scope;
+    return User::userPtr->SetCompress(pathname, enable != 0);
+}
+
+int mofs_get_stats(struct MoFSStats *statbuf) {
+    if (statbuf == nullptr) {
+        return -1;
+    }
+
+    DeviceManager::deviceManager.GetStats(*statbuf);
+    statbuf->dedupEnabled = DedupStore::dedupStore.Enabled();
+    DedupStore::dedupStore.GetStats(statbuf->dedupHits, statbuf->dedupSharedRefs);
+    statbuf->journalEnabled = Journal::journal.Enabled();
+    Journal::journal.GetStats(statbuf->journalCommits, statbuf->journalBlocks, statbuf->journalCheckpoints, statbuf->journalReplays);
+    statbuf->bitmapEnabled = BlockBitmap::blockBitmap.Enabled();
+    statbuf->freeBlocks = BlockBitmap::blockBitmap.FreeCount();
+    statbuf->dataBlocks = BlockBitmap::blockBitmap.DataBlockCount();
+    return 0;
+}
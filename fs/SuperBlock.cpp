@@ -8,37 +8,64 @@
 
 #include <ctime>
 #include <cstring>
+#include <climits>
+#include <vector>
 
 #include "../include/MoFSErrno.h"
 #include "../include/device/DeviceManager.h"
 #include "../include/SuperBlock.h"
+#include "../include/DedupStore.h"
+#include "../include/Journal.h"
+#include "../include/BlockBitmap.h"
 #include "../utils/Diagnose.h"
 #include "../include/MemInode.h"
 
+static_assert(sizeof(SuperBlock) == 1024, "SuperBlock must occupy exactly 1024 bytes on disk");
+
 SuperBlock SuperBlock::superBlock;
+std::vector<int> SuperBlock::unsyncedListBlocks;
 
-int SuperBlock::MakeFS(int totalDiskByte, int inodeNum) {
+int SuperBlock::MakeFS(long long totalDiskByte, int inodeNum, int blockSize, bool checksum, bool dedup, bool journal, bool bitmap) {
     SuperBlock& superBlockRef = SuperBlock::superBlock;
 
+    if (!DeviceManager::IsValidBlockSize(blockSize)) {
+        MoFSErrno = 16;
+        return -1;
+    }
 
     int inodeSegSize = sizeof(DiskInode) * inodeNum;
 
-    DeviceManager::deviceManager.blockBufferManager.InitLinkList(BLOCK_BUFFER_NUM);
-    DeviceManager::deviceManager.inodeBufferManager.InitLinkList(INODE_BUFFER_NUM);
+    // 丢弃旧映象未提交的修改记录，之后清空缓存
+    Journal::journal.Drop();
+    DeviceManager::deviceManager.ResetCache();
+    SuperBlock::unsyncedListBlocks.clear();
 
-    memset(DeviceManager::deviceManager.blockDirty, 0, BLOCK_BUFFER_NUM * sizeof(bool));
-    memset(DeviceManager::deviceManager.inodeDirty, 0, INODE_BUFFER_NUM * sizeof(bool));
+    superBlockRef.s_blockSize = blockSize;
+    superBlockRef.s_isize = (inodeSegSize + blockSize - 1) / blockSize;
 
-    superBlockRef.s_isize = (inodeSegSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // inode区和block区的起点按LAYOUT_ALIGN对齐
+    DeviceManager::deviceManager.SetLayout(blockSize, superBlockRef.s_isize);
 
-
-    int remainByte = totalDiskByte - inodeSegSize - sizeof(SuperBlock) - HEADER_SIG_SIZE;
-    if (remainByte <= BLOCK_SIZE) {
+    long long remainByte = totalDiskByte - DeviceManager::deviceManager.BlockOffset(0);
+    if (checksum) {
+        // 校验和区也要放进映象，每块4字节，另留出对齐和向上取整的余量
+        long long entryNum = remainByte / blockSize + superBlockRef.s_isize;
+        long long tableByte = (entryNum * (long long) sizeof(uint32_t) + CHECKSUM_PAGE_SIZE - 1) / CHECKSUM_PAGE_SIZE * CHECKSUM_PAGE_SIZE;
+        remainByte -= tableByte + LAYOUT_ALIGN + blockSize;
+    }
+    if (remainByte <= blockSize) {
         return -1;
     }
 
-    int blockNum = (remainByte + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // 块号和空闲表都是32位的
+    long long blockNum64 = (remainByte + blockSize - 1) / blockSize;
+    if (blockNum64 > INT_MAX) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    int blockNum = (int) blockNum64;
     superBlockRef.s_fsize = blockNum;
+    superBlockRef.s_imageByte = DeviceManager::deviceManager.BlockOffset(blockNum);
 
     superBlockRef.s_flock = 0;
     superBlockRef.s_ilock = 0;
@@ -47,26 +74,81 @@ int SuperBlock::MakeFS(int totalDiskByte, int inodeNum) {
     superBlockRef.s_ronly = 0;
     superBlockRef.s_time = time(nullptr);
 
-    DeviceManager::deviceManager.SetOffset(HEADER_SIG_SIZE + superBlockRef.s_isize * BLOCK_SIZE + sizeof(SuperBlock));
+    // 预先把映象扩展到整个文件系统的大小，mmap模式下映射需要覆盖所有块
+    if (-1 == DeviceManager::deviceManager.ReserveImage(DeviceManager::deviceManager.BlockOffset(blockNum))) {
+        return -1;
+    }
+
+    // 之后写入的空闲表块都会记下校验和
+    superBlockRef.s_checksum = checksum ? 1 : 0;
+    if (!checksum) {
+        DeviceManager::deviceManager.DropChecksums();
+    }
+    else if (-1 == DeviceManager::deviceManager.SetupChecksums(blockNum, superBlockRef.s_isize, false)) {
+        return -1;
+    }
+
+    // 日志区放在block区最末尾，不进入空闲表
+    int dataBlockNum = blockNum;
+    superBlockRef.s_journalBlockCnt = 0;
+    superBlockRef.s_journalBlock = 0;
+    if (journal) {
+        int journalBlockCnt = Journal::DefaultBlockCnt(blockSize, blockNum);
+        if (journalBlockCnt >= blockNum / 2) {
+            MoFSErrno = 11;
+            return -1;
+        }
+        dataBlockNum -= journalBlockCnt;
+        superBlockRef.s_journalBlock = dataBlockNum;
+        superBlockRef.s_journalBlockCnt = journalBlockCnt;
+    }
+
+    // 去重表放在日志区之前，每个数据块一项，表块不进入空闲表
+    superBlockRef.s_dedupBlockCnt = 0;
+    superBlockRef.s_dedupBlock = 0;
+    DedupStore::dedupStore.Drop();
+    if (dedup) {
+        int entrySize = (int) sizeof(DedupEntry);
+        superBlockRef.s_dedupBlockCnt = (int) (((long long) dataBlockNum * entrySize + blockSize + entrySize - 1) / (blockSize + entrySize));
+        dataBlockNum -= superBlockRef.s_dedupBlockCnt;
+        superBlockRef.s_dedupBlock = dataBlockNum;
+        if (-1 == DedupStore::dedupStore.Setup(dataBlockNum, superBlockRef.s_dedupBlockCnt, false)) {
+            return -1;
+        }
+    }
+
+    // 位图放在去重表之前，覆盖它之前的所有数据块
+    superBlockRef.s_bitmapBlockCnt = 0;
+    superBlockRef.s_bitmapBlock = 0;
+    BlockBitmap::blockBitmap.Drop();
+    if (bitmap) {
+        superBlockRef.s_bitmapBlockCnt = BlockBitmap::BlockCnt(blockSize, dataBlockNum);
+        dataBlockNum -= superBlockRef.s_bitmapBlockCnt;
+        superBlockRef.s_bitmapBlock = dataBlockNum;
+        if (-1 == BlockBitmap::blockBitmap.Setup(dataBlockNum, superBlockRef.s_bitmapBlockCnt, false)) {
+            return -1;
+        }
+    }
 
     // 设置空闲块
-    // 设置直接管辖的空闲块
-    superBlockRef.s_nfree = (blockNum - 1) % 100 + 1;
-    int directOffset = blockNum - superBlockRef.s_nfree;
+    // 设置直接管辖的空闲块，使用位图时空闲表为空
+    superBlockRef.s_nfree = bitmap ? 0 : (dataBlockNum - 1) % 100 + 1;
+    memset(superBlockRef.s_free, 0, sizeof(superBlockRef.s_free));
+    int directOffset = dataBlockNum - superBlockRef.s_nfree;
     for (int i = 0; i < superBlockRef.s_nfree; ++i) {
         superBlockRef.s_free[i] = directOffset + i;
     }
 
     // 写入间接管辖的空闲块
-    int freeBlocks[128]{};
-    int hundreds = (blockNum - superBlockRef.s_nfree) / 100;
+    std::vector<int> freeBlocks(blockSize / sizeof(int));
+    int hundreds = bitmap ? 0 : (dataBlockNum - superBlockRef.s_nfree) / 100;
     freeBlocks[0] = 100;
     for (int i = 0; i < hundreds; ++i) {
         for (int j = 0; j < 100; ++j) {
             freeBlocks[j + 1] = i * 100 + j;
         }
 
-        DeviceManager::deviceManager.WriteBlock((i + 1) * 100, freeBlocks);
+        SuperBlock::WriteListBlock((i + 1) * 100, freeBlocks.data());
     }
 
 
@@ -92,7 +174,7 @@ int SuperBlock::MakeFS(int totalDiskByte, int inodeNum) {
 //            Diagnose::PrintError("Cannot alloc free block.");
             return -1;
         }
-        DeviceManager::deviceManager.WriteBlock(freeBlock, freeBlocks);
+        SuperBlock::WriteListBlock(freeBlock, freeBlocks.data());
         freeBlocks[0] = freeBlock;
     }
 
@@ -123,16 +205,31 @@ int SuperBlock::MakeFS(int totalDiskByte, int inodeNum) {
 
     // superBlock 写回磁盘
     DeviceManager::deviceManager.StoreSuperBlock(&superBlockRef);
+
+    // 格式化的内容全部落盘后写入空的日志头块，之后的修改都经过日志
+    if (journal && -1 == Journal::journal.Setup(superBlockRef.s_journalBlock, superBlockRef.s_journalBlockCnt, false)) {
+        return -1;
+    }
     return 0;
 }
 
 int SuperBlock::AllocBlock() {
+    if (BlockBitmap::blockBitmap.Enabled()) {
+        int allocated;
+        return this->AllocBlocks(1, 0, allocated);
+    }
+
+    if ((this->s_nfree <= 0 || (this->s_nfree == 1 && this->s_free[0] == 0)) && Journal::journal.ReclaimFrees()) {
+        // 空闲表已空，提交事务把推迟释放的块放回空闲表
+        return this->AllocBlock();
+    }
     if (this->s_nfree <= 0) {
         MoFSErrno = 11;
         return -1;
     }
 
     int freeBlock = this->s_free[this->s_nfree - 1]; // 取出最后一个直接管辖的空闲块
+    this->s_fmod = 1;
     if (this->s_nfree == 1) {
         // 分配完这个块之前，没有空闲块被superBlock直接管辖，需要将s_free[0]指向的块的内容调入
         // 调入后，s_free[0]指向的块被释放，可以作为空闲块返回
@@ -142,15 +239,21 @@ int SuperBlock::AllocBlock() {
             return -1;
         }
 
-        int blockContent[BLOCK_SIZE / sizeof(int)];
-        if (BLOCK_SIZE != DeviceManager::deviceManager.ReadBlock(this->s_free[0], blockContent)) {
+        char* blockContent;
+        int handle = DeviceManager::deviceManager.GetBlock(this->s_free[0], blockContent);
+        if (handle == -1) {
             MoFSErrno = 16;
             return -1;
         }
 
         // 这里的memcpy将同时写s_nfree 和 s_free
         memcpy(&(this->s_nfree), blockContent, 101 * sizeof(int));
+        DeviceManager::deviceManager.PutBlock(handle, false);
 
+        // 启用日志时，提交之前磁盘上的空闲表仍指向这个链表块，它不能马上被写成数据
+        if (Journal::journal.DeferFree(freeBlock)) {
+            return this->AllocBlock();
+        }
         return freeBlock;
     }
     else {
@@ -161,12 +264,48 @@ int SuperBlock::AllocBlock() {
     }
 }
 
+int SuperBlock::AllocBlocks(int count, int goal, int &allocated) {
+    BlockBitmap& blockBitmap = BlockBitmap::blockBitmap;
+    if (!blockBitmap.Enabled()) {
+        // 空闲链表中的块没有顺序，逐块分配
+        allocated = 1;
+        return this->AllocBlock();
+    }
+
+    if (blockBitmap.FreeCount() == 0 && Journal::journal.ReclaimFrees()) {
+        // 位图已满，提交事务把推迟释放的块放回位图
+        return this->AllocBlocks(count, goal, allocated);
+    }
+    return blockBitmap.Alloc(count, goal, allocated);
+}
+
 int SuperBlock::ReleaseBlock(int blockIdx) {
+    int sharedResult = DedupStore::dedupStore.DropRef(blockIdx);
+    if (sharedResult != 0) {
+        // 仍有其它文件引用这一块
+        return sharedResult == 1 ? 0 : -1;
+    }
+
+    // 释放它的修改提交之前，已提交的元数据仍引用这个块
+    if (Journal::journal.DeferFree(blockIdx)) {
+        return 0;
+    }
+    return this->AddFreeBlock(blockIdx);
+}
+
+int SuperBlock::AddFreeBlock(int blockIdx) {
+    if (BlockBitmap::blockBitmap.Enabled()) {
+        return BlockBitmap::blockBitmap.Free(blockIdx);
+    }
+
+    this->s_fmod = 1;
     if (this->s_nfree == 100) {
         // 当前superBlock直接管辖的空闲块已满，将当前的这101字写入一个块中。这里存入blockIdx这个待释放的块中。
-        int readBuffer[128];
-        DeviceManager::deviceManager.WriteBlock(blockIdx, readBuffer);
-        memcpy(&(this->s_nfree), readBuffer, 101 * sizeof(int));
+        std::vector<int> writeBuffer(DeviceManager::deviceManager.BlockSize() / sizeof(int));
+        memcpy(writeBuffer.data(), &(this->s_nfree), 101 * sizeof(int));
+        if (-1 == SuperBlock::WriteListBlock(blockIdx, writeBuffer.data())) {
+            return -1;
+        }
 
         this->s_nfree = 1;
         this->s_free[0] = blockIdx;
@@ -191,6 +330,7 @@ int SuperBlock::AllocDiskInode() {
         return -1;
     }
 
+    this->s_fmod = 1;
     --(this->s_ninode);
     int freeInode = this->s_inode[this->s_ninode];
     this->s_inode[this->s_ninode] = 0;
@@ -199,11 +339,14 @@ int SuperBlock::AllocDiskInode() {
         // 直接管辖的inode已经耗尽，需要重新从加载一批
         if (this->s_nextInodeBlk != 0) {
             // 仍然有block存着空闲inode
-            int buffer[BLOCK_SIZE / sizeof(int)];
-            DeviceManager::deviceManager.ReadBlock(this->s_nextInodeBlk, buffer);
-
-            this->s_nextInodeBlk = buffer[0];
-            memcpy(this->s_inode, &(buffer[1]), 100 * sizeof(int));
+            char* blockContent;
+            int handle = DeviceManager::deviceManager.GetBlock(this->s_nextInodeBlk, blockContent);
+            if (handle != -1) {
+                int* buffer = (int*) blockContent;
+                this->s_nextInodeBlk = buffer[0];
+                memcpy(this->s_inode, &(buffer[1]), 100 * sizeof(int));
+                DeviceManager::deviceManager.PutBlock(handle, false);
+            }
         }
     }
 
@@ -211,6 +354,7 @@ int SuperBlock::AllocDiskInode() {
 }
 
 int SuperBlock::ReleaseInode(int inodeIdx) {
+    this->s_fmod = 1;
     if (this->s_ninode == 100) {
         // 当前直接管辖的inode已达上限，找一个block写入
         int blockIdx = this->AllocBlock();
@@ -219,11 +363,13 @@ int SuperBlock::ReleaseInode(int inodeIdx) {
             return -1;
         }
 
-        int buffer[128]{};
+        std::vector<int> buffer(DeviceManager::deviceManager.BlockSize() / sizeof(int));
         buffer[0] = blockIdx;
         memcpy(&(buffer[1]), this->s_inode, 100 * sizeof(int));
 
-        DeviceManager::deviceManager.WriteBlock(blockIdx, buffer);
+        if (-1 == SuperBlock::WriteListBlock(blockIdx, buffer.data())) {
+            return -1;
+        }
 
         this->s_ninode = 1;
         this->s_inode[0] = inodeIdx;
@@ -236,3 +382,79 @@ int SuperBlock::ReleaseInode(int inodeIdx) {
         return 0;
     }
 }
+
+int SuperBlock::WriteListBlock(int blockIdx, void *content) {
+    // 先加入日志事务，提交之前不会写回原位置
+    if (-1 == Journal::journal.LogBlock(blockIdx)) {
+        return -1;
+    }
+    DeviceManager::deviceManager.WriteBlock(blockIdx, content);
+    SuperBlock::unsyncedListBlocks.push_back(blockIdx);
+    return 0;
+}
+
+int SuperBlock::LoadJournal() {
+    if (this->s_journalBlockCnt == 0) {
+        Journal::journal.Drop();
+        return 0;
+    }
+
+    int replayedCnt = Journal::journal.Setup(this->s_journalBlock, this->s_journalBlockCnt, true);
+    if (replayedCnt > 0 && -1 == DeviceManager::deviceManager.LoadSuperBlock(this)) {
+        // 重放改写了SuperBlock，重新加载
+        return -1;
+    }
+    return replayedCnt;
+}
+
+int SuperBlock::LoadDedupTable() {
+    if (this->s_dedupBlockCnt == 0) {
+        DedupStore::dedupStore.Drop();
+        return 0;
+    }
+    return DedupStore::dedupStore.Setup(this->s_dedupBlock, this->s_dedupBlockCnt, true);
+}
+
+int SuperBlock::LoadBlockBitmap() {
+    if (this->s_bitmapBlockCnt == 0) {
+        BlockBitmap::blockBitmap.Drop();
+        return 0;
+    }
+    return BlockBitmap::blockBitmap.Setup(this->s_bitmapBlock, this->s_bitmapBlockCnt, true);
+}
+
+int SuperBlock::Flush() {
+    DeviceManager& deviceManager = DeviceManager::deviceManager;
+
+    // 引用数先于空闲表落盘，崩溃后共享的块不会因为引用数丢失而被提前释放
+    if (-1 == DedupStore::dedupStore.Flush()) {
+        return -1;
+    }
+
+    // 位图先于inode落盘，崩溃后文件引用的块不会仍标记为空闲
+    if (-1 == BlockBitmap::blockBitmap.Flush()) {
+        return -1;
+    }
+    if (!SuperBlock::unsyncedListBlocks.empty()) {
+        // 链表块落盘之后，磁盘上的SuperBlock才能指向它们
+        if (-1 == deviceManager.FlushBlocks(SuperBlock::unsyncedListBlocks.data(), (int) SuperBlock::unsyncedListBlocks.size())) {
+            return -1;
+        }
+        if (-1 == deviceManager.SyncDevice()) {
+            return -1;
+        }
+        SuperBlock::unsyncedListBlocks.clear();
+    }
+
+    if (this->s_fmod == 0) {
+        return 0;
+    }
+
+    this->s_fmod = 0;
+    this->s_time = time(nullptr);
+    if (-1 == deviceManager.StoreSuperBlock(this) || -1 == deviceManager.SyncDevice()) {
+        this->s_fmod = 1;
+        return -1;
+    }
+    return 0;
+}
@@ -13,8 +13,11 @@
 #include "../include/DirEntry.h"
 #include "../utils/Diagnose.h"
 #include "../include/MoFSErrno.h"
+#include "../include/device/DeviceManager.h"
+#include "../include/Journal.h"
 
-#define BLOCK_SIZE 512
+/// 插入目录项时每次读取的字节数
+#define DIR_READ_CHUNK 512
 
 // 默认情况下
 User* User::userPtr = nullptr;
@@ -42,23 +45,30 @@ int SearchFileInodeByName(char* nameBuffer, int bufferSize, OpenFile& dirFile) {
     if (bufferSize == 0) {
         return dirFile.f_inode->i_number;
     }
-    // 逐块读取并查找
-    DirEntry entries[BLOCK_SIZE / sizeof(DirEntry)];
-
-    int readByteCnt = 0;
-    dirFile.Seek(0, SEEK_SET);
-    while (true) {
-        readByteCnt = dirFile.Read((char* )entries, BLOCK_SIZE);
-        if (readByteCnt <= 0) {
-            break;
+    // 逐块在缓存中原地查找，不复制目录项
+    MemInode* dirInode = dirFile.f_inode;
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int blockNum = (dirInode->i_size + blockSize - 1) / blockSize;
+    for (int blockIdx = 0; blockIdx < blockNum; ++blockIdx) {
+        char* blockData;
+        int handle = DeviceManager::deviceManager.GetBlock(dirInode->BlockMap(blockIdx), blockData);
+        if (handle == -1) {
+            return -1;
         }
 
-        for (int i = 0; i < readByteCnt / sizeof(DirEntry); ++i) {
+        DirEntry* entries = (DirEntry*) blockData;
+        int blockByteCnt = dirInode->i_size - blockIdx * blockSize;
+        int entryNum = (blockByteCnt < blockSize ? blockByteCnt : blockSize) / sizeof(DirEntry);
+        for (int i = 0; i < entryNum; ++i) {
             if (entries[i].m_ino > 0 && NameComp(nameBuffer, entries[i].m_name, bufferSize)) {
-                return entries[i].m_ino;
+                int inodeIdx = entries[i].m_ino;
+                DeviceManager::deviceManager.PutBlock(handle, false);
+                return inodeIdx;
             }
         }
+        DeviceManager::deviceManager.PutBlock(handle, false);
     }
+    dirInode->i_lastAccessTime = time(nullptr);
 
     return -1;
 }
@@ -71,33 +81,40 @@ int SearchFileInodeByName(char* nameBuffer, int bufferSize, OpenFile& dirFile) {
  * @return 0为成功，-1为错误
  */
 int RemoveEntryInDirFile(char* nameBuffer, int bufferSize, OpenFile& dirFile) {
-    // 逐块读取并查找
-    DirEntry entries[BLOCK_SIZE / sizeof(DirEntry)];
-
-    int readByteCnt = 0;
-    dirFile.Seek(0, SEEK_SET);
-    while (true) {
-        readByteCnt = dirFile.Read((char* )entries, BLOCK_SIZE);
-        if (readByteCnt <= 0) {
-            break;
+    // 逐块在缓存中原地查找，找到后直接修改缓存块
+    MemInode* dirInode = dirFile.f_inode;
+    int blockSize = DeviceManager::deviceManager.BlockSize();
+    int blockNum = (dirInode->i_size + blockSize - 1) / blockSize;
+    for (int blockIdx = 0; blockIdx < blockNum; ++blockIdx) {
+        char* blockData;
+        int blockNo = dirInode->BlockMap(blockIdx);
+        int handle = DeviceManager::deviceManager.GetBlock(blockNo, blockData);
+        if (handle == -1) {
+            return -1;
         }
 
-        for (int i = 0; i < readByteCnt / sizeof(DirEntry); ++i) {
+        DirEntry* entries = (DirEntry*) blockData;
+        int blockByteCnt = dirInode->i_size - blockIdx * blockSize;
+        int entryNum = (blockByteCnt < blockSize ? blockByteCnt : blockSize) / sizeof(DirEntry);
+        for (int i = 0; i < entryNum; ++i) {
             if (entries[i].m_ino > 0 && NameComp(nameBuffer, entries[i].m_name, bufferSize)) {
+                // 目录块先加入日志事务再修改
+                if (-1 == Journal::journal.LogBlock(blockNo)) {
+                    DeviceManager::deviceManager.PutBlock(handle, false);
+                    return -1;
+                }
                 entries[i].m_ino = -1; // 将ino标记为-1，设置为空闲
-
-                // 写回
-                dirFile.Seek(-1 * readByteCnt, SEEK_CUR);
-                dirFile.Write((char*)entries, readByteCnt);
+                DeviceManager::deviceManager.PutBlock(handle, true);
 
                 // 将更新后的inode写回磁盘
-                if (-1 == dirFile.f_inode->StoreToDisk(dirFile.f_inode->i_lastAccessTime, time(nullptr))) {
+                if (-1 == dirInode->StoreToDisk(dirInode->i_lastAccessTime, time(nullptr))) {
                     return -1;
                 }
 
                 return 0;
             }
         }
+        DeviceManager::deviceManager.PutBlock(handle, false);
     }
 
     return -1;
@@ -111,13 +128,13 @@ int RemoveEntryInDirFile(char* nameBuffer, int bufferSize, OpenFile& dirFile) {
  * @return 0为成功，-1为错误
  */
 int InsertEntryInDirFile(char* nameBuffer, int bufferSize, int inodeIdx, OpenFile& dirFile) {
-    // 逐块读取并查找
-    DirEntry entries[BLOCK_SIZE / sizeof(DirEntry)];
+    // 分段读取并查找
+    DirEntry entries[DIR_READ_CHUNK / sizeof(DirEntry)];
 
     int readByteCnt = 0;
     dirFile.Seek(0, SEEK_SET);
     while (true) {
-        readByteCnt = dirFile.Read((char* )entries, BLOCK_SIZE);
+        readByteCnt = dirFile.Read((char* )entries, DIR_READ_CHUNK);
         if (readByteCnt <= 0) {
             break;
         }
@@ -342,6 +359,11 @@ int User::Create(const char *path, int mode) {
         return -1;
     }
 
+    // 在压缩的目录中新建的文件和目录也压缩
+    if (currentDirFile.f_inode->i_mode & MemInode::ICOMPR) {
+        mode |= (int) MemInode::ICOMPR;
+    }
+
     int newDiskInode = SuperBlock::superBlock.AllocDiskInode();
     if (newDiskInode == -1) {
         // errno 已经在AllocDiskInode设置
@@ -367,6 +389,7 @@ int User::Create(const char *path, int mode) {
     this->userOpenFileTable[emptyIndex].f_inode = memInodePtr;
     this->userOpenFileTable[emptyIndex].f_flag = FileFlags::MOFS_WRITE;
     this->userOpenFileTable[emptyIndex].f_offset = 0;
+    this->userOpenFileTable[emptyIndex].ResetReadAhead();
 
     // MemInode初始化
 //    memInodePtr->i_flag = INodeFlag::IUPD | INodeFlag::IACC;
@@ -452,6 +475,28 @@ int User::Seek(int fd, int offset, int fromWhere) {
     return this->userOpenFileTable[fd].Seek(offset, fromWhere);
 }
 
+int User::Sync(int fd, bool dataOnly) {
+    if (fd < 0 || fd >= USER_OPEN_FILE_TABLE_SIZE || this->userOpenFileTable[fd].f_inode == nullptr) {
+        MoFSErrno = 3;
+        return -1;
+    }
+
+    return this->userOpenFileTable[fd].f_inode->Sync(dataOnly);
+}
+
+int User::SetCompress(const char *path, bool enable) {
+    int fd = this->Open(path, FileFlags::MOFS_READ | FileFlags::MOFS_WRITE);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int result = this->userOpenFileTable[fd].f_inode->SetCompress(enable);
+    if (-1 == this->Close(fd)) {
+        return -1;
+    }
+    return result;
+}
+
 
 int User::Link(const char *srcPath, const char *dstPath) {
     // 找到srcPath的inode
@@ -0,0 +1,371 @@
+﻿/**
+ * @file AsyncIO.cpp
+ * @brief 异步I/O队列实现
+ * @author 韩孟霖
+ * @date 2022/6/8
+ * @license GPL v3
+ */
+#include <cstring>
+#include <cstddef>
+#ifdef __linux__
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "../../include/device/AsyncIO.h"
+
+/**
+ * @brief 用设备同步执行一个请求
+ * @param device 映象设备
+ * @param request 请求
+ */
+static void ExecuteRequest(BlockDevice* device, AsyncRequest* request) {
+    if (request->opcode == ASYNC_IO_READ) {
+        if (request->vector != nullptr) {
+            request->result = device->ReadV(request->offset, request->vector, request->vectorCnt);
+        }
+        else {
+            request->result = device->Read(request->offset, request->buffer, request->length);
+        }
+    }
+    else if (request->vector != nullptr) {
+        request->result = device->WriteV(request->offset, request->vector, request->vectorCnt);
+    }
+    else {
+        request->result = device->Write(request->offset, request->buffer, request->length);
+    }
+}
+
+int AsyncIO::SubmitAll(AsyncRequest *requests, int count) {
+    int submittedCnt = 0;
+    int completedCnt = 0;
+    for (int i = 0; i < count; ++i) {
+        requests[i].result = -1;
+        if (0 == this->Submit(&requests[i])) {
+            ++submittedCnt;
+        }
+    }
+
+    while (completedCnt < submittedCnt) {
+        int currentCnt = this->Complete(submittedCnt - completedCnt);
+        if (currentCnt == 0) {
+            // 队列出错，不会再有完成事件
+            break;
+        }
+        completedCnt += currentCnt;
+    }
+
+    int failedCnt = 0;
+    for (int i = 0; i < count; ++i) {
+        if (requests[i].result != requests[i].length) {
+            ++failedCnt;
+        }
+    }
+    return failedCnt;
+}
+
+AsyncIO *AsyncIO::AsyncIOFactory(const char *name, BlockDevice *device) {
+    bool isAuto = strcmp(name, "auto") == 0;
+    if (strcmp(name, "off") == 0 || (isAuto && device->FileDescriptor() < 0)) {
+        // 没有文件描述符的设备（如stdio）不支持并发读写
+        return new InlineAsyncIO(device);
+    }
+
+#ifdef __linux__
+    if (isAuto || strcmp(name, "uring") == 0) {
+        UringAsyncIO* uring = new UringAsyncIO();
+        if (device->FileDescriptor() >= 0 && 0 == uring->Init(device->FileDescriptor(), ASYNC_IO_QUEUE_DEPTH)) {
+            return uring;
+        }
+        delete uring;
+        if (!isAuto) {
+            return nullptr;
+        }
+    }
+#endif
+
+    if (isAuto || strcmp(name, "threads") == 0) {
+        return new ThreadPoolAsyncIO(device, ASYNC_IO_WORKER_NUM);
+    }
+    return nullptr;
+}
+
+InlineAsyncIO::InlineAsyncIO(BlockDevice *device) {
+    this->device = device;
+}
+
+int InlineAsyncIO::Submit(AsyncRequest *request) {
+    ExecuteRequest(this->device, request);
+    ++this->completedCnt;
+    return 0;
+}
+
+int InlineAsyncIO::Complete(int minCnt) {
+    int completedCnt = this->completedCnt;
+    this->completedCnt = 0;
+    return completedCnt;
+}
+
+ThreadPoolAsyncIO::ThreadPoolAsyncIO(BlockDevice *device, int workerNum) {
+    this->device = device;
+    for (int i = 0; i < workerNum; ++i) {
+        this->workers.emplace_back(&ThreadPoolAsyncIO::WorkerLoop, this);
+    }
+}
+
+ThreadPoolAsyncIO::~ThreadPoolAsyncIO() {
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        this->stopping = true;
+    }
+    this->submitCond.notify_all();
+    for (std::thread& worker : this->workers) {
+        worker.join();
+    }
+}
+
+void ThreadPoolAsyncIO::WorkerLoop() {
+    while (true) {
+        AsyncRequest* request;
+        {
+            std::unique_lock<std::mutex> lock(this->queueMutex);
+            this->submitCond.wait(lock, [this] { return this->stopping || !this->pendingQueue.empty(); });
+            if (this->pendingQueue.empty()) {
+                // stopping且没有剩余请求
+                return;
+            }
+            request = this->pendingQueue.front();
+            this->pendingQueue.pop_front();
+        }
+
+        ExecuteRequest(this->device, request);
+
+        {
+            std::lock_guard<std::mutex> lock(this->queueMutex);
+            ++this->completedCnt;
+        }
+        this->completeCond.notify_one();
+    }
+}
+
+int ThreadPoolAsyncIO::Submit(AsyncRequest *request) {
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        this->pendingQueue.push_back(request);
+        ++this->inflightCnt;
+    }
+    this->submitCond.notify_one();
+    return 0;
+}
+
+int ThreadPoolAsyncIO::Complete(int minCnt) {
+    std::unique_lock<std::mutex> lock(this->queueMutex);
+    if (minCnt > this->inflightCnt) {
+        minCnt = this->inflightCnt;
+    }
+    this->completeCond.wait(lock, [this, minCnt] { return this->completedCnt >= minCnt; });
+
+    int completedCnt = this->completedCnt;
+    this->completedCnt = 0;
+    this->inflightCnt -= completedCnt;
+    return completedCnt;
+}
+
+#ifdef __linux__
+static_assert(sizeof(BlockIOVec) == sizeof(struct iovec) && offsetof(BlockIOVec, length) == offsetof(struct iovec, iov_len),
+              "BlockIOVec must share the layout of struct iovec");
+
+/**
+ * @brief 在途请求的附加信息，iovec需要在请求完成前保持有效
+ */
+struct UringAsyncIO::SlotInfo {
+    struct iovec vec;
+    AsyncRequest* request;
+};
+
+UringAsyncIO::~UringAsyncIO() {
+    // 等待所有在途请求完成，避免内核写入已经释放的缓冲区
+    while (this->inflightCnt > 0 && 0 == this->Enter(1)) {
+        this->Reap();
+    }
+
+    if (this->sqes != nullptr) {
+        munmap(this->sqes, this->sqesSize);
+    }
+    if (this->cqRing != nullptr && this->cqRing != this->sqRing) {
+        munmap(this->cqRing, this->cqRingSize);
+    }
+    if (this->sqRing != nullptr) {
+        munmap(this->sqRing, this->sqRingSize);
+    }
+    if (this->ringFd >= 0) {
+        close(this->ringFd);
+    }
+    delete[] this->slots;
+    delete[] this->freeSlots;
+}
+
+int UringAsyncIO::Init(int fd, int queueDepth) {
+    struct io_uring_params params{};
+    this->ringFd = (int) syscall(__NR_io_uring_setup, queueDepth, &params);
+    if (this->ringFd < 0) {
+        // 内核不支持，或者被seccomp等禁止
+        return -1;
+    }
+    this->fileFd = fd;
+
+    this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap && this->cqRingSize > this->sqRingSize) {
+        this->sqRingSize = this->cqRingSize;
+    }
+
+    void* mapAddr = mmap(nullptr, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+    if (mapAddr == MAP_FAILED) {
+        return -1;
+    }
+    this->sqRing = mapAddr;
+
+    if (singleMmap) {
+        this->cqRing = this->sqRing;
+    }
+    else {
+        mapAddr = mmap(nullptr, this->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+        if (mapAddr == MAP_FAILED) {
+            return -1;
+        }
+        this->cqRing = mapAddr;
+    }
+
+    this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    mapAddr = mmap(nullptr, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+    if (mapAddr == MAP_FAILED) {
+        return -1;
+    }
+    this->sqes = mapAddr;
+
+    char* sqBase = (char*) this->sqRing;
+    this->sqHead = (unsigned*) (sqBase + params.sq_off.head);
+    this->sqTail = (unsigned*) (sqBase + params.sq_off.tail);
+    this->sqMask = (unsigned*) (sqBase + params.sq_off.ring_mask);
+    this->sqArray = (unsigned*) (sqBase + params.sq_off.array);
+    this->sqEntries = params.sq_entries;
+
+    char* cqBase = (char*) this->cqRing;
+    this->cqHead = (unsigned*) (cqBase + params.cq_off.head);
+    this->cqTail = (unsigned*) (cqBase + params.cq_off.tail);
+    this->cqMask = (unsigned*) (cqBase + params.cq_off.ring_mask);
+    this->cqes = cqBase + params.cq_off.cqes;
+
+    // 在途请求数不超过SQ的长度，CQ至少和SQ一样长，不会溢出
+    this->slots = new SlotInfo[this->sqEntries];
+    this->freeSlots = new int[this->sqEntries];
+    for (unsigned i = 0; i < this->sqEntries; ++i) {
+        this->freeSlots[i] = (int) i;
+    }
+    this->freeSlotTop = (int) this->sqEntries;
+    return 0;
+}
+
+int UringAsyncIO::Enter(int waitCnt) {
+    while (true) {
+        int ret = (int) syscall(__NR_io_uring_enter, this->ringFd, this->toSubmitCnt, waitCnt,
+                                waitCnt > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret >= 0) {
+            this->toSubmitCnt -= ret;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+        if (errno != EINTR) {
+            // 内核资源暂时不足，先收割已经完成的请求
+            this->Reap();
+        }
+    }
+}
+
+void UringAsyncIO::Reap() {
+    unsigned head = *this->cqHead;
+    unsigned tail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = (struct io_uring_cqe*) this->cqes + (head & *this->cqMask);
+        int slotIdx = (int) cqe->user_data;
+        this->slots[slotIdx].request->result = cqe->res < 0 ? -1 : cqe->res;
+        this->freeSlots[this->freeSlotTop++] = slotIdx;
+
+        --this->inflightCnt;
+        ++this->completedCnt;
+        ++head;
+    }
+    __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+}
+
+int UringAsyncIO::Submit(AsyncRequest *request) {
+    // 队列已满，等待至少一个请求完成
+    while (this->freeSlotTop == 0) {
+        if (-1 == this->Enter(1)) {
+            return -1;
+        }
+        this->Reap();
+    }
+
+    int slotIdx = this->freeSlots[--this->freeSlotTop];
+    SlotInfo& slot = this->slots[slotIdx];
+    slot.vec.iov_base = request->buffer;
+    slot.vec.iov_len = request->length;
+    slot.request = request;
+
+    unsigned tail = *this->sqTail;
+    unsigned index = tail & *this->sqMask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) this->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = request->opcode == ASYNC_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = this->fileFd;
+    sqe->off = request->offset;
+    if (request->vector != nullptr) {
+        // 分散读/聚集写直接使用调用者的段数组，它与iovec布局相同
+        sqe->addr = (unsigned long long) request->vector;
+        sqe->len = request->vectorCnt;
+    }
+    else {
+        sqe->addr = (unsigned long long) &slot.vec;
+        sqe->len = 1;
+    }
+    sqe->user_data = slotIdx;
+
+    this->sqArray[index] = index;
+    __atomic_store_n(this->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    ++this->toSubmitCnt;
+    ++this->inflightCnt;
+    return 0;
+}
+
+int UringAsyncIO::Complete(int minCnt) {
+    this->Reap();
+    int waitCnt = minCnt - this->completedCnt;
+    if (waitCnt > this->inflightCnt) {
+        waitCnt = this->inflightCnt;
+    }
+
+    if (this->toSubmitCnt > 0 || waitCnt > 0) {
+        if (-1 == this->Enter(waitCnt > 0 ? waitCnt : 0)) {
+            // 提交失败时不会再有完成事件，报告已完成的部分
+            int completedCnt = this->completedCnt;
+            this->completedCnt = 0;
+            return completedCnt;
+        }
+        this->Reap();
+    }
+
+    int completedCnt = this->completedCnt;
+    this->completedCnt = 0;
+    return completedCnt;
+}
+#endif
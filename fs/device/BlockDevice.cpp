@@ -0,0 +1,608 @@
+﻿/**
+ * @file BlockDevice.cpp
+ * @brief 映象文件I/O接口的实现
+ * @author 韩孟霖
+ * @date 2022/6/6
+ * @license GPL v3
+ */
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <climits>
+#else
+#include <io.h>
+#endif
+
+#include "../../include/device/BlockDevice.h"
+
+#ifndef _WIN32
+static_assert(sizeof(off_t) >= 8, "image offsets need a 64-bit off_t, build with _FILE_OFFSET_BITS=64");
+#endif
+
+long long BlockDevice::ReadV(long long offset, const BlockIOVec *iov, int iovCnt) {
+    // 默认实现逐段读取
+    long long readByteCnt = 0;
+    for (int i = 0; i < iovCnt; ++i) {
+        long long currentByteCnt = this->Read(offset + readByteCnt, iov[i].base, (long long) iov[i].length);
+        readByteCnt += currentByteCnt;
+        if (currentByteCnt != (long long) iov[i].length) {
+            break;
+        }
+    }
+    return readByteCnt;
+}
+
+long long BlockDevice::WriteV(long long offset, const BlockIOVec *iov, int iovCnt) {
+    // 默认实现逐段写入
+    long long writeByteCnt = 0;
+    for (int i = 0; i < iovCnt; ++i) {
+        long long currentByteCnt = this->Write(offset + writeByteCnt, iov[i].base, (long long) iov[i].length);
+        writeByteCnt += currentByteCnt;
+        if (currentByteCnt != (long long) iov[i].length) {
+            break;
+        }
+    }
+    return writeByteCnt;
+}
+
+BlockDevice *BlockDevice::DeviceFactory(const char *deviceName) {
+    if (strcmp(deviceName, "stdio") == 0) {
+        return new StdioBlockDevice();
+    }
+    if (strcmp(deviceName, "mem") == 0) {
+        return new MemoryBlockDevice();
+    }
+#ifndef _WIN32
+    if (strcmp(deviceName, "pread") == 0) {
+        return new PosixBlockDevice();
+    }
+    if (strcmp(deviceName, "mmap") == 0) {
+        return new MmapBlockDevice();
+    }
+#endif
+    return nullptr;
+}
+
+bool BlockDevice::IsMemoryImage(const char *imagePath) {
+    return strncmp(imagePath, MEMORY_IMAGE_PREFIX, strlen(MEMORY_IMAGE_PREFIX)) == 0;
+}
+
+MemoryBlockDevice::~MemoryBlockDevice() {
+    this->Close();
+}
+
+int MemoryBlockDevice::Open(const char *imagePath) {
+    if (!IsMemoryImage(imagePath)) {
+        return -1;
+    }
+
+    const char* sizeStr = imagePath + strlen(MEMORY_IMAGE_PREFIX);
+    char* unitStr = nullptr;
+    long long size = strtoll(sizeStr, &unitStr, 10);
+    if (unitStr == sizeStr || size <= 0) {
+        return -1;
+    }
+    switch (*unitStr) {
+        case 'G': case 'g':
+            size <<= 30;
+            ++unitStr;
+            break;
+        case 'M': case 'm':
+            ++unitStr;
+            // fallthrough
+        case '\0':
+            // 不带后缀时以MB为单位
+            size <<= 20;
+            break;
+        case 'K': case 'k':
+            size <<= 10;
+            ++unitStr;
+            break;
+        default:
+            return -1;
+    }
+    if (*unitStr != '\0') {
+        return -1;
+    }
+
+    // calloc得到的大块内存按需分配物理页，未写过的部分不占用内存
+    this->data = (char*) calloc(size, 1);
+    if (this->data == nullptr) {
+        return -1;
+    }
+    this->capacity = size;
+    return 0;
+}
+
+void MemoryBlockDevice::Close() {
+    free(this->data);
+    this->data = nullptr;
+    this->capacity = 0;
+}
+
+long long MemoryBlockDevice::Read(long long offset, void *buffer, long long size) {
+    if (offset >= this->capacity) {
+        return 0;
+    }
+    if (size > this->capacity - offset) {
+        size = this->capacity - offset;
+    }
+    memcpy(buffer, this->data + offset, size);
+    return size;
+}
+
+long long MemoryBlockDevice::Write(long long offset, const void *buffer, long long size) {
+    if (offset >= this->capacity) {
+        return 0;
+    }
+    if (size > this->capacity - offset) {
+        size = this->capacity - offset;
+    }
+    memcpy(this->data + offset, buffer, size);
+    return size;
+}
+
+int MemoryBlockDevice::Reserve(long long size) {
+    return size <= this->capacity ? 0 : -1;
+}
+
+StdioBlockDevice::~StdioBlockDevice() {
+    this->Close();
+}
+
+int StdioBlockDevice::Open(const char *imagePath) {
+    // 尝试打开映象文件
+    this->imgFilePtr = fopen(imagePath, "rb+");
+    // 如果不存在，创建一个
+    if (this->imgFilePtr == nullptr) {
+        this->imgFilePtr = fopen(imagePath, "wb+");
+    }
+    return this->imgFilePtr == nullptr ? -1 : 0;
+}
+
+void StdioBlockDevice::Close() {
+    if (this->imgFilePtr != nullptr) {
+        fclose(this->imgFilePtr);
+        this->imgFilePtr = nullptr;
+    }
+}
+
+/**
+ * @brief 移动文件位置。fseek的偏移量是long，在Windows上只有32位，映象超过2GB时需要64位的版本
+ * @param filePtr 文件指针
+ * @param offset 偏移量
+ * @param whence SEEK_SET SEEK_END
+ * @return 0表示成功，-1表示出错
+ */
+static int SeekImage(FILE* filePtr, long long offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(filePtr, offset, whence) == 0 ? 0 : -1;
+#else
+    return fseeko(filePtr, offset, whence) == 0 ? 0 : -1;
+#endif
+}
+
+long long StdioBlockDevice::Read(long long offset, void *buffer, long long size) {
+    if (SeekImage(this->imgFilePtr, offset, SEEK_SET) == -1) {
+        return 0;
+    }
+    return fread(buffer, 1, size, this->imgFilePtr);
+}
+
+long long StdioBlockDevice::Write(long long offset, const void *buffer, long long size) {
+    if (SeekImage(this->imgFilePtr, offset, SEEK_SET) == -1) {
+        return 0;
+    }
+    return fwrite(buffer, 1, size, this->imgFilePtr);
+}
+
+long long StdioBlockDevice::Size() {
+    if (SeekImage(this->imgFilePtr, 0, SEEK_END) == -1) {
+        return -1;
+    }
+#ifdef _WIN32
+    return _ftelli64(this->imgFilePtr);
+#else
+    return ftello(this->imgFilePtr);
+#endif
+}
+
+int StdioBlockDevice::Sync() {
+    // 先把stdio的用户态缓冲交给内核，再要求内核写入设备
+    if (fflush(this->imgFilePtr) != 0) {
+        return -1;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(this->imgFilePtr)) == 0 ? 0 : -1;
+#else
+    return fsync(fileno(this->imgFilePtr)) == 0 ? 0 : -1;
+#endif
+}
+
+#ifndef _WIN32
+PosixBlockDevice::~PosixBlockDevice() {
+    this->Close();
+}
+
+int PosixBlockDevice::Open(const char *imagePath) {
+    this->fd = open(imagePath, O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        return -1;
+    }
+
+#ifdef O_DIRECT
+    // 大块的流式读写用另一个描述符绕过页缓存，两个描述符的一致性由内核保证
+    this->directFd = open(imagePath, O_RDWR | O_DIRECT);
+#endif
+    return 0;
+}
+
+void PosixBlockDevice::Close() {
+    if (this->fd >= 0) {
+        close(this->fd);
+        this->fd = -1;
+    }
+    if (this->directFd >= 0) {
+        close(this->directFd);
+        this->directFd = -1;
+    }
+}
+
+long long PosixBlockDevice::Read(long long offset, void *buffer, long long size) {
+    long long readByteCnt = 0;
+    while (readByteCnt < size) {
+        ssize_t currentByteCnt = pread(this->fd, (char*) buffer + readByteCnt, size - readByteCnt, offset + readByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt <= 0) {
+            // 出错或到达文件末尾
+            break;
+        }
+        readByteCnt += currentByteCnt;
+    }
+    return readByteCnt;
+}
+
+long long PosixBlockDevice::Write(long long offset, const void *buffer, long long size) {
+    long long writeByteCnt = 0;
+    while (writeByteCnt < size) {
+        ssize_t currentByteCnt = pwrite(this->fd, (const char*) buffer + writeByteCnt, size - writeByteCnt, offset + writeByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt <= 0) {
+            break;
+        }
+        writeByteCnt += currentByteCnt;
+    }
+    return writeByteCnt;
+}
+
+long long PosixBlockDevice::ReadV(long long offset, const BlockIOVec *iov, int iovCnt) {
+    long long readByteCnt = 0;
+    struct iovec vectors[IOV_MAX];
+
+    // 一次preadv最多读入IOV_MAX段
+    while (iovCnt > 0) {
+        int batchCnt = iovCnt < IOV_MAX ? iovCnt : IOV_MAX;
+        long long batchByteCnt = 0;
+        for (int i = 0; i < batchCnt; ++i) {
+            vectors[i].iov_base = iov[i].base;
+            vectors[i].iov_len = iov[i].length;
+            batchByteCnt += (long long) iov[i].length;
+        }
+
+        ssize_t currentByteCnt = preadv(this->fd, vectors, batchCnt, offset + readByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt <= 0) {
+            // 出错或到达文件末尾
+            break;
+        }
+
+        readByteCnt += currentByteCnt;
+        if (currentByteCnt != batchByteCnt) {
+            // 只读到一部分，剩余部分逐段补读，到达文件末尾时停止
+            long long skipByteCnt = currentByteCnt;
+            for (int i = 0; i < batchCnt; ++i) {
+                long long length = (long long) iov[i].length;
+                if (skipByteCnt >= length) {
+                    skipByteCnt -= length;
+                    continue;
+                }
+
+                long long restByteCnt = this->Read(offset + readByteCnt, (char*) iov[i].base + skipByteCnt, length - skipByteCnt);
+                readByteCnt += restByteCnt;
+                if (restByteCnt != length - skipByteCnt) {
+                    return readByteCnt;
+                }
+                skipByteCnt = 0;
+            }
+        }
+
+        iov += batchCnt;
+        iovCnt -= batchCnt;
+    }
+    return readByteCnt;
+}
+
+long long PosixBlockDevice::WriteV(long long offset, const BlockIOVec *iov, int iovCnt) {
+    long long writeByteCnt = 0;
+    struct iovec vectors[IOV_MAX];
+
+    // 一次pwritev最多提交IOV_MAX段
+    while (iovCnt > 0) {
+        int batchCnt = iovCnt < IOV_MAX ? iovCnt : IOV_MAX;
+        long long batchByteCnt = 0;
+        for (int i = 0; i < batchCnt; ++i) {
+            vectors[i].iov_base = iov[i].base;
+            vectors[i].iov_len = iov[i].length;
+            batchByteCnt += (long long) iov[i].length;
+        }
+
+        ssize_t currentByteCnt = pwritev(this->fd, vectors, batchCnt, offset + writeByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt < 0) {
+            break;
+        }
+
+        writeByteCnt += currentByteCnt;
+        if (currentByteCnt != batchByteCnt) {
+            // 只写入了一部分，剩余部分逐段补写
+            long long skipByteCnt = currentByteCnt;
+            for (int i = 0; i < iovCnt; ++i) {
+                long long length = (long long) iov[i].length;
+                if (skipByteCnt >= length) {
+                    skipByteCnt -= length;
+                    continue;
+                }
+
+                long long restByteCnt = this->Write(offset + writeByteCnt, (const char*) iov[i].base + skipByteCnt, length - skipByteCnt);
+                writeByteCnt += restByteCnt;
+                if (restByteCnt != length - skipByteCnt) {
+                    break;
+                }
+                skipByteCnt = 0;
+            }
+            break;
+        }
+
+        iov += batchCnt;
+        iovCnt -= batchCnt;
+    }
+    return writeByteCnt;
+}
+
+long long PosixBlockDevice::ReadDirect(long long offset, void *buffer, long long size) {
+    long long readByteCnt = 0;
+    while (this->directFd >= 0 && readByteCnt < size) {
+        ssize_t currentByteCnt = pread(this->directFd, (char*) buffer + readByteCnt, size - readByteCnt, offset + readByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt <= 0 || currentByteCnt % DIRECT_IO_ALIGN != 0) {
+            // 出错、到达文件末尾，或者读到了不对齐的文件末尾，剩下的部分走页缓存
+            readByteCnt += currentByteCnt > 0 ? currentByteCnt : 0;
+            break;
+        }
+        readByteCnt += currentByteCnt;
+    }
+
+    if (readByteCnt < size) {
+        readByteCnt += this->Read(offset + readByteCnt, (char*) buffer + readByteCnt, size - readByteCnt);
+        // 只使用一次的数据不留在页缓存中
+        this->Advise(offset, size, DEVICE_ADVICE_DONTNEED);
+    }
+    return readByteCnt;
+}
+
+long long PosixBlockDevice::WriteDirect(long long offset, const void *buffer, long long size) {
+    long long writeByteCnt = 0;
+    while (this->directFd >= 0 && writeByteCnt < size) {
+        ssize_t currentByteCnt = pwrite(this->directFd, (const char*) buffer + writeByteCnt, size - writeByteCnt, offset + writeByteCnt);
+        if (currentByteCnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (currentByteCnt <= 0 || currentByteCnt % DIRECT_IO_ALIGN != 0) {
+            writeByteCnt += currentByteCnt > 0 ? currentByteCnt : 0;
+            break;
+        }
+        writeByteCnt += currentByteCnt;
+    }
+
+    if (writeByteCnt < size) {
+        writeByteCnt += this->Write(offset + writeByteCnt, (const char*) buffer + writeByteCnt, size - writeByteCnt);
+        this->Advise(offset, size, DEVICE_ADVICE_DONTNEED);
+    }
+    return writeByteCnt;
+}
+
+void PosixBlockDevice::Advise(long long offset, long long length, int advice) {
+#ifdef POSIX_FADV_NORMAL
+    static const int adviceTable[] = {
+            POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED
+    };
+    if (advice >= 0 && advice < (int) (sizeof(adviceTable) / sizeof(int))) {
+        posix_fadvise(this->fd, offset, length, adviceTable[advice]);
+    }
+#endif
+}
+
+/**
+ * @brief 同步文件数据，平台没有fdatasync时用fsync
+ * @param fd 文件描述符
+ * @return 0表示成功，-1表示出错
+ */
+static int SyncFileData(int fd) {
+    int result;
+    do {
+#ifdef __APPLE__
+        result = fsync(fd);
+#else
+        result = fdatasync(fd);
+#endif
+    } while (result != 0 && errno == EINTR);
+    return result == 0 ? 0 : -1;
+}
+
+long long PosixBlockDevice::Size() {
+    struct stat imageStat{};
+    if (fstat(this->fd, &imageStat) != 0) {
+        return -1;
+    }
+    return imageStat.st_size;
+}
+
+int PosixBlockDevice::Sync() {
+    // 直接I/O的描述符指向同一个文件，同步一次即可覆盖两者的写入
+    return SyncFileData(this->fd);
+}
+
+MmapBlockDevice::~MmapBlockDevice() {
+    this->Close();
+}
+
+int MmapBlockDevice::Open(const char *imagePath) {
+    this->fd = open(imagePath, O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        return -1;
+    }
+
+    struct stat imageStat{};
+    if (fstat(this->fd, &imageStat) != 0) {
+        this->Close();
+        return -1;
+    }
+
+    // 新建的空映象在Reserve之后才映射
+    if (imageStat.st_size > 0 && this->Remap(imageStat.st_size) == -1) {
+        this->Close();
+        return -1;
+    }
+    return 0;
+}
+
+void MmapBlockDevice::Close() {
+    if (this->mappedData != nullptr) {
+        munmap(this->mappedData, this->mappedSize);
+        this->mappedData = nullptr;
+        this->mappedSize = 0;
+    }
+    if (this->fd >= 0) {
+        close(this->fd);
+        this->fd = -1;
+    }
+}
+
+int MmapBlockDevice::Remap(long long size) {
+    // 32位平台的地址空间映射不了超过SIZE_MAX的映象
+    if ((unsigned long long) size > SIZE_MAX) {
+        return -1;
+    }
+
+    if (this->mappedData != nullptr) {
+        munmap(this->mappedData, this->mappedSize);
+        this->mappedData = nullptr;
+        this->mappedSize = 0;
+    }
+
+    void* mapAddr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (mapAddr == MAP_FAILED) {
+        return -1;
+    }
+
+    this->mappedData = (char*) mapAddr;
+    this->mappedSize = size;
+    return 0;
+}
+
+long long MmapBlockDevice::Read(long long offset, void *buffer, long long size) {
+    if (offset >= this->mappedSize) {
+        return 0;
+    }
+    if (size > this->mappedSize - offset) {
+        size = this->mappedSize - offset;
+    }
+    memcpy(buffer, this->mappedData + offset, size);
+    return size;
+}
+
+long long MmapBlockDevice::Write(long long offset, const void *buffer, long long size) {
+    // 写入映射之外的区域会引发SIGBUS，先扩展映象
+    if (offset + size > this->mappedSize && this->Reserve(offset + size) == -1) {
+        return 0;
+    }
+    memcpy(this->mappedData + offset, buffer, size);
+    return size;
+}
+
+void MmapBlockDevice::Advise(long long offset, long long length, int advice) {
+    static const int adviceTable[] = {
+            MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED
+    };
+    if (this->mappedData == nullptr || offset >= this->mappedSize || advice < 0 || advice >= (int) (sizeof(adviceTable) / sizeof(int))) {
+        return;
+    }
+
+    // madvise要求起始地址按页对齐
+    long long pageSize = sysconf(_SC_PAGESIZE);
+    long long alignedOffset = offset / pageSize * pageSize;
+    if (length <= 0 || offset + length > this->mappedSize) {
+        length = this->mappedSize - offset;
+    }
+    madvise(this->mappedData + alignedOffset, length + offset - alignedOffset, adviceTable[advice]);
+}
+
+int MmapBlockDevice::Reserve(long long size) {
+    if (size <= this->mappedSize) {
+        return 0;
+    }
+
+    struct stat imageStat{};
+    if (fstat(this->fd, &imageStat) != 0) {
+        return -1;
+    }
+    if (imageStat.st_size < size && ftruncate(this->fd, size) != 0) {
+        return -1;
+    }
+    return this->Remap(imageStat.st_size > size ? imageStat.st_size : size);
+}
+
+long long MmapBlockDevice::Size() {
+    struct stat imageStat{};
+    if (fstat(this->fd, &imageStat) != 0) {
+        return -1;
+    }
+    return imageStat.st_size;
+}
+
+int MmapBlockDevice::Flush(long long offset, long long length) {
+    if (this->mappedData == nullptr || length <= 0 || offset >= this->mappedSize) {
+        return 0;
+    }
+
+    // msync要求起始地址按页对齐
+    long long pageSize = sysconf(_SC_PAGESIZE);
+    long long alignedOffset = offset / pageSize * pageSize;
+    if (offset + length > this->mappedSize) {
+        length = this->mappedSize - offset;
+    }
+    return msync(this->mappedData + alignedOffset, length + offset - alignedOffset, MS_SYNC) == 0 ? 0 : -1;
+}
+
+int MmapBlockDevice::Sync() {
+    // 映射中被修改的区域已经由Flush用msync写入，这里保证Reserve扩展后的文件大小也落到设备上
+    return SyncFileData(this->fd);
+}
+#endif
@@ -8,13 +8,147 @@
 #include <cstring>
 
 #include "../../include/device/Buffer.h"
+#include "../../include/device/BufferPolicy.h"
 
-BufferLinkList::BufferLinkList(int bufferNum) {
-    this->prevLinkList = new int[bufferNum];
+BufferHashIndex::BufferHashIndex(int bufferNum) {
+    int tableSize = 16;
+    this->tableShift = 28;
+    while (tableSize < 2 * bufferNum) {
+        tableSize <<= 1;
+        --this->tableShift;
+    }
 
-    this->nextLinkList = new int[bufferNum];
+    this->keyTable = new int[tableSize];
+    this->valueTable = new int[tableSize];
+    this->tableMask = tableSize - 1;
+
+    this->Clear();
+}
+
+BufferHashIndex::~BufferHashIndex() {
+    delete[] this->keyTable;
+    delete[] this->valueTable;
+}
+
+int BufferHashIndex::Slot(int blockIdx) const {
+    // Fibonacci hashing，连续的块号会被打散到整张表中
+    return (int) (((unsigned int) blockIdx * 2654435761u) >> this->tableShift);
+}
+
+int BufferHashIndex::Find(int blockIdx) const {
+    if (blockIdx < 0) {
+        return -1;
+    }
+
+    int slot = this->Slot(blockIdx);
+    while (this->keyTable[slot] != -1) {
+        if (this->keyTable[slot] == blockIdx) {
+            return this->valueTable[slot];
+        }
+        slot = (slot + 1) & this->tableMask;
+    }
+
+    return -1;
+}
+
+void BufferHashIndex::Insert(int blockIdx, int bufferIdx) {
+    if (blockIdx < 0) {
+        // 非法块号不进入索引，查找时总是未命中
+        return;
+    }
+
+    int slot = this->Slot(blockIdx);
+    while (this->keyTable[slot] != -1 && this->keyTable[slot] != blockIdx) {
+        slot = (slot + 1) & this->tableMask;
+    }
+
+    this->keyTable[slot] = blockIdx;
+    this->valueTable[slot] = bufferIdx;
+}
+
+void BufferHashIndex::Erase(int blockIdx) {
+    if (blockIdx < 0) {
+        return;
+    }
+
+    int slot = this->Slot(blockIdx);
+    while (this->keyTable[slot] != blockIdx) {
+        if (this->keyTable[slot] == -1) {
+            // 不存在
+            return;
+        }
+        slot = (slot + 1) & this->tableMask;
+    }
+
+    // 后移删除：把探测链上后续的项往前挪，保证查找不会提前遇到空槽
+    int hole = slot;
+    int next = (hole + 1) & this->tableMask;
+    while (this->keyTable[next] != -1) {
+        int home = this->Slot(this->keyTable[next]);
+        // home 不在 (hole, next] 区间内时，next处的项可以移动到hole
+        if (((next - home) & this->tableMask) >= ((next - hole) & this->tableMask)) {
+            this->keyTable[hole] = this->keyTable[next];
+            this->valueTable[hole] = this->valueTable[next];
+            hole = next;
+        }
+        next = (next + 1) & this->tableMask;
+    }
+    this->keyTable[hole] = -1;
+}
 
+void BufferHashIndex::Clear() {
+    memset(this->keyTable, -1, (this->tableMask + 1) * sizeof(int));
+}
+
+BufferPolicy::BufferPolicy(int bufferNum) : hashIndex(bufferNum) {
+    this->bufferNum = bufferNum;
     this->numberLinkList = new int[bufferNum];
+    this->pinCount = new int[bufferNum];
+    this->ClearBuffers();
+}
+
+BufferPolicy::~BufferPolicy() {
+    delete[] this->numberLinkList;
+    delete[] this->pinCount;
+}
+
+void BufferPolicy::Invalidate(int bufferIdx) {
+    this->hashIndex.Erase(this->numberLinkList[bufferIdx]);
+    this->numberLinkList[bufferIdx] = -1;
+}
+
+void BufferPolicy::Restore(int bufferIdx, int blockIdx) {
+    this->hashIndex.Erase(this->numberLinkList[bufferIdx]);
+    this->numberLinkList[bufferIdx] = blockIdx;
+    this->hashIndex.Insert(blockIdx, bufferIdx);
+}
+
+void BufferPolicy::ClearBuffers() {
+    memset(this->numberLinkList, -1, this->bufferNum * sizeof(int));
+    memset(this->pinCount, 0, this->bufferNum * sizeof(int));
+    this->hashIndex.Clear();
+}
+
+BufferPolicy *BufferPolicy::PolicyFactory(const char *policyName, int bufferNum) {
+    if (strcmp(policyName, "lru") == 0) {
+        return new BufferLinkList(bufferNum);
+    }
+    if (strcmp(policyName, "clock") == 0) {
+        return new ClockBufferPolicy(bufferNum);
+    }
+    if (strcmp(policyName, "2q") == 0) {
+        return new TwoQueueBufferPolicy(bufferNum);
+    }
+    if (strcmp(policyName, "arc") == 0) {
+        return new ARCBufferPolicy(bufferNum);
+    }
+    return nullptr;
+}
+
+BufferLinkList::BufferLinkList(int bufferNum) : BufferPolicy(bufferNum) {
+    this->prevLinkList = new int[bufferNum];
+
+    this->nextLinkList = new int[bufferNum];
 
     this->InitLinkList(bufferNum);
 }
@@ -22,22 +156,21 @@ BufferLinkList::BufferLinkList(int bufferNum) {
 BufferLinkList::~BufferLinkList() {
     delete[] this->prevLinkList;
     delete[] this->nextLinkList;
-    delete[] this->numberLinkList;
+}
+
+void BufferLinkList::Reset() {
+    this->InitLinkList(this->bufferNum);
 }
 
 int BufferLinkList::GetBufferedIndex(int blockIdx) {
-    int searchPtr = this->headPtr;
-    while (searchPtr >= 0) {
-        if (this->numberLinkList[searchPtr] == blockIdx) {
-            // cache hit
-            if (searchPtr != this->headPtr) {
-                // 如果找到的结点是头结点，没有必要调用insertHead
-                this->InsertHead(searchPtr);
-            }
-            return searchPtr;
+    int searchPtr = this->hashIndex.Find(blockIdx);
+    if (searchPtr >= 0) {
+        // cache hit
+        if (searchPtr != this->headPtr) {
+            // 如果找到的结点是头结点，没有必要调用insertHead
+            this->InsertHead(searchPtr);
         }
-
-        searchPtr = this->nextLinkList[searchPtr];
+        return searchPtr;
     }
 
     return -1;
@@ -54,15 +187,26 @@ int BufferLinkList::AllocNewBuffer(int blockIdx, int &oldBlockIdx) {
     }
     oldBlockIdx = -1;
     if (allocIdx == -1) {
-        // 没有空闲缓存块，释放队尾的缓存块
+        // 没有空闲缓存块，释放队尾的缓存块，被固定的块跳过
         allocIdx = this->rearPtr;
+        while (allocIdx >= 0 && this->IsPinned(allocIdx)) {
+            allocIdx = this->prevLinkList[allocIdx];
+        }
+        if (allocIdx == -1) {
+            // 所有缓存块都被固定
+            return -1;
+        }
         oldBlockIdx = this->numberLinkList[allocIdx];
+        this->hashIndex.Erase(oldBlockIdx);
     }
 
-    // 将新分配的缓存块插入队首
-    this->InsertHead(allocIdx);
+    // 将新分配的缓存块插入队首，已经是头结点时不需要移动
+    if (allocIdx != this->headPtr || this->rearPtr == -1) {
+        this->InsertHead(allocIdx);
+    }
 
     this->numberLinkList[allocIdx] = blockIdx;
+    this->hashIndex.Insert(blockIdx, allocIdx);
 
     return allocIdx;
 }
@@ -116,7 +260,7 @@ void BufferLinkList::InitLinkList(int bufferNum) {
     this->nextLinkList[bufferNum - 1] = -1;
 
 
-    memset(this->numberLinkList, -1, bufferNum * sizeof(int));
+    this->ClearBuffers();
 
     this->headPtr = 0;
     this->rearPtr = -1;
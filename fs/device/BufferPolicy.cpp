@@ -0,0 +1,418 @@
+﻿/**
+ * @file BufferPolicy.cpp
+ * @brief CLOCK、2Q、ARC缓存置换策略实现
+ * @author 韩孟霖
+ * @date 2022/6/4
+ * @license GPL v3
+ */
+#include <cstring>
+
+#include "../../include/device/BufferPolicy.h"
+
+IndexList::IndexList(int *prevArray, int *nextArray) {
+    this->prevArray = prevArray;
+    this->nextArray = nextArray;
+    this->Clear();
+}
+
+void IndexList::PushHead(int idx) {
+    this->prevArray[idx] = -1;
+    this->nextArray[idx] = this->head;
+    if (this->head >= 0) {
+        this->prevArray[this->head] = idx;
+    }
+    else {
+        this->tail = idx;
+    }
+    this->head = idx;
+    ++this->size;
+}
+
+void IndexList::Remove(int idx) {
+    int prevIdx = this->prevArray[idx];
+    int nextIdx = this->nextArray[idx];
+
+    if (prevIdx >= 0) {
+        this->nextArray[prevIdx] = nextIdx;
+    }
+    else {
+        this->head = nextIdx;
+    }
+
+    if (nextIdx >= 0) {
+        this->prevArray[nextIdx] = prevIdx;
+    }
+    else {
+        this->tail = prevIdx;
+    }
+    --this->size;
+}
+
+void IndexList::Clear() {
+    this->head = -1;
+    this->tail = -1;
+    this->size = 0;
+}
+
+int IndexList::LastUnpinned(const BufferPolicy *policy) const {
+    int idx = this->tail;
+    while (idx >= 0 && policy->IsPinned(idx)) {
+        idx = this->prevArray[idx];
+    }
+    return idx;
+}
+
+/**
+ * @brief 将缓存块重新绑定到新的块号，同时维护哈希索引
+ * @param policy 策略
+ * @param bufferIdx 缓存块序号
+ * @param blockIdx 新的块号
+ * @param oldBlockIdx 原来的块号，-1为空闲块
+ */
+static void BindBuffer(BufferPolicy* policy, int bufferIdx, int blockIdx, int &oldBlockIdx) {
+    oldBlockIdx = policy->numberLinkList[bufferIdx];
+    policy->hashIndex.Erase(oldBlockIdx);
+
+    policy->numberLinkList[bufferIdx] = blockIdx;
+    policy->hashIndex.Insert(blockIdx, bufferIdx);
+}
+
+ClockBufferPolicy::ClockBufferPolicy(int bufferNum) : BufferPolicy(bufferNum) {
+    this->referenceBit = new char[bufferNum];
+    this->Reset();
+}
+
+ClockBufferPolicy::~ClockBufferPolicy() {
+    delete[] this->referenceBit;
+}
+
+int ClockBufferPolicy::GetBufferedIndex(int blockIdx) {
+    int bufferIdx = this->hashIndex.Find(blockIdx);
+    if (bufferIdx >= 0) {
+        // 命中只置访问位，不需要拼接链表
+        this->referenceBit[bufferIdx] = 1;
+    }
+    return bufferIdx;
+}
+
+int ClockBufferPolicy::AllocNewBuffer(int blockIdx, int &oldBlockIdx) {
+    int allocIdx;
+    if (this->usedNum < this->bufferNum) {
+        allocIdx = this->usedNum;
+        ++this->usedNum;
+    }
+    else {
+        // 给访问位为1的块第二次机会，被固定的块跳过。扫过两圈仍然找不到说明全部被固定
+        int scanned = 0;
+        while (this->referenceBit[this->clockHand] || this->IsPinned(this->clockHand)) {
+            this->referenceBit[this->clockHand] = 0;
+            this->clockHand = (this->clockHand + 1) % this->bufferNum;
+            if (++scanned > 2 * this->bufferNum) {
+                return -1;
+            }
+        }
+        allocIdx = this->clockHand;
+        this->clockHand = (this->clockHand + 1) % this->bufferNum;
+    }
+
+    BindBuffer(this, allocIdx, blockIdx, oldBlockIdx);
+    // 新调入的块访问位为0，只被访问一次的块会在下一轮被换出
+    this->referenceBit[allocIdx] = 0;
+    return allocIdx;
+}
+
+void ClockBufferPolicy::Reset() {
+    memset(this->referenceBit, 0, this->bufferNum);
+    this->ClearBuffers();
+    this->clockHand = 0;
+    this->usedNum = 0;
+}
+
+TwoQueueBufferPolicy::TwoQueueBufferPolicy(int bufferNum)
+        : BufferPolicy(bufferNum),
+          prevArray(new int[bufferNum]), nextArray(new int[bufferNum]),
+          a1in(prevArray, nextArray), am(prevArray, nextArray),
+          ghostLimit(bufferNum / 2 > 0 ? bufferNum / 2 : 1), ghostIndex(ghostLimit) {
+    // 论文推荐的参数：A1in占缓存的25%，A1out记录缓存块数量50%的块号
+    this->a1inLimit = bufferNum / 4 > 0 ? bufferNum / 4 : 1;
+    this->queueFlag = new char[bufferNum];
+    this->ghostRing = new int[this->ghostLimit];
+    this->Reset();
+}
+
+TwoQueueBufferPolicy::~TwoQueueBufferPolicy() {
+    delete[] this->prevArray;
+    delete[] this->nextArray;
+    delete[] this->queueFlag;
+    delete[] this->ghostRing;
+}
+
+int TwoQueueBufferPolicy::GetBufferedIndex(int blockIdx) {
+    int bufferIdx = this->hashIndex.Find(blockIdx);
+    if (bufferIdx >= 0 && this->queueFlag[bufferIdx] == 2 && this->am.head != bufferIdx) {
+        // Am中按LRU调整；A1in中的命中不改变位置，避免短时间内的相关访问被当成热点
+        this->am.Remove(bufferIdx);
+        this->am.PushHead(bufferIdx);
+    }
+    return bufferIdx;
+}
+
+int TwoQueueBufferPolicy::Reclaim() {
+    bool fromA1in = this->a1in.size > this->a1inLimit || this->am.size == 0;
+    int victim = (fromA1in ? this->a1in : this->am).LastUnpinned(this);
+    if (victim < 0) {
+        // 目标队列中的块都被固定，尝试另一个队列
+        fromA1in = !fromA1in;
+        victim = (fromA1in ? this->a1in : this->am).LastUnpinned(this);
+    }
+    if (victim < 0) {
+        return -1;
+    }
+
+    if (fromA1in) {
+        this->a1in.Remove(victim);
+
+        // 记入A1out，覆盖最老的记录
+        int expired = this->ghostRing[this->ghostPos];
+        if (expired >= 0) {
+            this->ghostIndex.Erase(expired);
+        }
+        this->ghostRing[this->ghostPos] = this->numberLinkList[victim];
+        this->ghostIndex.Insert(this->numberLinkList[victim], this->ghostPos);
+        this->ghostPos = (this->ghostPos + 1) % this->ghostLimit;
+    }
+    else {
+        this->am.Remove(victim);
+    }
+    return victim;
+}
+
+int TwoQueueBufferPolicy::AllocNewBuffer(int blockIdx, int &oldBlockIdx) {
+    int allocIdx;
+    if (this->usedNum < this->bufferNum) {
+        allocIdx = this->usedNum;
+        ++this->usedNum;
+    }
+    else {
+        allocIdx = this->Reclaim();
+        if (allocIdx < 0) {
+            return -1;
+        }
+    }
+
+    BindBuffer(this, allocIdx, blockIdx, oldBlockIdx);
+
+    int ghostIdx = this->ghostIndex.Find(blockIdx);
+    if (ghostIdx >= 0) {
+        // 最近被换出过又被访问，说明不是一次性的扫描，进入Am
+        this->ghostRing[ghostIdx] = -1;
+        this->ghostIndex.Erase(blockIdx);
+        this->queueFlag[allocIdx] = 2;
+        this->am.PushHead(allocIdx);
+    }
+    else {
+        this->queueFlag[allocIdx] = 1;
+        this->a1in.PushHead(allocIdx);
+    }
+    return allocIdx;
+}
+
+void TwoQueueBufferPolicy::Restore(int bufferIdx, int blockIdx) {
+    // 换出时已记入A1out，块仍在缓存中时不能同时留在A1out里
+    int ghostIdx = this->ghostIndex.Find(blockIdx);
+    if (ghostIdx >= 0) {
+        this->ghostRing[ghostIdx] = -1;
+        this->ghostIndex.Erase(blockIdx);
+    }
+    BufferPolicy::Restore(bufferIdx, blockIdx);
+}
+
+void TwoQueueBufferPolicy::Reset() {
+    memset(this->queueFlag, 0, this->bufferNum);
+    memset(this->ghostRing, -1, this->ghostLimit * sizeof(int));
+    this->ClearBuffers();
+    this->ghostIndex.Clear();
+    this->a1in.Clear();
+    this->am.Clear();
+    this->ghostPos = 0;
+    this->usedNum = 0;
+}
+
+ARCBufferPolicy::ARCBufferPolicy(int bufferNum)
+        : BufferPolicy(bufferNum),
+          prevArray(new int[bufferNum]), nextArray(new int[bufferNum]),
+          t1(prevArray, nextArray), t2(prevArray, nextArray),
+          ghostPrev(new int[bufferNum + 1]), ghostNext(new int[bufferNum + 1]),
+          b1(ghostPrev, ghostNext), b2(ghostPrev, ghostNext),
+          ghostIndex(bufferNum + 1) {
+    this->listFlag = new char[bufferNum];
+    // |B1| + |B2| <= bufferNum，多留一个结点作为余量
+    this->ghostKey = new int[bufferNum + 1];
+    this->ghostFlag = new char[bufferNum + 1];
+    this->ghostFree = new int[bufferNum + 1];
+    this->Reset();
+}
+
+ARCBufferPolicy::~ARCBufferPolicy() {
+    delete[] this->prevArray;
+    delete[] this->nextArray;
+    delete[] this->listFlag;
+    delete[] this->ghostPrev;
+    delete[] this->ghostNext;
+    delete[] this->ghostKey;
+    delete[] this->ghostFlag;
+    delete[] this->ghostFree;
+}
+
+int ARCBufferPolicy::GetBufferedIndex(int blockIdx) {
+    int bufferIdx = this->hashIndex.Find(blockIdx);
+    if (bufferIdx >= 0) {
+        // 命中T1或T2，移到T2的表头
+        if (this->listFlag[bufferIdx] == 1) {
+            this->t1.Remove(bufferIdx);
+        }
+        else {
+            this->t2.Remove(bufferIdx);
+        }
+        this->listFlag[bufferIdx] = 2;
+        this->t2.PushHead(bufferIdx);
+    }
+    return bufferIdx;
+}
+
+void ARCBufferPolicy::PushGhost(IndexList &ghostList, int blockIdx) {
+    if (this->ghostFreeTop == 0) {
+        // 正常情况下不会发生，丢弃较长的幽灵链表的尾部
+        IndexList& longer = this->b1.size >= this->b2.size ? this->b1 : this->b2;
+        this->RemoveGhost(longer, longer.tail);
+    }
+
+    int ghostIdx = this->ghostFree[--this->ghostFreeTop];
+    this->ghostKey[ghostIdx] = blockIdx;
+    this->ghostFlag[ghostIdx] = (&ghostList == &this->b1) ? 1 : 2;
+    ghostList.PushHead(ghostIdx);
+    this->ghostIndex.Insert(blockIdx, ghostIdx);
+}
+
+void ARCBufferPolicy::RemoveGhost(IndexList &ghostList, int ghostIdx) {
+    ghostList.Remove(ghostIdx);
+    this->ghostIndex.Erase(this->ghostKey[ghostIdx]);
+    this->ghostFlag[ghostIdx] = 0;
+    this->ghostFree[this->ghostFreeTop++] = ghostIdx;
+}
+
+void ARCBufferPolicy::Restore(int bufferIdx, int blockIdx) {
+    // 换出时已记入B1或B2，块仍在缓存中时不能同时留在幽灵链表里
+    int ghostIdx = this->ghostIndex.Find(blockIdx);
+    if (ghostIdx >= 0) {
+        this->RemoveGhost(this->ghostFlag[ghostIdx] == 1 ? this->b1 : this->b2, ghostIdx);
+    }
+    BufferPolicy::Restore(bufferIdx, blockIdx);
+}
+
+int ARCBufferPolicy::Replace(bool hitInB2) {
+    bool fromT1 = this->t1.size >= 1 && ((hitInB2 && this->t1.size == this->target) || this->t1.size > this->target || this->t2.size == 0);
+    int victim = (fromT1 ? this->t1 : this->t2).LastUnpinned(this);
+    if (victim < 0) {
+        // 目标链表中的块都被固定，尝试另一条链表
+        fromT1 = !fromT1;
+        victim = (fromT1 ? this->t1 : this->t2).LastUnpinned(this);
+    }
+    if (victim < 0) {
+        return -1;
+    }
+
+    if (fromT1) {
+        this->t1.Remove(victim);
+        this->PushGhost(this->b1, this->numberLinkList[victim]);
+    }
+    else {
+        this->t2.Remove(victim);
+        this->PushGhost(this->b2, this->numberLinkList[victim]);
+    }
+    return victim;
+}
+
+int ARCBufferPolicy::AllocNewBuffer(int blockIdx, int &oldBlockIdx) {
+    int capacity = this->bufferNum;
+    int ghostIdx = this->ghostIndex.Find(blockIdx);
+    int allocIdx;
+    bool toT2 = false;
+
+    if (ghostIdx >= 0) {
+        bool hitInB2 = this->ghostFlag[ghostIdx] == 2;
+        if (hitInB2) {
+            // 命中B2，说明T2太小，减小p
+            int delta = this->b1.size >= this->b2.size ? this->b1.size / this->b2.size : 1;
+            this->target = this->target - delta > 0 ? this->target - delta : 0;
+            this->RemoveGhost(this->b2, ghostIdx);
+        }
+        else {
+            // 命中B1，说明T1太小，增大p
+            int delta = this->b2.size >= this->b1.size ? this->b2.size / this->b1.size : 1;
+            this->target = this->target + delta < capacity ? this->target + delta : capacity;
+            this->RemoveGhost(this->b1, ghostIdx);
+        }
+
+        allocIdx = this->usedNum < capacity ? this->usedNum++ : this->Replace(hitInB2);
+        toT2 = true;
+    }
+    else if (this->usedNum < capacity) {
+        // 缓存未满，不需要换出
+        allocIdx = this->usedNum++;
+    }
+    else if (this->t1.size + this->b1.size >= capacity) {
+        if (this->t1.size < capacity) {
+            this->RemoveGhost(this->b1, this->b1.tail);
+            allocIdx = this->Replace(false);
+        }
+        else {
+            // B1为空且T1占满缓存，直接丢弃T1的尾部
+            allocIdx = this->t1.LastUnpinned(this);
+            if (allocIdx >= 0) {
+                this->t1.Remove(allocIdx);
+            }
+        }
+    }
+    else {
+        if (this->t1.size + this->t2.size + this->b1.size + this->b2.size >= 2 * capacity) {
+            this->RemoveGhost(this->b2, this->b2.tail);
+        }
+        allocIdx = this->Replace(false);
+    }
+
+    if (allocIdx < 0) {
+        // 所有缓存块都被固定
+        return -1;
+    }
+
+    BindBuffer(this, allocIdx, blockIdx, oldBlockIdx);
+    if (toT2) {
+        this->listFlag[allocIdx] = 2;
+        this->t2.PushHead(allocIdx);
+    }
+    else {
+        this->listFlag[allocIdx] = 1;
+        this->t1.PushHead(allocIdx);
+    }
+    return allocIdx;
+}
+
+void ARCBufferPolicy::Reset() {
+    memset(this->listFlag, 0, this->bufferNum);
+    memset(this->ghostFlag, 0, this->bufferNum + 1);
+    this->ClearBuffers();
+    this->ghostIndex.Clear();
+    this->t1.Clear();
+    this->t2.Clear();
+    this->b1.Clear();
+    this->b2.Clear();
+
+    for (int i = 0; i <= this->bufferNum; ++i) {
+        this->ghostFree[i] = i;
+    }
+    this->ghostFreeTop = this->bufferNum + 1;
+
+    this->usedNum = 0;
+    this->target = 0;
+}
@@ -6,233 +6,2121 @@
  * @license GPL v3
  */
 #include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <new>
+#include <cstdint>
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
 
 #include "../../utils/Diagnose.h"
+#include "../../utils/Crc32c.h"
 #include "../../include/device/DeviceManager.h"
 #include "../../include/SuperBlock.h"
 #include "../../include/MoFSErrno.h"
 
-/// 映象文件的默认偏移量
-#define DEFAULT_OFFSET 256 * 1024
+/// 缓存锁的单次等待时间(毫秒)，超时后后台写回线程检查是否需要退出
+#define FLUSHER_LOCK_WAIT_MS 50
 
 DeviceManager DeviceManager::deviceManager;
 
+/**
+ * @brief 取得单调时钟的当前时间
+ * @return 毫秒数
+ */
+static long long NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 DeviceManager::DeviceManager() {
-    this->imgFilePtr = nullptr;
+    // 布局在SuperBlock加载或格式化时确定，在此之前按旧格式、空的inode区计算
+    this->SetLayout(0, 0);
+}
+
+void DeviceManager::SetCacheSize(long long blockCacheByte, int inodeCacheEntries) {
+    this->blockCacheByte = blockCacheByte;
+    this->inodeCacheEntries = inodeCacheEntries > 0 ? inodeCacheEntries : DEFAULT_INODE_BUFFER_NUM;
+}
+
+int DeviceManager::SetCachePolicy(const std::string &policyName) {
+    BufferPolicy* probe = BufferPolicy::PolicyFactory(policyName.c_str(), 1);
+    if (probe == nullptr) {
+        return -1;
+    }
+    delete probe;
+
+    this->cachePolicyName = policyName;
+    return 0;
+}
+
+int DeviceManager::SetDeviceType(const std::string &deviceName) {
+    // 内存盘由映象路径选择
+    if (deviceName == "mem") {
+        return -1;
+    }
+    BlockDevice* probe = BlockDevice::DeviceFactory(deviceName.c_str());
+    if (probe == nullptr) {
+        return -1;
+    }
+    delete probe;
+
+    this->deviceName = deviceName;
+    return 0;
+}
+
+int DeviceManager::SetAsyncIO(const std::string &asyncIOName) {
+    if (asyncIOName != "auto" && asyncIOName != "uring" && asyncIOName != "threads" && asyncIOName != "off") {
+        return -1;
+    }
+
+    this->asyncIOName = asyncIOName;
+    return 0;
+}
+
+void DeviceManager::SetDirtyThreshold(int dirtyRatio, int dirtyExpireMs) {
+    this->dirtyRatio = dirtyRatio > 0 && dirtyRatio <= 100 ? dirtyRatio : DEFAULT_DIRTY_RATIO;
+    this->dirtyExpireMs = dirtyExpireMs;
+}
+
+void DeviceManager::AllocCache() {
+    this->FreeCache();
+
+    // 缓存的字节数固定，块数随块大小变化
+    if (this->blockCacheByte > 0) {
+        this->blockBufferNum = (int) std::max((long long) MIN_BLOCK_BUFFER_NUM, this->blockCacheByte / this->blockSize);
+    }
+    else {
+        this->blockBufferNum = DEFAULT_BLOCK_BUFFER_NUM;
+    }
+
+    // 块按块号的哈希分到各个分片，每个分片独立加锁和置换，多个线程访问不同的块时互不阻塞
+    this->shardNum = std::min(MAX_CACHE_SHARD_NUM, std::max(1, this->blockBufferNum / MIN_SHARD_BUFFER_NUM));
+    this->shardBufferNum = this->blockBufferNum / this->shardNum;
+    this->shards = new CacheShard[this->shardNum];
+    for (int i = 0; i < this->shardNum; ++i) {
+        int firstBuffer = i * this->shardBufferNum;
+        int bufferNum = i == this->shardNum - 1 ? this->blockBufferNum - firstBuffer : this->shardBufferNum;
+        this->shards[i].firstBuffer = firstBuffer;
+        this->shards[i].manager = BufferPolicy::PolicyFactory(this->cachePolicyName.c_str(), bufferNum);
+    }
+    this->blockDirty = new bool[this->blockBufferNum];
+    this->blockDirtySince = new long long[this->blockBufferNum];
+    this->blockLoading = new bool[this->blockBufferNum];
+    this->blockHeld = new bool[this->blockBufferNum];
+    this->flusherStaging = new char[2 * FLUSHER_BATCH_SIZE * this->blockSize];
+
+    size_t blockBufferByte = (size_t) this->blockBufferNum * this->blockSize;
+#ifdef _WIN32
+    this->blockBuffer = (char*) malloc(blockBufferByte);
+#else
+    // 大块的缓存区使用匿名映射，物理页在第一次使用时才分配
+    void* mapAddr = mmap(nullptr, blockBufferByte, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    this->blockBuffer = mapAddr == MAP_FAILED ? nullptr : (char*) mapAddr;
+#endif
+
+    // inode按inode区的整块缓存，一次读写覆盖一块中的所有inode
+    int inodesPerBlock = this->InodesPerBlock();
+    this->inodeBufferNum = std::max(MIN_INODE_BLOCK_BUFFER_NUM, (this->inodeCacheEntries + inodesPerBlock - 1) / inodesPerBlock);
+    this->inodeBufferManager = BufferPolicy::PolicyFactory(this->cachePolicyName.c_str(), this->inodeBufferNum);
+    this->inodeBuffer = new char[(size_t) this->inodeBufferNum * this->blockSize];
+    this->inodeDirty = new bool[this->inodeBufferNum];
+    this->inodeDirtySince = new long long[this->inodeBufferNum];
+    this->inodeHeld = new bool[this->inodeBufferNum];
+
+    this->ResetCache();
+}
+
+void DeviceManager::FreeCache() {
+    if (this->shards != nullptr) {
+        for (int i = 0; i < this->shardNum; ++i) {
+            delete this->shards[i].manager;
+        }
+    }
+    delete[] this->shards;
+    delete[] this->blockDirty;
+    delete[] this->blockDirtySince;
+    delete[] this->blockLoading;
+    delete[] this->blockHeld;
+    delete[] this->flusherStaging;
+    if (this->blockBuffer != nullptr) {
+#ifdef _WIN32
+        free(this->blockBuffer);
+#else
+        munmap(this->blockBuffer, (size_t) this->blockBufferNum * this->blockSize);
+#endif
+    }
+
+    delete this->inodeBufferManager;
+    delete[] this->inodeBuffer;
+    delete[] this->inodeDirty;
+    delete[] this->inodeDirtySince;
+    delete[] this->inodeHeld;
+
+    this->shards = nullptr;
+    this->blockDirty = nullptr;
+    this->blockDirtySince = nullptr;
+    this->blockLoading = nullptr;
+    this->blockHeld = nullptr;
+    this->flusherStaging = nullptr;
+    this->blockBuffer = nullptr;
+    this->inodeBufferManager = nullptr;
+    this->inodeBuffer = nullptr;
+    this->inodeDirty = nullptr;
+    this->inodeDirtySince = nullptr;
+    this->inodeHeld = nullptr;
+}
+
+void DeviceManager::ResetCache() {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    // 写回线程正在写的旧数据不能落在新格式化的映象上
+    this->WaitFlusherIdle();
+    ++this->cacheGeneration;
+
+    for (int i = 0; i < this->shardNum; ++i) {
+        std::lock_guard<std::mutex> shardLock(this->shards[i].mutex);
+        this->shards[i].manager->Reset();
+        this->shards[i].writingBlocks.clear();
+    }
+    this->inodeBufferManager->Reset();
+
+    // 将两个dirty表置为false
+    memset(this->blockDirty, 0, this->blockBufferNum * sizeof(bool));
+    memset(this->blockLoading, 0, this->blockBufferNum * sizeof(bool));
+    memset(this->inodeDirty, 0, this->inodeBufferNum * sizeof(bool));
+    memset(this->blockHeld, 0, this->blockBufferNum * sizeof(bool));
+    memset(this->inodeHeld, 0, this->inodeBufferNum * sizeof(bool));
+    this->dirtyBlockCnt = 0;
+    this->dirtyInodeCnt = 0;
+}
+
+void DeviceManager::MarkBlockDirty(int bufferIdx) {
+    if (this->blockDirty[bufferIdx]) {
+        return;
+    }
+    this->blockDirty[bufferIdx] = true;
+    this->blockDirtySince[bufferIdx] = NowMs();
+    ++this->dirtyBlockCnt;
+
+    // 脏块超过比例，唤醒写回线程，不等到下一个周期
+    if (this->flusherThread.joinable() && (long long) this->dirtyBlockCnt * 100 > (long long) this->dirtyRatio * this->blockBufferNum) {
+        std::lock_guard<std::mutex> lock(this->flusherMutex);
+        if (!this->flushRequested) {
+            this->flushRequested = true;
+            this->flusherCond.notify_one();
+        }
+    }
+}
+
+void DeviceManager::MarkInodeDirty(int bufferIdx) {
+    if (this->inodeDirty[bufferIdx]) {
+        return;
+    }
+    this->inodeDirty[bufferIdx] = true;
+    this->inodeDirtySince[bufferIdx] = NowMs();
+    ++this->dirtyInodeCnt;
+}
+
+void DeviceManager::ClearBlockDirty(int bufferIdx) {
+    if (this->blockDirty[bufferIdx]) {
+        this->blockDirty[bufferIdx] = false;
+        --this->dirtyBlockCnt;
+    }
+}
+
+void DeviceManager::ClearInodeDirty(int bufferIdx) {
+    if (this->inodeDirty[bufferIdx]) {
+        this->inodeDirty[bufferIdx] = false;
+        --this->dirtyInodeCnt;
+    }
+}
+
+int DeviceManager::ReserveImage(long long imageSize) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    std::unique_lock<std::mutex> ioLock(this->ioMutex, std::defer_lock);
+    if (this->serialDevice) {
+        ioLock.lock();
+    }
+    if (-1 == this->device->Reserve(imageSize)) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    return 0;
+}
+
+long long DeviceManager::ImageSize() {
+    if (this->device == nullptr) {
+        return -1;
+    }
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    std::unique_lock<std::mutex> ioLock(this->ioMutex, std::defer_lock);
+    if (this->serialDevice) {
+        ioLock.lock();
+    }
+    return this->device->Size();
+}
+
+long long DeviceManager::DeviceRead(long long offset, void *buffer, long long length) {
+    long long readByteCnt;
+    {
+        // 耗时包括在ioMutex上的等待，是调用者实际经历的延迟
+        long long startUs = IOStats::NowUs();
+        std::unique_lock<std::mutex> lock(this->ioMutex, std::defer_lock);
+        if (this->serialDevice) {
+            lock.lock();
+        }
+        readByteCnt = this->device->Read(offset, buffer, length);
+        this->ioStats.RecordIO(IO_OP_READ, readByteCnt, startUs);
+    }
+
+    if (readByteCnt > 0 && !this->VerifyChecksums(offset, buffer, readByteCnt)) {
+        return -1;
+    }
+    return readByteCnt;
+}
+
+long long DeviceManager::DeviceWrite(long long offset, const void *buffer, long long length) {
+    this->UpdateChecksums(offset, buffer, length);
+    long long startUs = IOStats::NowUs();
+    std::unique_lock<std::mutex> lock(this->ioMutex, std::defer_lock);
+    if (this->serialDevice) {
+        lock.lock();
+    }
+    long long writeByteCnt = this->device->Write(offset, buffer, length);
+    this->ioStats.RecordIO(IO_OP_WRITE, writeByteCnt, startUs);
+    return writeByteCnt;
+}
+
+long long DeviceManager::DeviceWriteV(long long offset, const BlockIOVec *vectors, int vectorCnt) {
+    this->UpdateChecksumsV(offset, vectors, vectorCnt);
+    long long startUs = IOStats::NowUs();
+    std::unique_lock<std::mutex> lock(this->ioMutex, std::defer_lock);
+    if (this->serialDevice) {
+        lock.lock();
+    }
+    long long writeByteCnt = this->device->WriteV(offset, vectors, vectorCnt);
+    this->ioStats.RecordIO(IO_OP_WRITE, writeByteCnt, startUs);
+    return writeByteCnt;
+}
+
+int DeviceManager::SubmitIO(AsyncRequest *requests, int count) {
+    if (count == 0) {
+        return 0;
+    }
+    for (int i = 0; i < count && this->checksums != nullptr; ++i) {
+        if (requests[i].opcode != ASYNC_IO_WRITE) {
+            continue;
+        }
+        if (requests[i].vector != nullptr) {
+            this->UpdateChecksumsV(requests[i].offset, requests[i].vector, requests[i].vectorCnt);
+        }
+        else {
+            this->UpdateChecksums(requests[i].offset, requests[i].buffer, requests[i].length);
+        }
+    }
+
+    int failedCnt;
+    {
+        long long startUs = IOStats::NowUs();
+        std::lock_guard<std::mutex> lock(this->ioMutex);
+        failedCnt = this->asyncIO->SubmitAll(requests, count);
+        // 一批请求同时在途，每个请求的延迟都按整批完成的时间计
+        for (int i = 0; i < count; ++i) {
+            this->ioStats.RecordIO(requests[i].opcode == ASYNC_IO_READ ? IO_OP_READ : IO_OP_WRITE, requests[i].result, startUs);
+        }
+    }
+
+    // 校验不一致的读请求按失败处理，读入的缓存块会被作废
+    for (int i = 0; i < count && this->checksums != nullptr; ++i) {
+        if (requests[i].opcode != ASYNC_IO_READ || requests[i].result != requests[i].length) {
+            continue;
+        }
+        bool verified = requests[i].vector != nullptr ? this->VerifyChecksumsV(requests[i].offset, requests[i].vector, requests[i].vectorCnt)
+                                                       : this->VerifyChecksums(requests[i].offset, requests[i].buffer, requests[i].length);
+        if (!verified) {
+            requests[i].result = -1;
+            ++failedCnt;
+        }
+    }
+    return failedCnt;
+}
+
+char *DeviceManager::MappedRange(long long offset, long long length) {
+    if (offset < 0 || offset + length > this->device->MappedSize()) {
+        MoFSErrno = 16;
+        return nullptr;
+    }
+    return this->device->MappedData() + offset;
+}
+
+void DeviceManager::MarkMappedDirty(long long offset, long long length) {
+    this->RefreshMappedChecksums(offset, length);
+    if (this->mappedDirtyBegin == -1) {
+        this->mappedDirtySince = NowMs();
+    }
+    if (this->mappedDirtyBegin == -1 || offset < this->mappedDirtyBegin) {
+        this->mappedDirtyBegin = offset;
+    }
+    if (offset + length > this->mappedDirtyEnd) {
+        this->mappedDirtyEnd = offset + length;
+    }
+}
+
+void DeviceManager::OpenImage(const char *imagePath) {
+    // 打开映象文件，不存在时创建；内存盘不受--device影响
+    this->device = BlockDevice::DeviceFactory(BlockDevice::IsMemoryImage(imagePath) ? "mem" : this->deviceName.c_str());
+    if (-1 == this->device->Open(imagePath)) {
+        // 如果还是打不开，那肯定有问题
+        MoFSErrno = 19;
+        delete this->device;
+        this->device = nullptr;
+//        Diagnose::PrintError("Cannot open image : " + std::string(imagePath));
+        return;
+    }
+    this->mappedMode = this->device->IsMapped();
+    this->serialDevice = !this->device->IsConcurrent();
+
+    if (!this->mappedMode) {
+        this->asyncIO = AsyncIO::AsyncIOFactory(this->asyncIOName.c_str(), this->device);
+        if (this->asyncIO == nullptr) {
+            Diagnose::PrintError("Async I/O backend unavailable : " + this->asyncIOName + ", fallback to auto.");
+            this->asyncIO = AsyncIO::AsyncIOFactory("auto", this->device);
+        }
+    }
+
+    this->AllocCache();
+    if (this->blockBuffer == nullptr) {
+        MoFSErrno = 4;
+        return;
+    }
+
+    if (this->dirtyExpireMs > 0) {
+        this->flusherThread = std::thread(&DeviceManager::FlusherLoop, this);
+    }
+}
+
+DeviceManager::~DeviceManager() {
+    // 先停止写回线程，剩下的脏数据由下面统一写回
+    if (this->flusherThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(this->flusherMutex);
+            this->flusherStopping = true;
+        }
+        this->flusherCond.notify_all();
+        this->flusherThread.join();
+    }
+
+    if (this->device == nullptr || this->blockBuffer == nullptr) {
+        // 映象没有打开，也就没有缓存需要写回
+        delete this->asyncIO;
+        delete this->device;
+        this->FreeCache();
+        return;
+    }
+
+    // 将所有缓存的脏块写回文件，最后写校验和
+    this->FlushDirtyBlocks();
+    this->FlushDirtyInodes();
+    this->FlushChecksums();
+    this->DropChecksums();
+
+    delete this->asyncIO;
+    this->asyncIO = nullptr;
+    delete this->device;
+    this->device = nullptr;
+    this->FreeCache();
+}
+
+int DeviceManager::FlushDirtyBlocks() {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    this->WaitFlusherIdle();
+
+    if (this->mappedMode) {
+        // 修改已经在映射中，只需要把被修改的区域同步到映象。校验和先写进映射，随同一次msync落盘
+        if (-1 == this->FlushChecksums()) {
+            return -1;
+        }
+        if (this->mappedDirtyBegin != -1) {
+            long long startUs = IOStats::NowUs();
+            long long flushByteCnt = this->mappedDirtyEnd - this->mappedDirtyBegin;
+            if (-1 == this->device->Flush(this->mappedDirtyBegin, flushByteCnt)) {
+                MoFSErrno = 16;
+                return -1;
+            }
+            this->ioStats.RecordIO(IO_OP_WRITE, flushByteCnt, startUs);
+            this->mappedDirtyBegin = -1;
+            this->mappedDirtyEnd = 0;
+        }
+        return 0;
+    }
+
+    // 逐个分片取出脏块，固定后清除脏标记，写入期间不持有分片的锁。写入期间被再次修改的块重新变脏，留到下次。
+    // 等待日志提交的块不写回，原位置保持上一次提交时的内容
+    std::vector<std::pair<int, int>> dirtyBlocks; // (块号, 缓存块序号)
+    dirtyBlocks.reserve(this->dirtyBlockCnt);
+    for (int s = 0; s < this->shardNum; ++s) {
+        CacheShard& shard = this->shards[s];
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        for (int i = 0; i < shard.manager->bufferNum; ++i) {
+            int bufferIdx = shard.firstBuffer + i;
+            if (this->blockDirty[bufferIdx] && !this->blockLoading[bufferIdx] && !this->blockHeld[bufferIdx]) {
+                shard.manager->Pin(i);
+                this->ClearBlockDirty(bufferIdx);
+                dirtyBlocks.emplace_back(shard.manager->numberLinkList[i], bufferIdx);
+            }
+        }
+    }
+    return this->WritePinnedBlocks(dirtyBlocks);
+}
+
+int DeviceManager::FlushBlocks(const int *blockNos, int count) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->mappedMode) {
+        // 映射中只记录了被修改的区域，无法只写回其中的某些块
+        return this->FlushDirtyBlocks();
+    }
+    this->WaitFlusherIdle();
+
+    std::vector<std::pair<int, int>> dirtyBlocks; // (块号, 缓存块序号)
+    for (int i = 0; i < count; ++i) {
+        if (blockNos[i] <= 0) {
+            continue;
+        }
+        CacheShard& shard = this->ShardOf(blockNos[i]);
+        std::unique_lock<std::mutex> shardLock(shard.mutex);
+        // 本线程没有固定正在读入的缓存块，可以等待；正在换出或不经过缓存写入的块等它写完再同步
+        int bufferIdx = this->LookupBlock(shard, shardLock, blockNos[i], true);
+        if (bufferIdx >= 0 && this->blockDirty[bufferIdx] && !this->blockHeld[bufferIdx]) {
+            shard.manager->Pin(bufferIdx - shard.firstBuffer);
+            this->ClearBlockDirty(bufferIdx);
+            dirtyBlocks.emplace_back(blockNos[i], bufferIdx);
+        }
+    }
+    return this->WritePinnedBlocks(dirtyBlocks);
+}
+
+int DeviceManager::WritePinnedBlocks(std::vector<std::pair<int, int>> &dirtyBlocks) {
+    if (dirtyBlocks.empty()) {
+        return 0;
+    }
+
+    // 按块号排序，写入顺序与映象中的位置一致，块号连续的块不论在缓存区的哪里都可以合并为一次聚集写
+    std::sort(dirtyBlocks.begin(), dirtyBlocks.end());
+
+    std::vector<BlockIOVec> vectors(dirtyBlocks.size());
+    std::vector<bool> blockFailed(dirtyBlocks.size());
+    AsyncRequest requests[ASYNC_IO_QUEUE_DEPTH];
+    int requestCnt = 0;
+    bool anyFailed = false;
+
+    int dirtyCnt = (int) dirtyBlocks.size();
+    IOStats::Count(this->ioStats.blockWriteBacks, dirtyCnt);
+    int runStart = 0;
+    while (runStart < dirtyCnt) {
+        int runLength = 1;
+        while (runStart + runLength < dirtyCnt && runLength < ASYNC_IO_MAX_VECTOR
+               && dirtyBlocks[runStart + runLength].first == dirtyBlocks[runStart].first + runLength) {
+            ++runLength;
+        }
+
+        for (int i = runStart; i < runStart + runLength; ++i) {
+            vectors[i] = {this->BlockBufferAt(dirtyBlocks[i].second), (size_t) this->blockSize};
+        }
+        requests[requestCnt] = {ASYNC_IO_WRITE, this->BlockOffset(dirtyBlocks[runStart].first), nullptr,
+                                (long long) runLength * this->blockSize, -1, runStart, &vectors[runStart], runLength};
+        ++requestCnt;
+        runStart += runLength;
+
+        // 各次写之间互不依赖，攒满一批后同时提交
+        if (requestCnt == ASYNC_IO_QUEUE_DEPTH || runStart == dirtyCnt) {
+            if (this->SubmitIO(requests, requestCnt) > 0) {
+                anyFailed = true;
+                for (int i = 0; i < requestCnt; ++i) {
+                    if (requests[i].result == requests[i].length) {
+                        continue;
+                    }
+                    for (int j = 0; j < requests[i].vectorCnt; ++j) {
+                        blockFailed[requests[i].tag + j] = true;
+                    }
+                }
+            }
+            requestCnt = 0;
+        }
+    }
+
+    for (int i = 0; i < dirtyCnt; ++i) {
+        int bufferIdx = dirtyBlocks[i].second;
+        CacheShard& shard = this->ShardOfBuffer(bufferIdx);
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        if (blockFailed[i]) {
+            // 写失败的块仍然是脏的
+            this->MarkBlockDirty(bufferIdx);
+        }
+        shard.manager->Unpin(bufferIdx - shard.firstBuffer);
+    }
+
+    if (anyFailed) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    return 0;
+}
+
+int DeviceManager::FlushDirtyInodes() {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    this->WaitFlusherIdle();
+
+    int* numberList = this->inodeBufferManager->numberLinkList;
+    std::vector<int> dirtyIdx;
+    dirtyIdx.reserve(this->dirtyInodeCnt);
+    for (int i = 0; i < this->inodeBufferNum; ++i) {
+        if (this->inodeDirty[i] && !this->inodeHeld[i]) {
+            dirtyIdx.push_back(i);
+        }
+    }
+    std::sort(dirtyIdx.begin(), dirtyIdx.end(), [numberList](int a, int b) { return numberList[a] < numberList[b]; });
+
+    // inode区块在映象中顺序存放，块号相邻的块可以一次写入
+    std::vector<BlockIOVec> vectors(dirtyIdx.size());
+    bool anyFailed = false;
+    int dirtyCnt = (int) dirtyIdx.size();
+    int runStart = 0;
+    while (runStart < dirtyCnt) {
+        int runLength = 1;
+        while (runStart + runLength < dirtyCnt && runLength < ASYNC_IO_MAX_VECTOR
+               && numberList[dirtyIdx[runStart + runLength]] == numberList[dirtyIdx[runStart]] + runLength) {
+            ++runLength;
+        }
+
+        for (int i = runStart; i < runStart + runLength; ++i) {
+            vectors[i] = {this->InodeBlockAt(dirtyIdx[i]), (size_t) this->blockSize};
+        }
+        if (0 == this->WriteInodeBlocks(numberList[dirtyIdx[runStart]], &vectors[runStart], runLength)) {
+            for (int i = runStart; i < runStart + runLength; ++i) {
+                this->ClearInodeDirty(dirtyIdx[i]);
+            }
+        }
+        else {
+            anyFailed = true;
+        }
+        runStart += runLength;
+    }
+
+    if (anyFailed) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    return 0;
+}
+
+int DeviceManager::FlushInode(int inodeNo) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->mappedMode) {
+        // inode直接写在映射中，由SyncDevice一起msync
+        return 1;
+    }
+    this->WaitFlusherIdle();
+
+    int inodeBlockNo = inodeNo / this->InodesPerBlock();
+    int bufferIdx = this->inodeBufferManager->GetBufferedIndex(inodeBlockNo);
+    if (bufferIdx == -1 || !this->inodeDirty[bufferIdx] || this->inodeHeld[bufferIdx]) {
+        // 不在缓存中的inode要么已经写回，要么是绕过缓存直接写入的；等待日志提交的由日志负责
+        return 0;
+    }
+    if (-1 == this->WriteInodeToFile(bufferIdx, inodeBlockNo)) {
+        return -1;
+    }
+    this->ClearInodeDirty(bufferIdx);
+    return 1;
+}
+
+int DeviceManager::SyncDevice() {
+    // 已经写入的块的校验和随它们一起落盘；mmap模式下修改还在映射中，先用msync交给映象
+    if (-1 == (this->mappedMode ? this->FlushDirtyBlocks() : this->FlushChecksums())) {
+        return -1;
+    }
+
+    long long startUs = IOStats::NowUs();
+    std::unique_lock<std::mutex> ioLock(this->ioMutex, std::defer_lock);
+    if (this->serialDevice) {
+        ioLock.lock();
+    }
+    if (-1 == this->device->Sync()) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    this->ioStats.RecordIO(IO_OP_SYNC, 0, startUs);
+    return 0;
+}
+
+int DeviceManager::SetupChecksums(int dataBlockNum, int inodeBlockNum, bool load) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    this->WaitFlusherIdle();
+    this->DropChecksums();
+
+    int entryNum = dataBlockNum + inodeBlockNum;
+    long long tableOffset = (this->BlockOffset(dataBlockNum) + LAYOUT_ALIGN - 1) / LAYOUT_ALIGN * LAYOUT_ALIGN;
+    int pageNum = (entryNum + CHECKSUM_ENTRIES_PER_PAGE - 1) / CHECKSUM_ENTRIES_PER_PAGE;
+    long long tableByteCnt = (long long) pageNum * CHECKSUM_PAGE_SIZE;
+    if (this->mappedMode && -1 == this->ReserveImage(tableOffset + tableByteCnt)) {
+        return -1;
+    }
+
+    std::atomic<uint32_t>* table = new (std::nothrow) std::atomic<uint32_t>[(size_t) pageNum * CHECKSUM_ENTRIES_PER_PAGE]();
+    std::atomic<bool>* pageDirty = new (std::nothrow) std::atomic<bool>[pageNum]();
+    if (table == nullptr || pageDirty == nullptr) {
+        delete[] table;
+        delete[] pageDirty;
+        MoFSErrno = 4;
+        return -1;
+    }
+
+    if (load) {
+        // 映象可能只延伸到写入过的最后一块，校验和区没写过的部分按0处理
+        std::vector<uint32_t> stored((size_t) pageNum * CHECKSUM_ENTRIES_PER_PAGE, 0);
+        if (this->DeviceRead(tableOffset, stored.data(), tableByteCnt) < 0) {
+            delete[] table;
+            delete[] pageDirty;
+            MoFSErrno = 16;
+            return -1;
+        }
+        for (int i = 0; i < entryNum; ++i) {
+            table[i].store(stored[i], std::memory_order_relaxed);
+        }
+    }
+    else {
+        for (int i = 0; i < pageNum; ++i) {
+            pageDirty[i].store(true, std::memory_order_relaxed);
+        }
+    }
+
+    this->checksumOffset = tableOffset;
+    this->checksumDataBlockNum = dataBlockNum;
+    this->checksumEntryNum = entryNum;
+    this->checksumPageDirty = pageDirty;
+    this->checksums = table;
+    return 0;
+}
+
+void DeviceManager::DropChecksums() {
+    delete[] this->checksums;
+    delete[] this->checksumPageDirty;
+    this->checksums = nullptr;
+    this->checksumPageDirty = nullptr;
+    this->checksumDataBlockNum = 0;
+    this->checksumEntryNum = 0;
+    this->checksumOffset = 0;
+}
+
+int DeviceManager::FlushChecksums() {
+    if (this->checksums == nullptr) {
+        return 0;
+    }
+    // mmap模式下写入映射后要记录修改区域，与前台一样先取缓存锁
+    std::unique_lock<std::recursive_timed_mutex> cacheLock(this->cacheMutex, std::defer_lock);
+    if (this->mappedMode) {
+        cacheLock.lock();
+    }
+    std::lock_guard<std::mutex> lock(this->checksumMutex);
+
+    int pageNum = (this->checksumEntryNum + CHECKSUM_ENTRIES_PER_PAGE - 1) / CHECKSUM_ENTRIES_PER_PAGE;
+    std::vector<uint32_t> staging;
+    int page = 0;
+    while (page < pageNum) {
+        if (!this->checksumPageDirty[page].exchange(false, std::memory_order_acquire)) {
+            ++page;
+            continue;
+        }
+
+        // 连续的脏页一次写入
+        int runStart = page;
+        ++page;
+        while (page < pageNum && this->checksumPageDirty[page].exchange(false, std::memory_order_acquire)) {
+            ++page;
+        }
+        staging.resize((size_t) (page - runStart) * CHECKSUM_ENTRIES_PER_PAGE);
+        for (size_t i = 0; i < staging.size(); ++i) {
+            staging[i] = this->checksums[(size_t) runStart * CHECKSUM_ENTRIES_PER_PAGE + i].load(std::memory_order_relaxed);
+        }
+
+        long long runOffset = this->checksumOffset + (long long) runStart * CHECKSUM_PAGE_SIZE;
+        long long runByteCnt = (long long) staging.size() * sizeof(uint32_t);
+        if (this->DeviceWrite(runOffset, staging.data(), runByteCnt) != runByteCnt) {
+            for (int i = runStart; i < page; ++i) {
+                this->checksumPageDirty[i].store(true, std::memory_order_relaxed);
+            }
+            MoFSErrno = 16;
+            return -1;
+        }
+        if (this->mappedMode) {
+            this->MarkMappedDirty(runOffset, runByteCnt);
+        }
+    }
+    return 0;
+}
+
+int DeviceManager::ChecksumRange(long long offset, long long length, int &firstEntry, long long &firstOffset) const {
+    if (this->checksums == nullptr || length <= 0) {
+        return 0;
+    }
+
+    long long areaOffset;
+    int areaFirstEntry;
+    int areaBlockNum;
+    if (offset >= this->blockContentOffset) {
+        areaOffset = this->blockContentOffset;
+        areaFirstEntry = 0;
+        areaBlockNum = this->checksumDataBlockNum;
+    }
+    else if (offset >= this->inodeTableOffset) {
+        areaOffset = this->inodeTableOffset;
+        areaFirstEntry = this->checksumDataBlockNum;
+        areaBlockNum = this->checksumEntryNum - this->checksumDataBlockNum;
+    }
+    else {
+        return 0;
+    }
+
+    long long firstBlock = (offset - areaOffset) / this->blockSize;
+    long long lastBlock = std::min((offset + length - 1 - areaOffset) / this->blockSize, (long long) areaBlockNum - 1);
+    if (firstBlock > lastBlock) {
+        return 0;
+    }
+    firstEntry = areaFirstEntry + (int) firstBlock;
+    firstOffset = areaOffset + firstBlock * this->blockSize;
+    return (int) (lastBlock - firstBlock + 1);
+}
+
+void DeviceManager::UpdateChecksums(long long offset, const void *data, long long length) {
+    int firstEntry;
+    long long blockOffset;
+    int blockCnt = this->ChecksumRange(offset, length, firstEntry, blockOffset);
+    for (int i = 0; i < blockCnt; ++i, blockOffset += this->blockSize) {
+        uint32_t crc = 0;
+        if (blockOffset >= offset && blockOffset + this->blockSize <= offset + length) {
+            crc = Crc32c::Compute((const char*) data + (blockOffset - offset), this->blockSize);
+        }
+        int entry = firstEntry + i;
+        this->checksums[entry].store(crc, std::memory_order_relaxed);
+        this->checksumPageDirty[entry / CHECKSUM_ENTRIES_PER_PAGE].store(true, std::memory_order_release);
+    }
+}
+
+void DeviceManager::UpdateChecksumsV(long long offset, const BlockIOVec *vectors, int vectorCnt) {
+    for (int i = 0; i < vectorCnt && this->checksums != nullptr; ++i) {
+        this->UpdateChecksums(offset, vectors[i].base, (long long) vectors[i].length);
+        offset += (long long) vectors[i].length;
+    }
+}
+
+bool DeviceManager::VerifyChecksums(long long offset, const void *data, long long length) {
+    int firstEntry;
+    long long blockOffset;
+    int blockCnt = this->ChecksumRange(offset, length, firstEntry, blockOffset);
+    for (int i = 0; i < blockCnt; ++i, blockOffset += this->blockSize) {
+        uint32_t stored = this->checksums[firstEntry + i].load(std::memory_order_relaxed);
+        if (stored == 0 || blockOffset < offset || blockOffset + this->blockSize > offset + length) {
+            continue;
+        }
+        IOStats::Count(this->ioStats.checksumVerifies);
+        if (Crc32c::Compute((const char*) data + (blockOffset - offset), this->blockSize) != stored) {
+            IOStats::Count(this->ioStats.checksumErrors);
+            int entry = firstEntry + i;
+            Diagnose::PrintError(entry < this->checksumDataBlockNum ? "Checksum mismatch : block " + std::to_string(entry)
+                                                                     : "Checksum mismatch : inode block " + std::to_string(entry - this->checksumDataBlockNum));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeviceManager::VerifyChecksumsV(long long offset, const BlockIOVec *vectors, int vectorCnt) {
+    for (int i = 0; i < vectorCnt && this->checksums != nullptr; ++i) {
+        if (!this->VerifyChecksums(offset, vectors[i].base, (long long) vectors[i].length)) {
+            return false;
+        }
+        offset += (long long) vectors[i].length;
+    }
+    return true;
+}
+
+void DeviceManager::RefreshMappedChecksums(long long offset, long long length) {
+    int firstEntry;
+    long long blockOffset;
+    int blockCnt = this->ChecksumRange(offset, length, firstEntry, blockOffset);
+    if (blockCnt > 0) {
+        this->UpdateChecksums(blockOffset, this->device->MappedData() + blockOffset, (long long) blockCnt * this->blockSize);
+    }
+}
+
+void DeviceManager::GetStats(MoFSStats &stats) {
+    stats.blockSize = this->blockSize;
+    stats.blockBufferNum = this->mappedMode ? 0 : this->blockBufferNum;
+    stats.dirtyBlockNum = this->dirtyBlockCnt;
+    stats.inodeBufferNum = this->mappedMode ? 0 : this->inodeBufferNum;
+    stats.checksumEnabled = this->checksums != nullptr;
+    this->ioStats.Snapshot(stats);
+}
+
+void DeviceManager::ResetStats() {
+    this->ioStats.Reset();
+}
+
+bool DeviceManager::WriteBackEvicted(int bufferIdx, int blockNo) {
+    // 调用时不持有任何分片的锁。被换出的块已经不在哈希索引中，向两侧查找仍在缓存中的相邻脏块，
+    // 逐个在所属分片的锁内固定、清除脏标记并复制到暂存区。正在读入或被固定的块可能正在被修改，都要跳过。
+    // 固定只能防止换出，放开锁后前台仍会写入这些缓存块，所以写盘时用暂存区中的副本
+    static thread_local std::vector<char> evictStaging;
+    int neighbourIdx[2 * EVICT_CLUSTER_BLOCKS];
+    int lowerCnt = 0;
+    int upperCnt = 0;
+    for (int direction = -1; direction <= 1; direction += 2) {
+        int& cnt = direction < 0 ? lowerCnt : upperCnt;
+        int* idxList = direction < 0 ? neighbourIdx : neighbourIdx + EVICT_CLUSTER_BLOCKS;
+        while (cnt < EVICT_CLUSTER_BLOCKS) {
+            int neighbourNo = blockNo + direction * (cnt + 1);
+            if (neighbourNo < 0) {
+                break;
+            }
+
+            CacheShard& shard = this->ShardOf(neighbourNo);
+            std::lock_guard<std::mutex> shardLock(shard.mutex);
+            int localIdx = shard.manager->hashIndex.Find(neighbourNo);
+            int idx = shard.firstBuffer + localIdx;
+            if (localIdx < 0 || idx == bufferIdx || !this->blockDirty[idx] || this->blockLoading[idx] || shard.manager->IsPinned(localIdx)) {
+                break;
+            }
+            if (evictStaging.size() < (size_t) 2 * EVICT_CLUSTER_BLOCKS * this->blockSize) {
+                evictStaging.resize((size_t) 2 * EVICT_CLUSTER_BLOCKS * this->blockSize);
+            }
+            shard.manager->Pin(localIdx);
+            this->ClearBlockDirty(idx);
+            idxList[cnt] = idx;
+            size_t slot = (size_t) (idxList - neighbourIdx) + cnt;
+            memcpy(evictStaging.data() + slot * this->blockSize, this->BlockBufferAt(idx), this->blockSize);
+            ++cnt;
+        }
+    }
+
+    IOStats::Count(this->ioStats.blockWriteBacks, 1 + lowerCnt + upperCnt);
+    if (lowerCnt == 0 && upperCnt == 0) {
+        return this->DeviceWrite(this->BlockOffset(blockNo), this->BlockBufferAt(bufferIdx), this->blockSize) == (unsigned int) this->blockSize;
+    }
+
+    BlockIOVec vectors[2 * EVICT_CLUSTER_BLOCKS + 1];
+    int vectorCnt = 0;
+    for (int i = lowerCnt - 1; i >= 0; --i) {
+        vectors[vectorCnt++] = {evictStaging.data() + (size_t) i * this->blockSize, (size_t) this->blockSize};
+    }
+    vectors[vectorCnt++] = {this->BlockBufferAt(bufferIdx), (size_t) this->blockSize};
+    for (int i = 0; i < upperCnt; ++i) {
+        vectors[vectorCnt++] = {evictStaging.data() + (size_t) (EVICT_CLUSTER_BLOCKS + i) * this->blockSize, (size_t) this->blockSize};
+    }
+
+    bool failed = this->DeviceWriteV(this->BlockOffset(blockNo - lowerCnt), vectors, vectorCnt) != (long long) vectorCnt * this->blockSize;
+
+    // 相邻的块已经写回，之后被换出时不需要再写；写失败的重新标记为脏
+    for (int i = 0; i < 2 * EVICT_CLUSTER_BLOCKS; ++i) {
+        if ((i < EVICT_CLUSTER_BLOCKS && i >= lowerCnt) || i >= EVICT_CLUSTER_BLOCKS + upperCnt) {
+            continue;
+        }
+        CacheShard& shard = this->ShardOfBuffer(neighbourIdx[i]);
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        if (failed) {
+            this->MarkBlockDirty(neighbourIdx[i]);
+        }
+        shard.manager->Unpin(neighbourIdx[i] - shard.firstBuffer);
+    }
+    return !failed;
+}
+
+void DeviceManager::WaitFlusherIdle() {
+    std::unique_lock<std::mutex> lock(this->flusherMutex);
+    this->flusherIdleCond.wait(lock, [this] { return !this->flusherWriting; });
+}
+
+bool DeviceManager::LockForFlusher() {
+    // 信号处理函数可能在主线程持有缓存锁时调用exit，析构函数会等待写回线程退出，不能无限期地等锁
+    while (!this->cacheMutex.try_lock_for(std::chrono::milliseconds(FLUSHER_LOCK_WAIT_MS))) {
+        std::lock_guard<std::mutex> lock(this->flusherMutex);
+        if (this->flusherStopping) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DeviceManager::FlusherLoop() {
+#ifndef _WIN32
+    // 信号只交给主线程处理
+    sigset_t signalSet;
+    sigfillset(&signalSet);
+    pthread_sigmask(SIG_BLOCK, &signalSet, nullptr);
+#endif
+
+    // 每隔半个过期时间检查一次，最长不超过1秒
+    int intervalMs = this->dirtyExpireMs / 2 < 1000 ? this->dirtyExpireMs / 2 : 1000;
+    if (intervalMs < 1) {
+        intervalMs = 1;
+    }
+
+    while (true) {
+        bool draining;
+        {
+            std::unique_lock<std::mutex> lock(this->flusherMutex);
+            this->flusherCond.wait_for(lock, std::chrono::milliseconds(intervalMs),
+                                       [this] { return this->flusherStopping || this->flushRequested; });
+            if (this->flusherStopping) {
+                return;
+            }
+            draining = this->flushRequested;
+            this->flushRequested = false;
+        }
+
+        while (this->WriteBackBatch(draining) > 0) {
+        }
+    }
+}
+
+int DeviceManager::WriteBackBatch(bool draining) {
+    if (!this->LockForFlusher()) {
+        return 0;
+    }
+
+    long long now = NowMs();
+    if (this->mappedMode) {
+        // 映射中的修改只需要msync
+        if (this->mappedDirtyBegin != -1 && now - this->mappedDirtySince >= this->dirtyExpireMs) {
+            this->FlushDirtyBlocks();
+        }
+        this->cacheMutex.unlock();
+        return 0;
+    }
+
+    // 超过比例时写回到比例的一半以下，否则只写回过期的
+    long long drainTarget = (long long) this->dirtyRatio * this->blockBufferNum / 200;
+    if ((long long) this->dirtyBlockCnt * 100 > (long long) this->dirtyRatio * this->blockBufferNum) {
+        draining = true;
+    }
+
+    // 逐个分片挑选，选中的块固定并清除脏标记
+    std::pair<int, int> blocks[FLUSHER_BATCH_SIZE]; // (块号, 缓存块序号)
+    int blockCnt = 0;
+    for (int s = 0; s < this->shardNum && blockCnt < FLUSHER_BATCH_SIZE; ++s) {
+        CacheShard& shard = this->shards[s];
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        for (int i = 0; i < shard.manager->bufferNum && blockCnt < FLUSHER_BATCH_SIZE; ++i) {
+            // 被固定的块正在被前台直接修改，等它放回后再写
+            int bufferIdx = shard.firstBuffer + i;
+            if (!this->blockDirty[bufferIdx] || this->blockLoading[bufferIdx] || shard.manager->IsPinned(i)) {
+                continue;
+            }
+            bool expired = now - this->blockDirtySince[bufferIdx] >= this->dirtyExpireMs;
+            if (expired || (draining && this->dirtyBlockCnt > drainTarget)) {
+                shard.manager->Pin(i);
+                this->ClearBlockDirty(bufferIdx);
+                blocks[blockCnt] = {shard.manager->numberLinkList[i], bufferIdx};
+                ++blockCnt;
+            }
+        }
+    }
+
+    // 按块号排序后复制到暂存区，块号连续的块在暂存区中也连续，可以一次写入
+    std::sort(blocks, blocks + blockCnt);
+    for (int i = 0; i < blockCnt; ++i) {
+        CacheShard& shard = this->ShardOfBuffer(blocks[i].second);
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        memcpy(this->flusherStaging + (size_t) i * this->blockSize, this->BlockBufferAt(blocks[i].second), this->blockSize);
+    }
+
+    int* inodeNumberList = inodeBufferManager->numberLinkList;
+    int inodeIdx[FLUSHER_BATCH_SIZE];
+    int inodeCnt = 0;
+    for (int i = 0; i < this->inodeBufferNum && inodeCnt < FLUSHER_BATCH_SIZE && this->dirtyInodeCnt > 0; ++i) {
+        if (this->inodeDirty[i] && !inodeBufferManager->IsPinned(i) && now - this->inodeDirtySince[i] >= this->dirtyExpireMs) {
+            inodeIdx[inodeCnt] = i;
+            ++inodeCnt;
+        }
+    }
+
+    std::sort(inodeIdx, inodeIdx + inodeCnt, [inodeNumberList](int a, int b) { return inodeNumberList[a] < inodeNumberList[b]; });
+    char* inodeStaging = this->flusherStaging + (size_t) FLUSHER_BATCH_SIZE * this->blockSize;
+    int inodeBlockNo[FLUSHER_BATCH_SIZE];
+    for (int i = 0; i < inodeCnt; ++i) {
+        memcpy(inodeStaging + (size_t) i * this->blockSize, this->InodeBlockAt(inodeIdx[i]), this->blockSize);
+        inodeBufferManager->Pin(inodeIdx[i]);
+        this->ClearInodeDirty(inodeIdx[i]);
+        inodeBlockNo[i] = inodeNumberList[inodeIdx[i]];
+    }
+
+    if (blockCnt == 0 && inodeCnt == 0) {
+        this->cacheMutex.unlock();
+        return 0;
+    }
+
+    int generation = this->cacheGeneration;
+    long long contentOffset = this->BlockOffset(0);
+    IOStats::Count(this->ioStats.blockWriteBacks, blockCnt);
+    {
+        std::lock_guard<std::mutex> lock(this->flusherMutex);
+        this->flusherWriting = true;
+    }
+
+    // 数据已经在暂存区中，写入期间放开缓存锁，前台不必等待；不支持并发读写的设备由ioMutex串行化
+    this->cacheMutex.unlock();
+
+    bool blockFailed[FLUSHER_BATCH_SIZE];
+    bool inodeFailed[FLUSHER_BATCH_SIZE];
+    bool anyFailed = false;
+    int runStart = 0;
+    while (runStart < blockCnt) {
+        int runLength = 1;
+        while (runStart + runLength < blockCnt && blocks[runStart + runLength].first == blocks[runStart].first + runLength) {
+            ++runLength;
+        }
+
+        long long runByteCnt = (long long) runLength * this->blockSize;
+        bool failed = this->DeviceWrite(contentOffset + (long long) blocks[runStart].first * this->blockSize,
+                                        this->flusherStaging + (size_t) runStart * this->blockSize, runByteCnt) != runByteCnt;
+        for (int i = 0; i < runLength; ++i) {
+            blockFailed[runStart + i] = failed;
+        }
+        anyFailed = anyFailed || failed;
+        runStart += runLength;
+    }
+
+    runStart = 0;
+    while (runStart < inodeCnt) {
+        int runLength = 1;
+        while (runStart + runLength < inodeCnt && inodeBlockNo[runStart + runLength] == inodeBlockNo[runStart] + runLength) {
+            ++runLength;
+        }
+
+        BlockIOVec runVector = {inodeStaging + (size_t) runStart * this->blockSize, (size_t) runLength * this->blockSize};
+        bool failed = -1 == this->WriteInodeBlocks(inodeBlockNo[runStart], &runVector, 1);
+        for (int i = 0; i < runLength; ++i) {
+            inodeFailed[runStart + i] = failed;
+        }
+        anyFailed = anyFailed || failed;
+        runStart += runLength;
+    }
+
+    // 这批块的校验和也在锁外写回，SetupChecksums会等这批写完再替换校验和
+    anyFailed = -1 == this->FlushChecksums() || anyFailed;
+
+    {
+        std::lock_guard<std::mutex> lock(this->flusherMutex);
+        this->flusherWriting = false;
+    }
+    this->flusherIdleCond.notify_all();
+
+    if (!this->LockForFlusher()) {
+        return 0;
+    }
+
+    // ResetCache之后固定计数已经清零，缓存中也不再是这批数据
+    if (generation == this->cacheGeneration) {
+        for (int i = 0; i < blockCnt; ++i) {
+            CacheShard& shard = this->ShardOfBuffer(blocks[i].second);
+            std::lock_guard<std::mutex> shardLock(shard.mutex);
+            if (blockFailed[i]) {
+                // 写失败的块重新标记为脏，留到以后再写
+                this->MarkBlockDirty(blocks[i].second);
+            }
+            shard.manager->Unpin(blocks[i].second - shard.firstBuffer);
+        }
+        for (int i = 0; i < inodeCnt; ++i) {
+            if (inodeFailed[i]) {
+                this->MarkInodeDirty(inodeIdx[i]);
+            }
+            inodeBufferManager->Unpin(inodeIdx[i]);
+        }
+    }
+    this->cacheMutex.unlock();
+
+    if (anyFailed) {
+        Diagnose::PrintError("Background write back failed.");
+        return 0;
+    }
+    return blockCnt + inodeCnt;
+}
+
+void DeviceManager::SetLayout(int blockSize, int inodeBlockNum) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    int newBlockSize = blockSize == 0 ? LEGACY_BLOCK_SIZE : blockSize;
+
+    if (newBlockSize != this->blockSize && this->blockBuffer != nullptr) {
+        // 缓存中的块按旧的块大小组织，先写回再按新的块大小重新分配
+        this->FlushDirtyBlocks();
+        this->FlushDirtyInodes();
+        this->FreeCache();
+        this->blockSize = newBlockSize;
+        this->AllocCache();
+    }
+    this->blockSize = newBlockSize;
+
+    if (blockSize == 0) {
+        // 旧格式：inode区从SuperBlock内部开始，block区紧接inode区
+        this->inodeTableOffset = HEADER_SIG_SIZE + 64;
+        this->blockContentOffset = HEADER_SIG_SIZE + (long long) inodeBlockNum * LEGACY_BLOCK_SIZE + sizeof(SuperBlock);
+    }
+    else {
+        this->inodeTableOffset = HEADER_SIG_SIZE + SUPER_BLOCK_AREA_SIZE;
+        long long inodeTableEnd = this->inodeTableOffset + (long long) inodeBlockNum * blockSize;
+        this->blockContentOffset = (inodeTableEnd + LAYOUT_ALIGN - 1) / LAYOUT_ALIGN * LAYOUT_ALIGN;
+    }
+}
+
+int DeviceManager::LookupBlock(CacheShard &shard, std::unique_lock<std::mutex> &lock, int blockNo, bool wait) {
+    while (true) {
+        // 正在不经过缓存写入的块，写完之前读入缓存会得到旧的内容
+        if (!this->IsWritingThrough(shard, blockNo)) {
+            int localIdx = shard.manager->GetBufferedIndex(blockNo);
+            if (localIdx == -1) {
+                return -1;
+            }
+            if (!this->blockLoading[shard.firstBuffer + localIdx]) {
+                return shard.firstBuffer + localIdx;
+            }
+        }
+
+        if (!wait) {
+            return -2;
+        }
+        shard.ioCond.wait(lock);
+    }
+}
+
+int DeviceManager::AllocBlockBuffer(CacheShard &shard, std::unique_lock<std::mutex> &lock, int blockNo) {
+    int swapBlockNo = -1;
+    int localIdx = shard.manager->AllocNewBuffer(blockNo, swapBlockNo);
+    if (localIdx == -1) {
+        MoFSErrno = 4;
+        return -1;
+    }
 
-    // 先给SuperBlock 和 inode区分配 256KB。这个值可以在SuperBlock加载时被修改。
-    this->SetOffset(DEFAULT_OFFSET + HEADER_SIG_SIZE);
+    // 新块已经在哈希索引中，读入完成之前其他线程查到它时等待
+    int bufferIdx = shard.firstBuffer + localIdx;
+    shard.manager->Pin(localIdx);
+    this->blockLoading[bufferIdx] = true;
+    if (swapBlockNo != -1) {
+        IOStats::Count(this->ioStats.blockEvictions);
+    }
 
-    // 将两个dirty表置为false
-    memset(this->blockDirty, 0, BLOCK_BUFFER_NUM * sizeof(bool));
-    memset(this->inodeDirty, 0, INODE_BUFFER_NUM * sizeof(bool));
+    if (swapBlockNo != -1 && this->blockDirty[bufferIdx]) {
+        // 有块因为新的缓存块需求而被释放，且该块脏，需要写回磁盘。
+        // 写回期间放开分片的锁，被换出的块登记为正在写入，写完之前其他线程不能读入它
+        this->ClearBlockDirty(bufferIdx);
+        this->BeginWriteThrough(shard, swapBlockNo);
+        lock.unlock();
+        bool written = this->WriteBackEvicted(bufferIdx, swapBlockNo);
+        if (!written) {
+            // 写失败时缓存块仍保存被换出的块，改回对应它并保持为脏，本次分配失败。
+            // 解除写入登记之前恢复，等待它的线程随后直接命中
+            lock.lock();
+            shard.manager->Restore(localIdx, swapBlockNo);
+            this->MarkBlockDirty(bufferIdx);
+            this->blockLoading[bufferIdx] = false;
+            shard.manager->Unpin(localIdx);
+            lock.unlock();
+        }
+        this->EndWriteThrough(swapBlockNo);
+        lock.lock();
+        if (!written) {
+            Diagnose::PrintError("Cannot write back evicted block " + std::to_string(swapBlockNo) + ".");
+            MoFSErrno = 16;
+            return -1;
+        }
+    }
+    this->ClearBlockDirty(bufferIdx);
+    return bufferIdx;
 }
 
-void DeviceManager::OpenImage(const char *imagePath) {
-    // 尝试打开映象文件
-    this->imgFilePtr = fopen(imagePath, "rb+");
-    // 如果不存在，创建一个
-    if (this->imgFilePtr == nullptr) {
-        this->imgFilePtr = fopen(imagePath, "wb+");
+void DeviceManager::FinishLoading(CacheShard &shard, int bufferIdx, bool succeeded) {
+    this->blockLoading[bufferIdx] = false;
+    if (!succeeded) {
+        // 只缓存读满的，不过不出意外都是读满的
+        shard.manager->Invalidate(bufferIdx - shard.firstBuffer);
+    }
+    shard.ioCond.notify_all();
+}
+
+void DeviceManager::BeginWriteThrough(CacheShard &shard, int blockNo) {
+    shard.writingBlocks.push_back(blockNo);
+}
+
+bool DeviceManager::IsWritingThrough(CacheShard &shard, int blockNo) {
+    return std::find(shard.writingBlocks.begin(), shard.writingBlocks.end(), blockNo) != shard.writingBlocks.end();
+}
+
+void DeviceManager::EndWriteThrough(int blockNo) {
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // 同一块可能被多个线程同时登记，每次只移除一个
+    shard.writingBlocks.erase(std::find(shard.writingBlocks.begin(), shard.writingBlocks.end(), blockNo));
+    shard.ioCond.notify_all();
+}
+
+int DeviceManager::PrefetchBlocks(const int *blockNos, int count) {
+    if (this->mappedMode) {
+        return 0;
+    }
+
+    // 同时固定的缓存块不超过一半，给其他调用者留出空间
+    int batchLimit = this->blockBufferNum / 2 < ASYNC_IO_QUEUE_DEPTH ? this->blockBufferNum / 2 : ASYNC_IO_QUEUE_DEPTH;
+    if (batchLimit < 1) {
+        batchLimit = 1;
+    }
+
+    AsyncRequest requests[ASYNC_IO_QUEUE_DEPTH];
+    int loadedCnt = 0;
+    int idx = 0;
+    while (idx < count) {
+        int requestCnt = 0;
+        for (; idx < count && requestCnt < batchLimit; ++idx) {
+            int blockNo = blockNos[idx];
+            if (blockNo < 0) {
+                continue;
+            }
+
+            // 只查哈希索引，不改变置换顺序，随后的GetBlock会正常地更新；正在读写的块由其他线程负责，不等待
+            CacheShard& shard = this->ShardOf(blockNo);
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            if (shard.manager->hashIndex.Find(blockNo) >= 0 || this->IsWritingThrough(shard, blockNo)) {
+                continue;
+            }
+
+            int bufferIdx = this->AllocBlockBuffer(shard, lock, blockNo);
+            if (bufferIdx == -1) {
+                // 缓存被固定的块占满，不再预读
+                idx = count;
+                break;
+            }
+            requests[requestCnt] = {ASYNC_IO_READ, this->BlockOffset(blockNo), this->BlockBufferAt(bufferIdx), this->blockSize, -1, bufferIdx};
+            ++requestCnt;
+        }
 
-        if (this->imgFilePtr == nullptr) {
-            // 如果还是打不开，那肯定有问题
-            MoFSErrno = 19;
-//            Diagnose::PrintError("Cannot open image : " + std::string(imagePath));
-            return;
+        this->SubmitIO(requests, requestCnt);
+        for (int i = 0; i < requestCnt; ++i) {
+            CacheShard& shard = this->ShardOfBuffer(requests[i].tag);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.manager->Unpin(requests[i].tag - shard.firstBuffer);
+            this->FinishLoading(shard, requests[i].tag, requests[i].result == this->blockSize);
+            if (requests[i].result == this->blockSize) {
+                ++loadedCnt;
+            }
         }
     }
+    return loadedCnt;
 }
 
-DeviceManager::~DeviceManager() {
-    // 将所有缓存的脏块写回文件
-    int currentPtr = blockBufferManager.headPtr;
-    while (currentPtr >= 0) {
-        if (this->blockDirty[currentPtr]) {
-            // 脏块
-            this->WriteBlockToFile(currentPtr, this->blockBufferManager.numberLinkList[currentPtr]);
+int DeviceManager::FetchBlock(CacheShard &shard, std::unique_lock<std::mutex> &lock, int blockNo) {
+    if (blockNo < 0) {
+        // 未分配的块（索引表中的-1），不允许进入缓存
+        MoFSErrno = 16;
+        return -1;
+    }
+
+    // 检查缓存
+    int bufferIdx = this->LookupBlock(shard, lock, blockNo, true);
+    if (bufferIdx != -1) {
+        IOStats::Count(this->ioStats.blockHits);
+        return bufferIdx;
+    }
+
+    // 没缓存
+    IOStats::Count(this->ioStats.blockMisses);
+    bufferIdx = this->AllocBlockBuffer(shard, lock, blockNo);
+    if (bufferIdx == -1) {
+        // 所有缓存块都被GetBlock固定，或被换出的脏块写回失败
+        return -1;
+    }
+
+    // 直接读入缓存块，不经过中间缓冲区，读取期间其他块的访问不受影响
+    lock.unlock();
+    bool succeeded = this->DeviceRead(this->BlockOffset(blockNo), this->BlockBufferAt(bufferIdx), this->blockSize) == this->blockSize;
+    lock.lock();
+
+    shard.manager->Unpin(bufferIdx - shard.firstBuffer);
+    this->FinishLoading(shard, bufferIdx, succeeded);
+    if (!succeeded) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    return bufferIdx;
+}
+
+unsigned int DeviceManager::ReadBlock(int blockNo, void *buffer) {
+    if (this->mappedMode) {
+        std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+        char* blockData = blockNo < 0 ? nullptr : this->MappedRange(this->BlockOffset(blockNo), this->blockSize);
+        if (blockData == nullptr) {
+            MoFSErrno = 16;
+            return 0;
+        }
+        memcpy(buffer, blockData, this->blockSize);
+        return this->blockSize;
+    }
+
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->FetchBlock(shard, lock, blockNo);
+    if (bufferIdx == -1) {
+        if (MoFSErrno != 4) {
+            return 0;
         }
 
-        currentPtr = blockBufferManager.nextLinkList[currentPtr];
+        // 缓存被固定的块占满，绕过缓存直接读
+        lock.unlock();
+        long long readByteCnt = this->DeviceRead(this->BlockOffset(blockNo), buffer, this->blockSize);
+        return readByteCnt < 0 ? 0 : (unsigned int) readByteCnt;
     }
 
-    currentPtr = inodeBufferManager.headPtr;
-    while (currentPtr >= 0) {
-        if (this->inodeDirty[currentPtr]) {
-            this->WriteInodeToFile(currentPtr, this->inodeBufferManager.numberLinkList[currentPtr]);
+    memcpy(buffer, this->BlockBufferAt(bufferIdx), this->blockSize);
+    return this->blockSize;
+}
+
+unsigned int DeviceManager::WriteBlock(int blockNo, void *buffer) {
+    if (this->mappedMode) {
+        std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+        char* blockData = blockNo < 0 ? nullptr : this->MappedRange(this->BlockOffset(blockNo), this->blockSize);
+        if (blockData == nullptr) {
+            MoFSErrno = 16;
+            return 0;
         }
+        memcpy(blockData, buffer, this->blockSize);
+        this->MarkMappedDirty(this->BlockOffset(blockNo), this->blockSize);
+        return this->blockSize;
+    }
 
-        currentPtr = inodeBufferManager.nextLinkList[currentPtr];
+    if (blockNo < 0) {
+        MoFSErrno = 16;
+        return 0;
     }
 
-    if (this->imgFilePtr != nullptr) {
-        fclose(this->imgFilePtr);
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->LookupBlock(shard, lock, blockNo, true);
+    IOStats::Count(bufferIdx == -1 ? this->ioStats.blockMisses : this->ioStats.blockHits);
+    if (bufferIdx == -1) {
+        // 整块覆盖，未命中时不需要读入原来的内容
+        bufferIdx = this->AllocBlockBuffer(shard, lock, blockNo);
+        if (bufferIdx == -1) {
+            // 缓存被固定的块占满，绕过缓存直接写
+            this->BeginWriteThrough(shard, blockNo);
+            lock.unlock();
+            unsigned int writeByteCnt = this->DeviceWrite(this->BlockOffset(blockNo), buffer, this->blockSize);
+            this->EndWriteThrough(blockNo);
+            return writeByteCnt;
+        }
+        shard.manager->Unpin(bufferIdx - shard.firstBuffer);
+        this->FinishLoading(shard, bufferIdx, true);
     }
+
+    memcpy(this->BlockBufferAt(bufferIdx), buffer, this->blockSize);
+    this->MarkBlockDirty(bufferIdx);
+    return this->blockSize;
 }
 
-void DeviceManager::SetOffset(int offset) {
-    this->blockContentOffset = offset;
+int DeviceManager::ReadBlocks(const int *blockNos, int count, char *buffer) {
+    if (this->mappedMode) {
+        for (int i = 0; i < count; ++i) {
+            if (this->blockSize != this->ReadBlock(blockNos[i], buffer + (size_t) i * this->blockSize)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // 同时固定的缓存块不超过一半，给其他调用者留出空间
+    int batchLimit = this->blockBufferNum / 2 < ASYNC_IO_MAX_VECTOR ? this->blockBufferNum / 2 : ASYNC_IO_MAX_VECTOR;
+    if (batchLimit < 1) {
+        batchLimit = 1;
+    }
+
+    int missPos[ASYNC_IO_MAX_VECTOR];
+    int missIdx[ASYNC_IO_MAX_VECTOR];
+    BlockIOVec vectors[ASYNC_IO_MAX_VECTOR];
+    AsyncRequest requests[ASYNC_IO_MAX_VECTOR];
+
+    int pos = 0;
+    while (pos < count) {
+        // 命中的块直接复制，未命中的块分配缓存块并固定，攒满一批后一起读
+        int missCnt = 0;
+        bool stopped = false;
+        for (; pos < count && missCnt < batchLimit; ++pos) {
+            int blockNo = blockNos[pos];
+            char* dst = buffer + (size_t) pos * this->blockSize;
+            if (blockNo < 0) {
+                MoFSErrno = 16;
+                stopped = true;
+                break;
+            }
+
+            // 已经有块在读入时不能等待其他线程的块，否则可能互相等待，先读完这一批
+            CacheShard& shard = this->ShardOf(blockNo);
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            int bufferIdx = this->LookupBlock(shard, lock, blockNo, missCnt == 0);
+            if (bufferIdx == -2) {
+                break;
+            }
+            if (bufferIdx != -1) {
+                IOStats::Count(this->ioStats.blockHits);
+                memcpy(dst, this->BlockBufferAt(bufferIdx), this->blockSize);
+                continue;
+            }
+
+            IOStats::Count(this->ioStats.blockMisses);
+            bufferIdx = this->AllocBlockBuffer(shard, lock, blockNo);
+            if (bufferIdx == -1) {
+                // 缓存被固定的块占满，绕过缓存直接读
+                lock.unlock();
+                if (this->DeviceRead(this->BlockOffset(blockNo), dst, this->blockSize) != this->blockSize) {
+                    MoFSErrno = 16;
+                    stopped = true;
+                    break;
+                }
+                continue;
+            }
+            missPos[missCnt] = pos;
+            missIdx[missCnt] = bufferIdx;
+            vectors[missCnt] = {this->BlockBufferAt(bufferIdx), (size_t) this->blockSize};
+            ++missCnt;
+        }
+
+        // 块号连续的未命中块合并为一次分散读，读入各自的缓存块
+        int requestCnt = 0;
+        int runStart = 0;
+        while (runStart < missCnt) {
+            int runLength = 1;
+            while (runStart + runLength < missCnt
+                   && blockNos[missPos[runStart + runLength]] == blockNos[missPos[runStart]] + runLength) {
+                ++runLength;
+            }
+            requests[requestCnt] = {ASYNC_IO_READ, this->BlockOffset(blockNos[missPos[runStart]]), nullptr,
+                                    (long long) runLength * this->blockSize, -1, runStart, &vectors[runStart], runLength};
+            ++requestCnt;
+            runStart += runLength;
+        }
+        this->SubmitIO(requests, requestCnt);
+
+        bool failed = false;
+        for (int i = 0; i < requestCnt; ++i) {
+            bool requestFailed = requests[i].result != requests[i].length;
+            for (int j = requests[i].tag; j < requests[i].tag + requests[i].vectorCnt; ++j) {
+                CacheShard& shard = this->ShardOfBuffer(missIdx[j]);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (!requestFailed) {
+                    memcpy(buffer + (size_t) missPos[j] * this->blockSize, this->BlockBufferAt(missIdx[j]), this->blockSize);
+                }
+                shard.manager->Unpin(missIdx[j] - shard.firstBuffer);
+                this->FinishLoading(shard, missIdx[j], !requestFailed);
+            }
+            failed = failed || requestFailed;
+        }
+
+        if (failed) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        if (stopped) {
+            // 块号无效或直接读失败
+            return -1;
+        }
+    }
+    return 0;
 }
 
-unsigned int DeviceManager::ReadBlock(int blockNo, void *buffer) {
-    // 检查缓存
-    int bufferIdx = blockBufferManager.GetBufferedIndex(blockNo);
-    if (bufferIdx != -1) {
-        // 有缓存
-        memcpy(buffer, blockBuffer[bufferIdx], BLOCK_SIZE);
-//        Diagnose::PrintLog("ReadBlock (Buffered) " + std::to_string(blockNo) + ' ' + std::to_string(bufferIdx));
-        return BLOCK_SIZE;
+int DeviceManager::WriteBlocks(const int *blockNos, int count, const char *buffer) {
+    if (this->mappedMode) {
+        for (int i = 0; i < count; ++i) {
+            if (this->blockSize != this->WriteBlock(blockNos[i], (void*) (buffer + (size_t) i * this->blockSize))) {
+                return -1;
+            }
+        }
+        return 0;
     }
 
-    // 没缓存
-    int dstOffset = blockNo * BLOCK_SIZE + this->blockContentOffset;
-    fseek(this->imgFilePtr, dstOffset, SEEK_SET);
+    AsyncRequest requests[ASYNC_IO_QUEUE_DEPTH];
+    int requestCnt = 0;
+    bool failed = false;
 
-    int readByteCnt = fread(buffer, 1, BLOCK_SIZE, this->imgFilePtr);
-    if (readByteCnt == BLOCK_SIZE) {
-        // 只缓存读满的，不过不出意外都是读满的
-        int swapBlockIdx = -1;
-        int newBufferIdx = blockBufferManager.AllocNewBuffer(blockNo, swapBlockIdx);
-        if (swapBlockIdx != -1 && blockDirty[newBufferIdx]) {
-            // newBufferIdx指向的块的内容需要被写回磁盘中
-            this->WriteBlockToFile(newBufferIdx, swapBlockIdx);
+    // 提交已经攒下的直接写，完成后解除这些块的登记
+    auto submitRequests = [&]() {
+        failed = this->SubmitIO(requests, requestCnt) > 0 || failed;
+        for (int i = 0; i < requestCnt; ++i) {
+            for (int j = 0; j < requests[i].length / this->blockSize; ++j) {
+                this->EndWriteThrough(blockNos[requests[i].tag + j]);
+            }
+        }
+        requestCnt = 0;
+    };
+
+    int pos = 0;
+    while (pos < count) {
+        if (blockNos[pos] < 0) {
+            MoFSErrno = 16;
+            failed = true;
+            break;
+        }
+
+        // 已缓存的块在缓存中修改，保持缓存与映象一致。有登记未完成时不能等待其他线程，先提交
+        CacheShard& shard = this->ShardOf(blockNos[pos]);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        int bufferIdx = this->LookupBlock(shard, lock, blockNos[pos], requestCnt == 0);
+        if (bufferIdx == -2) {
+            lock.unlock();
+            submitRequests();
+            continue;
+        }
+        if (bufferIdx != -1) {
+            IOStats::Count(this->ioStats.blockHits);
+            memcpy(this->BlockBufferAt(bufferIdx), buffer + (size_t) pos * this->blockSize, this->blockSize);
+            this->MarkBlockDirty(bufferIdx);
+            ++pos;
+            continue;
+        }
+        this->BeginWriteThrough(shard, blockNos[pos]);
+        lock.unlock();
+
+        // 未缓存且块号连续的块在缓冲区中也连续，一次写入，不占用缓存。写完之前登记在各自的分片中，其他线程不会读入旧内容
+        int runLength = 1;
+        while (pos + runLength < count && blockNos[pos + runLength] == blockNos[pos] + runLength) {
+            CacheShard& nextShard = this->ShardOf(blockNos[pos + runLength]);
+            std::lock_guard<std::mutex> nextLock(nextShard.mutex);
+            if (nextShard.manager->hashIndex.Find(blockNos[pos + runLength]) >= 0) {
+                break;
+            }
+            this->BeginWriteThrough(nextShard, blockNos[pos + runLength]);
+            ++runLength;
+        }
+        IOStats::Count(this->ioStats.blockMisses, runLength);
+        requests[requestCnt] = {ASYNC_IO_WRITE, this->BlockOffset(blockNos[pos]), (void*) (buffer + (size_t) pos * this->blockSize),
+                                (long long) runLength * this->blockSize, -1, pos};
+        ++requestCnt;
+        pos += runLength;
+
+        if (requestCnt == ASYNC_IO_QUEUE_DEPTH) {
+            submitRequests();
         }
-        memcpy(blockBuffer[newBufferIdx], buffer, BLOCK_SIZE);
-        this->blockDirty[newBufferIdx] = false;
-//        Diagnose::PrintLog("ReadBlock (No buffered) " + std::to_string(blockNo) + ' ' + std::to_string(newBufferIdx) + " current rear : " + std::to_string(blockBufferManager.rearPtr));
     }
-    return readByteCnt;
+
+    if (requestCnt > 0) {
+        submitRequests();
+    }
+    if (failed) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    return 0;
 }
 
-unsigned int DeviceManager::WriteBlock(int blockNo, void *buffer) {
-    // 检查缓存
-    int bufferIdx = blockBufferManager.GetBufferedIndex(blockNo);
-    if (bufferIdx != -1) {
-        // 有缓存
-        memcpy(blockBuffer[bufferIdx], buffer, BLOCK_SIZE);
-        blockDirty[bufferIdx] = true;
-//        Diagnose::PrintLog("WriteBlock (Buffered) " + std::to_string(blockNo) + ' ' + std::to_string(bufferIdx));
-        return BLOCK_SIZE;
+int DeviceManager::DirectTransfer(bool isWrite, long long offset, char *buffer, long long length) {
+    // 每个线程一块中转缓冲区，第一次不对齐的传输时分配
+    static thread_local std::vector<char> bounceStorage;
+
+    auto transfer = [this, isWrite](long long position, char* data, long long byteCnt, bool direct) {
+        long long startUs = IOStats::NowUs();
+        std::unique_lock<std::mutex> ioLock(this->ioMutex, std::defer_lock);
+        if (this->serialDevice) {
+            ioLock.lock();
+        }
+        long long doneByteCnt;
+        if (isWrite) {
+            doneByteCnt = direct ? this->device->WriteDirect(position, data, byteCnt) : this->device->Write(position, data, byteCnt);
+        }
+        else {
+            doneByteCnt = direct ? this->device->ReadDirect(position, data, byteCnt) : this->device->Read(position, data, byteCnt);
+        }
+        this->ioStats.RecordIO(isWrite ? IO_OP_WRITE : IO_OP_READ, doneByteCnt, startUs);
+        return doneByteCnt == byteCnt;
+    };
+
+    // 旧格式的映象中块不按4KiB对齐，首尾不对齐的部分照常读写
+    long long alignedBegin = (offset + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    long long alignedEnd = (offset + length) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    if (alignedBegin >= alignedEnd) {
+        return transfer(offset, buffer, length, false) ? 0 : -1;
+    }
+    if (alignedBegin > offset && !transfer(offset, buffer, alignedBegin - offset, false)) {
+        return -1;
+    }
+    if (alignedEnd < offset + length && !transfer(alignedEnd, buffer + (alignedEnd - offset), offset + length - alignedEnd, false)) {
+        return -1;
     }
 
-    // 没缓存
-    int swapBlockIdx = -1;
-    int newBufferIdx = blockBufferManager.AllocNewBuffer(blockNo, swapBlockIdx);
-    if (swapBlockIdx != -1 && blockDirty[newBufferIdx]) {
-        // 有块因为新的缓存块需求而被释放，且该块脏
-        // 需要写回磁盘
-        this->WriteBlockToFile(newBufferIdx, swapBlockIdx);
+    char* alignedData = buffer + (alignedBegin - offset);
+    if ((uintptr_t) alignedData % DIRECT_IO_ALIGN == 0) {
+        return transfer(alignedBegin, alignedData, alignedEnd - alignedBegin, true) ? 0 : -1;
+    }
+
+    // 调用者的缓冲区不对齐，分段经过中转缓冲区
+    if (bounceStorage.empty()) {
+        bounceStorage.resize(DIRECT_IO_BOUNCE_BYTE + DIRECT_IO_ALIGN);
     }
-    memcpy(blockBuffer[newBufferIdx], buffer, BLOCK_SIZE);
-    blockDirty[newBufferIdx] = true;
-//    Diagnose::PrintLog("WriteBlock (No buffered) " + std::to_string(blockNo) + ' ' + std::to_string(newBufferIdx) + " : swap out block : " +
-//                               std::to_string(swapBlockIdx) + " current rear : " + std::to_string(blockBufferManager.rearPtr));
-    return BLOCK_SIZE;
+    char* bounce = (char*) (((uintptr_t) bounceStorage.data() + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN);
+    for (long long position = alignedBegin; position < alignedEnd; position += DIRECT_IO_BOUNCE_BYTE) {
+        long long byteCnt = std::min((long long) DIRECT_IO_BOUNCE_BYTE, alignedEnd - position);
+        char* data = buffer + (position - offset);
+        if (isWrite) {
+            memcpy(bounce, data, byteCnt);
+        }
+        if (!transfer(position, bounce, byteCnt, true)) {
+            return -1;
+        }
+        if (!isWrite) {
+            memcpy(data, bounce, byteCnt);
+        }
+    }
+    return 0;
 }
 
-int DeviceManager::ReadInode(int inodeNo, DiskInode *inodePtr) {
-    // 检查缓存
-    int bufferIdx = inodeBufferManager.GetBufferedIndex(inodeNo);
+int DeviceManager::ReadBlocksDirect(const int *blockNos, int count, char *buffer) {
+    if (this->mappedMode) {
+        return this->ReadBlocks(blockNos, count, buffer);
+    }
+
+    int pos = 0;
+    while (pos < count) {
+        if (blockNos[pos] < 0) {
+            MoFSErrno = 16;
+            return -1;
+        }
+
+        // 缓存中的块可能比映象新，从缓存复制
+        char* dst = buffer + (size_t) pos * this->blockSize;
+        {
+            CacheShard& shard = this->ShardOf(blockNos[pos]);
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            int bufferIdx = this->LookupBlock(shard, lock, blockNos[pos], true);
+            if (bufferIdx != -1) {
+                IOStats::Count(this->ioStats.blockHits);
+                memcpy(dst, this->BlockBufferAt(bufferIdx), this->blockSize);
+                ++pos;
+                continue;
+            }
+        }
+
+        // 未缓存且块号连续的块一次读入，不分配缓存块
+        int runLength = 1;
+        while (pos + runLength < count && blockNos[pos + runLength] == blockNos[pos] + runLength) {
+            CacheShard& nextShard = this->ShardOf(blockNos[pos + runLength]);
+            std::lock_guard<std::mutex> nextLock(nextShard.mutex);
+            if (nextShard.manager->hashIndex.Find(blockNos[pos + runLength]) >= 0 || this->IsWritingThrough(nextShard, blockNos[pos + runLength])) {
+                break;
+            }
+            ++runLength;
+        }
+
+        IOStats::Count(this->ioStats.blockMisses, runLength);
+        long long runOffset = this->BlockOffset(blockNos[pos]);
+        long long runByteCnt = (long long) runLength * this->blockSize;
+        if (-1 == this->DirectTransfer(false, runOffset, dst, runByteCnt) || !this->VerifyChecksums(runOffset, dst, runByteCnt)) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        pos += runLength;
+    }
+    return 0;
+}
+
+int DeviceManager::WriteBlocksDirect(const int *blockNos, int count, const char *buffer) {
+    if (this->mappedMode) {
+        return this->WriteBlocks(blockNos, count, buffer);
+    }
+
+    int pos = 0;
+    while (pos < count) {
+        if (blockNos[pos] < 0) {
+            MoFSErrno = 16;
+            return -1;
+        }
+
+        // 已缓存的块在缓存中修改，缓存与映象保持一致
+        CacheShard& shard = this->ShardOf(blockNos[pos]);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        int bufferIdx = this->LookupBlock(shard, lock, blockNos[pos], true);
+        if (bufferIdx != -1) {
+            IOStats::Count(this->ioStats.blockHits);
+            memcpy(this->BlockBufferAt(bufferIdx), buffer + (size_t) pos * this->blockSize, this->blockSize);
+            this->MarkBlockDirty(bufferIdx);
+            ++pos;
+            continue;
+        }
+        this->BeginWriteThrough(shard, blockNos[pos]);
+        lock.unlock();
+
+        // 未缓存且块号连续的块一次写入，写完之前登记在各自的分片中
+        int runLength = 1;
+        while (pos + runLength < count && blockNos[pos + runLength] == blockNos[pos] + runLength) {
+            CacheShard& nextShard = this->ShardOf(blockNos[pos + runLength]);
+            std::lock_guard<std::mutex> nextLock(nextShard.mutex);
+            if (nextShard.manager->hashIndex.Find(blockNos[pos + runLength]) >= 0) {
+                break;
+            }
+            this->BeginWriteThrough(nextShard, blockNos[pos + runLength]);
+            ++runLength;
+        }
+
+        IOStats::Count(this->ioStats.blockMisses, runLength);
+        long long runOffset = this->BlockOffset(blockNos[pos]);
+        long long runByteCnt = (long long) runLength * this->blockSize;
+        this->UpdateChecksums(runOffset, buffer + (size_t) pos * this->blockSize, runByteCnt);
+        int result = this->DirectTransfer(true, runOffset, (char*) (buffer + (size_t) pos * this->blockSize), runByteCnt);
+        for (int i = 0; i < runLength; ++i) {
+            this->EndWriteThrough(blockNos[pos + i]);
+        }
+        if (result == -1) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        pos += runLength;
+    }
+    return 0;
+}
+
+int DeviceManager::GetBlock(int blockNo, char *&data) {
+    if (this->mappedMode) {
+        // 映射本身就是缓存，不需要固定
+        std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+        data = blockNo < 0 ? nullptr : this->MappedRange(this->BlockOffset(blockNo), this->blockSize);
+        if (data == nullptr) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        return blockNo;
+    }
+
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->FetchBlock(shard, lock, blockNo);
+    if (bufferIdx == -1) {
+        return -1;
+    }
+
+    shard.manager->Pin(bufferIdx - shard.firstBuffer);
+    data = this->BlockBufferAt(bufferIdx);
+    return bufferIdx;
+}
+
+void DeviceManager::PutBlock(int handle, bool dirty) {
+    if (this->mappedMode) {
+        if (dirty) {
+            std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+            this->MarkMappedDirty(this->BlockOffset(handle), this->blockSize);
+        }
+        return;
+    }
+
+    CacheShard& shard = this->ShardOfBuffer(handle);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (dirty) {
+        this->MarkBlockDirty(handle);
+    }
+    shard.manager->Unpin(handle - shard.firstBuffer);
+}
+
+int DeviceManager::HoldBlock(int blockNo) {
+    if (this->mappedMode) {
+        return 0;
+    }
+
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->FetchBlock(shard, lock, blockNo);
+    if (bufferIdx == -1) {
+        return -1;
+    }
+    if (this->blockHeld[bufferIdx]) {
+        return 0;
+    }
+    shard.manager->Pin(bufferIdx - shard.firstBuffer);
+    this->blockHeld[bufferIdx] = true;
+    return 1;
+}
+
+int DeviceManager::HoldInode(int inodeNo, int &inodeBlockNo) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    inodeBlockNo = inodeNo / this->InodesPerBlock();
+    if (this->mappedMode) {
+        return 0;
+    }
+
+    int bufferIdx = this->FetchInodeBlock(inodeBlockNo);
+    if (bufferIdx == -1) {
+        MoFSErrno = 4;
+        return -1;
+    }
+    if (this->inodeHeld[bufferIdx]) {
+        return 0;
+    }
+    this->inodeBufferManager->Pin(bufferIdx);
+    this->inodeHeld[bufferIdx] = true;
+    return 1;
+}
+
+int DeviceManager::CopyHeldBlock(int blockNo, char *buffer) {
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->LookupBlock(shard, lock, blockNo, false);
+    if (bufferIdx < 0 || !this->blockHeld[bufferIdx]) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    memcpy(buffer, this->BlockBufferAt(bufferIdx), this->blockSize);
+    return 0;
+}
+
+int DeviceManager::CopyHeldInodeBlock(int inodeBlockNo, char *buffer) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    int bufferIdx = this->inodeBufferManager->GetBufferedIndex(inodeBlockNo);
+    if (bufferIdx == -1 || !this->inodeHeld[bufferIdx]) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    memcpy(buffer, this->InodeBlockAt(bufferIdx), this->blockSize);
+    return 0;
+}
+
+void DeviceManager::ReleaseHeldBlock(int blockNo) {
+    CacheShard& shard = this->ShardOf(blockNo);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    int bufferIdx = this->LookupBlock(shard, lock, blockNo, false);
+    if (bufferIdx < 0 || !this->blockHeld[bufferIdx]) {
+        return;
+    }
+    this->blockHeld[bufferIdx] = false;
+    shard.manager->Unpin(bufferIdx - shard.firstBuffer);
+}
+
+void DeviceManager::ReleaseHeldInodeBlock(int inodeBlockNo) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    int bufferIdx = this->inodeBufferManager->GetBufferedIndex(inodeBlockNo);
+    if (bufferIdx == -1 || !this->inodeHeld[bufferIdx]) {
+        return;
+    }
+    this->inodeHeld[bufferIdx] = false;
+    this->inodeBufferManager->Unpin(bufferIdx);
+}
+
+int DeviceManager::WriteInodeBlock(int inodeBlockNo, const char *data) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    long long dstOffset = this->InodeOffset(inodeBlockNo * this->InodesPerBlock());
+    if (this->mappedMode) {
+        char* inodeData = this->MappedRange(dstOffset, this->blockSize);
+        if (inodeData == nullptr) {
+            return -1;
+        }
+        memcpy(inodeData, data, this->blockSize);
+        this->MarkMappedDirty(dstOffset, this->blockSize);
+        return 0;
+    }
+
+    int bufferIdx = this->inodeBufferManager->GetBufferedIndex(inodeBlockNo);
     if (bufferIdx != -1) {
-        // 有缓存
-        memcpy(inodePtr, &(inodeBuffer[bufferIdx]), sizeof(DiskInode));
+        memcpy(this->InodeBlockAt(bufferIdx), data, this->blockSize);
+        this->MarkInodeDirty(bufferIdx);
         return 0;
     }
+    BlockIOVec vector = {(void*) data, (size_t) this->blockSize};
+    return this->WriteInodeBlocks(inodeBlockNo, &vector, 1);
+}
 
-    // 没缓存
-    unsigned int dstOffset = 64 + inodeNo * sizeof(DiskInode) + HEADER_SIG_SIZE;
-    fseek(this->imgFilePtr, dstOffset, SEEK_SET);
+int DeviceManager::FetchInodeBlock(int inodeBlockNo) {
+    int bufferIdx = inodeBufferManager->GetBufferedIndex(inodeBlockNo);
+    if (bufferIdx != -1) {
+        IOStats::Count(this->ioStats.inodeHits);
+        return bufferIdx;
+    }
+    IOStats::Count(this->ioStats.inodeMisses);
+
+    int swapInodeBlockNo = -1;
+    bufferIdx = inodeBufferManager->AllocNewBuffer(inodeBlockNo, swapInodeBlockNo);
+    if (bufferIdx == -1) {
+        // 所有inode缓存块都在被写回
+        return -1;
+    }
+    if (swapInodeBlockNo != -1) {
+        IOStats::Count(this->ioStats.inodeEvictions);
+    }
+    if (swapInodeBlockNo != -1 && inodeDirty[bufferIdx]) {
+        // 被换出的块是脏的，需要先写回磁盘
+        this->WriteInodeToFile(bufferIdx, swapInodeBlockNo);
+    }
+    this->ClearInodeDirty(bufferIdx);
 
-    unsigned int readByte = fread(inodePtr,  1, sizeof(DiskInode),this->imgFilePtr);
-    if (readByte != sizeof(DiskInode)) {
+    // inode区的末尾可能还没有被写过，读不满的部分补0
+    long long readByteCnt = this->DeviceRead(this->InodeOffset(inodeBlockNo * this->InodesPerBlock()), this->InodeBlockAt(bufferIdx), this->blockSize);
+    if (readByteCnt < 0) {
+        inodeBufferManager->Invalidate(bufferIdx);
         MoFSErrno = 16;
         return -1;
     }
+    memset(this->InodeBlockAt(bufferIdx) + readByteCnt, 0, this->blockSize - readByteCnt);
+
+    return bufferIdx;
+}
+
+int DeviceManager::ReadInode(int inodeNo, DiskInode *inodePtr) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->mappedMode) {
+        char* inodeData = this->MappedRange(this->InodeOffset(inodeNo), sizeof(DiskInode));
+        if (inodeData == nullptr) {
+            return -1;
+        }
+        memcpy(inodePtr, inodeData, sizeof(DiskInode));
+        return 0;
+    }
 
-    // 缓存
-    int swapInodeIdx = -1;
-    int newBufferIdx = inodeBufferManager.AllocNewBuffer(inodeNo, swapInodeIdx);
-    if (swapInodeIdx != -1 && inodeDirty[newBufferIdx]) {
-        // newBufferIdx指向的块的内容需要被写回磁盘中
-        this->WriteInodeToFile(newBufferIdx, swapInodeIdx);
+    // 整块读入inode所在的inode区块，同一块中的其它inode随后直接命中
+    int inodesPerBlock = this->InodesPerBlock();
+    int bufferIdx = this->FetchInodeBlock(inodeNo / inodesPerBlock);
+    if (bufferIdx == -1) {
+        // 这次不缓存，直接读取
+        if (this->DeviceRead(this->InodeOffset(inodeNo), inodePtr, sizeof(DiskInode)) != sizeof(DiskInode)) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        return 0;
     }
-    memcpy(&(inodeBuffer[newBufferIdx]), inodePtr, sizeof(DiskInode));
-    this->inodeDirty[newBufferIdx] = false;
 
+    memcpy(inodePtr, this->InodeBlockAt(bufferIdx) + (inodeNo % inodesPerBlock) * sizeof(DiskInode), sizeof(DiskInode));
     return 0;
 }
 
 int DeviceManager::WriteInode(int inodeNo, DiskInode *inodePtr) {
-    // 检查缓存
-    int bufferIdx = inodeBufferManager.GetBufferedIndex(inodeNo);
-    if (bufferIdx != -1) {
-        // 有缓存
-        memcpy(&(inodeBuffer[bufferIdx]), inodePtr, sizeof(DiskInode));
-        inodeDirty[bufferIdx] = true;
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->mappedMode) {
+        long long dstOffset = this->InodeOffset(inodeNo);
+        char* inodeData = this->MappedRange(dstOffset, sizeof(DiskInode));
+        if (inodeData == nullptr) {
+            return -1;
+        }
+        memcpy(inodeData, inodePtr, sizeof(DiskInode));
+        this->MarkMappedDirty(dstOffset, sizeof(DiskInode));
         return 0;
     }
 
-    // 没缓存
-    int swapInodeIdx = -1;
-    int newBufferIdx = inodeBufferManager.AllocNewBuffer(inodeNo, swapInodeIdx);
-    if (swapInodeIdx != -1 && inodeDirty[newBufferIdx]) {
-        // 有块因为新的缓存块需求而被释放，且该块脏
-        // 需要写回磁盘
-        this->WriteInodeToFile(newBufferIdx, swapInodeIdx);
+    // 在缓存的inode区块中修改，写回时整块写入
+    int inodesPerBlock = this->InodesPerBlock();
+    int bufferIdx = this->FetchInodeBlock(inodeNo / inodesPerBlock);
+    if (bufferIdx == -1) {
+        // 所有inode缓存块都在被写回，绕过缓存直接写
+        if (this->DeviceWrite(this->InodeOffset(inodeNo), inodePtr, sizeof(DiskInode)) != sizeof(DiskInode)) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        return 0;
     }
-    memcpy(&(inodeBuffer[newBufferIdx]), inodePtr, sizeof(DiskInode));
-    inodeDirty[newBufferIdx] = true;
+
+    memcpy(this->InodeBlockAt(bufferIdx) + (inodeNo % inodesPerBlock) * sizeof(DiskInode), inodePtr, sizeof(DiskInode));
+    this->MarkInodeDirty(bufferIdx);
     return 0;
 }
 
 int DeviceManager::LoadSuperBlock(void *superBlockPtr) {
-    fseek(this->imgFilePtr, HEADER_SIG_SIZE, SEEK_SET);
-    unsigned int readByte = fread(superBlockPtr, sizeof(SuperBlock), 1, this->imgFilePtr);
-
-    if (readByte != 1) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->DeviceRead(HEADER_SIG_SIZE, superBlockPtr, sizeof(SuperBlock)) != sizeof(SuperBlock)) {
         MoFSErrno = 16;
         return -1;
     }
 
     SuperBlock* ptr = (SuperBlock*) superBlockPtr;
-    this->blockContentOffset = ptr->s_isize * BLOCK_SIZE + sizeof(SuperBlock) + HEADER_SIG_SIZE;
+    if (ptr->s_blockSize != 0 && !IsValidBlockSize(ptr->s_blockSize)) {
+        MoFSErrno = 16;
+        return -1;
+    }
+    this->SetLayout(ptr->s_blockSize, ptr->s_isize);
+    if (ptr->s_imageByte != 0 && ptr->s_imageByte != this->BlockOffset(ptr->s_fsize)) {
+        // 记录的映象大小与块数对不上，SuperBlock已损坏
+        MoFSErrno = 16;
+        return -1;
+    }
+
+    // 映象文件只延伸到写入过的最后一块，mmap模式下需要先扩展到整个文件系统的大小
+    if (this->mappedMode && -1 == this->ReserveImage(this->BlockOffset(ptr->s_fsize))) {
+        return -1;
+    }
+
+    if (ptr->s_checksum == 0) {
+        this->DropChecksums();
+    }
+    else if (-1 == this->SetupChecksums(ptr->s_fsize, ptr->s_isize, true)) {
+        return -1;
+    }
+
+    // inode区接下来会被零散地读取，提示内核提前读入
+    this->device->Advise(HEADER_SIG_SIZE, this->blockContentOffset - HEADER_SIG_SIZE, DEVICE_ADVICE_WILLNEED);
 
     return 0;
 }
 
 int DeviceManager::StoreSuperBlock(void *superBlockPtr) {
-    fseek(this->imgFilePtr, HEADER_SIG_SIZE, SEEK_SET);
-    unsigned int writeByte = fwrite(superBlockPtr, sizeof(SuperBlock), 1, this->imgFilePtr);
-
-    if (writeByte != 1) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    if (this->DeviceWrite(HEADER_SIG_SIZE, superBlockPtr, sizeof(SuperBlock)) != sizeof(SuperBlock)) {
         MoFSErrno = 16;
         return -1;
     }
-
-    SuperBlock* ptr = (SuperBlock*) superBlockPtr;
-    this->blockContentOffset = ptr->s_isize * BLOCK_SIZE + sizeof(SuperBlock) + HEADER_SIG_SIZE;
+    if (this->mappedMode) {
+        this->MarkMappedDirty(HEADER_SIG_SIZE, sizeof(SuperBlock));
+    }
 
     return 0;
 }
 
 unsigned int DeviceManager::WriteBlockToFile(int bufferIdx, int blockIdx) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
 //    Diagnose::PrintLog("WriteBlockToFile " + std::to_string(bufferIdx) + ' ' + std::to_string(blockIdx));
-    int dstOffset = blockIdx * BLOCK_SIZE + this->blockContentOffset;
-    fseek(this->imgFilePtr, dstOffset, SEEK_SET);
+    return this->DeviceWrite(this->BlockOffset(blockIdx), this->BlockBufferAt(bufferIdx), this->blockSize);
+}
 
-    return fwrite(this->blockBuffer[bufferIdx], BLOCK_SIZE, 1, this->imgFilePtr);
+int DeviceManager::WriteInodeToFile(int bufferIdx, int inodeBlockIdx) {
+    std::lock_guard<std::recursive_timed_mutex> lock(this->cacheMutex);
+    BlockIOVec vector = {this->InodeBlockAt(bufferIdx), (size_t) this->blockSize};
+    return this->WriteInodeBlocks(inodeBlockIdx, &vector, 1);
 }
 
-int DeviceManager::WriteInodeToFile(int bufferIdx, int inodeIdx) {
-    unsigned int dstOffset = 64 + inodeIdx * sizeof(DiskInode) + HEADER_SIG_SIZE;
-    fseek(this->imgFilePtr, dstOffset, SEEK_SET);
+int DeviceManager::WriteInodeBlocks(int inodeBlockNo, const BlockIOVec *vectors, int vectorCnt) {
+    long long dstOffset = this->InodeOffset(inodeBlockNo * this->InodesPerBlock());
+    long long byteCnt = 0;
+    for (int i = 0; i < vectorCnt; ++i) {
+        byteCnt += (long long) vectors[i].length;
+    }
+    IOStats::Count(this->ioStats.inodeWriteBacks, byteCnt / this->blockSize);
+
+    // 旧格式中inode区从SuperBlock内部开始，跳过与SuperBlock重叠的部分，避免覆盖SuperBlock
+    long long skipByteCnt = HEADER_SIG_SIZE + (long long) sizeof(SuperBlock) - dstOffset;
+    if (skipByteCnt <= 0) {
+        if (this->DeviceWriteV(dstOffset, vectors, vectorCnt) != byteCnt) {
+            MoFSErrno = 16;
+            return -1;
+        }
+        return 0;
+    }
 
-    unsigned int writeByte = fwrite(&(inodeBuffer[bufferIdx]), 1, sizeof(DiskInode), this->imgFilePtr);
+    std::vector<BlockIOVec> trimmed;
+    for (int i = 0; i < vectorCnt; ++i) {
+        if (skipByteCnt >= (long long) vectors[i].length) {
+            skipByteCnt -= (long long) vectors[i].length;
+            continue;
+        }
+        trimmed.push_back({(char*) vectors[i].base + skipByteCnt, vectors[i].length - (size_t) skipByteCnt});
+        skipByteCnt = 0;
+    }
+    if (trimmed.empty()) {
+        return 0;
+    }
 
-    if (writeByte != sizeof(DiskInode)) {
+    long long trimmedByteCnt = 0;
+    for (const BlockIOVec& vector : trimmed) {
+        trimmedByteCnt += (long long) vector.length;
+    }
+    if (this->DeviceWriteV(dstOffset + byteCnt - trimmedByteCnt, trimmed.data(), (int) trimmed.size()) != trimmedByteCnt) {
         MoFSErrno = 16;
         return -1;
     }
-
     return 0;
 }
@@ -0,0 +1,175 @@
+﻿/**
+ * @file IOStats.cpp
+ * @brief 统计计数器实现
+ * @author 韩孟霖
+ * @date 2022/6/14
+ * @license GPL v3
+ */
+#include <chrono>
+#include <cstdio>
+
+#include "../../include/device/IOStats.h"
+#include "../../utils/Crc32c.h"
+
+long long IOStats::NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void IOStats::RecordIO(int op, long long byteCnt, long long startUs) {
+    long long elapsedUs = NowUs() - startUs;
+    if (elapsedUs < 0) {
+        elapsedUs = 0;
+    }
+
+    OpCounters& counters = this->opCounters[op];
+    Count(counters.count);
+    if (byteCnt > 0) {
+        Count(counters.bytes, byteCnt);
+    }
+    Count(counters.totalUs, elapsedUs);
+
+    // 不足1微秒的落在0号桶，之后每个桶的上界翻倍
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKET_NUM - 1 && (1LL << bucket) <= elapsedUs) {
+        ++bucket;
+    }
+    Count(counters.buckets[bucket]);
+
+    unsigned long long maxUs = counters.maxUs.load(std::memory_order_relaxed);
+    while ((unsigned long long) elapsedUs > maxUs
+           && !counters.maxUs.compare_exchange_weak(maxUs, elapsedUs, std::memory_order_relaxed)) {
+    }
+}
+
+void IOStats::Snapshot(MoFSStats &stats) const {
+    stats.blockHits = this->blockHits.load(std::memory_order_relaxed);
+    stats.blockMisses = this->blockMisses.load(std::memory_order_relaxed);
+    stats.blockEvictions = this->blockEvictions.load(std::memory_order_relaxed);
+    stats.blockWriteBacks = this->blockWriteBacks.load(std::memory_order_relaxed);
+
+    stats.inodeHits = this->inodeHits.load(std::memory_order_relaxed);
+    stats.inodeMisses = this->inodeMisses.load(std::memory_order_relaxed);
+    stats.inodeEvictions = this->inodeEvictions.load(std::memory_order_relaxed);
+    stats.inodeWriteBacks = this->inodeWriteBacks.load(std::memory_order_relaxed);
+
+    stats.checksumVerifies = this->checksumVerifies.load(std::memory_order_relaxed);
+    stats.checksumErrors = this->checksumErrors.load(std::memory_order_relaxed);
+
+    for (int op = 0; op < IO_OP_NUM; ++op) {
+        const OpCounters& counters = this->opCounters[op];
+        IOOpStats& opStats = stats.deviceOps[op];
+        opStats.count = counters.count.load(std::memory_order_relaxed);
+        opStats.bytes = counters.bytes.load(std::memory_order_relaxed);
+        opStats.totalUs = counters.totalUs.load(std::memory_order_relaxed);
+        opStats.maxUs = counters.maxUs.load(std::memory_order_relaxed);
+        for (int i = 0; i < LATENCY_BUCKET_NUM; ++i) {
+            opStats.buckets[i] = counters.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void IOStats::Reset() {
+    std::atomic<unsigned long long>* cacheCounters[] = {
+            &this->blockHits, &this->blockMisses, &this->blockEvictions, &this->blockWriteBacks,
+            &this->inodeHits, &this->inodeMisses, &this->inodeEvictions, &this->inodeWriteBacks,
+            &this->checksumVerifies, &this->checksumErrors
+    };
+    for (std::atomic<unsigned long long>* counter : cacheCounters) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+
+    for (OpCounters& counters : this->opCounters) {
+        counters.count.store(0, std::memory_order_relaxed);
+        counters.bytes.store(0, std::memory_order_relaxed);
+        counters.totalUs.store(0, std::memory_order_relaxed);
+        counters.maxUs.store(0, std::memory_order_relaxed);
+        for (std::atomic<unsigned long long>& bucket : counters.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief 格式化一行缓存的统计
+ * @param name 缓存名称
+ * @param hits 命中次数
+ * @param misses 未命中次数
+ * @param evictions 换出次数
+ * @param writeBacks 写回块数
+ * @param lineEnd 行尾
+ * @return 一行文本
+ */
+static std::string FormatCache(const char* name, unsigned long long hits, unsigned long long misses,
+                               unsigned long long evictions, unsigned long long writeBacks, const char* lineEnd) {
+    unsigned long long accesses = hits + misses;
+    char line[256];
+    snprintf(line, sizeof(line), "  %-6s hits %llu  misses %llu  hit rate %.2f%%  evictions %llu  write-backs %llu%s",
+             name, hits, misses, accesses == 0 ? 0.0 : 100.0 * hits / accesses, evictions, writeBacks, lineEnd);
+    return line;
+}
+
+std::string IOStats::Format(const MoFSStats &stats, const char *lineEnd) {
+    static const char* opNames[IO_OP_NUM] = {"read", "write", "sync"};
+    char line[256];
+    std::string text;
+
+    snprintf(line, sizeof(line), "cache: %d block buffers of %d bytes (%d dirty), %d inode buffers%s",
+             stats.blockBufferNum, stats.blockSize, stats.dirtyBlockNum, stats.inodeBufferNum, lineEnd);
+    text += line;
+    text += FormatCache("block", stats.blockHits, stats.blockMisses, stats.blockEvictions, stats.blockWriteBacks, lineEnd);
+    text += FormatCache("inode", stats.inodeHits, stats.inodeMisses, stats.inodeEvictions, stats.inodeWriteBacks, lineEnd);
+    if (stats.checksumEnabled) {
+        snprintf(line, sizeof(line), "checksum: crc32c (%s)  verified %llu  mismatches %llu%s",
+                 Crc32c::Implementation(), stats.checksumVerifies, stats.checksumErrors, lineEnd);
+        text += line;
+    }
+    if (stats.dedupEnabled) {
+        snprintf(line, sizeof(line), "dedup: hits %llu  shared references %llu%s", stats.dedupHits, stats.dedupSharedRefs, lineEnd);
+        text += line;
+    }
+    if (stats.bitmapEnabled) {
+        snprintf(line, sizeof(line), "bitmap: free blocks %d of %d (%.2f%%)%s", stats.freeBlocks, stats.dataBlocks,
+                 stats.dataBlocks == 0 ? 0.0 : 100.0 * stats.freeBlocks / stats.dataBlocks, lineEnd);
+        text += line;
+    }
+    if (stats.journalEnabled || stats.journalReplays) {
+        snprintf(line, sizeof(line), "journal: commits %llu  logged blocks %llu  checkpoints %llu  replayed %llu%s",
+                 stats.journalCommits, stats.journalBlocks, stats.journalCheckpoints, stats.journalReplays, lineEnd);
+        text += line;
+    }
+
+    text += "device:";
+    text += lineEnd;
+    for (int op = 0; op < IO_OP_NUM; ++op) {
+        const IOOpStats& opStats = stats.deviceOps[op];
+        snprintf(line, sizeof(line), "  %-6s ops %llu  bytes %llu  avg %lluus  max %lluus%s", opNames[op],
+                 opStats.count, opStats.bytes, opStats.count == 0 ? 0ULL : opStats.totalUs / opStats.count, opStats.maxUs, lineEnd);
+        text += line;
+    }
+
+    // 只列出有操作落入的桶，标签为桶的上界
+    text += "latency (us):";
+    text += lineEnd;
+    for (int op = 0; op < IO_OP_NUM; ++op) {
+        const IOOpStats& opStats = stats.deviceOps[op];
+        if (opStats.count == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "  %-6s", opNames[op]);
+        text += line;
+        for (int i = 0; i < LATENCY_BUCKET_NUM; ++i) {
+            if (opStats.buckets[i] == 0) {
+                continue;
+            }
+            if (i == LATENCY_BUCKET_NUM - 1) {
+                snprintf(line, sizeof(line), " >=%lld:%llu", 1LL << (i - 1), opStats.buckets[i]);
+            }
+            else {
+                snprintf(line, sizeof(line), " <%lld:%llu", 1LL << i, opStats.buckets[i]);
+            }
+            text += line;
+        }
+        text += lineEnd;
+    }
+    return text;
+}
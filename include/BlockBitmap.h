@@ -0,0 +1,153 @@
+﻿/**
+ * @file BlockBitmap.h
+ * @brief 空闲块位图：每个数据块一位，内存中另有逐层汇总的索引，用于就近分配连续的块和统计空闲块数
+ * @author 韩孟霖
+ * @date 2022/6/20
+ * @license GPL v3
+ */
+
+#ifndef MOFS_BLOCKBITMAP_H
+#define MOFS_BLOCKBITMAP_H
+
+#include <cstdint>
+#include <vector>
+
+/// 分配连续块时最多检查的空闲段数，找不到足够长的段时取其中最长的一段
+#define BITMAP_RUN_SEARCH_LIMIT 64
+
+/**
+ * @brief 空闲块位图。映象中位于数据块之后、不参与分配的若干块，第i位为1表示i号块已被占用，0号块总是占用；
+ * 加载时整个读入内存，修改时同时写入缓存中的位图块。
+ * 内存中每64位汇总为上一层的一位，表示其中是否还有空闲块，逐层汇总到只剩一个字，查找下一个空闲块时跳过已满的部分
+ */
+class BlockBitmap {
+public:
+    /**
+     * @brief 启用位图
+     * @param bitmapBlock 位图的第一块，也是数据块的块数
+     * @param bitmapBlockCnt 位图的块数
+     * @param load true表示从映象读入，false表示新格式化，除0号块外全部空闲
+     * @return 0表示成功，-1表示失败
+     */
+    int Setup(int bitmapBlock, int bitmapBlockCnt, bool load);
+
+    /**
+     * @brief 关闭位图，映象使用空闲链表时使用
+     */
+    void Drop();
+
+    /**
+     * @brief 映象是否使用位图管理空闲块
+     * @return true表示启用
+     */
+    bool Enabled() const {
+        return this->blockNum != 0;
+    }
+
+    /**
+     * @brief 格式化时位图的块数
+     * @param blockSize 块大小
+     * @param blockNum 位图和数据块的总块数
+     * @return 块数
+     */
+    static int BlockCnt(int blockSize, int blockNum);
+
+    /**
+     * @brief 分配一段连续的块。优先在goal之后（到末尾后回到开头）找长度为count的空闲段，
+     * 检查BITMAP_RUN_SEARCH_LIMIT段仍找不到时取其中最长的一段
+     * @param count 最多分配的块数
+     * @param goal 希望从这一块开始，不大于0时从上次分配的位置之后开始
+     * @param allocated 实际分配的块数，在1到count之间
+     * @return 第一块的块号，-1表示出错，没有空闲块时置MoFSErrno为11
+     */
+    int Alloc(int count, int goal, int& allocated);
+
+    /**
+     * @brief 释放一个块
+     * @param blockNo 块号
+     * @return 0表示成功，-1表示出错
+     */
+    int Free(int blockNo);
+
+    /**
+     * @brief 空闲块数
+     * @return 块数
+     */
+    int FreeCount() const {
+        return this->freeCnt;
+    }
+
+    /**
+     * @brief 数据块的块数，即位图覆盖的块数
+     * @return 块数
+     */
+    int DataBlockCount() const {
+        return this->blockNum;
+    }
+
+    /**
+     * @brief 把上次Flush之后修改过的位图块写入映象并同步到设备
+     * @return 0表示成功，-1表示失败
+     */
+    int Flush();
+
+    static BlockBitmap blockBitmap;     ///< 位图单例
+
+private:
+    /**
+     * @brief 从pos开始的第一个空闲块
+     * @param pos 起始块号
+     * @return 块号，-1表示pos之后没有空闲块
+     */
+    long long NextFree(long long pos) const;
+
+    /**
+     * @brief 从pos开始、limit之前的第一个已占用的块
+     * @param pos 起始块号
+     * @param limit 查找的上界
+     * @return 块号，没有时返回limit
+     */
+    long long NextUsed(long long pos, long long limit) const;
+
+    /**
+     * @brief 汇总层level中从bit开始的第一个置位的位
+     * @param level 层号，0是直接汇总位图的一层
+     * @param bit 起始位
+     * @return 位号，-1表示没有
+     */
+    long long NextSummaryBit(int level, long long bit) const;
+
+    /**
+     * @brief 把一段块标记为占用或空闲，更新汇总层并写入缓存中的位图块
+     * @param first 第一块
+     * @param count 块数
+     * @param used true表示占用
+     * @return 0表示成功，-1表示失败
+     */
+    int Mark(int first, int count, bool used);
+
+    /**
+     * @brief 位图中的一个字变化后，更新各汇总层
+     * @param wordIdx 字号
+     */
+    void UpdateSummary(long long wordIdx);
+
+    /**
+     * @brief 把一段字写入缓存中的位图块
+     * @param firstWord 第一个字
+     * @param lastWord 最后一个字
+     * @return 0表示成功，-1表示失败
+     */
+    int StoreWords(long long firstWord, long long lastWord);
+
+    int bitmapBlock{};                              ///< 位图的第一块
+    int blockNum{};                                 ///< 位图覆盖的块数
+    int freeCnt{};                                  ///< 空闲块数
+    int rotor{1};                                   ///< 不指定位置时从这一块开始找
+    std::vector<uint64_t> words;                    ///< 位图，末尾多出的位标记为占用
+    std::vector<std::vector<uint64_t>> summary;     ///< 汇总层，summary[0]的第i位表示words[i]中有空闲块
+    std::vector<int> unsyncedBitmapBlocks;          ///< 上次Flush之后修改过的位图块
+    std::vector<char> bitmapBlockUnsynced;          ///< 位图块是否已在unsyncedBitmapBlocks中
+};
+
+#endif //MOFS_BLOCKBITMAP_H
@@ -0,0 +1,150 @@
+﻿/**
+ * @file DedupStore.h
+ * @brief 块级去重：按内容指纹找到内容相同的已有块，让多个文件共享它，并记录共享块的引用数
+ * @author 韩孟霖
+ * @date 2022/6/18
+ * @license GPL v3
+ */
+
+#ifndef MOFS_DEDUPSTORE_H
+#define MOFS_DEDUPSTORE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief 去重表中每个数据块的一项，也是去重表在映象中的格式
+ */
+struct DedupEntry {
+    uint64_t fingerprint;   ///< 块内容的指纹，0表示没有记录
+    uint32_t sharedRefs;    ///< 第一个引用之外的引用数，0表示没有被共享
+    uint32_t reserved;      ///< 保留，为0
+};
+
+/**
+ * @brief 去重表。映象中位于block区末尾、不参与分配的若干块，每个数据块一项；加载时整个读入内存，
+ * 修改时同时写入缓存中的表块。只有普通文件整块写入的块会记录指纹，部分修改的块清除指纹
+ */
+class DedupStore {
+public:
+    /**
+     * @brief 计算块内容的指纹：前后两半各一个CRC32C。指纹相同时还要比较内容，指纹只用于查找
+     * @param data 数据
+     * @param length 字节数
+     * @return 非0的指纹
+     */
+    static uint64_t Fingerprint(const char* data, int length);
+
+    /**
+     * @brief 启用去重表
+     * @param tableBlock 去重表的第一块，也是数据块的块数
+     * @param tableBlockCnt 去重表的块数
+     * @param load true表示从映象读入，false表示新格式化，表块全部清0
+     * @return 0表示成功，-1表示失败
+     */
+    int Setup(int tableBlock, int tableBlockCnt, bool load);
+
+    /**
+     * @brief 关闭去重，映象没有去重表时使用
+     */
+    void Drop();
+
+    /**
+     * @brief 映象是否带去重表
+     * @return true表示启用
+     */
+    bool Enabled() const {
+        return !this->entries.empty();
+    }
+
+    /**
+     * @brief 按指纹查找块
+     * @param fingerprint 指纹
+     * @return 块号，-1表示没有
+     */
+    int Find(uint64_t fingerprint) const;
+
+    /**
+     * @brief 块的内容是否与data相同，相同时计为一次命中
+     * @param blockNo 块号
+     * @param data 一整块数据
+     * @return true表示相同
+     */
+    bool Matches(int blockNo, const char* data);
+
+    /**
+     * @brief 块被整块写入了新内容，记下新的指纹
+     * @param blockNo 块号
+     * @param fingerprint 指纹
+     * @return 0表示成功，-1表示失败
+     */
+    int Register(int blockNo, uint64_t fingerprint);
+
+    /**
+     * @brief 块的内容将被部分修改或不再是普通文件数据，清除指纹
+     * @param blockNo 块号
+     * @return 0表示成功，-1表示失败
+     */
+    int Forget(int blockNo);
+
+    /**
+     * @brief 块是否被多个文件共享。共享的块不能原地修改
+     * @param blockNo 块号
+     * @return true表示共享
+     */
+    bool IsShared(int blockNo) const;
+
+    /**
+     * @brief 又有一处引用了这个块
+     * @param blockNo 块号
+     * @return 0表示成功，-1表示失败
+     */
+    int AddRef(int blockNo);
+
+    /**
+     * @brief 释放一处引用。没有其它引用时清除指纹，由调用者把块放回空闲表
+     * @param blockNo 块号
+     * @return 1表示仍有其它引用，不能释放；0表示可以释放；-1表示失败
+     */
+    int DropRef(int blockNo);
+
+    /**
+     * @brief 把上次Flush之后修改过的表块写入映象并同步到设备
+     * @return 0表示成功，-1表示失败
+     */
+    int Flush();
+
+    /**
+     * @brief 取得统计
+     * @param hits 整块写入时找到相同内容、不必写入的块数
+     * @param sharedRefs 当前所有块第一个引用之外的引用数之和，即节省的块数
+     */
+    void GetStats(unsigned long long& hits, unsigned long long& sharedRefs) const;
+
+    /**
+     * @brief 命中次数清零
+     */
+    void ResetStats();
+
+    static DedupStore dedupStore;   ///< 去重表单例
+
+private:
+    /**
+     * @brief 把一项写入缓存中的表块
+     * @param blockNo 数据块号
+     * @return 0表示成功，-1表示失败
+     */
+    int StoreEntry(int blockNo);
+
+    int tableBlock{};                                   ///< 去重表的第一块
+    std::vector<DedupEntry> entries;                    ///< 每个数据块一项
+    std::unordered_map<uint64_t, int> index;            ///< 指纹到块号
+    std::vector<int> unsyncedTableBlocks;               ///< 上次Flush之后修改过的表块
+    std::vector<char> tableBlockUnsynced;               ///< 表块是否已在unsyncedTableBlocks中
+    std::vector<char> compareBuffer;                    ///< 比较内容时读入已有的块
+    unsigned long long hits{};                          ///< 命中次数
+    unsigned long long sharedRefs{};                    ///< 所有项sharedRefs之和
+};
+
+#endif //MOFS_DEDUPSTORE_H
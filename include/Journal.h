@@ -0,0 +1,285 @@
+﻿/**
+ * @file Journal.h
+ * @brief 元数据日志：目录块、索引块、空闲表、去重表、inode和SuperBlock的修改先整块写入日志区，提交后再写回原位置
+ * @author 韩孟霖
+ * @date 2022/6/19
+ * @license GPL v3
+ */
+
+#ifndef MOFS_JOURNAL_H
+#define MOFS_JOURNAL_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/// 日志区的默认字节数，格式化时按块大小换算成块数，不超过block区的1/8
+#define JOURNAL_DEFAULT_BYTE (4 * 1024 * 1024)
+
+/// 日志区块数的下限，包括头块
+#define JOURNAL_MIN_BLOCKS 64
+
+/// 默认的组提交间隔(毫秒)，可由 --journal-commit-ms 修改
+#define DEFAULT_JOURNAL_COMMIT_MS 1000
+
+/// 日志头块和日志块的魔数
+#define JOURNAL_MAGIC 0x4D6F4A6Cu
+
+/// 日志块的类型
+#define JOURNAL_BLOCK_HEADER 0      ///< 日志区的头块，sequence为最早一个未写回事务的序号，count为它在环中的位置
+#define JOURNAL_BLOCK_DESCRIPTOR 1  ///< 描述块，之后紧跟count块映像
+#define JOURNAL_BLOCK_REVOKE 2      ///< 撤销块，记录count个在本事务中被释放的块
+#define JOURNAL_BLOCK_COMMIT 3      ///< 提交块，count为本事务在它之前的块数，之后是这些块的CRC32C
+
+/// 映像所属的区域
+#define JOURNAL_AREA_BLOCK 0        ///< block区的块
+#define JOURNAL_AREA_INODE 1        ///< inode区的块
+#define JOURNAL_AREA_SUPER 2        ///< SuperBlock按块大小切分后的一段
+
+/**
+ * @brief 每个日志块开头的头部，也是日志在映象中的格式
+ */
+struct JournalBlockHeader {
+    uint32_t magic;         ///< JOURNAL_MAGIC
+    uint32_t type;          ///< JOURNAL_BLOCK_*
+    uint32_t sequence;      ///< 事务序号
+    uint32_t count;         ///< 含义随类型而定
+};
+
+/**
+ * @brief 描述块中的一项，对应随后的一块映像
+ */
+struct JournalTag {
+    int32_t area;           ///< JOURNAL_AREA_*
+    int32_t blockNo;        ///< 区域内的块号
+};
+
+/**
+ * @brief 元数据日志。映象中位于block区末尾、不参与分配的若干块：第一块是头块，其余的块组成环。
+ * 修改元数据块之前先把块留在缓存中，一个事务的所有修改连同SuperBlock一次写入环中并同步，之后这些块才照常写回；
+ * 环用过一半时把所有脏数据写回原位置并推进头块。加载时重放头块之后校验通过的事务
+ */
+class Journal {
+public:
+    /**
+     * @brief 一次文件系统操作。操作之间才会提交事务，后台提交线程不会在操作中途提交
+     */
+    class OpScope {
+    public:
+        OpScope() {
+            Journal::journal.BeginOp();
+        }
+
+        ~OpScope() {
+            Journal::journal.EndOp();
+        }
+
+        OpScope(const OpScope&) = delete;
+        OpScope& operator=(const OpScope&) = delete;
+    };
+
+    /**
+     * @brief 析构函数，停止后台提交线程
+     */
+    ~Journal();
+
+    /**
+     * @brief 格式化时日志区的块数
+     * @param blockSize 块大小
+     * @param blockNum block区的块数
+     * @return 块数
+     */
+    static int DefaultBlockCnt(int blockSize, int blockNum);
+
+    /**
+     * @brief 设置组提交的间隔，需要在Setup之前调用
+     * @param commitMs 事务最多积累的毫秒数，不大于0时每次操作结束都提交，不启动后台提交线程
+     */
+    void SetCommitInterval(int commitMs);
+
+    /**
+     * @brief 启用日志。mmap模式下只重放，不启用
+     * @param journalBlock 日志区的第一块
+     * @param journalBlockCnt 日志区的块数
+     * @param load true表示加载映象，重放其中已提交的事务；false表示新格式化，把缓存中的数据全部写回后写入空的头块
+     * @return 重放的事务数，-1表示出错
+     */
+    int Setup(int journalBlock, int journalBlockCnt, bool load);
+
+    /**
+     * @brief 关闭日志，丢弃未提交的修改记录，映象没有日志区或格式化时使用
+     */
+    void Drop();
+
+    /**
+     * @brief 是否在记录日志
+     * @return true表示启用
+     */
+    bool Enabled() const {
+        return this->enabled;
+    }
+
+    /**
+     * @brief 即将修改一个block区的元数据块，把它加入当前事务
+     * @param blockNo 块号
+     * @return 0表示成功，-1表示出错
+     */
+    int LogBlock(int blockNo);
+
+    /**
+     * @brief 即将修改一组block区的元数据块
+     * @param blockNos 块号数组
+     * @param count 块数
+     * @return 0表示成功，-1表示出错
+     */
+    int LogBlocks(const int* blockNos, int count);
+
+    /**
+     * @brief 即将修改一个DiskInode，把它所在的inode区块加入当前事务
+     * @param inodeNo inode号
+     * @return 0表示成功，-1表示出错
+     */
+    int LogInode(int inodeNo);
+
+    /**
+     * @brief 推迟释放一个块：释放它的操作结束、事务提交之后才放回空闲表，之前不会被重新分配
+     * @param blockNo 块号
+     * @return true表示已推迟，false表示没有启用日志，调用者直接释放
+     */
+    bool DeferFree(int blockNo);
+
+    /**
+     * @brief 空闲表耗尽时，提交事务把推迟释放的块放回空闲表
+     * @return true表示有块被放回
+     */
+    bool ReclaimFrees();
+
+    /**
+     * @brief 提交当前事务：写入日志区并同步到设备，之后事务中的块可以写回原位置
+     * @return 0表示成功，-1表示出错
+     */
+    int Commit();
+
+    /**
+     * @brief 提交当前事务后把所有脏数据写回原位置，清空日志
+     * @return 0表示成功，-1表示出错
+     */
+    int Checkpoint();
+
+    /**
+     * @brief 取得统计
+     * @param commits 提交的事务数
+     * @param loggedBlocks 写入日志区的块数
+     * @param checkpoints 写回并清空日志的次数
+     * @param replayed 加载时重放的事务数
+     */
+    void GetStats(unsigned long long& commits, unsigned long long& loggedBlocks,
+                  unsigned long long& checkpoints, unsigned long long& replayed) const;
+
+    /**
+     * @brief 统计清零
+     */
+    void ResetStats();
+
+    static Journal journal;     ///< 日志单例
+
+private:
+    /**
+     * @brief 开始一次操作，可以嵌套
+     */
+    void BeginOp();
+
+    /**
+     * @brief 结束一次操作。最外层的操作结束时，它推迟释放的块可以随下次提交放回空闲表，事务足够大或足够久时提交
+     */
+    void EndOp();
+
+    /**
+     * @brief 当前事务是否应当提交
+     * @return true表示应当提交
+     */
+    bool CommitDue() const;
+
+    /**
+     * @brief 提交当前事务，由Commit在标记提交中之后调用
+     * @return 0表示成功，-1表示出错
+     */
+    int CommitRunning();
+
+    /**
+     * @brief 把所有脏数据写回原位置并同步，然后推进头块，清空日志
+     * @return 0表示成功，-1表示出错
+     */
+    int WriteBack();
+
+    /**
+     * @brief 写入头块并同步
+     * @return 0表示成功，-1表示出错
+     */
+    int StoreHeader();
+
+    /**
+     * @brief 重放日志区中头块之后校验通过的事务
+     * @return 重放的事务数，-1表示出错
+     */
+    int Replay();
+
+    /**
+     * @brief 环中的位置对应的块号
+     * @param pos 环中的位置
+     * @return 块号
+     */
+    int RingBlock(int pos) const {
+        return this->journalBlock + 1 + pos % this->ringCnt;
+    }
+
+    /**
+     * @brief 后台提交线程主循环：每个提交间隔醒来一次，没有操作在进行时提交到期的事务
+     */
+    void CommitterLoop();
+
+    /**
+     * @brief 停止后台提交线程
+     */
+    void StopCommitter();
+
+    bool enabled{};                             ///< 是否在记录日志
+    int journalBlock{};                         ///< 日志区的第一块，即头块
+    int ringCnt{};                              ///< 环的块数
+    int headPos{};                              ///< 下一个事务写入环中的位置
+    int tailPos{};                              ///< 最早一个未写回的事务在环中的位置
+    int usedCnt{};                              ///< 环中未写回的块数
+    uint32_t sequence{1};                       ///< 下一个事务的序号
+    int commitMs{DEFAULT_JOURNAL_COMMIT_MS};    ///< 组提交间隔
+
+    int blockHoldLimit{};                       ///< 一个事务最多留下的block区块数，超过时在操作中途提交
+    int inodeHoldLimit{};                       ///< 一个事务最多留下的inode区块数
+    size_t freeBatch{};                         ///< 一次提交最多放回空闲表的块数
+
+    std::vector<int> heldBlocks;                ///< 当前事务的block区块
+    std::vector<int> heldInodeBlocks;           ///< 当前事务的inode区块
+    std::vector<int> pendingFrees;              ///< 正在进行的操作推迟释放的块
+    std::vector<int> readyFrees;                ///< 操作已经结束、等待提交时放回空闲表的块
+    std::unordered_set<int> freedBlocks;        ///< 本次提交放回空闲表、不再写入日志的块
+    std::unordered_set<int> loggedBlocks;       ///< 上次写回之后写入过日志的block区块，释放时需要撤销
+    std::vector<char> committedSuper;           ///< 上次提交的SuperBlock
+    long long runningSince{};                   ///< 当前事务第一次修改的时间(毫秒)，0表示没有修改
+    bool committing{};                          ///< 正在提交，期间的修改加入本次提交
+
+    std::recursive_mutex opMutex;               ///< 操作和提交互斥
+    int opDepth{};                              ///< 操作的嵌套深度
+    std::thread committerThread;                ///< 后台提交线程
+    std::mutex committerMutex;                  ///< 保护committerStopping
+    std::condition_variable committerCond;      ///< 唤醒后台提交线程
+    bool committerStopping{};                   ///< 后台提交线程需要退出
+
+    unsigned long long commits{};               ///< 提交的事务数
+    unsigned long long journalWrites{};         ///< 写入日志区的块数
+    unsigned long long checkpoints{};           ///< 写回并清空日志的次数
+    unsigned long long replayed{};              ///< 加载时重放的事务数
+};
+
+#endif //MOFS_JOURNAL_H
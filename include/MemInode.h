@@ -10,10 +10,27 @@
 #ifndef MOFS_MEMINODE_H
 #define MOFS_MEMINODE_H
 
+#include <vector>
+
 #include "DiskInode.h"
 
 #define SYSTEM_MEM_INODE_NUM 512
 
+/// 顺序读取时第一次预读的块数
+#define READ_AHEAD_INIT_BLOCKS 8
+
+/// 预读窗口的最大块数，窗口在连续的顺序读取中逐次翻倍直到这个值
+#define READ_AHEAD_MAX_BLOCKS 256
+
+/// 一次映射、读写的最大块数
+#define MAX_BLOCK_BATCH 256
+
+/// 压缩的单位，每组连续的逻辑块一起压缩，文件末尾的组可以不满
+#define COMPRESS_GROUP_BLOCKS 16
+
+/// 索引表中的这一项表示该逻辑块的数据压缩在所在组开头的几个块中，没有对应的物理块
+#define COMPRESSED_BLOCK (-2)
+
 /**
  * @brief i_flag中标志位
  */
@@ -48,10 +65,33 @@ public:
     static const unsigned int IRWXU = (IREAD|IWRITE|IEXEC);		///< 文件主对文件的读、写、执行权限
     static const unsigned int IRWXG = ((IRWXU) >> 3);			///< 文件主同组用户对文件的读、写、执行权限
     static const unsigned int IRWXO = ((IRWXU) >> 6);			///< 其他用户对文件的读、写、执行权限
+    static const unsigned int ICOMPR = 0x10000;		///< 文件内容按组压缩存储；目录带此标志时，其中新建的文件和目录继承它
 
     static const int SMALL_FILE_BLOCK = 6;	///< 小型文件：直接索引表最多可寻址的逻辑块号
-    static const int LARGE_FILE_BLOCK = 128 * 2 + 6;	///< 大型文件：经一次间接索引表最多可寻址的逻辑块号
-    static const int HUGE_FILE_BLOCK = 128 * 128 * 2 + 128 * 2 + 6;	///< 巨型文件：经二次间接索引最大可寻址文件逻辑块号
+
+    /**
+     * @brief 每个索引块的项数，随映象的块大小变化
+     * @return 块大小 / sizeof(int)
+     */
+    static int IndexFanout();
+
+    /**
+     * @brief 大型文件：经一次间接索引表最多可寻址的逻辑块号
+     * @return 6 + 2 * IndexFanout()
+     */
+    static int LargeFileBlock();
+
+    /**
+     * @brief 巨型文件：经二次间接索引最大可寻址文件逻辑块号
+     * @return 6 + 2 * IndexFanout() + 2 * IndexFanout()^2
+     */
+    static int HugeFileBlock();
+
+    /**
+     * @brief 文件的最大字节数
+     * @return HugeFileBlock() * 块大小
+     */
+    static long long MaxFileByte();
 
     /* Functions */
 public:
@@ -79,18 +119,27 @@ public:
      * @param offset 起始偏移量
      * @param buffer 读取缓冲区
      * @param size 读取字节数
+     * @param direct 中间的整块是否绕过缓存直接读取
      * @return 返回实际读取字节数，-1表示错误
      */
-    int Read(int offset, char* buffer, int size);
+    int Read(int offset, char* buffer, int size, bool direct = false);
 
     /**
      * @brief 根据Inode对象中的物理磁盘块索引表，将数据写入文件
      * @param offset 起始偏移量
      * @param buffer 写入缓冲区
      * @param size 写入字节数
+     * @param direct 中间的整块是否绕过缓存直接写入
      * @return 返回实际读取字节数，-1表示错误
      */
-    int Write(int offset, char* buffer, int size);
+    int Write(int offset, char* buffer, int size, bool direct = false);
+
+    /**
+     * @brief 打开或关闭压缩。打开时立即压缩已有的内容，关闭时把压缩的组全部展开；目录只修改标志，影响之后在其中新建的文件
+     * @param enable 是否压缩
+     * @return 0表示成功，-1表示失败
+     */
+    int SetCompress(bool enable);
 
     /**
      * @brief 扩展文件大小
@@ -106,6 +155,23 @@ public:
      */
     int BlockMap(int logicBlockIndex);
 
+    /**
+     * @brief 将一段连续的逻辑块转换成物理块号。先一起读入覆盖这段范围的索引块，之后的BlockMap不再逐个同步读取
+     * @param firstLogicBlock 起始逻辑块号
+     * @param blockCnt 块数，超过MAX_BLOCK_BATCH或超出文件末尾的部分被忽略
+     * @param blockNos 返回物理块号
+     * @return 实际转换的块数
+     */
+    int MapBlocks(int firstLogicBlock, int blockCnt, int* blockNos);
+
+    /**
+     * @brief 预读一段逻辑块，数据块的读请求一起提交
+     * @param firstLogicBlock 起始逻辑块号
+     * @param blockCnt 块数，超过MAX_BLOCK_BATCH或超出文件末尾的部分被忽略
+     * @return 新读入缓存的数据块数
+     */
+    int ReadAhead(int firstLogicBlock, int blockCnt);
+
     /**
      * @brief 释放占用的所有Block
      * @return 0表示成功，-1表示失败
@@ -127,6 +193,27 @@ public:
      */
     int StoreToDisk(int lastAccTime, int lastModTime);
 
+    /**
+     * @brief 列出文件占用的所有数据块和索引块
+     * @param blockNos 块号追加到这里
+     * @return 0表示成功，-1表示读取索引块失败
+     */
+    int CollectBlocks(std::vector<int>& blockNos);
+
+    /**
+     * @brief 把文件同步到设备，不关闭文件。依次落盘：文件的数据块和索引块，空闲链表和SuperBlock，inode，
+     * 每一步一次设备同步。先落盘SuperBlock，崩溃后新分配给文件的块不会仍在空闲表中而被分配两次
+     * @param dataOnly 为true时只保证读出数据所需的inode字段，大小和索引表没有变化时不写inode
+     * @return 0表示成功，-1表示失败
+     */
+    int Sync(bool dataOnly);
+
+    /**
+     * @brief 把整个文件系统同步到设备：所有打开文件的inode写入缓存后，依次落盘所有脏块、SuperBlock和所有脏inode
+     * @return 0表示成功，-1表示失败
+     */
+    static int SyncAll();
+
     /* Members */
 public:
     // 由于DiskInode的缓存机制的存在，不需要i_flag机制来减少磁盘I/O
@@ -145,8 +232,9 @@ public:
     int		i_size;			///< 文件大小，字节为单位
     int		i_addr[10];		///< 用于文件逻辑块号和物理块号转换的基本索引表
 
-    int		i_used;		    ///< 指示该inode是否有效。在systemMemInodeTable中，若为1则表示有效，0表示空闲。
+    int		i_used{};	    ///< 指示该inode是否有效。在systemMemInodeTable中，若为1则表示有效，0表示空闲。
                             ///< 在UNIX V6++中，这里存放最近一次读取文件的逻辑块号，用于判断是否需要预读。
+                            ///< MoFS的顺序读取判断放在每个OpenFile中，见OpenFile::f_raNextOffset。
 
     int     i_lastAccessTime;    ///< 最后访问时间
     int     i_lastModifyTime;    ///< 最后修改时间
@@ -154,6 +242,126 @@ public:
     static MemInode systemMemInodeTable[SYSTEM_MEM_INODE_NUM]; ///< 系统全局inode表
 
 private:
+    /**
+     * @brief 读取一段已经在文件范围内的数据，不做压缩的处理
+     * @param offset 起始偏移量
+     * @param buffer 读取缓冲区
+     * @param size 读取字节数
+     * @param direct 中间的整块是否绕过缓存直接读取
+     * @return 0表示成功，-1表示错误
+     */
+    int ReadRange(int offset, char* buffer, int size, bool direct);
+
+    /**
+     * @brief 写入一段已经分配了块的数据，不做压缩的处理
+     * @param offset 起始偏移量
+     * @param buffer 写入缓冲区
+     * @param size 写入字节数
+     * @param direct 中间的整块是否绕过缓存直接写入
+     * @return 0表示成功，-1表示错误
+     */
+    int WriteRange(int offset, char* buffer, int size, bool direct);
+
+    /**
+     * @brief 是否对写入的整块去重：映象带去重表时的普通文件。目录块会在缓存中原地修改，不参与共享
+     * @return true表示去重
+     */
+    bool UsesDedup() const;
+
+    /**
+     * @brief 去重地写入一段连续的整块。内容与已有的块相同时改为引用那一块，释放原来的块；
+     * 否则写入原来的块，原来的块被共享时换成新分配的块，并记下新内容的指纹
+     * @param firstLogicBlock 第一个逻辑块号
+     * @param blockNos 这些逻辑块当前对应的物理块号，会被修改
+     * @param blockCnt 块数
+     * @param src 数据
+     * @param direct 是否绕过缓存直接写入
+     * @return 0表示成功，-1表示失败
+     */
+    int WriteBlocksDedup(int firstLogicBlock, int* blockNos, int blockCnt, const char* src, bool direct);
+
+    /**
+     * @brief 将要部分修改一块：块被共享时复制到新分配的块上，并清除指纹
+     * @param logicBlock 逻辑块号
+     * @param blockNo 当前的物理块号，复制时改为新块号
+     * @return 0表示成功，-1表示失败
+     */
+    int UnshareBlock(int logicBlock, int& blockNo);
+
+    /**
+     * @brief 是否按组压缩：带ICOMPR标志的普通文件
+     * @return true表示压缩
+     */
+    bool IsCompressed() const {
+        return (this->i_mode & ICOMPR) != 0 && (this->i_mode & IFMT) != IFDIR;
+    }
+
+    /**
+     * @brief 组中实际的逻辑块数，只有文件末尾的组可能不满
+     * @param group 组号
+     * @return 块数
+     */
+    int GroupBlockCnt(int group) const;
+
+    /**
+     * @brief 组是否以压缩形式存储，即组的最后一块在索引表中是COMPRESSED_BLOCK
+     * @param group 组号
+     * @return true表示压缩
+     */
+    bool IsGroupCompressed(int group);
+
+    /**
+     * @brief 读入并解压一个压缩的组，结果留在i_groupData中，之后读同一组不再解压
+     * @param group 组号
+     * @return 0表示成功，-1表示失败
+     */
+    int LoadGroup(int group);
+
+    /**
+     * @brief 把一组的内容写入映象。压缩后至少省下一块时，压缩数据写在组开头的几块中，其余的块释放、索引项记为COMPRESSED_BLOCK；
+     * 否则每块原样写入，原来压缩时释放的块重新分配
+     * @param group 组号
+     * @param data 组的全部内容，GroupBlockCnt(group)个整块
+     * @param rawOnDisk 映象中已经是这些未压缩的内容，压缩省不下块时不必重写
+     * @return 0表示成功，-1表示失败
+     */
+    int StoreGroup(int group, const char* data, bool rawOnDisk);
+
+    /**
+     * @brief 把压缩的组展开为每块原样存储，之后可以在缓存中按块修改
+     * @param group 组号
+     * @return 0表示成功，-1表示失败
+     */
+    int ExpandGroup(int group);
+
+    /**
+     * @brief 按组的新存储方式调整索引表：前storedCnt块需要物理块，原来是COMPRESSED_BLOCK的重新分配；
+     * 之后的块释放并记为COMPRESSED_BLOCK
+     * @param group 组号
+     * @param storedCnt 需要物理块的块数
+     * @param blockNos 返回前storedCnt块的物理块号
+     * @return 0表示成功，-1表示失败
+     */
+    int LayoutGroup(int group, int storedCnt, int* blockNos);
+
+    /**
+     * @brief 压缩被部分改写过的组。关闭、同步文件时调用
+     * @return 0表示成功，-1表示失败
+     */
+    int CompressPending();
+
+    /**
+     * @brief 修改索引表中的一项
+     * @param logicBlockIndex 逻辑块号
+     * @param blockNo 新的物理块号或COMPRESSED_BLOCK
+     * @return 0表示成功，-1表示失败
+     */
+    int SetBlockMap(int logicBlockIndex, int blockNo);
+
+    int     i_groupNo = -1;             ///< i_groupData中是哪一组解压后的内容，-1表示没有
+    std::vector<char> i_groupData;      ///< 最近读取的压缩组解压后的内容
+    std::vector<int> i_pendingGroups;   ///< 被部分改写、等待压缩的组
+
     /**
      * 构造函数，不允许在其它地方实例化MemInode
      */
@@ -12,8 +12,8 @@
 #define MAX_ERRNO 20
 #define MAX_MSG_LENGTH 32
 
-/// 对标errno，但具体值和Linux不一致
-extern int MoFSErrno;
+/// 对标errno，但具体值和Linux不一致。与errno一样每个线程各有一份
+extern thread_local int MoFSErrno;
 
 /// 每个MoFSErrno对应的错误描述
 extern char ErrnoMsg[MAX_ERRNO][MAX_MSG_LENGTH];
@@ -23,6 +23,7 @@ enum FileFlags
 {
     MOFS_READ = 0x1,			///< 读请求类型
     MOFS_WRITE = 0x2,			///< 写请求类型
+    MOFS_DIRECT_IO = 0x20,		///< 整块读写绕过缓存，由mofs_open在打开后设置
 };
 
 class OpenFile {
@@ -80,6 +81,11 @@ public:
      */
     int Seek(int offset, int fromWhere);
 
+    /**
+     * @brief 清空预读状态，下一次从文件头开始的读取被视为顺序读取
+     */
+    void ResetReadAhead();
+
 
     /**
      * @brief 检查inode是否能满足flag
@@ -107,5 +113,10 @@ public:
     int		        f_count;		///< 当前引用该文件控制块的进程数量
     MemInode*	    f_inode;		///< 指向打开文件的内存Inode指针
     int		        f_offset;		///< 文件读写位置指针
+
+    // 预读状态。本次读取从上次读取结束的位置开始时视为顺序读取，预读窗口逐次翻倍；否则窗口清零
+    int             f_raNextOffset;  ///< 上次读取结束的位置
+    int             f_raWindow;      ///< 当前预读窗口的块数，0表示没有在顺序读取
+    int             f_raEnd;         ///< 已经预读到的逻辑块号（不含）
 };
 #endif //MOFS_OPENFILE_H
@@ -13,6 +13,7 @@
 
 #include "OpenFile.h"
 #include "DirEntry.h"
+#include "device/IOStats.h"
 
 /**
  * @brief 创建普通文件，并以只读方式打开
@@ -104,6 +105,42 @@ int mofs_stat(const char *pathname, struct FileStat* statbuf);
  */
 int mofs_inode_stat(int inodeIndex, struct FileStat *statbuf);
 
+/**
+ * @brief 将文件的数据和inode同步到设备，返回后即使进程崩溃或断电也不会丢失
+ * @param fd 文件描述符
+ * @return 0为成功，-1为失败
+ * @note 依次落盘文件的数据块和索引块、空闲链表和SuperBlock、inode，每一步只做一次设备同步
+ */
+int mofs_fsync(int fd);
+
+/**
+ * @brief 与mofs_fsync相同，但只同步读出数据所需的inode字段，只有访问、修改时间变化时不写inode
+ * @param fd 文件描述符
+ * @return 0为成功，-1为失败
+ */
+int mofs_fdatasync(int fd);
+
+/**
+ * @brief 将整个文件系统缓存中的修改同步到设备，包括所有打开文件的inode
+ * @return 0为成功，-1为失败
+ */
+int mofs_sync();
+
+/**
+ * @brief 打开或关闭文件的透明压缩。目录带有此标志时，其中新建的文件和目录继承它
+ * @param pathname 路径名
+ * @param enable 非0为压缩，0为不压缩
+ * @return 0为成功，-1为失败
+ */
+int mofs_compress(const char *pathname, int enable);
+
+/**
+ * @brief 获取块缓存、inode缓存的命中与写回计数，以及映象读写的次数、字节数和延迟分布
+ * @param statbuf 存放返回信息的缓冲区
+ * @return 0为成功，-1为失败
+ */
+int mofs_get_stats(struct MoFSStats* statbuf);
+
 // 以下为mofs_open函数中oflags可使用的选项
 // 以下三项必须三选一
 const int MOFS_RDONLY = FileFlags::MOFS_READ;  ///< 0001 只读
@@ -114,6 +151,7 @@ const int MOFS_RDWR = MOFS_RDONLY | MOFS_WRONLY; ///< 0011 读写
 const int MOFS_CREAT = 0x4;                ///< 0100, 如果待打开的文件不存在，则创建
 const int MOFS_APPEND = 0x8;               ///< 1000, 将读写指针设置在结尾
 const int MOFS_DIRECTORY = 0x10;           ///< 0001 0000, 如果打开的文件不是目录文件，则返回-1
+const int MOFS_DIRECT = FileFlags::MOFS_DIRECT_IO; ///< 0010 0000, 整块的读写绕过缓存直接读写映象，用于只使用一次的大文件传输
 
 // 以下为mofs_open函数中mode可使用的选项，仅在oflags有O_CREAT时有效
 const int MOFS_IRUSR = 0400;           ///< 100 000 000 本用户可读
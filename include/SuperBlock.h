@@ -9,6 +9,8 @@
 #ifndef MOFS_SUPERBLOCK_H
 #define MOFS_SUPERBLOCK_H
 
+#include <vector>
+
 /**
  * @brief 超级块类
  */
@@ -27,11 +29,34 @@ public:
 
     /**
      * 格式化
-     * @param totalDiskByte 待格式化的磁盘字节数，会创建这么大的磁盘映象
+     * @param totalDiskByte 待格式化的磁盘字节数，会创建这么大的磁盘映象。块号是32位的，块数不能超过INT_MAX
      * @param inodeNum 最大inode数量
+     * @param blockSize 块大小，须为MIN_BLOCK_SIZE到MAX_BLOCK_SIZE之间的2的幂
+     * @param checksum 是否为每块记录CRC32C，校验和区占用映象末尾的空间
+     * @param dedup 是否启用块级去重，去重表占用block区末尾的块
+     * @param journal 是否启用元数据日志，日志区占用block区最末尾的块
+     * @param bitmap 是否用位图代替空闲链表管理空闲块，位图占用去重表之前的块
+     * @return 0表示成功，-1表示出错
+     */
+    static int MakeFS(long long totalDiskByte, int inodeNum, int blockSize, bool checksum, bool dedup, bool journal, bool bitmap);
+
+    /**
+     * @brief 加载SuperBlock之后，按其中的记录启用或关闭日志，重放已提交的事务。需要在LoadDedupTable之前调用
+     * @return 重放的事务数，-1表示出错
+     */
+    int LoadJournal();
+
+    /**
+     * @brief 加载SuperBlock之后，按其中的记录启用或关闭去重表
      * @return 0表示成功，-1表示出错
      */
-    static int MakeFS(int totalDiskByte, int inodeNum);
+    int LoadDedupTable();
+
+    /**
+     * @brief 加载SuperBlock之后，按其中的记录启用或关闭空闲块位图。需要在LoadJournal之后调用
+     * @return 0表示成功，-1表示出错
+     */
+    int LoadBlockBitmap();
 
     /**
      * @brief 分配一个块，存数据
@@ -40,12 +65,28 @@ public:
     int AllocBlock();
 
     /**
-     * @brief 释放一个块，标记为空闲块
+     * @brief 分配一段连续的块。使用空闲链表时每次只分配一块
+     * @param count 最多分配的块数
+     * @param goal 希望从这一块开始，不大于0时不指定
+     * @param allocated 实际分配的块数，在1到count之间
+     * @return 第一块的块号，-1表示出错
+     */
+    int AllocBlocks(int count, int goal, int& allocated);
+
+    /**
+     * @brief 释放一个块，标记为空闲块。去重后仍被其它文件引用的块只减少引用数；启用日志时推迟到事务提交时放回空闲表
      * @param blockIdx 待释放的块号
      * @return 0表示成功，-1表示出错
      */
     int ReleaseBlock(int blockIdx);
 
+    /**
+     * @brief 把块放回空闲表，使用位图时清除它的占用位
+     * @param blockIdx 块号
+     * @return 0表示成功，-1表示出错
+     */
+    int AddFreeBlock(int blockIdx);
+
     /**
      * @brief 分配一个DiskInode
      * @return 分配到的DiskInode号，-1表示出错
@@ -59,6 +100,22 @@ public:
      */
     int ReleaseInode(int inodeIdx);
 
+    /**
+     * @brief 把去重表、空闲块位图、空闲块和空闲inode的链表块和SuperBlock依次写入映象并同步到设备。
+     * 链表块先落盘，SuperBlock指向它们时它们已经完整；SuperBlock没有修改时只处理链表块
+     * @return 0表示成功，-1表示出错
+     */
+    int Flush();
+
+private:
+    /**
+     * @brief 写入一个空闲链表块，并记下它，Flush时先于SuperBlock落盘
+     * @param blockIdx 块号
+     * @param content 块内容
+     * @return 0表示成功，-1表示出错
+     */
+    static int WriteListBlock(int blockIdx, void* content);
+
     /* Members */
 public:
     int		s_isize;		///< 外存Inode区占用的盘块数
@@ -78,10 +135,22 @@ public:
     int		s_fmod;			///< 内存中super block副本被修改标志，意味着需要更新外存对应的Super Block
     int		s_ronly;		///< 本文件系统只能读出
     int		s_time;			///< 最近一次更新时间
-    int		padding[45];	///< 填充使SuperBlock块大小等于1024字节，占据2个扇区
+    int     s_blockSize;    ///< 块大小(字节)，0表示旧格式的映象，块大小为512字节
+    long long s_imageByte;  ///< 文件系统占用的映象字节数，即最后一块的结束位置；0表示没有记录的旧映象
+    int     s_checksum;     ///< 非0表示映象末尾有校验和区，每块一个CRC32C
+    int     s_dedupBlock;   ///< 去重表的第一块，之前的块是数据块；s_dedupBlockCnt为0时无意义
+    int     s_dedupBlockCnt;///< 去重表占用的块数，0表示没有启用去重
+    int     s_journalBlock; ///< 日志区的第一块；s_journalBlockCnt为0时无意义
+    int     s_journalBlockCnt;///< 日志区占用的块数，0表示没有启用日志
+    int     s_bitmapBlock;  ///< 空闲块位图的第一块，之前的块是数据块；s_bitmapBlockCnt为0时无意义
+    int     s_bitmapBlockCnt;///< 位图占用的块数，0表示使用空闲链表
+    int		padding[35];	///< 填充使SuperBlock块大小等于1024字节，占据2个扇区
 
 
     static SuperBlock superBlock; ///< SuperBlock单例
+
+private:
+    static std::vector<int> unsyncedListBlocks; ///< 上次Flush之后写入的链表块号，静态成员不占用磁盘上SuperBlock的空间
 };
 
 #endif //MOFS_SUPERBLOCK_H
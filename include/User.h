@@ -103,6 +103,22 @@ public:
      */
     int Seek(int fd, int offset, int fromWhere);
 
+    /**
+     * @brief 将打开的文件同步到设备
+     * @param fd file descriptor
+     * @param dataOnly 是否只同步数据和读出数据所需的inode字段
+     * @return 0表示成功，-1表示失败
+     */
+    int Sync(int fd, bool dataOnly);
+
+    /**
+     * @brief 打开或关闭文件的压缩，需要写权限；对目录设置时影响之后在其中新建的文件和目录
+     * @param path 路径
+     * @param enable 是否压缩
+     * @return 0表示成功，-1表示失败
+     */
+    int SetCompress(const char* path, bool enable);
+
     /**
      * @brief 切换用户工作目录
      * @param new_dir 新的工作目录
@@ -0,0 +1,213 @@
+﻿/**
+ * @file AsyncIO.h
+ * @brief 异步I/O提交/完成队列：Linux下使用io_uring，不可用时退化为工作线程池
+ * @author 韩孟霖
+ * @date 2022/6/8
+ * @license GPL v3
+ */
+
+#ifndef MOFS_ASYNCIO_H
+#define MOFS_ASYNCIO_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#include "BlockDevice.h"
+
+/// 同时在途的请求数上限
+#define ASYNC_IO_QUEUE_DEPTH 64
+
+/// 线程池的工作线程数
+#define ASYNC_IO_WORKER_NUM 4
+
+/// 一次分散读/聚集写最多的段数，不超过IOV_MAX
+#define ASYNC_IO_MAX_VECTOR 256
+
+/// 请求类型
+#define ASYNC_IO_READ   0
+#define ASYNC_IO_WRITE  1
+
+/**
+ * @brief 一次异步读写请求，在完成之前调用者需要保证它和buffer都有效
+ */
+struct AsyncRequest {
+    int opcode;         ///< ASYNC_IO_READ 或 ASYNC_IO_WRITE
+    long long offset;   ///< 映象内偏移量
+    void* buffer;       ///< 数据缓冲区
+    long long length;   ///< 字节数
+    long long result;   ///< 完成后为实际读写的字节数，-1表示出错
+    int tag;            ///< 调用者自定义，例如对应的缓存块序号
+    const BlockIOVec* vector; ///< 非空时为分散读/聚集写，忽略buffer，length为各段长度之和
+    int vectorCnt;      ///< vector的段数
+};
+
+/**
+ * @brief 异步I/O队列。Submit只把请求放入提交队列，Complete统一提交并等待完成，
+ * 多个请求可以同时在途
+ */
+class AsyncIO {
+public:
+    virtual ~AsyncIO() = default;
+
+    /**
+     * @brief 将请求放入提交队列。在途请求达到队列深度时，先等待一部分完成
+     * @param request 请求
+     * @return 0表示成功，-1表示出错
+     */
+    virtual int Submit(AsyncRequest* request) = 0;
+
+    /**
+     * @brief 提交所有排队的请求，并等待至少minCnt个请求完成
+     * @param minCnt 至少等待完成的请求数
+     * @return 自上次调用以来完成的请求数，结果写在各请求的result中
+     */
+    virtual int Complete(int minCnt) = 0;
+
+    /**
+     * @brief 实现的名称
+     * @return uring threads inline
+     */
+    virtual const char* Name() const = 0;
+
+    /**
+     * @brief 提交一组请求并等待全部完成
+     * @param requests 请求数组
+     * @param count 请求数量
+     * @return 结果不等于length的请求数量
+     */
+    int SubmitAll(AsyncRequest* requests, int count);
+
+    /**
+     * @brief 根据名称创建异步I/O队列
+     * @param name auto uring threads off。auto依次尝试io_uring和线程池；off在调用线程中同步执行
+     * @param device 映象设备
+     * @return 队列，名称无法识别或指定的实现不可用时返回nullptr
+     */
+    static AsyncIO* AsyncIOFactory(const char* name, BlockDevice* device);
+};
+
+/**
+ * @brief 在Submit时直接同步执行，用于不支持并发读写的设备
+ */
+class InlineAsyncIO : public AsyncIO {
+public:
+    explicit InlineAsyncIO(BlockDevice* device);
+
+    int Submit(AsyncRequest* request) override;
+
+    int Complete(int minCnt) override;
+
+    const char* Name() const override {
+        return "inline";
+    }
+
+private:
+    BlockDevice* device;
+    int completedCnt{}; ///< 尚未被Complete报告的完成数
+};
+
+/**
+ * @brief 工作线程池，每个线程用设备的Read/Write执行请求，设备需要支持并发读写不同的区域
+ */
+class ThreadPoolAsyncIO : public AsyncIO {
+public:
+    ThreadPoolAsyncIO(BlockDevice* device, int workerNum);
+
+    ~ThreadPoolAsyncIO() override;
+
+    int Submit(AsyncRequest* request) override;
+
+    int Complete(int minCnt) override;
+
+    const char* Name() const override {
+        return "threads";
+    }
+
+private:
+    /**
+     * @brief 工作线程主循环
+     */
+    void WorkerLoop();
+
+    BlockDevice* device;
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable submitCond;     ///< 有新请求或需要退出
+    std::condition_variable completeCond;   ///< 有请求完成
+    std::deque<AsyncRequest*> pendingQueue; ///< 等待执行的请求
+    int inflightCnt{};  ///< 已提交但未被Complete报告的请求数
+    int completedCnt{}; ///< 尚未被Complete报告的完成数
+    bool stopping{};
+};
+
+#ifdef __linux__
+/**
+ * @brief 直接使用io_uring系统调用，不依赖liburing。请求以READV/WRITEV提交，要求内核不低于5.1
+ */
+class UringAsyncIO : public AsyncIO {
+public:
+    ~UringAsyncIO() override;
+
+    /**
+     * @brief 建立io_uring
+     * @param fd 映象文件描述符
+     * @param queueDepth 队列深度
+     * @return 0表示成功，-1表示内核不支持或被禁止
+     */
+    int Init(int fd, int queueDepth);
+
+    int Submit(AsyncRequest* request) override;
+
+    int Complete(int minCnt) override;
+
+    const char* Name() const override {
+        return "uring";
+    }
+
+private:
+    /**
+     * @brief 收割完成队列中的所有事件
+     */
+    void Reap();
+
+    /**
+     * @brief 调用io_uring_enter提交排队的请求
+     * @param waitCnt 等待完成的请求数
+     * @return 0表示成功，-1表示出错
+     */
+    int Enter(int waitCnt);
+
+    int ringFd{-1};
+    int fileFd{-1};
+
+    void* sqRing{};
+    size_t sqRingSize{};
+    void* cqRing{};
+    size_t cqRingSize{};
+    void* sqes{};
+    size_t sqesSize{};
+
+    unsigned* sqHead{};
+    unsigned* sqTail{};
+    unsigned* sqMask{};
+    unsigned* sqArray{};
+    unsigned sqEntries{};
+    unsigned* cqHead{};
+    unsigned* cqTail{};
+    unsigned* cqMask{};
+    void* cqes{};
+
+    struct SlotInfo;
+    SlotInfo* slots{};      ///< 每个在途请求的iovec和请求指针，以user_data索引
+    int* freeSlots{};       ///< 空闲slot栈
+    int freeSlotTop{};
+    int toSubmitCnt{};      ///< 已放入SQ但尚未io_uring_enter的请求数
+    int inflightCnt{};      ///< 已放入SQ但尚未完成的请求数
+    int completedCnt{};     ///< 尚未被Complete报告的完成数
+};
+#endif
+
+#endif //MOFS_ASYNCIO_H
@@ -0,0 +1,363 @@
+﻿/**
+ * @file BlockDevice.h
+ * @brief 映象文件的I/O接口，以及基于stdio、POSIX文件描述符、内存映射和纯内存的实现
+ * @author 韩孟霖
+ * @date 2022/6/6
+ * @license GPL v3
+ */
+
+#ifndef MOFS_BLOCKDEVICE_H
+#define MOFS_BLOCKDEVICE_H
+
+#include <cstdio>
+#include <cstddef>
+
+/// 访问模式提示，对应posix_fadvise的advice
+#define DEVICE_ADVICE_NORMAL        0
+#define DEVICE_ADVICE_SEQUENTIAL    1
+#define DEVICE_ADVICE_RANDOM        2
+#define DEVICE_ADVICE_WILLNEED      3
+#define DEVICE_ADVICE_DONTNEED      4
+
+/// 直接I/O要求偏移量、长度和内存地址对齐的字节数
+#define DIRECT_IO_ALIGN 4096
+
+/// 以此为前缀的映象路径表示内存盘，如 mem:64 表示64MB
+#define MEMORY_IMAGE_PREFIX "mem:"
+
+/**
+ * @brief 一段连续的内存，用于聚集写
+ */
+struct BlockIOVec {
+    void* base;     ///< 首地址
+    size_t length;  ///< 字节数
+};
+
+/**
+ * @brief 映象文件的I/O接口，DeviceManager通过它读写映象，偏移量均为映象内的绝对字节偏移
+ */
+class BlockDevice {
+public:
+    virtual ~BlockDevice() = default;
+
+    /**
+     * @brief 打开映象文件，不存在时创建
+     * @param imagePath 映象路径
+     * @return 0表示成功，-1表示出错
+     */
+    virtual int Open(const char* imagePath) = 0;
+
+    /**
+     * @brief 关闭映象文件
+     */
+    virtual void Close() = 0;
+
+    /**
+     * @brief 从offset处读取size字节
+     * @param offset 映象内偏移量
+     * @param buffer 目标缓冲区
+     * @param size 字节数
+     * @return 实际读取的字节数，读到文件末尾时小于size
+     */
+    virtual long long Read(long long offset, void* buffer, long long size) = 0;
+
+    /**
+     * @brief 向offset处写入size字节
+     * @param offset 映象内偏移量
+     * @param buffer 源缓冲区
+     * @param size 字节数
+     * @return 实际写入的字节数
+     */
+    virtual long long Write(long long offset, const void* buffer, long long size) = 0;
+
+    /**
+     * @brief 将从offset开始的连续区域依次读入多段内存
+     * @param offset 映象内偏移量
+     * @param iov 内存段数组
+     * @param iovCnt 内存段数量
+     * @return 实际读取的字节数
+     */
+    virtual long long ReadV(long long offset, const BlockIOVec* iov, int iovCnt);
+
+    /**
+     * @brief 将多段内存依次写入从offset开始的连续区域
+     * @param offset 映象内偏移量
+     * @param iov 内存段数组
+     * @param iovCnt 内存段数量
+     * @return 实际写入的字节数
+     */
+    virtual long long WriteV(long long offset, const BlockIOVec* iov, int iovCnt);
+
+    /**
+     * @brief 绕过内核页缓存读取，offset、size和buffer都要按DIRECT_IO_ALIGN对齐。不支持直接I/O的实现退化为Read
+     * @param offset 映象内偏移量
+     * @param buffer 目标缓冲区
+     * @param size 字节数
+     * @return 实际读取的字节数
+     */
+    virtual long long ReadDirect(long long offset, void* buffer, long long size) {
+        return this->Read(offset, buffer, size);
+    }
+
+    /**
+     * @brief 绕过内核页缓存写入，对齐要求同ReadDirect。不支持直接I/O的实现退化为Write
+     * @param offset 映象内偏移量
+     * @param buffer 源缓冲区
+     * @param size 字节数
+     * @return 实际写入的字节数
+     */
+    virtual long long WriteDirect(long long offset, const void* buffer, long long size) {
+        return this->Write(offset, buffer, size);
+    }
+
+    /**
+     * @brief 向内核提示接下来的访问模式，不支持的实现忽略即可
+     * @param offset 区域起始偏移量
+     * @param length 区域长度，0表示到文件末尾
+     * @param advice DEVICE_ADVICE_*
+     */
+    virtual void Advise(long long offset, long long length, int advice) {}
+
+    /**
+     * @brief 保证映象至少有size字节，不足时扩展（扩展的部分为空洞）
+     * @param size 映象字节数
+     * @return 0表示成功，-1表示出错
+     */
+    virtual int Reserve(long long size) {
+        return 0;
+    }
+
+    /**
+     * @brief 映象当前的字节数
+     * @return 字节数，-1表示出错
+     */
+    virtual long long Size() = 0;
+
+    /**
+     * @brief 将指定范围内的修改写入存储设备
+     * @param offset 区域起始偏移量
+     * @param length 区域长度
+     * @return 0表示成功，-1表示出错
+     */
+    virtual int Flush(long long offset, long long length) {
+        return 0;
+    }
+
+    /**
+     * @brief 等待此前所有写入落到存储设备上，相当于对映象做一次fdatasync
+     * @return 0表示成功，-1表示出错
+     */
+    virtual int Sync() {
+        return 0;
+    }
+
+    /**
+     * @brief 映象的文件描述符，供io_uring等直接提交请求
+     * @return 文件描述符，没有时为-1
+     */
+    virtual int FileDescriptor() const {
+        return -1;
+    }
+
+    /**
+     * @brief 是否支持多个线程同时读写不同的区域，不支持时DeviceManager用ioMutex串行化所有读写
+     * @return true表示支持
+     */
+    virtual bool IsConcurrent() const {
+        return this->FileDescriptor() >= 0;
+    }
+
+    /**
+     * @brief 是否将映象映射进内存。为true时DeviceManager绕过自己的缓存，直接读写MappedData
+     * @return true表示映射
+     */
+    virtual bool IsMapped() const {
+        return false;
+    }
+
+    /**
+     * @brief 映象在内存中的映射
+     * @return 映射首地址，不支持映射或映象为空时为nullptr
+     */
+    virtual char* MappedData() {
+        return nullptr;
+    }
+
+    /**
+     * @brief 映射覆盖的字节数
+     * @return 字节数，不支持映射时为0
+     */
+    virtual long long MappedSize() const {
+        return 0;
+    }
+
+    /**
+     * @brief 根据名称创建设备
+     * @param deviceName 设备名称，可为 stdio pread mmap mem
+     * @return 设备，名称无法识别时返回nullptr
+     */
+    static BlockDevice* DeviceFactory(const char* deviceName);
+
+    /**
+     * @brief 映象路径是否表示内存盘
+     * @param imagePath 映象路径
+     * @return true表示以MEMORY_IMAGE_PREFIX开头
+     */
+    static bool IsMemoryImage(const char* imagePath);
+};
+
+/**
+ * @brief 纯内存的映象，打开时按路径中的容量一次分配，关闭后内容即丢弃。
+ * 没有磁盘I/O，用于测量文件系统自身的开销，所有平台可用
+ */
+class MemoryBlockDevice : public BlockDevice {
+public:
+    ~MemoryBlockDevice() override;
+
+    /**
+     * @brief 分配内存盘
+     * @param imagePath 形如 mem:SIZE，SIZE可带K、M、G后缀，不带时以MB为单位
+     * @return 0表示成功，-1表示容量无法解析或内存不足
+     */
+    int Open(const char* imagePath) override;
+
+    void Close() override;
+
+    long long Read(long long offset, void* buffer, long long size) override;
+
+    long long Write(long long offset, const void* buffer, long long size) override;
+
+    /**
+     * @brief 容量固定，不能超出Open时分配的大小
+     */
+    int Reserve(long long size) override;
+
+    long long Size() override {
+        return this->capacity;
+    }
+
+    bool IsConcurrent() const override {
+        return true;
+    }
+
+private:
+    char* data{};           ///< 内存盘首地址
+    long long capacity{};   ///< 内存盘字节数
+};
+
+/**
+ * @brief 基于stdio FILE*的实现，每次读写前fseek，所有平台可用
+ */
+class StdioBlockDevice : public BlockDevice {
+public:
+    ~StdioBlockDevice() override;
+
+    int Open(const char* imagePath) override;
+
+    void Close() override;
+
+    long long Read(long long offset, void* buffer, long long size) override;
+
+    long long Write(long long offset, const void* buffer, long long size) override;
+
+    long long Size() override;
+
+    int Sync() override;
+
+private:
+    FILE* imgFilePtr{}; ///< 映象文件指针
+};
+
+#ifndef _WIN32
+/**
+ * @brief 基于文件描述符的实现。pread/pwrite不需要单独的lseek，也没有stdio的用户态缓冲，
+ * 分散读、聚集写使用preadv、pwritev，访问模式提示使用posix_fadvise
+ */
+class PosixBlockDevice : public BlockDevice {
+public:
+    ~PosixBlockDevice() override;
+
+    int Open(const char* imagePath) override;
+
+    void Close() override;
+
+    long long Read(long long offset, void* buffer, long long size) override;
+
+    long long Write(long long offset, const void* buffer, long long size) override;
+
+    long long ReadV(long long offset, const BlockIOVec* iov, int iovCnt) override;
+
+    long long WriteV(long long offset, const BlockIOVec* iov, int iovCnt) override;
+
+    long long ReadDirect(long long offset, void* buffer, long long size) override;
+
+    long long WriteDirect(long long offset, const void* buffer, long long size) override;
+
+    void Advise(long long offset, long long length, int advice) override;
+
+    long long Size() override;
+
+    int Sync() override;
+
+    int FileDescriptor() const override {
+        return this->fd;
+    }
+
+private:
+    int fd{-1}; ///< 映象文件描述符
+    int directFd{-1}; ///< 以O_DIRECT打开的同一映象，文件系统不支持时为-1，直接I/O退化为读写后丢弃页缓存
+};
+
+/**
+ * @brief 将整个映象用mmap映射进内存，由内核页缓存充当块缓存。
+ * Read/Write仍然可用（在映射上memcpy），DeviceManager在这种模式下直接使用MappedData
+ */
+class MmapBlockDevice : public BlockDevice {
+public:
+    ~MmapBlockDevice() override;
+
+    int Open(const char* imagePath) override;
+
+    void Close() override;
+
+    long long Read(long long offset, void* buffer, long long size) override;
+
+    long long Write(long long offset, const void* buffer, long long size) override;
+
+    void Advise(long long offset, long long length, int advice) override;
+
+    int Reserve(long long size) override;
+
+    long long Size() override;
+
+    int Flush(long long offset, long long length) override;
+
+    int Sync() override;
+
+    bool IsMapped() const override {
+        return true;
+    }
+
+    char* MappedData() override {
+        return this->mappedData;
+    }
+
+    long long MappedSize() const override {
+        return this->mappedSize;
+    }
+
+private:
+    /**
+     * @brief 按文件当前大小重新建立映射
+     * @param size 文件字节数
+     * @return 0表示成功，-1表示出错
+     */
+    int Remap(long long size);
+
+    int fd{-1};                 ///< 映象文件描述符
+    char* mappedData{};         ///< 映射首地址
+    long long mappedSize{};     ///< 映射字节数
+};
+#endif
+
+#endif //MOFS_BLOCKDEVICE_H
@@ -10,9 +10,159 @@
 #define MOFS_BUFFER_H
 
 /**
- * 实现缓存机制的链表，可以适配block和inode的缓存机制
+ * @brief 块号 -> 缓存块序号 的开放寻址哈希索引（线性探测），使命中与未命中的查找都是O(1)
  */
-class BufferLinkList {
+class BufferHashIndex {
+public:
+    /**
+     * @brief 构造函数
+     * @param bufferNum 缓存块数量，哈希表大小取不小于其两倍的2的幂
+     */
+    explicit BufferHashIndex(int bufferNum);
+
+    /**
+     * @brief 析构函数
+     */
+    ~BufferHashIndex();
+
+    /**
+     * @brief 查找块号对应的缓存块序号
+     * @param blockIdx 目标块序号
+     * @return 缓存块序号，-1表示不存在
+     */
+    int Find(int blockIdx) const;
+
+    /**
+     * @brief 插入一条索引，blockIdx为负时忽略
+     * @param blockIdx 目标块序号
+     * @param bufferIdx 缓存块序号
+     */
+    void Insert(int blockIdx, int bufferIdx);
+
+    /**
+     * @brief 删除一条索引，采用后移删除，无需墓碑标记
+     * @param blockIdx 目标块序号
+     */
+    void Erase(int blockIdx);
+
+    /**
+     * @brief 清空索引
+     */
+    void Clear();
+
+private:
+    /**
+     * @brief 计算块号的初始探测位置
+     * @param blockIdx 块号
+     * @return 哈希表下标
+     */
+    int Slot(int blockIdx) const;
+
+    int* keyTable;   ///< 每个槽保存的块号，-1表示空槽
+    int* valueTable; ///< 每个槽保存的缓存块序号
+    int tableMask;   ///< 哈希表大小 - 1
+    int tableShift;  ///< 32 - log2(哈希表大小)，取乘法哈希的高位
+};
+
+/**
+ * @brief 缓存置换策略的接口。策略只管理缓存块序号与块号的对应关系，不接触缓存内容
+ */
+class BufferPolicy {
+public:
+    /**
+     * @brief 构造函数
+     * @param bufferNum 缓存块数量
+     */
+    explicit BufferPolicy(int bufferNum);
+
+    /**
+     * @brief 析构函数
+     */
+    virtual ~BufferPolicy();
+
+    /**
+     * @brief 获取目标块对应的缓存块的地址，命中时更新策略的状态
+     * @param blockIdx 目标块序号
+     * @return 缓存块序号，-1表示未缓存
+     */
+    virtual int GetBufferedIndex(int blockIdx) = 0;
+
+    /**
+     * @brief 分配一个新的缓存块，被固定的缓存块不会被换出
+     * @param blockIdx 目标块序号
+     * @param oldBlockIdx 被换出的块序号，-1为未换出
+     * @return 分配的缓存块序号，-1表示所有缓存块都被固定
+     */
+    virtual int AllocNewBuffer(int blockIdx, int &oldBlockIdx) = 0;
+
+    /**
+     * @brief 清空所有缓存块，恢复到初始状态
+     */
+    virtual void Reset() = 0;
+
+    /**
+     * @brief 按名称构造置换策略
+     * @param policyName 策略名称，可为 lru clock 2q arc
+     * @param bufferNum 缓存块数量
+     * @return 构造出的策略，名称无法识别时返回nullptr
+     */
+    static BufferPolicy* PolicyFactory(const char* policyName, int bufferNum);
+
+    /**
+     * @brief 固定缓存块，使其不会被换出，可以重复固定
+     * @param bufferIdx 缓存块序号
+     */
+    void Pin(int bufferIdx) {
+        ++this->pinCount[bufferIdx];
+    }
+
+    /**
+     * @brief 解除一次固定
+     * @param bufferIdx 缓存块序号
+     */
+    void Unpin(int bufferIdx) {
+        --this->pinCount[bufferIdx];
+    }
+
+    /**
+     * @brief 判断缓存块是否被固定
+     * @param bufferIdx 缓存块序号
+     * @return true表示被固定
+     */
+    bool IsPinned(int bufferIdx) const {
+        return this->pinCount[bufferIdx] > 0;
+    }
+
+    /**
+     * @brief 使缓存块失效，它不再对应任何块，之后会被正常地换出
+     * @param bufferIdx 缓存块序号
+     */
+    void Invalidate(int bufferIdx);
+
+    /**
+     * @brief 刚分配出的缓存块改回对应被换出的块，用于被换出的脏块没能写回时
+     * @param bufferIdx 缓存块序号
+     * @param blockIdx 被换出的块序号
+     */
+    virtual void Restore(int bufferIdx, int blockIdx);
+
+    int bufferNum; ///< 缓存块数量
+    int* numberLinkList; ///< 指示每个缓存块缓存的块编号，-1表示空闲
+    BufferHashIndex hashIndex; ///< 块编号 -> 缓存块的哈希索引
+
+protected:
+    /**
+     * @brief 清空块编号、固定计数和哈希索引，供Reset使用
+     */
+    void ClearBuffers();
+
+    int* pinCount; ///< 每个缓存块被固定的次数
+};
+
+/**
+ * 实现缓存机制的链表（LRU策略），可以适配block和inode的缓存机制
+ */
+class BufferLinkList : public BufferPolicy {
 public:
     /**
      * @brief 构造函数
@@ -23,12 +173,11 @@ public:
     /**
      * @brief 析构函数
      */
-    ~BufferLinkList();
+    ~BufferLinkList() override;
 
     // 这里采用序号的方式而非使用指针相互勾结，主要考量是在搜寻需要的块时，连续的内存地址能够增加CPU L1 cache hit 的概率
     int* prevLinkList; ///< 指示每个结点的前一项是谁（尾结点 -> 头结点）
     int* nextLinkList; ///< 指示每个结点的后一项是谁 （头结点 -> 尾结点）
-    int* numberLinkList; ///< 指示缓存的块编号
 
     int headPtr; ///< 指向头结点
     int rearPtr; ///< 指向尾结点（最后一个占用结点），指向-1表示结点全空闲
@@ -38,15 +187,20 @@ public:
      * @param blockIdx 目标块序号
      * @return 缓存块序号，-1表示未缓存
      */
-    int GetBufferedIndex(int blockIdx);
+    int GetBufferedIndex(int blockIdx) override;
 
     /**
      * @brief 分配一个新的缓存块
      * @param blockIdx 目标块序号
      * @param oldBlockIdx 被换出的块序号，-1为未换出
-     * @return 分配的缓存块序号，缓存机制保证一定返回有意义的值
+     * @return 分配的缓存块序号，-1表示所有缓存块都被固定
+     */
+    int AllocNewBuffer(int blockIdx, int &oldBlockIdx) override;
+
+    /**
+     * @brief 清空链表
      */
-    int AllocNewBuffer(int blockIdx, int &oldBlockIdx);
+    void Reset() override;
 
     /**
      * 初始化链表
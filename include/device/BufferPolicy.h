@@ -0,0 +1,179 @@
+﻿/**
+ * @file BufferPolicy.h
+ * @brief LRU以外的缓存置换策略：CLOCK、2Q、ARC
+ * @author 韩孟霖
+ * @date 2022/6/4
+ * @license GPL v3
+ */
+
+#ifndef MOFS_BUFFERPOLICY_H
+#define MOFS_BUFFERPOLICY_H
+
+#include "Buffer.h"
+
+/**
+ * @brief 基于序号的双向链表，结点的前后指针保存在共享的数组中，多条链表可以共用一组数组
+ */
+class IndexList {
+public:
+    /**
+     * @brief 构造函数
+     * @param prevArray 前指针数组
+     * @param nextArray 后指针数组
+     */
+    IndexList(int* prevArray, int* nextArray);
+
+    /**
+     * @brief 将结点插入表头（最近使用端）
+     * @param idx 结点序号
+     */
+    void PushHead(int idx);
+
+    /**
+     * @brief 将结点从表中移除
+     * @param idx 结点序号
+     */
+    void Remove(int idx);
+
+    /**
+     * @brief 清空链表，不修改数组内容
+     */
+    void Clear();
+
+    /**
+     * @brief 从表尾（最久未使用端）向表头寻找第一个没有被固定的结点
+     * @param policy 记录固定状态的策略
+     * @return 结点序号，-1表示全部被固定
+     */
+    int LastUnpinned(const BufferPolicy* policy) const;
+
+    int head; ///< 表头，-1表示空表
+    int tail; ///< 表尾，-1表示空表
+    int size; ///< 结点数量
+
+private:
+    int* prevArray;
+    int* nextArray;
+};
+
+/**
+ * @brief CLOCK策略：命中时只设置访问位，不移动任何结点；换出时指针扫过访问位为1的块并清零
+ */
+class ClockBufferPolicy : public BufferPolicy {
+public:
+    explicit ClockBufferPolicy(int bufferNum);
+
+    ~ClockBufferPolicy() override;
+
+    int GetBufferedIndex(int blockIdx) override;
+
+    int AllocNewBuffer(int blockIdx, int &oldBlockIdx) override;
+
+    void Reset() override;
+
+private:
+    char* referenceBit; ///< 每个缓存块的访问位
+    int clockHand;      ///< 时钟指针
+    int usedNum;        ///< 已经使用过的缓存块数量，小于bufferNum时直接分配空闲块
+};
+
+/**
+ * @brief 2Q策略（Johnson & Shasha）。新块进入FIFO队列A1in，被换出后记录在只保存块号的A1out中；
+ * 只有在A1out中再次被访问的块才进入LRU队列Am。一次性的顺序扫描只会冲刷A1in，不会冲刷Am
+ */
+class TwoQueueBufferPolicy : public BufferPolicy {
+public:
+    explicit TwoQueueBufferPolicy(int bufferNum);
+
+    ~TwoQueueBufferPolicy() override;
+
+    int GetBufferedIndex(int blockIdx) override;
+
+    int AllocNewBuffer(int blockIdx, int &oldBlockIdx) override;
+
+    void Reset() override;
+
+    void Restore(int bufferIdx, int blockIdx) override;
+
+private:
+    /**
+     * @brief 选出被换出的缓存块，并维护A1out
+     * @return 缓存块序号
+     */
+    int Reclaim();
+
+    int* prevArray;
+    int* nextArray;
+    char* queueFlag;  ///< 缓存块所在的队列，0为空闲，1为A1in，2为Am
+    IndexList a1in;   ///< FIFO队列
+    IndexList am;     ///< LRU队列
+    int a1inLimit;    ///< A1in的目标长度
+    int usedNum;      ///< 已经使用过的缓存块数量
+
+    int* ghostRing;   ///< A1out，环形保存被换出的块号，-1表示该位置无效
+    int ghostLimit;   ///< A1out的长度
+    int ghostPos;     ///< 下一个写入位置，同时也是最老的记录
+    BufferHashIndex ghostIndex; ///< 块号 -> ghostRing位置
+};
+
+/**
+ * @brief ARC策略（Megiddo & Modha）。T1/T2分别保存只访问过一次、访问过多次的块，B1/B2记录它们最近被换出的块号，
+ * 根据在B1/B2中的命中情况自适应地调整T1的目标长度
+ */
+class ARCBufferPolicy : public BufferPolicy {
+public:
+    explicit ARCBufferPolicy(int bufferNum);
+
+    ~ARCBufferPolicy() override;
+
+    int GetBufferedIndex(int blockIdx) override;
+
+    int AllocNewBuffer(int blockIdx, int &oldBlockIdx) override;
+
+    void Reset() override;
+
+    void Restore(int bufferIdx, int blockIdx) override;
+
+private:
+    /**
+     * @brief ARC中的REPLACE过程，从T1或T2中换出一块并记入B1或B2
+     * @param hitInB2 本次请求是否命中B2
+     * @return 被换出的缓存块序号
+     */
+    int Replace(bool hitInB2);
+
+    /**
+     * @brief 将块号记入幽灵链表的表头
+     * @param ghostList B1或B2
+     * @param blockIdx 块号
+     */
+    void PushGhost(IndexList& ghostList, int blockIdx);
+
+    /**
+     * @brief 删除一个幽灵结点
+     * @param ghostList 结点所在的B1或B2
+     * @param ghostIdx 结点序号
+     */
+    void RemoveGhost(IndexList& ghostList, int ghostIdx);
+
+    int* prevArray;
+    int* nextArray;
+    char* listFlag;   ///< 缓存块所在的链表，0为空闲，1为T1，2为T2
+    IndexList t1;
+    IndexList t2;
+    int usedNum;      ///< 已经使用过的缓存块数量
+
+    int* ghostPrev;
+    int* ghostNext;
+    int* ghostKey;    ///< 幽灵结点记录的块号
+    char* ghostFlag;  ///< 幽灵结点所在的链表，0为空闲，1为B1，2为B2
+    int* ghostFree;   ///< 空闲幽灵结点栈
+    int ghostFreeTop;
+    IndexList b1;
+    IndexList b2;
+    BufferHashIndex ghostIndex; ///< 块号 -> 幽灵结点
+
+    int target; ///< T1的目标长度 p
+};
+
+#endif //MOFS_BUFFERPOLICY_H
@@ -10,22 +10,84 @@
 #define MOFS_DEVICEMANAGER_H
 #include <string>
 #include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <cstdint>
 
 #include "../DiskInode.h"
 #include "Buffer.h"
+#include "BlockDevice.h"
+#include "AsyncIO.h"
+#include "IOStats.h"
 
 
-/// 块大小(字节)
-#define BLOCK_SIZE 512
+/// 格式化时的默认块大小(字节)，可由 --block-size 修改
+#define DEFAULT_BLOCK_SIZE 4096
+
+/// 块大小的取值范围(字节)，块大小必须是2的幂
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+/// 旧格式映象的块大小(字节)，SuperBlock中s_blockSize为0的映象使用旧的布局
+#define LEGACY_BLOCK_SIZE 512
 
 /// 设备前部占用空间(字节)，包括引导区、内核等
-#define HEADER_SIG_SIZE 200 * BLOCK_SIZE
+#define HEADER_SIG_SIZE (200 * 512)
+
+/// SuperBlock独占的区域(字节)，inode区紧随其后
+#define SUPER_BLOCK_AREA_SIZE 4096
+
+/// block区起点的对齐粒度(字节)，与页和常见设备的物理扇区对齐
+#define LAYOUT_ALIGN 4096
+
+/// DiskInode 缓冲区的默认数量，可由 --inode-cache-entries 修改
+#define DEFAULT_INODE_BUFFER_NUM 128
+
+/// Block 缓冲区的默认数量，可由 --block-cache-mb 修改
+#define DEFAULT_BLOCK_BUFFER_NUM 128
+
+/// 按字节数换算出的block缓存块数量的下限，保证大块时仍有足够的缓存块可以固定
+#define MIN_BLOCK_BUFFER_NUM 16
+
+/// inode缓存以inode区的整块为单位，按项数换算出的块数的下限
+#define MIN_INODE_BLOCK_BUFFER_NUM 8
+
+/// block缓存的最大分片数，每个分片有独立的锁和置换状态
+#define MAX_CACHE_SHARD_NUM 16
 
-/// DiskInode 缓冲区的数量
-#define INODE_BUFFER_NUM 128
+/// 每个分片至少拥有的缓存块数，缓存较小时减少分片数
+#define MIN_SHARD_BUFFER_NUM 64
 
-/// Block 缓冲区的数量
-#define BLOCK_BUFFER_NUM 128
+/// 脏块占block缓存的百分比超过该值时，后台写回线程开始写回，可由 --dirty-ratio 修改
+#define DEFAULT_DIRTY_RATIO 10
+
+/// 脏块/脏inode保留在缓存中的最长时间(毫秒)，超过后由后台写回线程写回，可由 --dirty-expire-ms 修改
+#define DEFAULT_DIRTY_EXPIRE_MS 5000
+
+/// 后台写回线程每一批写回的数量
+#define FLUSHER_BATCH_SIZE 64
+
+/// 换出脏块时，向前、向后各最多顺带写回的相邻脏块数
+#define EVICT_CLUSTER_BLOCKS 16
+
+/// 直接I/O的对齐中转缓冲区大小，调用者的缓冲区不对齐时分段经过它
+#define DIRECT_IO_BOUNCE_BYTE (1024 * 1024)
+
+/// 校验和区按页记录修改并写回，每页的字节数
+#define CHECKSUM_PAGE_SIZE 4096
+
+/// 校验和区每页的项数
+#define CHECKSUM_ENTRIES_PER_PAGE (CHECKSUM_PAGE_SIZE / (int) sizeof(uint32_t))
+
+/// 默认的映象I/O方式，可由 --device 修改
+#ifdef _WIN32
+#define DEFAULT_DEVICE_NAME "stdio"
+#else
+#define DEFAULT_DEVICE_NAME "pread"
+#endif
 
 /**
  * @brief 块设备管理器，包含缓存机制
@@ -39,11 +101,64 @@ public:
     DeviceManager();
 
     /**
-     * @brief 打开映象文件
-     * @param imagePath 映象路径
+     * @brief 设置缓存大小，需要在OpenImage之前调用
+     * @param blockCacheByte block缓存的字节数，缓存块数量随块大小确定；不大于0时使用默认的块数
+     * @param inodeCacheEntries 缓存的DiskInode数量，换算成inode区的块数
+     */
+    void SetCacheSize(long long blockCacheByte, int inodeCacheEntries);
+
+    /**
+     * @brief 设置缓存置换策略，需要在OpenImage之前调用
+     * @param policyName 策略名称，可为 lru clock 2q arc
+     * @return 0表示成功，-1表示策略名称无法识别
+     */
+    int SetCachePolicy(const std::string& policyName);
+
+    /**
+     * @brief 设置映象I/O方式，需要在OpenImage之前调用
+     * @param deviceName 设备名称，可为 stdio pread mmap
+     * @return 0表示成功，-1表示名称无法识别
+     */
+    int SetDeviceType(const std::string& deviceName);
+
+    /**
+     * @brief 设置异步I/O的实现，需要在OpenImage之前调用
+     * @param asyncIOName 名称，可为 auto uring threads off
+     * @return 0表示成功，-1表示名称无法识别
+     */
+    int SetAsyncIO(const std::string& asyncIOName);
+
+    /**
+     * @brief 设置后台写回的阈值，需要在OpenImage之前调用
+     * @param dirtyRatio 脏块占缓存的百分比超过该值时开始写回，写回到一半以下
+     * @param dirtyExpireMs 脏数据在缓存中保留的最长毫秒数，不大于0时不启动后台写回线程
+     */
+    void SetDirtyThreshold(int dirtyRatio, int dirtyExpireMs);
+
+    /**
+     * @brief 打开映象文件，并按SetCacheSize设置的大小分配缓存
+     * @param imagePath 映象路径，以MEMORY_IMAGE_PREFIX开头时为内存盘
      */
     void OpenImage(const char *imagePath);
 
+    /**
+     * @brief 映象当前的字节数，内存盘为其容量
+     * @return 字节数，映象未打开或出错时为-1
+     */
+    long long ImageSize();
+
+    /**
+     * @brief 清空所有缓存，丢弃其中的脏数据，格式化时使用
+     */
+    void ResetCache();
+
+    /**
+     * @brief 保证映象至少有imageSize字节，mmap模式下映射需要覆盖整个文件系统
+     * @param imageSize 映象字节数
+     * @return 0表示成功，-1表示出错
+     */
+    int ReserveImage(long long imageSize);
+
     /**
      * @brief 加载SuperBlock
      * @param superBlockPtr 超级块在内存的地址
@@ -82,6 +197,193 @@ public:
      */
     unsigned int WriteBlock(int blockNo, void *buffer);
 
+    /**
+     * @brief 读取一组整块到连续的缓冲区。命中的块直接复制；未命中的块读入缓存，块号连续的合并为一次分散读，各次读同时提交
+     * @param blockNos 块号数组
+     * @param count 块数
+     * @param buffer 目标缓冲区，count * BlockSize() 字节
+     * @return 0表示成功，-1表示出错
+     */
+    int ReadBlocks(const int* blockNos, int count, char* buffer);
+
+    /**
+     * @brief 将连续的缓冲区整块写入一组块。已缓存的块在缓存中修改；未缓存的块不经过缓存，块号连续的合并为一次写直接写入映象
+     * @param blockNos 块号数组
+     * @param count 块数
+     * @param buffer 源缓冲区，count * BlockSize() 字节
+     * @return 0表示成功，-1表示出错
+     */
+    int WriteBlocks(const int* blockNos, int count, const char* buffer);
+
+    /**
+     * @brief 整块读取只使用一次的大块数据。已缓存的块从缓存复制；未缓存的块不进入缓存，
+     * 块号连续的合并后用直接I/O从映象读入，也不留在内核页缓存中
+     * @param blockNos 块号数组
+     * @param count 块数
+     * @param buffer 目标缓冲区，count * BlockSize() 字节
+     * @return 0表示成功，-1表示出错
+     */
+    int ReadBlocksDirect(const int* blockNos, int count, char* buffer);
+
+    /**
+     * @brief 整块写入只使用一次的大块数据。已缓存的块在缓存中修改，保持缓存与映象一致；
+     * 未缓存的块不进入缓存，块号连续的合并后用直接I/O写入映象
+     * @param blockNos 块号数组
+     * @param count 块数
+     * @param buffer 源缓冲区，count * BlockSize() 字节
+     * @return 0表示成功，-1表示出错
+     */
+    int WriteBlocksDirect(const int* blockNos, int count, const char* buffer);
+
+    /**
+     * @brief 取得块在缓存中的地址，不经过复制直接读写。缓存块在PutBlock之前被固定，不会被换出
+     * @param blockNo 块号
+     * @param data 返回缓存块首地址，长度为BlockSize()
+     * @return 句柄，交给PutBlock释放；-1表示出错
+     * @note 同一时刻被固定的块不能占满缓存，否则返回-1并置MoFSErrno为4。mmap模式下data直接指向映射，句柄即块号
+     */
+    int GetBlock(int blockNo, char* &data);
+
+    /**
+     * @brief 释放GetBlock取得的缓存块
+     * @param handle GetBlock返回的句柄
+     * @param dirty 调用者是否修改了缓存块的内容
+     */
+    void PutBlock(int handle, bool dirty);
+
+    /**
+     * @brief 将一组块同时读入缓存，已经缓存的块跳过。读请求通过异步I/O队列一起提交，可以同时在途
+     * @param blockNos 块号数组，-1被忽略
+     * @param count 块数
+     * @return 新读入缓存的块数
+     */
+    int PrefetchBlocks(const int* blockNos, int count);
+
+    /**
+     * @brief 写回一组块中缓存着的脏块，其余的块跳过。正在不经过缓存写入的块等它写完，返回后这些块的内容都已交给映象
+     * @param blockNos 块号数组，不大于0的块号被忽略
+     * @param count 块数
+     * @return 0表示成功，-1表示有块写失败，这些块仍然是脏的
+     */
+    int FlushBlocks(const int* blockNos, int count);
+
+    /**
+     * @brief 写回inode所在的inode区块，该块不脏时什么也不做
+     * @param inodeNo inode号
+     * @return 1表示写回了inode区块，之后需要SyncDevice；0表示不需要写回；-1表示出错
+     */
+    int FlushInode(int inodeNo);
+
+    /**
+     * @brief 写回所有脏块。脏块按块号排序，块号连续的合并为一次聚集写，各次写同时提交
+     * @return 0表示成功，-1表示有块写失败，这些块仍然是脏的
+     */
+    int FlushDirtyBlocks();
+
+    /**
+     * @brief 写回所有脏inode。按inode区块号排序，相邻的块合并为一次聚集写
+     * @return 0表示成功，-1表示有inode写失败
+     */
+    int FlushDirtyInodes();
+
+    /**
+     * @brief 等待已经交给映象的写入落到存储设备上。只保证调用之前完成的写入，缓存中的脏数据需要先写回
+     * @return 0表示成功，-1表示出错并置MoFSErrno为16
+     */
+    int SyncDevice();
+
+    /**
+     * @brief 启用校验和区，格式化或加载带校验和的映象时在布局确定之后调用。
+     * 校验和区紧接在最后一块之后，数据块在前、inode区块在后，每块一个CRC32C，整个区域常驻内存
+     * @param dataBlockNum 数据块数，即s_fsize
+     * @param inodeBlockNum inode区块数，即s_isize
+     * @param load true表示从映象读入已有的校验和；false表示刚格式化，全部清零并在之后写回
+     * @return 0表示成功，-1表示出错
+     */
+    int SetupChecksums(int dataBlockNum, int inodeBlockNum, bool load);
+
+    /**
+     * @brief 关闭校验并释放校验和，加载或格式化不带校验和的映象时调用
+     */
+    void DropChecksums();
+
+    /**
+     * @brief 把修改过的校验和页写入映象。SyncDevice和后台写回线程会调用它，校验和与数据在同一个写回周期内落盘
+     * @return 0表示成功，-1表示出错，没写成的页留到下次
+     */
+    int FlushChecksums();
+
+    /**
+     * @brief 把块留在缓存中并暂缓写回，日志在修改元数据块之前调用。
+     * 块不在缓存中时先读入，之后被固定，FlushDirtyBlocks、FlushBlocks和后台写回都跳过它，直到ReleaseHeldBlock
+     * @param blockNo 块号
+     * @return 1表示新留下了该块；0表示该块已经被留下，或mmap模式下不需要；-1表示出错
+     */
+    int HoldBlock(int blockNo);
+
+    /**
+     * @brief 把inode所在的inode区块留在缓存中并暂缓写回，与HoldBlock相同
+     * @param inodeNo inode号
+     * @param inodeBlockNo 返回inode区块号
+     * @return 1表示新留下了该块；0表示该块已经被留下，或mmap模式下不需要；-1表示出错
+     */
+    int HoldInode(int inodeNo, int& inodeBlockNo);
+
+    /**
+     * @brief 复制被留下的块的当前内容
+     * @param blockNo 块号
+     * @param buffer 目标缓冲区，BlockSize()字节
+     * @return 0表示成功，-1表示该块没有被留下
+     */
+    int CopyHeldBlock(int blockNo, char* buffer);
+
+    /**
+     * @brief 复制被留下的inode区块的当前内容
+     * @param inodeBlockNo inode区块号
+     * @param buffer 目标缓冲区，BlockSize()字节
+     * @return 0表示成功，-1表示该块没有被留下
+     */
+    int CopyHeldInodeBlock(int inodeBlockNo, char* buffer);
+
+    /**
+     * @brief 解除HoldBlock，块保持脏标记，之后照常写回
+     * @param blockNo 块号
+     */
+    void ReleaseHeldBlock(int blockNo);
+
+    /**
+     * @brief 解除HoldInode，inode区块保持脏标记，之后照常写回
+     * @param inodeBlockNo inode区块号
+     */
+    void ReleaseHeldInodeBlock(int inodeBlockNo);
+
+    /**
+     * @brief 整块写入一个inode区块，重放日志时使用。已缓存时在缓存中修改
+     * @param inodeBlockNo inode区块号
+     * @param data 源数据，BlockSize()字节
+     * @return 0表示成功，-1表示出错
+     */
+    int WriteInodeBlock(int inodeBlockNo, const char* data);
+
+    /**
+     * @brief 映象是否被映射进内存
+     * @return true表示mmap模式，读写不经过缓存
+     */
+    bool MappedMode() const {
+        return this->mappedMode;
+    }
+
+    /**
+     * @brief 取得缓存和映象I/O的统计信息
+     * @param stats 结果
+     */
+    void GetStats(MoFSStats& stats);
+
+    /**
+     * @brief 统计计数清零，缓存的配置不变
+     */
+    void ResetStats();
+
     /**
      * @brief 根据提供的bufferIdx，向磁盘中写入数据
      * @param bufferIdx 待写入的缓存块
@@ -91,12 +393,12 @@ public:
     unsigned int WriteBlockToFile(int bufferIdx, int blockIdx);
 
     /**
-     * @brief 根据提供的bufferIdx，向磁盘中写入DiskInode
-     * @param bufferIdx 待写入的缓存inode号
-     * @param inodeIdx 待写入的inode号
+     * @brief 根据提供的bufferIdx，将缓存的inode区块整块写入磁盘
+     * @param bufferIdx 待写入的inode缓存块
+     * @param inodeBlockIdx 待写入的inode区块号
      * @return 0表示成功，-1表示出错
      */
-    int WriteInodeToFile(int bufferIdx, int inodeIdx);
+    int WriteInodeToFile(int bufferIdx, int inodeBlockIdx);
 
     /**
      * @brief 读取指定编号的diskInode
@@ -115,24 +417,425 @@ public:
     int WriteInode(int inodeNo, DiskInode* inodePtr);
 
     /**
-     * @brief 设置block区起始的偏移量
-     * @param offset 偏移量
+     * @brief 设置映象的布局，块大小改变时重新分配block缓存
+     * @param blockSize 块大小，0表示旧格式的映象(512字节的块，inode区和block区不对齐)
+     * @param inodeBlockNum inode区占用的块数
+     */
+    void SetLayout(int blockSize, int inodeBlockNum);
+
+    /**
+     * @brief 判断块大小是否可以用于格式化
+     * @param blockSize 块大小
+     * @return 在MIN_BLOCK_SIZE和MAX_BLOCK_SIZE之间的2的幂时为true
+     */
+    static bool IsValidBlockSize(int blockSize) {
+        return blockSize >= MIN_BLOCK_SIZE && blockSize <= MAX_BLOCK_SIZE && (blockSize & (blockSize - 1)) == 0;
+    }
+
+    /**
+     * @brief 当前映象的块大小
+     * @return 字节数
+     */
+    int BlockSize() const {
+        return this->blockSize;
+    }
+
+    /**
+     * @brief 计算块在映象中的偏移量
+     * @param blockNo 块号
+     * @return 字节偏移量
      */
-    void SetOffset(int offset);
+    long long BlockOffset(int blockNo) const {
+        return (long long) blockNo * this->blockSize + this->blockContentOffset;
+    }
 
+    /**
+     * @brief 获取缓存块的地址
+     * @param bufferIdx 缓存块序号
+     * @return 缓存块首地址
+     */
+    char* BlockBufferAt(int bufferIdx) {
+        return this->blockBuffer + (size_t) bufferIdx * this->blockSize;
+    }
 
-    // 缓冲区相关
-    BufferLinkList inodeBufferManager{INODE_BUFFER_NUM};
-    DiskInode inodeBuffer[INODE_BUFFER_NUM];
-    bool inodeDirty[INODE_BUFFER_NUM]; ///< 标记脏inode
+    // 缓冲区相关，在OpenImage时按运行时参数分配
+    std::string cachePolicyName{"lru"}; ///< 缓存置换策略
+    int inodeCacheEntries{DEFAULT_INODE_BUFFER_NUM}; ///< 要求缓存的DiskInode数量
+    int inodeBufferNum{}; ///< inode缓存块数量，由inodeCacheEntries和块大小换算
+    BufferPolicy* inodeBufferManager{}; ///< 以inode区块号为键
+    char* inodeBuffer{}; ///< inodeBufferNum * blockSize 字节，每块存放InodesPerBlock()个DiskInode
+    bool* inodeDirty{}; ///< 标记脏的inode缓存块
 
-    BufferLinkList blockBufferManager{BLOCK_BUFFER_NUM};
-    char blockBuffer[BLOCK_BUFFER_NUM][BLOCK_SIZE];
-    bool blockDirty[BLOCK_BUFFER_NUM]; ///< 标记脏block
+    int blockBufferNum{DEFAULT_BLOCK_BUFFER_NUM}; ///< block缓存块数量
+    char* blockBuffer{}; ///< blockBufferNum * blockSize 字节的连续缓存区
+    bool* blockDirty{}; ///< 标记脏block
+    bool* blockHeld{}; ///< 被HoldBlock留下、等待日志提交的block缓存块
+    bool* inodeHeld{}; ///< 被HoldInode留下、等待日志提交的inode缓存块
 
 private:
-    FILE* imgFilePtr{}; ///< DeviceManager 持有的file指针
-    int blockContentOffset{}; ///< block #0 从这个偏移量开始
+    /**
+     * @brief block缓存的一个分片。块按块号的哈希分到各个分片，分片拥有blockBuffer中连续的一段缓存块
+     */
+    struct CacheShard {
+        std::mutex mutex; ///< 保护本分片的置换状态、缓存块的脏标记和读入标记
+        std::condition_variable ioCond; ///< 本分片有块读入完成，或不经过缓存的写入完成
+        BufferPolicy* manager{}; ///< 本分片的置换策略，其中的缓存块序号从0开始
+        int firstBuffer{}; ///< 本分片第一个缓存块在blockBuffer中的序号
+        std::vector<int> writingBlocks; ///< 不在缓存中、正在写入映象的块号，写完之前不能读入缓存
+    };
+
+    /**
+     * @brief 块所属的分片
+     * @param blockNo 块号
+     * @return 分片
+     */
+    CacheShard& ShardOf(int blockNo) {
+        return this->shards[(unsigned int) blockNo * 2654435761u % (unsigned int) this->shardNum];
+    }
+
+    /**
+     * @brief 缓存块所属的分片
+     * @param bufferIdx 缓存块序号
+     * @return 分片
+     */
+    CacheShard& ShardOfBuffer(int bufferIdx) {
+        int shardIdx = bufferIdx / this->shardBufferNum;
+        return this->shards[shardIdx < this->shardNum ? shardIdx : this->shardNum - 1];
+    }
+
+    /**
+     * @brief 按blockBufferNum和inodeBufferNum分配缓存
+     */
+    void AllocCache();
+
+    /**
+     * @brief 释放缓存
+     */
+    void FreeCache();
+
+
+    /**
+     * @brief 写入一组已经固定并清除了脏标记的缓存块，块号连续的合并为一次聚集写，各次写同时提交。
+     * 写完后解除固定，写失败的块重新标记为脏
+     * @param dirtyBlocks (块号, 缓存块序号)数组，会被按块号排序
+     * @return 0表示成功，-1表示有块写失败
+     */
+    int WritePinnedBlocks(std::vector<std::pair<int, int>>& dirtyBlocks);
+
+    /**
+     * @brief 写回被换出的脏块，并顺带写回块号与它相邻的脏块，合并为一次聚集写
+     * @param bufferIdx 被换出的缓存块序号
+     * @param blockNo 被换出的块号
+     * @return true表示被换出的块已写回；false表示写失败，相邻的块已重新标记为脏，被换出的块由调用者处理
+     */
+    bool WriteBackEvicted(int bufferIdx, int blockNo);
+
+    /**
+     * @brief 将缓存块标记为脏，记录变脏的时间，脏块过多时唤醒后台写回线程
+     * @param bufferIdx 缓存块序号
+     */
+    void MarkBlockDirty(int bufferIdx);
+
+    /**
+     * @brief 将inode缓存块标记为脏
+     * @param bufferIdx inode缓存块序号
+     */
+    void MarkInodeDirty(int bufferIdx);
+
+    /**
+     * @brief 清除缓存块的脏标记
+     * @param bufferIdx 缓存块序号
+     */
+    void ClearBlockDirty(int bufferIdx);
+
+    /**
+     * @brief 清除inode缓存块的脏标记
+     * @param bufferIdx inode缓存块序号
+     */
+    void ClearInodeDirty(int bufferIdx);
+
+    /**
+     * @brief 后台写回线程主循环：周期性地醒来，或在脏块过多时被唤醒
+     */
+    void FlusherLoop();
+
+    /**
+     * @brief 写回一批超时或超出比例的脏块和脏inode。在锁内把数据复制到暂存区并固定缓存，在锁外写入
+     * @param draining 脏块超过比例，需要一直写回到比例的一半以下
+     * @return 本批写回的数量，0表示没有需要继续写回的数据
+     */
+    int WriteBackBatch(bool draining);
+
+    /**
+     * @brief 等待后台写回线程写完正在锁外写入的一批数据，避免旧数据覆盖随后写入的新数据
+     */
+    void WaitFlusherIdle();
+
+    /**
+     * @brief 获取缓存锁，等待期间发现写回线程需要退出则放弃
+     * @return true表示已经获得锁
+     */
+    bool LockForFlusher();
+
+    /**
+     * @brief 计算DiskInode在映象中的偏移量
+     * @param inodeNo inode号
+     * @return 字节偏移量
+     */
+    long long InodeOffset(int inodeNo) const {
+        return (long long) inodeNo * sizeof(DiskInode) + this->inodeTableOffset;
+    }
+
+    /**
+     * @brief 每个inode区块存放的DiskInode数量
+     * @return blockSize / sizeof(DiskInode)
+     */
+    int InodesPerBlock() const {
+        return this->blockSize / (int) sizeof(DiskInode);
+    }
+
+    /**
+     * @brief 获取inode缓存块的地址
+     * @param bufferIdx inode缓存块序号
+     * @return 缓存块首地址
+     */
+    char* InodeBlockAt(int bufferIdx) {
+        return this->inodeBuffer + (size_t) bufferIdx * this->blockSize;
+    }
+
+    /**
+     * @brief 为inode区块取得一个缓存块，未命中时整块读入，被换出的脏块先写回
+     * @param inodeBlockNo inode区块号
+     * @return 缓存块序号，-1表示出错或所有缓存块都被固定
+     */
+    int FetchInodeBlock(int inodeBlockNo);
+
+    /**
+     * @brief 将连续的若干inode区块写入映象。旧格式中inode区的开头与SuperBlock重叠，重叠的部分不写
+     * @param inodeBlockNo 第一块的inode区块号
+     * @param vectors 各段缓冲区，总长度为vectorCnt * blockSize
+     * @param vectorCnt 段数
+     * @return 0表示成功，-1表示出错
+     */
+    int WriteInodeBlocks(int inodeBlockNo, const BlockIOVec* vectors, int vectorCnt);
+
+    /**
+     * @brief mmap模式下取得映象中一段区域的地址
+     * @param offset 映象内偏移量
+     * @param length 区域长度
+     * @return 区域首地址，超出映象时返回nullptr并置MoFSErrno为16
+     */
+    char* MappedRange(long long offset, long long length);
+
+    /**
+     * @brief mmap模式下记录被修改的区域，FlushDirtyBlocks时用msync写回
+     * @param offset 映象内偏移量
+     * @param length 区域长度
+     */
+    void MarkMappedDirty(long long offset, long long length);
+
+    /**
+     * @brief 在分片中查找块，需要持有分片的锁
+     * @param shard 块所属的分片
+     * @param lock 分片的锁，等待期间会被释放
+     * @param blockNo 块号
+     * @param wait 块正在读入或正在不经过缓存地写入时是否等待。持有其他正在读入的缓存块时不能等待，否则可能互相等待
+     * @return 缓存块序号；-1表示未缓存；-2表示块正在读写且wait为false
+     */
+    int LookupBlock(CacheShard& shard, std::unique_lock<std::mutex>& lock, int blockNo, bool wait);
+
+    /**
+     * @brief 为未缓存的块分配一个缓存块，需要持有分片的锁。分配到的缓存块被固定并标记为正在读入，
+     * 被换出的脏块在锁外写回
+     * @param shard 块所属的分片
+     * @param lock 分片的锁，写回被换出的块期间会被释放
+     * @param blockNo 块号
+     * @return 缓存块序号，-1表示分片中的缓存块都被固定
+     */
+    int AllocBlockBuffer(CacheShard& shard, std::unique_lock<std::mutex>& lock, int blockNo);
+
+    /**
+     * @brief 结束缓存块的读入，需要持有分片的锁。读入失败的缓存块被作废
+     * @param shard 缓存块所属的分片
+     * @param bufferIdx 缓存块序号
+     * @param succeeded 读入是否成功
+     */
+    void FinishLoading(CacheShard& shard, int bufferIdx, bool succeeded);
+
+    /**
+     * @brief 为块取得一个缓存块并读入内容，需要持有分片的锁，读映象期间释放
+     * @param shard 块所属的分片
+     * @param lock 分片的锁，返回时仍然持有
+     * @param blockNo 块号
+     * @return 缓存块序号，-1表示出错
+     */
+    int FetchBlock(CacheShard& shard, std::unique_lock<std::mutex>& lock, int blockNo);
+
+    /**
+     * @brief 登记不经过缓存写入映象的块，需要持有分片的锁
+     * @param shard 块所属的分片
+     * @param blockNo 块号
+     */
+    void BeginWriteThrough(CacheShard& shard, int blockNo);
+
+    /**
+     * @brief 判断块是否正在不经过缓存地写入，需要持有分片的锁
+     * @param shard 块所属的分片
+     * @param blockNo 块号
+     * @return true表示正在写入
+     */
+    bool IsWritingThrough(CacheShard& shard, int blockNo);
+
+    /**
+     * @brief 不经过缓存的写入完成，唤醒等待该块的线程
+     * @param blockNo 块号
+     */
+    void EndWriteThrough(int blockNo);
+
+    /**
+     * @brief 找出映象中一段区域涉及的、有校验和的块，区域只会落在数据区或inode区中的一个
+     * @param offset 映象内偏移量
+     * @param length 区域长度
+     * @param firstEntry 返回第一块的校验和序号
+     * @param firstOffset 返回第一块在映象中的偏移量
+     * @return 块数，没有校验和区或区域不在数据区、inode区时为0
+     */
+    int ChecksumRange(long long offset, long long length, int& firstEntry, long long& firstOffset) const;
+
+    /**
+     * @brief 写映象之前更新校验和。区域整块覆盖的块重新计算；只覆盖一部分的块算不出新值，清零后不再校验
+     * @param offset 映象内偏移量
+     * @param data 将要写入的数据
+     * @param length 字节数
+     */
+    void UpdateChecksums(long long offset, const void* data, long long length);
+
+    /**
+     * @brief 聚集写之前更新校验和
+     * @param offset 映象内偏移量
+     * @param vectors 各段缓冲区
+     * @param vectorCnt 段数
+     */
+    void UpdateChecksumsV(long long offset, const BlockIOVec* vectors, int vectorCnt);
+
+    /**
+     * @brief 校验从映象读入的数据。只校验整块读入且记录了校验和的块，不一致时报错并计数
+     * @param offset 映象内偏移量
+     * @param data 读入的数据
+     * @param length 字节数
+     * @return true表示没有发现不一致
+     */
+    bool VerifyChecksums(long long offset, const void* data, long long length);
+
+    /**
+     * @brief 校验分散读入的数据
+     * @param offset 映象内偏移量
+     * @param vectors 各段缓冲区
+     * @param vectorCnt 段数
+     * @return true表示没有发现不一致
+     */
+    bool VerifyChecksumsV(long long offset, const BlockIOVec* vectors, int vectorCnt);
+
+    /**
+     * @brief mmap模式下按映射中的内容重新计算一段区域涉及的块的校验和，部分修改的块也整块重算
+     * @param offset 映象内偏移量
+     * @param length 区域长度
+     */
+    void RefreshMappedChecksums(long long offset, long long length);
+
+    /**
+     * @brief 读映象。设备不支持并发读写时串行执行
+     * @param offset 映象内偏移量
+     * @param buffer 缓冲区
+     * @param length 字节数
+     * @return 实际读取的字节数，-1表示出错或校验和不一致
+     */
+    long long DeviceRead(long long offset, void* buffer, long long length);
+
+    /**
+     * @brief 写映象。设备不支持并发读写时串行执行
+     * @param offset 映象内偏移量
+     * @param buffer 缓冲区
+     * @param length 字节数
+     * @return 实际写入的字节数，-1表示出错
+     */
+    long long DeviceWrite(long long offset, const void* buffer, long long length);
+
+    /**
+     * @brief 聚集写映象。设备不支持并发读写时串行执行
+     * @param offset 映象内偏移量
+     * @param vectors 各段缓冲区
+     * @param vectorCnt 段数
+     * @return 实际写入的字节数，-1表示出错
+     */
+    long long DeviceWriteV(long long offset, const BlockIOVec* vectors, int vectorCnt);
+
+    /**
+     * @brief 通过异步I/O队列提交一组请求并等待完成。队列不支持多线程同时使用，各线程的提交串行执行
+     * @param requests 请求数组
+     * @param count 请求数量
+     * @return 结果不等于length的请求数量
+     */
+    int SubmitIO(AsyncRequest* requests, int count);
+
+    /**
+     * @brief 用直接I/O读写映象的一段连续区域。区域中按DIRECT_IO_ALIGN对齐的部分绕过页缓存，
+     * 首尾不对齐的部分照常读写；缓冲区不对齐时经过对齐的中转缓冲区
+     * @param isWrite true为写，false为读
+     * @param offset 映象内偏移量
+     * @param buffer 缓冲区
+     * @param length 字节数
+     * @return 0表示成功，-1表示出错
+     */
+    int DirectTransfer(bool isWrite, long long offset, char* buffer, long long length);
+
+    std::string deviceName{DEFAULT_DEVICE_NAME}; ///< 映象I/O方式
+    BlockDevice* device{}; ///< DeviceManager 持有的映象设备
+    std::string asyncIOName{"auto"}; ///< 异步I/O的实现
+    AsyncIO* asyncIO{}; ///< 异步I/O队列，mmap模式下不使用
+    bool mappedMode{}; ///< 映象被映射进内存，读写不经过块缓存和inode缓存
+    bool serialDevice{}; ///< 设备不支持并发读写，所有设备I/O在ioMutex内执行
+    std::mutex ioMutex; ///< 串行化异步I/O队列的使用，以及不支持并发读写的设备上的I/O
+    IOStats ioStats; ///< 缓存命中、换出、写回和映象I/O的统计
+
+    CacheShard* shards{}; ///< block缓存的分片
+    int shardNum{1}; ///< 分片数
+    int shardBufferNum{}; ///< 每个分片的缓存块数，最后一个分片另外拥有除不尽的部分
+    bool* blockLoading{}; ///< 缓存块正在从映象读入，读完之前其他线程需要等待
+
+    long long mappedDirtyBegin{-1}; ///< mmap模式下被修改区域的起点，-1表示没有修改
+    long long mappedDirtyEnd{}; ///< mmap模式下被修改区域的终点
+    long long mappedDirtySince{}; ///< mmap模式下被修改区域最早变脏的时间(毫秒)
+    int blockSize{LEGACY_BLOCK_SIZE}; ///< 块大小，LoadSuperBlock或格式化时确定
+    long long blockCacheByte{}; ///< block缓存的字节数，不大于0时使用DEFAULT_BLOCK_BUFFER_NUM个块
+    long long inodeTableOffset{}; ///< inode #0 从这个偏移量开始
+    long long blockContentOffset{}; ///< block #0 从这个偏移量开始
+
+    // 校验和相关，只在带校验和的映象上分配
+    std::atomic<uint32_t>* checksums{}; ///< 数据块在前、inode区块在后，每块一个CRC32C；0表示没有记录，不校验
+    std::atomic<bool>* checksumPageDirty{}; ///< 校验和区的每一页是否需要写回
+    int checksumDataBlockNum{}; ///< 有校验和的数据块数
+    int checksumEntryNum{}; ///< 校验和的总项数，0表示映象没有校验和区
+    long long checksumOffset{}; ///< 校验和区在映象中的偏移量
+    std::mutex checksumMutex; ///< 串行化校验和区的写回。mmap模式下先取cacheMutex再取它
+
+    // 后台写回相关
+    std::recursive_timed_mutex cacheMutex; ///< 保护inode缓存、布局和映射模式下的脏区间，整体写回时也持有；block缓存由各分片的锁保护，持有分片的锁时不能再取它
+    int dirtyRatio{DEFAULT_DIRTY_RATIO}; ///< 后台写回的脏块比例阈值
+    int dirtyExpireMs{DEFAULT_DIRTY_EXPIRE_MS}; ///< 脏数据保留的最长毫秒数
+    std::atomic<int> dirtyBlockCnt{}; ///< 当前脏块数量，各分片共同修改
+    int dirtyInodeCnt{}; ///< 当前脏的inode缓存块数量
+    long long* blockDirtySince{}; ///< 每个缓存块变脏的时间(毫秒)
+    long long* inodeDirtySince{}; ///< 每个inode缓存块变脏的时间(毫秒)
+    char* flusherStaging{}; ///< 后台写回的暂存区，前FLUSHER_BATCH_SIZE块暂存block，后FLUSHER_BATCH_SIZE块暂存inode区块
+    std::thread flusherThread; ///< 后台写回线程
+    std::mutex flusherMutex; ///< 保护flusherStopping、flushRequested和flusherWriting
+    std::condition_variable flusherCond; ///< 唤醒后台写回线程
+    bool flusherStopping{}; ///< 后台写回线程需要退出
+    bool flushRequested{}; ///< 脏块超过比例，请求立即写回
+    bool flusherWriting{}; ///< 后台写回线程正在锁外写入一批数据
+    std::condition_variable flusherIdleCond; ///< 一批数据写入完成
+    int cacheGeneration{}; ///< 每次ResetCache加一，写回线程据此判断固定的缓存是否还有效
 };
 
 #endif //MOFS_DEVICEMANAGER_H
@@ -0,0 +1,149 @@
+﻿/**
+ * @file IOStats.h
+ * @brief 块缓存、inode缓存和映象I/O的统计：无锁计数器和按操作分类的延迟直方图
+ * @author 韩孟霖
+ * @date 2022/6/14
+ * @license GPL v3
+ */
+
+#ifndef MOFS_IOSTATS_H
+#define MOFS_IOSTATS_H
+
+#include <atomic>
+#include <string>
+
+/// 延迟直方图的桶数。第0个桶统计不足1微秒的操作，第i个桶统计[2^(i-1), 2^i)微秒的操作，最后一个桶包含更长的操作
+#define LATENCY_BUCKET_NUM 24
+
+/// 统计延迟的映象操作
+#define IO_OP_READ  0   ///< 读，包括分散读和直接I/O
+#define IO_OP_WRITE 1   ///< 写，包括聚集写、直接I/O和mmap模式下的msync
+#define IO_OP_SYNC  2   ///< 同步到存储设备
+#define IO_OP_NUM   3
+
+/**
+ * @brief 一类映象操作的次数、字节数和延迟分布
+ */
+struct IOOpStats {
+    unsigned long long count;       ///< 操作次数
+    unsigned long long bytes;       ///< 读写的字节数，同步为0
+    unsigned long long totalUs;     ///< 总耗时(微秒)
+    unsigned long long maxUs;       ///< 最长的一次耗时(微秒)
+    unsigned long long buckets[LATENCY_BUCKET_NUM]; ///< 延迟直方图
+};
+
+/**
+ * @brief 统计信息的快照，由mofs_get_stats返回
+ */
+struct MoFSStats {
+    int blockSize;                  ///< 块大小(字节)
+    int blockBufferNum;             ///< block缓存块数量
+    int dirtyBlockNum;              ///< 当前的脏块数量
+    int inodeBufferNum;             ///< inode缓存块数量
+    int checksumEnabled;            ///< 映象是否带校验和区
+    int dedupEnabled;               ///< 映象是否带去重表
+    int journalEnabled;             ///< 是否在记录元数据日志
+    int bitmapEnabled;              ///< 映象是否用位图管理空闲块
+    int freeBlocks;                 ///< 使用位图时的空闲块数
+    int dataBlocks;                 ///< 使用位图时的数据块总数
+
+    unsigned long long blockHits;       ///< 在block缓存中命中的块访问次数
+    unsigned long long blockMisses;     ///< 未命中的块访问次数，包括不经过缓存直接读写的块
+    unsigned long long blockEvictions;  ///< 为新块腾出空间而换出的缓存块数
+    unsigned long long blockWriteBacks; ///< 从缓存写回映象的脏块数
+
+    unsigned long long inodeHits;       ///< 在inode缓存中命中的inode区块访问次数
+    unsigned long long inodeMisses;     ///< 未命中的inode区块访问次数
+    unsigned long long inodeEvictions;  ///< 换出的inode缓存块数
+    unsigned long long inodeWriteBacks; ///< 写回映象的inode区块数
+
+    unsigned long long checksumVerifies; ///< 从映象读入时校验过的块数
+    unsigned long long checksumErrors;   ///< 校验和不一致的块数
+
+    unsigned long long dedupHits;       ///< 整块写入时找到相同内容、不必写入的块数
+    unsigned long long dedupSharedRefs; ///< 共享块第一个引用之外的引用数之和，即去重节省的块数
+
+    unsigned long long journalCommits;      ///< 提交的日志事务数
+    unsigned long long journalBlocks;       ///< 写入日志区的块数
+    unsigned long long journalCheckpoints;  ///< 写回原位置并清空日志的次数
+    unsigned long long journalReplays;      ///< 加载时重放的事务数
+
+    IOOpStats deviceOps[IO_OP_NUM];     ///< 映象操作，按IO_OP_*索引
+};
+
+/**
+ * @brief 统计计数器。所有计数都是relaxed的原子操作，各线程在任何锁内外都可以直接累加
+ */
+class IOStats {
+public:
+    /**
+     * @brief 当前时间，用于计算操作的耗时
+     * @return 单调时钟的微秒数
+     */
+    static long long NowUs();
+
+    /**
+     * @brief 累加计数器
+     * @param counter 计数器
+     * @param value 增量
+     */
+    static void Count(std::atomic<unsigned long long>& counter, unsigned long long value = 1) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 记录一次映象操作
+     * @param op IO_OP_*
+     * @param byteCnt 读写的字节数
+     * @param startUs 操作开始时NowUs()的值
+     */
+    void RecordIO(int op, long long byteCnt, long long startUs);
+
+    /**
+     * @brief 复制出所有计数，各计数分别读取，彼此之间不保证是同一时刻的值
+     * @param stats 结果
+     */
+    void Snapshot(MoFSStats& stats) const;
+
+    /**
+     * @brief 所有计数清零
+     */
+    void Reset();
+
+    /**
+     * @brief 把统计信息格式化为多行文本
+     * @param stats 统计信息
+     * @param lineEnd 行尾
+     * @return 文本，每行以lineEnd结尾
+     */
+    static std::string Format(const MoFSStats& stats, const char* lineEnd);
+
+    std::atomic<unsigned long long> blockHits{};
+    std::atomic<unsigned long long> blockMisses{};
+    std::atomic<unsigned long long> blockEvictions{};
+    std::atomic<unsigned long long> blockWriteBacks{};
+
+    std::atomic<unsigned long long> inodeHits{};
+    std::atomic<unsigned long long> inodeMisses{};
+    std::atomic<unsigned long long> inodeEvictions{};
+    std::atomic<unsigned long long> inodeWriteBacks{};
+
+    std::atomic<unsigned long long> checksumVerifies{};
+    std::atomic<unsigned long long> checksumErrors{};
+
+private:
+    /**
+     * @brief 一类映象操作的计数器，字段含义同IOOpStats
+     */
+    struct OpCounters {
+        std::atomic<unsigned long long> count{};
+        std::atomic<unsigned long long> bytes{};
+        std::atomic<unsigned long long> totalUs{};
+        std::atomic<unsigned long long> maxUs{};
+        std::atomic<unsigned long long> buckets[LATENCY_BUCKET_NUM]{};
+    };
+
+    OpCounters opCounters[IO_OP_NUM];
+};
+
+#endif //MOFS_IOSTATS_H
@@ -17,6 +17,7 @@
 #include "include/Primitive.h"
 #include "include/MoFSErrno.h"
 #include "include/CLI.h"
+#include "include/Journal.h"
 #include "utils/CmdTools.h"
 
 
@@ -30,7 +31,7 @@ using namespace std;
 int uid, gid;
 
 int InitSystem() {
-    memset(MemInode::systemMemInodeTable, 0, sizeof(MemInode) * SYSTEM_MEM_INODE_NUM);
+    // systemMemInodeTable中的项由构造函数初始化为空闲，含有vector成员，不能memset
     memset(User::userTable, 0, sizeof(int*) * MAX_USER_NUM);
     User::userPtr = new User{uid, gid};
     User::userTable[0] = User::userPtr;
@@ -40,6 +41,8 @@ int InitSystem() {
 }
 
 int shutdown() {
+    Journal::OpScope scope;
+
     // 释放userPtr
     for (User* & userPtr : User::userTable) {
         if (userPtr != nullptr) {
@@ -47,6 +50,12 @@ int shutdown() {
         }
     }
 
+    // 提交最后的事务并写回，日志清空后关闭
+    if (-1 == Journal::journal.Checkpoint()) {
+        return -1;
+    }
+    Journal::journal.Drop();
+
 
     // 写回SuperBlock
     return DeviceManager::deviceManager.StoreSuperBlock(&SuperBlock::superBlock);
@@ -69,16 +78,98 @@ int main(int argc, char* argv[]) {
     bool shouldMakeFS = (PARSE_SUCCESS == get_argument(argc, argv, "--mkfs", nullptr, nullptr));
 
 
+    // 缓存大小
+    int block_cache_mb = -1;
+    if (PARSE_ERR_INVALID_VALUE == get_argument(argc, argv, "--block-cache-mb", "%d", &block_cache_mb)) {
+        Diagnose::PrintError("Cannot parse arg : block-cache-mb.");
+        exit(-1);
+    }
+
+    int inode_cache_entries = -1;
+    if (PARSE_ERR_INVALID_VALUE == get_argument(argc, argv, "--inode-cache-entries", "%d", &inode_cache_entries)) {
+        Diagnose::PrintError("Cannot parse arg : inode-cache-entries.");
+        exit(-1);
+    }
+
+    string cache_policy;
+    if (PARSE_SUCCESS == get_str_argument(argc, argv, "--cache-policy", cache_policy)) {
+        if (-1 == DeviceManager::deviceManager.SetCachePolicy(cache_policy)) {
+            Diagnose::PrintError("Unrecognized cache policy : " + cache_policy + ".");
+            exit(-1);
+        }
+    }
+
+    string device_name;
+    if (PARSE_SUCCESS == get_str_argument(argc, argv, "--device", device_name)) {
+        if (-1 == DeviceManager::deviceManager.SetDeviceType(device_name)) {
+            Diagnose::PrintError("Unrecognized device : " + device_name + ".");
+            exit(-1);
+        }
+    }
+    if (PARSE_SUCCESS == get_argument(argc, argv, "--mmap", nullptr, nullptr)) {
+        if (-1 == DeviceManager::deviceManager.SetDeviceType("mmap")) {
+            Diagnose::PrintError("mmap not supported under this platform.");
+            exit(-1);
+        }
+    }
+
+    string async_io_name;
+    if (PARSE_SUCCESS == get_str_argument(argc, argv, "--async-io", async_io_name)) {
+        if (-1 == DeviceManager::deviceManager.SetAsyncIO(async_io_name)) {
+            Diagnose::PrintError("Unrecognized async io : " + async_io_name + ".");
+            exit(-1);
+        }
+    }
+
+    // 后台写回
+    int dirty_ratio = DEFAULT_DIRTY_RATIO;
+    if (PARSE_ERR_INVALID_VALUE == get_argument(argc, argv, "--dirty-ratio", "%d", &dirty_ratio)) {
+        Diagnose::PrintError("Cannot parse arg : dirty-ratio.");
+        exit(-1);
+    }
+
+    int dirty_expire_ms = DEFAULT_DIRTY_EXPIRE_MS;
+    if (PARSE_ERR_INVALID_VALUE == get_argument(argc, argv, "--dirty-expire-ms", "%d", &dirty_expire_ms)) {
+        Diagnose::PrintError("Cannot parse arg : dirty-expire-ms.");
+        exit(-1);
+    }
+    DeviceManager::deviceManager.SetDirtyThreshold(dirty_ratio, dirty_expire_ms);
+
+    // 元数据日志的组提交间隔
+    int journal_commit_ms = DEFAULT_JOURNAL_COMMIT_MS;
+    if (PARSE_ERR_INVALID_VALUE == get_argument(argc, argv, "--journal-commit-ms", "%d", &journal_commit_ms)) {
+        Diagnose::PrintError("Cannot parse arg : journal-commit-ms.");
+        exit(-1);
+    }
+    Journal::journal.SetCommitInterval(journal_commit_ms);
+
+    DeviceManager::deviceManager.SetCacheSize(block_cache_mb > 0 ? (long long) block_cache_mb * 1024 * 1024 : -1, inode_cache_entries);
+
     // 初始化
     DeviceManager::deviceManager.OpenImage(imagePath.c_str());
 
+    long long disk_byte = 10 * 1024 * 1024;
+    if (BlockDevice::IsMemoryImage(imagePath.c_str())) {
+        // 内存盘每次启动都是空的，总是格式化，默认占满整个内存盘
+        long long image_size = DeviceManager::deviceManager.ImageSize();
+        if (image_size <= 0) {
+            Diagnose::PrintError("Cannot create memory image : " + imagePath + ".");
+            exit(-1);
+        }
+        shouldMakeFS = true;
+        disk_byte = image_size;
+    }
+
     if (shouldMakeFS) {
-        int disk_size = 10;
+        int disk_size;
         int parse_size_result = get_argument(argc, argv, "--size", "%d", &disk_size);
         if (parse_size_result == PARSE_ERR_INVALID_VALUE) {
             Diagnose::PrintError("Cannot parse arg : size.");
             exit(-1);
         }
+        if (parse_size_result == PARSE_SUCCESS) {
+            disk_byte = (long long) disk_size * 1024 * 1024;
+        }
 
         int inode_num = 2048;
         int parse_inode_result = get_argument(argc, argv, "--inode", "%d", &inode_num);
@@ -87,7 +178,19 @@ int main(int argc, char* argv[]) {
             exit(-1);
         }
 
-        if (-1 == SuperBlock::MakeFS(disk_size * 1024 * 1024, inode_num)) {
+        int block_size = DEFAULT_BLOCK_SIZE;
+        int parse_block_size_result = get_argument(argc, argv, "--block-size", "%d", &block_size);
+        if (parse_block_size_result == PARSE_ERR_INVALID_VALUE || !DeviceManager::IsValidBlockSize(block_size)) {
+            Diagnose::PrintError("Cannot parse arg : block-size.");
+            exit(-1);
+        }
+
+        bool checksum = (PARSE_SUCCESS == get_argument(argc, argv, "--checksum", nullptr, nullptr));
+        bool dedup = (PARSE_SUCCESS == get_argument(argc, argv, "--dedup", nullptr, nullptr));
+        bool journal = (PARSE_SUCCESS == get_argument(argc, argv, "--journal", nullptr, nullptr));
+        bool bitmap = (PARSE_SUCCESS == get_argument(argc, argv, "--bitmap", nullptr, nullptr));
+
+        if (-1 == SuperBlock::MakeFS(disk_byte, inode_num, block_size, checksum, dedup, journal, bitmap)) {
             Diagnose::PrintError("Initial : Make FS failed.");
             exit(-1);
         }
@@ -98,6 +201,25 @@ int main(int argc, char* argv[]) {
             Diagnose::PrintError("Initial : Load SuperBlock failed.");
             exit(-1);
         }
+        int replayed = SuperBlock::superBlock.LoadJournal();
+        if (-1 == replayed) {
+            Diagnose::PrintError("Initial : Replay journal failed.");
+            exit(-1);
+        }
+        if (replayed > 0) {
+            Diagnose::PrintLog("Initial : Replayed " + to_string(replayed) + " journal transactions.");
+        }
+        if (SuperBlock::superBlock.s_journalBlockCnt != 0 && !Journal::journal.Enabled()) {
+            Diagnose::PrintLog("Initial : Journal disabled under mmap.");
+        }
+        if (-1 == SuperBlock::superBlock.LoadDedupTable()) {
+            Diagnose::PrintError("Initial : Load dedup table failed.");
+            exit(-1);
+        }
+        if (-1 == SuperBlock::superBlock.LoadBlockBitmap()) {
+            Diagnose::PrintError("Initial : Load block bitmap failed.");
+            exit(-1);
+        }
         Diagnose::PrintLog("Initial : Load SuperBlock success.");
     }
 
@@ -0,0 +1,202 @@
+﻿/**
+ * @file Crc32c.cpp
+ * @brief CRC32C实现
+ * @author 韩孟霖
+ * @date 2022/6/16
+ * @license GPL v3
+ */
+
+#include <cstring>
+
+#include "Crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/// CRC32C生成多项式的反射形式
+#define CRC32C_POLY 0x82F63B78u
+
+/**
+ * @brief slicing-by-8的查找表，table[k][n]是字节n后面再跟k个0字节的校验和
+ */
+struct Slicing8Table {
+    uint32_t table[8][256];
+
+    Slicing8Table() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t crc = n;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            this->table[0][n] = crc;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (int n = 0; n < 256; ++n) {
+                uint32_t prev = this->table[k - 1][n];
+                this->table[k][n] = (prev >> 8) ^ this->table[0][prev & 0xff];
+            }
+        }
+    }
+};
+
+static const Slicing8Table& GetSlicing8Table() {
+    static const Slicing8Table slicing8Table;
+    return slicing8Table;
+}
+
+uint32_t Crc32c::ExtendSlicing8(uint32_t crc, const void *data, size_t length) {
+    const uint32_t (*table)[256] = GetSlicing8Table().table;
+    const unsigned char* next = (const unsigned char*) data;
+    crc = ~crc;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // 按8字节对齐后一次处理8字节，8次查表互不依赖
+    while (length > 0 && ((uintptr_t) next & 7) != 0) {
+        crc = table[0][(crc ^ *next) & 0xff] ^ (crc >> 8);
+        ++next;
+        --length;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, next, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff]
+              ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        next += 8;
+        length -= 8;
+    }
+#endif
+
+    while (length > 0) {
+        crc = table[0][(crc ^ *next) & 0xff] ^ (crc >> 8);
+        ++next;
+        --length;
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HARDWARE
+/// 三路并行时每一路的字节数。长的一组用于大块数据，短的一组处理剩下不足3 * CRC32C_LONG的部分
+#define CRC32C_LONG 1024
+#define CRC32C_SHORT 128
+
+/**
+ * @brief 计算把校验和向后移动byteCnt个0字节所用的乘数x^(8 * byteCnt - 33) mod P。
+ * 32位乘32位的无进位乘积再经过一次64位的crc32指令，正好乘上x^33并模P
+ * @param byteCnt 字节数
+ * @return 反射形式的乘数
+ */
+static uint32_t ShiftConstant(size_t byteCnt) {
+    // 反射形式中x^0是最高位，乘x即右移一位，移出x^31时加上x^32 mod P
+    uint32_t power = 0x80000000u;
+    for (size_t i = 0; i < 8 * byteCnt - 33; ++i) {
+        power = (power >> 1) ^ ((power & 1) ? CRC32C_POLY : 0);
+    }
+    return power;
+}
+
+static const uint32_t longShift = ShiftConstant(CRC32C_LONG);
+static const uint32_t shortShift = ShiftConstant(CRC32C_SHORT);
+
+/**
+ * @brief 把校验和向后移动一路的长度，即后面再跟这么多0字节
+ * @param crc 校验和寄存器
+ * @param shift ShiftConstant的结果
+ * @return 移动后的寄存器
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t ShiftCrc(uint64_t crc, uint32_t shift) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long) crc), _mm_cvtsi32_si128((int) shift), 0);
+    return _mm_crc32_u64(0, (unsigned long long) _mm_cvtsi128_si64(product));
+}
+
+/**
+ * @brief 读取8字节
+ * @param data 地址
+ * @return 小端序的64位值
+ */
+static inline uint64_t Load64(const unsigned char* data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+/**
+ * @brief 用crc32指令计算。一条crc32指令的延迟是3个周期，吞吐量是每周期一条，
+ * 把数据分成相邻的三路同时计算才能跑满，最后用无进位乘法把前两路的结果移到末尾再合并
+ * @param crc 前面数据的校验和
+ * @param data 数据
+ * @param length 字节数
+ * @return 校验和
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t ExtendHardware(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* next = (const unsigned char*) data;
+    uint64_t crc0 = ~crc;
+
+    while (length > 0 && ((uintptr_t) next & 7) != 0) {
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *next);
+        ++next;
+        --length;
+    }
+
+    const size_t laneLengths[2] = {CRC32C_LONG, CRC32C_SHORT};
+    const uint32_t laneShifts[2] = {longShift, shortShift};
+    for (int group = 0; group < 2; ++group) {
+        size_t lane = laneLengths[group];
+        while (length >= 3 * lane) {
+            uint64_t crc1 = 0;
+            uint64_t crc2 = 0;
+            const unsigned char* end = next + lane;
+            do {
+                crc0 = _mm_crc32_u64(crc0, Load64(next));
+                crc1 = _mm_crc32_u64(crc1, Load64(next + lane));
+                crc2 = _mm_crc32_u64(crc2, Load64(next + 2 * lane));
+                next += 8;
+            } while (next < end);
+            crc0 = ShiftCrc(crc0, laneShifts[group]) ^ crc1;
+            crc0 = ShiftCrc(crc0, laneShifts[group]) ^ crc2;
+            next += 2 * lane;
+            length -= 3 * lane;
+        }
+    }
+
+    while (length >= 8) {
+        crc0 = _mm_crc32_u64(crc0, Load64(next));
+        next += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *next);
+        ++next;
+        --length;
+    }
+    return ~(uint32_t) crc0;
+}
+
+static bool HardwareSupported() {
+    static const bool supported = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    return supported;
+}
+#endif
+
+uint32_t Crc32c::Extend(uint32_t crc, const void *data, size_t length) {
+#ifdef CRC32C_HARDWARE
+    if (HardwareSupported()) {
+        return ExtendHardware(crc, data, length);
+    }
+#endif
+    return ExtendSlicing8(crc, data, length);
+}
+
+const char *Crc32c::Implementation() {
+#ifdef CRC32C_HARDWARE
+    if (HardwareSupported()) {
+        return "sse4.2+pclmul";
+    }
+#endif
+    return "slicing-by-8";
+}
@@ -0,0 +1,55 @@
+﻿/**
+ * @file Crc32c.h
+ * @brief CRC32C(Castagnoli)校验和。x86-64上CPU支持SSE4.2和PCLMUL时用crc32指令三路并行计算，否则用slicing-by-8查表
+ * @author 韩孟霖
+ * @date 2022/6/16
+ * @license GPL v3
+ */
+
+#ifndef MOFS_CRC32C_H
+#define MOFS_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief CRC32C计算，所有函数都是线程安全的
+ */
+class Crc32c {
+public:
+    /**
+     * @brief 计算一段数据的CRC32C
+     * @param data 数据
+     * @param length 字节数
+     * @return 校验和
+     */
+    static uint32_t Compute(const void* data, size_t length) {
+        return Extend(0, data, length);
+    }
+
+    /**
+     * @brief 在已有的校验和后接着计算，Extend(Compute(a), b) == Compute(a + b)
+     * @param crc 前面数据的校验和，从头开始时为0
+     * @param data 数据
+     * @param length 字节数
+     * @return 校验和
+     */
+    static uint32_t Extend(uint32_t crc, const void* data, size_t length);
+
+    /**
+     * @brief 只用查表的实现，供基准测试对比
+     * @param crc 前面数据的校验和
+     * @param data 数据
+     * @param length 字节数
+     * @return 校验和
+     */
+    static uint32_t ExtendSlicing8(uint32_t crc, const void* data, size_t length);
+
+    /**
+     * @brief 当前使用的实现
+     * @return sse4.2+pclmul 或 slicing-by-8
+     */
+    static const char* Implementation();
+};
+
+#endif //MOFS_CRC32C_H
@@ -0,0 +1,260 @@
+﻿/**
+ * @file Lz4.cpp
+ * @brief LZ4块格式实现
+ * @author 韩孟霖
+ * @date 2022/6/17
+ * @license GPL v3
+ */
+
+#include <cstring>
+#include <cstdint>
+
+#include "Lz4.h"
+
+/// 最短匹配长度
+#define LZ4_MIN_MATCH 4
+
+/// 格式要求最后5字节必须是字面量
+#define LZ4_LAST_LITERALS 5
+
+/// 最后一个匹配必须在末尾12字节之前开始
+#define LZ4_MF_LIMIT 12
+
+/// 匹配距离用16位记录
+#define LZ4_MAX_DISTANCE 65535
+
+/// 哈希表项数的对数
+#define LZ4_HASH_LOG 12
+
+/// 连续未命中时加快跳过的速度，每64字节步长加1
+#define LZ4_SKIP_TRIGGER 6
+
+/// 解压时短的字面量和匹配按固定的16字节复制，输入输出剩余空间足够时才这样做
+#define LZ4_FAST_COPY 16
+
+static inline uint32_t Load32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Load64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t HashSequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * @brief 写入长度的扩展字节，每个255表示后面还有
+ * @param op 输出位置
+ * @param length 超出token中15的部分
+ * @return 新的输出位置
+ */
+static inline unsigned char* WriteLength(unsigned char* op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char) length;
+    return op;
+}
+
+/**
+ * @brief 读取长度的扩展字节
+ * @param ip 输入位置，读完后后移
+ * @param ipEnd 输入末尾
+ * @param length 累加到这里
+ * @return false表示输入在扩展字节中结束
+ */
+static inline bool ReadLength(const unsigned char*& ip, const unsigned char* ipEnd, int& length) {
+    unsigned char byte;
+    do {
+        if (ip >= ipEnd) {
+            return false;
+        }
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * @brief 输出一个序列：字面量，以及之后的匹配
+ * @param op 输出位置
+ * @param opEnd 输出缓冲区末尾
+ * @param literals 字面量
+ * @param literalLength 字面量字节数
+ * @param distance 匹配距离，0表示只有字面量的最后一个序列
+ * @param matchLength 匹配长度减去LZ4_MIN_MATCH
+ * @return 新的输出位置，放不下时返回nullptr
+ */
+static unsigned char* WriteSequence(unsigned char* op, const unsigned char* opEnd, const unsigned char* literals,
+                                    int literalLength, int distance, int matchLength) {
+    // token、两段扩展长度和距离的最大字节数
+    long long needed = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+    if (needed > opEnd - op) {
+        return nullptr;
+    }
+
+    unsigned char* token = op++;
+    int literalToken = literalLength < 15 ? literalLength : 15;
+    if (literalLength >= 15) {
+        op = WriteLength(op, literalLength - 15);
+    }
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+    if (distance == 0) {
+        *token = (unsigned char) (literalToken << 4);
+        return op;
+    }
+
+    *op++ = (unsigned char) (distance & 0xff);
+    *op++ = (unsigned char) (distance >> 8);
+    int matchToken = matchLength < 15 ? matchLength : 15;
+    if (matchLength >= 15) {
+        op = WriteLength(op, matchLength - 15);
+    }
+    *token = (unsigned char) ((literalToken << 4) | matchToken);
+    return op;
+}
+
+int Lz4::Compress(const char *src, int srcSize, char *dst, int dstCapacity) {
+    const unsigned char* base = (const unsigned char*) src;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* end = base + srcSize;
+    const unsigned char* matchLimit = end - LZ4_LAST_LITERALS;
+    const unsigned char* mfLimit = end - LZ4_MF_LIMIT;
+    unsigned char* op = (unsigned char*) dst;
+    const unsigned char* opEnd = op + dstCapacity;
+
+    // 表项是序列在src中的位置加1，0表示空
+    int table[1 << LZ4_HASH_LOG] = {};
+
+    if (srcSize > LZ4_MF_LIMIT) {
+        while (ip < mfLimit) {
+            uint32_t sequence = Load32(ip);
+            uint32_t hash = HashSequence(sequence);
+            int candidate = table[hash] - 1;
+            table[hash] = (int) (ip - base) + 1;
+
+            const unsigned char* match = base + candidate;
+            if (candidate < 0 || ip - match > LZ4_MAX_DISTANCE || Load32(match) != sequence) {
+                ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+
+            // 向前扩展到上一个序列的末尾
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                --ip;
+                --match;
+            }
+
+            // 向后扩展，先按8字节比较
+            const unsigned char* matchEnd = ip + LZ4_MIN_MATCH;
+            const unsigned char* ref = match + LZ4_MIN_MATCH;
+            while (matchEnd + 8 <= matchLimit && Load64(matchEnd) == Load64(ref)) {
+                matchEnd += 8;
+                ref += 8;
+            }
+            while (matchEnd < matchLimit && *matchEnd == *ref) {
+                ++matchEnd;
+                ++ref;
+            }
+
+            op = WriteSequence(op, opEnd, anchor, (int) (ip - anchor), (int) (ip - match), (int) (matchEnd - ip - LZ4_MIN_MATCH));
+            if (op == nullptr) {
+                return 0;
+            }
+
+            // 匹配内部的位置也放进哈希表，提高之后的命中率
+            if (matchEnd - 2 > ip && matchEnd < mfLimit) {
+                table[HashSequence(Load32(matchEnd - 2))] = (int) (matchEnd - 2 - base) + 1;
+            }
+            ip = matchEnd;
+            anchor = ip;
+        }
+    }
+
+    op = WriteSequence(op, opEnd, anchor, (int) (end - anchor), 0, 0);
+    if (op == nullptr) {
+        return 0;
+    }
+    return (int) (op - (unsigned char*) dst);
+}
+
+int Lz4::Decompress(const char *src, int srcSize, char *dst, int dstCapacity) {
+    const unsigned char* ip = (const unsigned char*) src;
+    const unsigned char* ipEnd = ip + srcSize;
+    unsigned char* op = (unsigned char*) dst;
+    unsigned char* opEnd = op + dstCapacity;
+
+    while (ip < ipEnd) {
+        unsigned char token = *ip++;
+
+        int literalLength = token >> 4;
+        if (literalLength == 15 && !ReadLength(ip, ipEnd, literalLength)) {
+            return -1;
+        }
+        if (literalLength > ipEnd - ip || literalLength > opEnd - op) {
+            return -1;
+        }
+        if (literalLength <= LZ4_FAST_COPY && ipEnd - ip >= LZ4_FAST_COPY && opEnd - op >= LZ4_FAST_COPY) {
+            // 多复制的部分之后会被覆盖
+            memcpy(op, ip, LZ4_FAST_COPY);
+        }
+        else {
+            memcpy(op, ip, literalLength);
+        }
+        op += literalLength;
+        ip += literalLength;
+
+        if (ip == ipEnd) {
+            // 最后一个序列只有字面量
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return -1;
+        }
+        int distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > op - (unsigned char*) dst) {
+            return -1;
+        }
+
+        int matchLength = token & 15;
+        if (matchLength == 15 && !ReadLength(ip, ipEnd, matchLength)) {
+            return -1;
+        }
+        matchLength += LZ4_MIN_MATCH;
+        if (matchLength > opEnd - op) {
+            return -1;
+        }
+
+        const unsigned char* match = op - distance;
+        if (distance >= matchLength) {
+            if (matchLength <= LZ4_FAST_COPY && distance >= LZ4_FAST_COPY && opEnd - op >= LZ4_FAST_COPY) {
+                memcpy(op, match, LZ4_FAST_COPY);
+            }
+            else {
+                memcpy(op, match, matchLength);
+            }
+            op += matchLength;
+        }
+        else {
+            // 距离小于长度时源与目标重叠，重复的是最近distance字节。已输出的重复部分每复制一次长一倍
+            unsigned char* copyEnd = op + matchLength;
+            while (op < copyEnd) {
+                long long chunk = op - match < copyEnd - op ? op - match : copyEnd - op;
+                memcpy(op, match, chunk);
+                op += chunk;
+            }
+        }
+    }
+    return (int) (op - (unsigned char*) dst);
+}
@@ -0,0 +1,39 @@
+﻿/**
+ * @file Lz4.h
+ * @brief LZ4块格式的压缩与解压，用于文件数据的透明压缩
+ * @author 韩孟霖
+ * @date 2022/6/17
+ * @license GPL v3
+ */
+
+#ifndef MOFS_LZ4_H
+#define MOFS_LZ4_H
+
+/**
+ * @brief LZ4块格式编解码。只用贪心匹配和一张4字节序列的哈希表，压缩和解压都只有一次线性扫描，
+ * 输出与标准LZ4块格式兼容。所有函数都是线程安全的
+ */
+class Lz4 {
+public:
+    /**
+     * @brief 压缩
+     * @param src 原始数据
+     * @param srcSize 原始字节数
+     * @param dst 输出缓冲区
+     * @param dstCapacity 输出缓冲区的字节数
+     * @return 压缩后的字节数，放不进dstCapacity时返回0
+     */
+    static int Compress(const char* src, int srcSize, char* dst, int dstCapacity);
+
+    /**
+     * @brief 解压
+     * @param src 压缩数据
+     * @param srcSize 压缩数据的字节数
+     * @param dst 输出缓冲区
+     * @param dstCapacity 输出缓冲区的字节数
+     * @return 解压出的字节数，数据损坏或超出dstCapacity时返回-1
+     */
+    static int Decompress(const char* src, int srcSize, char* dst, int dstCapacity);
+};
+
+#endif //MOFS_LZ4_H